@@ -0,0 +1,106 @@
+/*
+ * allocguard.cpp
+ *
+ * Description:
+ * Per-thread count of heap allocations, through replacements of the global operator new.
+ *
+ */
+
+#include "includes/allocguard.h"
+#include <cstdlib>
+#include <new>
+
+/* constant-initialized, so usable from operator new before anything else runs on a thread */
+static thread_local std::uint64_t _allocations = 0;
+static thread_local int _guards = 0;
+
+/** allocate size bytes, counting the allocation while a guard is alive on the thread
+ * \throw: std::bad_alloc as the default operator new, once the new handler gives up
+ */
+static void *_allocate(std::size_t size)
+{
+	if (_guards)
+		++_allocations;
+	if (size == 0)
+		size = 1;
+	for (;;)
+	{
+		void *p = std::malloc(size);
+		if (p)
+			return p;
+		std::new_handler handler = std::get_new_handler();
+		if (!handler)
+			throw std::bad_alloc();
+		handler();
+	}
+}
+
+void *operator new(std::size_t size)
+{
+	return _allocate(size);
+}
+
+void *operator new[](std::size_t size)
+{
+	return _allocate(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+	try
+	{
+		return _allocate(size);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+	try
+	{
+		return _allocate(size);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+	std::free(p);
+}
+
+ModBusAllocationGuard::ModBusAllocationGuard() noexcept
+	: start(_allocations)
+{
+	++_guards;
+}
+
+ModBusAllocationGuard::~ModBusAllocationGuard()
+{
+	--_guards;
+}
+
+std::uint64_t ModBusAllocationGuard::count() const noexcept
+{
+	return _allocations - start;
+}
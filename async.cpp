@@ -0,0 +1,292 @@
+/*
+ * async.cpp
+ *
+ * Description:
+ * Connection shared through a lock-free request queue drained by a single I/O thread.
+ *
+ */
+
+#include "includes/async.h"
+#include "includes/logger.h"
+#include <cstring>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* the kinds of request */
+enum class ModBusRequestKind : std::uint8_t
+{
+	read_bits,
+	read_input_bits,
+	read_registers,
+	read_input_registers,
+	write_bit,
+	write_bits,
+	write_register,
+	write_registers,
+	none /* the stub node */
+};
+
+struct ModBusAsyncConnector::Request
+{
+	std::atomic<Request *> next{nullptr};
+	ModBusRequestKind kind;
+	int addr;
+	int num;
+	std::vector<std::uint16_t> registers{}; /* values to write */
+	std::vector<std::uint8_t> bits{};		/* values to write */
+	std::promise<ModBusReply> promise{};
+
+	Request(const ModBusRequestKind &kind, const int &addr, const int &num) : kind(kind), addr(addr), num(num) {}
+};
+
+/** connection to ip:port and its I/O thread, nothing is sent before the first request
+ * \throw: runtime_error when the libmodbus context or the eventfd cannot be created
+ *         std::system_error if the thread cannot be started
+ */
+ModBusAsyncConnector::ModBusAsyncConnector(const std::string &ip, const int &port)
+	: conn(ip, port), stub(new Request(ModBusRequestKind::none, 0, 0))
+{
+	head.store(stub);
+	tail = stub;
+	wakeup = eventfd(0, EFD_CLOEXEC);
+	if (wakeup == -1)
+	{
+		delete stub;
+		throw std::runtime_error("[ModBusAsyncConnector::ModBusAsyncConnector] Unable to create eventfd: " + std::string(strerror(errno)));
+	}
+	try
+	{
+		thread = std::thread(&ModBusAsyncConnector::run, this);
+	}
+	catch (...)
+	{
+		close(wakeup);
+		delete stub;
+		throw;
+	}
+}
+
+ModBusAsyncConnector::~ModBusAsyncConnector()
+{
+	stopping = true;
+	std::uint64_t one = 1;
+	if (write(wakeup, &one, sizeof(one)) == -1)
+	{
+		/* the counter cannot overflow with one write per wakeup */
+	}
+	thread.join();
+	close(wakeup);
+	delete stub;
+}
+
+ModBusConnector &ModBusAsyncConnector::connector() noexcept
+{
+	return conn;
+}
+
+/** link a node at the head of the queue (Vyukov's intrusive MPSC queue)
+ * Wait-free for producers: between the exchange and the store of next, the node is not
+ * reachable yet and pop() reports the queue as momentarily empty.
+ */
+void ModBusAsyncConnector::push(Request *request) noexcept
+{
+	request->next.store(nullptr, std::memory_order_relaxed);
+	Request *prev = head.exchange(request, std::memory_order_acq_rel);
+	prev->next.store(request, std::memory_order_release);
+}
+
+/* the oldest request, I/O thread only */
+ModBusAsyncConnector::Request *ModBusAsyncConnector::pop() noexcept
+{
+	Request *first = tail;
+	Request *next = first->next.load(std::memory_order_acquire);
+	if (first == stub)
+	{
+		if (!next)
+			return nullptr;
+		tail = next;
+		first = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+	if (next)
+	{
+		tail = next;
+		return first;
+	}
+	if (first != head.load(std::memory_order_acquire))
+		return nullptr; /* a producer is linking a node after first */
+
+	push(stub); /* first is the last node, put the stub behind it to detach it */
+	next = first->next.load(std::memory_order_acquire);
+	if (next)
+	{
+		tail = next;
+		return first;
+	}
+	return nullptr;
+}
+
+/** queue a request
+ * \throw: std::future_error
+ */
+std::future<ModBusReply> ModBusAsyncConnector::submit(Request *request)
+{
+	std::future<ModBusReply> future = request->promise.get_future();
+	push(request);
+	if (sleeping.exchange(false)) /* the I/O thread found the queue empty, wake it */
+	{
+		std::uint64_t one = 1;
+		if (write(wakeup, &one, sizeof(one)) == -1)
+		{
+			/* the counter cannot overflow with one write per wakeup */
+		}
+	}
+	return future;
+}
+
+/** send a request and complete its future
+ * The connection is established when needed, and dropped after a failure other than a modbus
+ * exception or a timeout so that the next request reconnects.
+ */
+void ModBusAsyncConnector::execute(Request *request) noexcept
+{
+	ModBusReply reply;
+	try
+	{
+		if (!conn.is_connect())
+			conn.connect();
+
+		switch (request->kind)
+		{
+		case ModBusRequestKind::read_bits:
+			reply.rc = conn.read_bits(request->addr, request->num, reply.bits);
+			break;
+		case ModBusRequestKind::read_input_bits:
+			reply.rc = conn.read_input_bits(request->addr, request->num, reply.bits);
+			break;
+		case ModBusRequestKind::read_registers:
+			reply.rc = conn.read_registers(request->addr, request->num, reply.registers);
+			break;
+		case ModBusRequestKind::read_input_registers:
+			reply.rc = conn.read_input_registers(request->addr, request->num, reply.registers);
+			break;
+		case ModBusRequestKind::write_bit:
+			reply.rc = conn.write_bit(request->addr, request->bits[0]);
+			break;
+		case ModBusRequestKind::write_bits:
+			reply.rc = conn.write_bits(request->addr, request->num, request->bits);
+			break;
+		case ModBusRequestKind::write_register:
+			reply.rc = conn.write_register(request->addr, request->registers[0]);
+			break;
+		default:
+			reply.rc = conn.write_registers(request->addr, request->num, request->registers);
+			break;
+		}
+		reply.error = reply.rc == -1 ? errno : 0;
+		if (reply.rc == -1 && reply.error < MODBUS_ENOBASE && reply.error != ETIMEDOUT)
+			conn.disconnect();
+	}
+	catch (const std::exception &e) /* connection failed */
+	{
+		reply.rc = -1;
+		reply.error = errno ? errno : ENOTCONN;
+	}
+
+	try
+	{
+		request->promise.set_value(std::move(reply));
+	}
+	catch (const std::exception &e)
+	{
+		MODBUS_LOG(error, "ModBusAsyncConnector::execute", "caught exception", e.what());
+	}
+	delete request;
+}
+
+/** I/O thread: send requests until destruction, sleeping on the eventfd while the queue is empty
+ * A producer sets nothing but the queue; the thread announces it sleeps, then checks the queue
+ * once more before blocking, so a request pushed meanwhile either is seen or wakes it.
+ */
+void ModBusAsyncConnector::run() noexcept
+{
+	while (true)
+	{
+		Request *request = pop();
+		if (request)
+		{
+			execute(request);
+			continue;
+		}
+
+		if (head.load() != tail) /* a push is in progress */
+		{
+			std::this_thread::yield();
+			continue;
+		}
+		if (stopping)
+			return;
+
+		sleeping = true;
+		if (head.load() != tail || stopping) /* pushed meanwhile */
+		{
+			sleeping = false;
+			continue;
+		}
+		std::uint64_t count;
+		if (read(wakeup, &count, sizeof(count)) == -1 && errno != EINTR)
+		{
+			MODBUS_LOG(error, "ModBusAsyncConnector::run", "reading eventfd fails", strerror(errno));
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		sleeping = false;
+	}
+}
+
+std::future<ModBusReply> ModBusAsyncConnector::read_bits(const int &addr, const int &num_of_bits)
+{
+	return submit(new Request(ModBusRequestKind::read_bits, addr, num_of_bits));
+}
+
+std::future<ModBusReply> ModBusAsyncConnector::read_input_bits(const int &addr, const int &num_of_bits)
+{
+	return submit(new Request(ModBusRequestKind::read_input_bits, addr, num_of_bits));
+}
+
+std::future<ModBusReply> ModBusAsyncConnector::read_registers(const int &addr, const int &num_of_registers)
+{
+	return submit(new Request(ModBusRequestKind::read_registers, addr, num_of_registers));
+}
+
+std::future<ModBusReply> ModBusAsyncConnector::read_input_registers(const int &addr, const int &num_of_registers)
+{
+	return submit(new Request(ModBusRequestKind::read_input_registers, addr, num_of_registers));
+}
+
+std::future<ModBusReply> ModBusAsyncConnector::write_bit(const int &addr, const std::uint8_t &value)
+{
+	Request *request = new Request(ModBusRequestKind::write_bit, addr, 1);
+	request->bits.assign(1, value);
+	return submit(request);
+}
+
+std::future<ModBusReply> ModBusAsyncConnector::write_bits(const int &addr, const std::vector<std::uint8_t> &values)
+{
+	Request *request = new Request(ModBusRequestKind::write_bits, addr, values.size());
+	request->bits = values;
+	return submit(request);
+}
+
+std::future<ModBusReply> ModBusAsyncConnector::write_register(const int &addr, const std::uint16_t &value)
+{
+	Request *request = new Request(ModBusRequestKind::write_register, addr, 1);
+	request->registers.assign(1, value);
+	return submit(request);
+}
+
+std::future<ModBusReply> ModBusAsyncConnector::write_registers(const int &addr, const std::vector<std::uint16_t> &values)
+{
+	Request *request = new Request(ModBusRequestKind::write_registers, addr, values.size());
+	request->registers = values;
+	return submit(request);
+}
@@ -0,0 +1,300 @@
+#include <iostream>
+#include "includes/modbus.h"
+#include "includes/histogram.h"
+#include "includes/function_code.h"
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+   Loopback benchmark of the request/response hot path.
+
+   Without -s, a ModBusServer is started as a child process on 127.0.0.1:PORT,
+   so that the client and server do not share a process and their threads do
+   not compete for the same locks. Every combination of the given function
+   codes, block sizes and connection counts is run for the given duration,
+   each connection being a thread doing blocking requests back to back.
+   The results are printed to stdout as a JSON array.
+*/
+
+struct BenchOptions
+{
+	std::string server = "";            /* external server, empty to start one */
+	int port = 15020;
+	std::vector<int> functions{3};      /* modbus function codes */
+	std::vector<int> blocks{1, 10, 100}; /* number of bits or registers per request */
+	std::vector<int> connections{1, 4};
+	double duration = 2.0; /* seconds measured per combination */
+	double warmup = 0.5;   /* seconds run before measuring */
+};
+
+struct BenchResult
+{
+	ModBusHistogram latency{}; /* in nanoseconds */
+	std::uint64_t errors = 0;
+};
+
+/* one request of the benchmarked kind, true on success */
+static bool request(ModBusConnector &conn, const int &function, const int &block,
+					std::vector<std::uint8_t> &bits, std::vector<std::uint16_t> &registers,
+					std::vector<std::uint16_t> &read_back)
+{
+	switch (function)
+	{
+	case MODBUS_FC_READ_COILS:
+		return conn.read_bits(0, block, bits) == block;
+	case MODBUS_FC_READ_DISCRETE_INPUTS:
+		return conn.read_input_bits(0, block, bits) == block;
+	case MODBUS_FC_READ_HOLDING_REGISTERS:
+		return conn.read_registers(0, block, registers) == block;
+	case MODBUS_FC_READ_INPUT_REGISTERS:
+		return conn.read_input_registers(0, block, registers) == block;
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+		return conn.write_bit(0, 1) == 1;
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+		return conn.write_register(0, 0x1234) == 1;
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+		return conn.write_bits(0, block, bits) == block;
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		return conn.write_registers(0, block, registers) == block;
+	default:
+		return conn.write_and_read_registers(0, block, registers, 0, block, read_back) == block;
+	}
+}
+
+/** run one combination
+ * Every connection records into its own histogram, merged once all threads are done.
+ * \throw: runtime_error if a connection cannot be established
+ */
+static BenchResult run(const BenchOptions &options, const int &function, const int &block, const int &num_connections)
+{
+	std::vector<std::unique_ptr<ModBusConnector>> conns;
+	for (int i = 0; i < num_connections; ++i)
+	{
+		conns.emplace_back(new ModBusConnector(options.server.empty() ? "127.0.0.1" : options.server, options.port));
+		conns.back()->connect();
+	}
+
+	std::vector<BenchResult> results(num_connections);
+	std::atomic<int> phase(0); /* 0: warmup, 1: measuring, 2: done */
+	std::vector<std::thread> threads;
+	for (int i = 0; i < num_connections; ++i)
+	{
+		threads.emplace_back([&, i] {
+			std::vector<std::uint8_t> bits(block, 1);
+			std::vector<std::uint16_t> registers(block, 0x1234);
+			std::vector<std::uint16_t> read_back;
+			BenchResult &result = results[i];
+			int current;
+			while ((current = phase.load(std::memory_order_relaxed)) != 2)
+			{
+				auto start = std::chrono::steady_clock::now();
+				bool ok = request(*conns[i], function, block, bits, registers, read_back);
+				auto elapsed = std::chrono::steady_clock::now() - start;
+				if (current == 0)
+					continue;
+				if (ok)
+					result.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+				else
+					++result.errors;
+			}
+		});
+	}
+
+	std::this_thread::sleep_for(std::chrono::duration<double>(options.warmup));
+	phase = 1;
+	std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+	phase = 2;
+	for (auto &thread : threads)
+		thread.join();
+
+	for (int i = 1; i < num_connections; ++i)
+	{
+		results[0].latency.merge(results[i].latency);
+		results[0].errors += results[i].errors;
+	}
+	return results[0];
+}
+
+/* a comma separated list of integers */
+static std::vector<int> parse_list(const std::string &arg)
+{
+	std::vector<int> values;
+	std::stringstream ss(arg);
+	std::string item;
+	while (std::getline(ss, item, ','))
+		values.push_back(std::stoi(item));
+	if (values.empty())
+		throw std::runtime_error("empty list: " + arg);
+	return values;
+}
+
+static void usage(const char *prog)
+{
+	std::cerr << "usage: " << prog << " [-s SERVER_IP] [-p PORT] [-f FUNCTION_CODES] [-b BLOCK_SIZES]"
+			  << " [-c CONNECTIONS] [-d SECONDS] [-w WARMUP_SECONDS]\n"
+			  << "  lists are comma separated, e.g. -f 1,3,16 -b 1,10,100 -c 1,8\n"
+			  << "  without -s a server is started on 127.0.0.1:PORT" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions options;
+	try
+	{
+		int opt;
+		while ((opt = getopt(argc, argv, "s:p:f:b:c:d:w:h")) != -1)
+		{
+			switch (opt)
+			{
+			case 's':
+				options.server = optarg;
+				break;
+			case 'p':
+				options.port = std::stoi(optarg);
+				break;
+			case 'f':
+				options.functions = parse_list(optarg);
+				break;
+			case 'b':
+				options.blocks = parse_list(optarg);
+				break;
+			case 'c':
+				options.connections = parse_list(optarg);
+				break;
+			case 'd':
+				options.duration = std::stod(optarg);
+				break;
+			case 'w':
+				options.warmup = std::stod(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		for (auto &function : options.functions)
+		{
+			if (!ModBusFunctionCode::name(function))
+				throw std::runtime_error("unsupported function code " + std::to_string(function));
+		}
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << e.what() << std::endl;
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* server in a child process, killed once done */
+	pid_t server = -1;
+	if (options.server.empty())
+	{
+		server = fork();
+		if (server == -1)
+		{
+			std::cerr << "Unable to start the server: " << strerror(errno) << std::endl;
+			return 1;
+		}
+		if (server == 0)
+		{
+			try
+			{
+				ModBusServer child("127.0.0.1", options.port, MODBUS_MAX_READ_BITS, MODBUS_MAX_READ_BITS,
+								   MODBUS_MAX_READ_REGISTERS, MODBUS_MAX_READ_REGISTERS);
+				child.listen(64);
+				while (1)
+				{
+					int connection_count = child.wait();
+					for (int n = 0; n < connection_count; ++n)
+						child.process(n);
+				}
+			}
+			catch (const std::exception &e)
+			{
+				std::cerr << "[bench server] " << e.what() << std::endl;
+			}
+			_exit(1);
+		}
+
+		/* wait for the server to listen */
+		ModBusConnector probe("127.0.0.1", options.port);
+		for (int attempt = 0; !probe.is_connect(); ++attempt)
+		{
+			try
+			{
+				probe.connect();
+			}
+			catch (const std::exception &e)
+			{
+				if (attempt == 100 || waitpid(server, nullptr, WNOHANG) == server)
+				{
+					std::cerr << "The server did not start: " << e.what() << std::endl;
+					kill(server, SIGKILL);
+					waitpid(server, nullptr, 0);
+					return 1;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+		}
+	}
+
+	int status = 0;
+	bool first = true;
+	std::cout << "[" << std::endl;
+	for (auto &function : options.functions)
+	{
+		for (auto &block : options.blocks)
+		{
+			for (auto &num_connections : options.connections)
+			{
+				if (block < 1 || block > ModBusFunctionCode::max_block(function) || num_connections < 1)
+				{
+					std::cerr << "skipping " << ModBusFunctionCode::name(function) << " block " << block
+							  << " connections " << num_connections << ": out of range" << std::endl;
+					continue;
+				}
+
+				BenchResult result;
+				try
+				{
+					result = run(options, function, block, num_connections);
+				}
+				catch (const std::exception &e)
+				{
+					std::cerr << ModBusFunctionCode::name(function) << ": " << e.what() << std::endl;
+					status = 1;
+					continue;
+				}
+
+				const ModBusHistogram &h = result.latency;
+				std::cout << (first ? "" : ",\n")
+						  << "  {\"function\": " << function << ", \"name\": \"" << ModBusFunctionCode::name(function) << "\""
+						  << ", \"block\": " << block << ", \"connections\": " << num_connections
+						  << ", \"duration_s\": " << options.duration
+						  << ", \"requests\": " << h.count() << ", \"errors\": " << result.errors
+						  << ", \"req_per_s\": " << (std::uint64_t)(h.count() / options.duration)
+						  << ", \"latency_us\": {\"min\": " << h.min() / 1e3 << ", \"mean\": " << h.mean() / 1e3
+						  << ", \"p50\": " << h.percentile(50) / 1e3 << ", \"p99\": " << h.percentile(99) / 1e3
+						  << ", \"p999\": " << h.percentile(99.9) / 1e3 << ", \"max\": " << h.max() / 1e3 << "}}"
+						  << std::flush;
+				first = false;
+			}
+		}
+	}
+	std::cout << "\n]" << std::endl;
+
+	if (server > 0)
+	{
+		kill(server, SIGTERM);
+		waitpid(server, nullptr, 0);
+	}
+	return status;
+}
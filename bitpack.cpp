@@ -0,0 +1,64 @@
+/*
+ * bitpack.cpp
+ *
+ * Description:
+ * Packing and unpacking of coil and discrete input values.
+ *
+ */
+
+#include "includes/bitpack.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/** pack bytes into bits
+ * \bits: num_of_bits bytes, 0 for an off bit, anything else for an on bit
+ * \packed: bytes(num_of_bits) bytes
+ */
+void ModBusBitPack::pack(const std::uint8_t *bits, const std::size_t &num_of_bits, std::uint8_t *packed) noexcept
+{
+	std::size_t i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= num_of_bits; i += 16)
+	{
+		/* the sign bit of each byte compared to 0 is gathered in byte order, LSB first */
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bits + i));
+		const unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		packed[i / 8] = static_cast<std::uint8_t>(mask);
+		packed[i / 8 + 1] = static_cast<std::uint8_t>(mask >> 8);
+	}
+#endif
+	for (; i < num_of_bits; i += 8)
+	{
+		std::uint8_t byte = 0;
+		for (std::size_t j = 0; j < 8 && i + j < num_of_bits; ++j)
+			byte |= (bits[i + j] ? 1 : 0) << j;
+		packed[i / 8] = byte;
+	}
+}
+
+/** unpack bits into bytes
+ * \packed: bytes(num_of_bits) bytes
+ * \bits: num_of_bits bytes, set to 0 or 1
+ */
+void ModBusBitPack::unpack(const std::uint8_t *packed, const std::size_t &num_of_bits, std::uint8_t *bits) noexcept
+{
+	std::size_t i = 0;
+#ifdef __SSE2__
+	const __m128i select = _mm_set_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+	const __m128i one = _mm_set1_epi8(1);
+	for (; i + 16 <= num_of_bits; i += 16)
+	{
+		/* spread the two bytes over the low and high halves, then test one bit per byte */
+		__m128i v = _mm_cvtsi32_si128(packed[i / 8] | packed[i / 8 + 1] << 8);
+		v = _mm_unpacklo_epi8(v, v);
+		v = _mm_unpacklo_epi16(v, v);
+		v = _mm_unpacklo_epi32(v, v);
+		v = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(v, select), select), one);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(bits + i), v);
+	}
+#endif
+	for (; i < num_of_bits; ++i)
+		bits[i] = (packed[i / 8] >> (i % 8)) & 1;
+}
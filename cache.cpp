@@ -0,0 +1,257 @@
+/*
+ * cache.cpp
+ *
+ * Description:
+ * Read-through cache of recently read ranges in front of a ModBusConnector.
+ *
+ */
+
+#include "includes/cache.h"
+#include "includes/logger.h"
+
+/** cache the reads of a connection
+ * \conn: the connection reads go to on a miss, must outlive the cache
+ * \default_max_age: the age of the values accepted by the reads without max_age
+ */
+ModBusReadCache::ModBusReadCache(ModBusConnector &conn, const std::chrono::milliseconds &default_max_age)
+	: conn(conn), default_max_age(default_max_age)
+{
+}
+
+/** copy a fresh cached range covering [addr, addr + num)
+ * Called with cache_lock held. Only the range starting at or before addr can cover it,
+ * since the ranges of an area do not overlap.
+ * \return: true on a hit
+ * \throw: std::bad_alloc
+ */
+template <typename T>
+bool ModBusReadCache::lookup(const ModBusArea &area, const int &addr, const int &num, const std::chrono::milliseconds &max_age, std::vector<T> &values)
+{
+	std::map<int, Entry> &entries = areas[(int)area].entries;
+	auto it = entries.upper_bound(addr);
+	if (it == entries.begin())
+		return false;
+	--it;
+
+	const Entry &entry = it->second;
+	if (addr + num > it->first + entry.num || Clock::now() - entry.time > max_age)
+		return false;
+
+	values.resize(num);
+	const int offset = addr - it->first;
+	for (int i = 0; i < num; ++i)
+		values[i] = (T)entry.values[offset + i];
+	return true;
+}
+
+/** keep a range, replacing the cached ranges it overlaps
+ * Called with cache_lock held.
+ * \generation: the generation of the area when the read was sent, nothing is kept if written since
+ * \throw: std::bad_alloc
+ */
+template <typename T>
+void ModBusReadCache::store(const ModBusArea &area, const int &addr, const std::vector<T> &values, const Clock::time_point &time, const std::uint64_t &generation)
+{
+	Area &a = areas[(int)area];
+	if (a.generation != generation)
+		return;
+
+	const int num = values.size();
+	auto it = a.entries.upper_bound(addr);
+	if (it != a.entries.begin() && std::prev(it)->first + std::prev(it)->second.num > addr)
+		--it;
+	while (it != a.entries.end() && it->first < addr + num)
+	{
+		if (it->second.time > time) /* a newer read of part of the range is kept instead */
+			return;
+		++it;
+	}
+
+	it = a.entries.upper_bound(addr);
+	if (it != a.entries.begin() && std::prev(it)->first + std::prev(it)->second.num > addr)
+		--it;
+	while (it != a.entries.end() && it->first < addr + num)
+		it = a.entries.erase(it);
+
+	Entry &entry = a.entries[addr];
+	entry.num = num;
+	entry.time = time;
+	entry.values.assign(values.begin(), values.end());
+}
+
+/* read bits from the device */
+int ModBusReadCache::fetch(const ModBusArea &area, const int &addr, const int &num, std::vector<std::uint8_t> &values) noexcept
+{
+	return area == ModBusArea::coils ? conn.read_bits(addr, num, values) : conn.read_input_bits(addr, num, values);
+}
+
+/* read registers from the device */
+int ModBusReadCache::fetch(const ModBusArea &area, const int &addr, const int &num, std::vector<std::uint16_t> &values) noexcept
+{
+	return area == ModBusArea::holding_registers ? conn.read_registers(addr, num, values) : conn.read_input_registers(addr, num, values);
+}
+
+/** read through the cache
+ * \return: -1 on failure, or num
+ */
+template <typename T>
+int ModBusReadCache::read(const ModBusArea &area, const int &addr, const int &num, const std::chrono::milliseconds &max_age, std::vector<T> &values) noexcept
+{
+	try
+	{
+		std::uint64_t generation;
+		{
+			std::lock_guard<std::mutex> lk(cache_lock);
+			if (num > 0 && lookup(area, addr, num, max_age, values))
+			{
+				++counters.hits;
+				return num;
+			}
+			++counters.misses;
+			generation = areas[(int)area].generation;
+		}
+
+		const Clock::time_point time = Clock::now(); /* the values are at least as recent as the request */
+		int rc = fetch(area, addr, num, values);
+		if (rc == num)
+		{
+			std::lock_guard<std::mutex> lk(cache_lock);
+			store(area, addr, values, time, generation);
+		}
+		return rc;
+	}
+	catch (const std::exception &e)
+	{
+		MODBUS_LOG(error, "ModBusReadCache::read", "caught exception", e.what());
+		return -1;
+	}
+}
+
+/** drop the cached ranges overlapping [addr, addr + num), and any read of the area in flight */
+void ModBusReadCache::invalidate(const ModBusArea &area, const int &addr, const int &num) noexcept
+{
+	try
+	{
+		std::lock_guard<std::mutex> lk(cache_lock);
+		Area &a = areas[(int)area];
+		++a.generation;
+		auto it = a.entries.upper_bound(addr);
+		if (it != a.entries.begin() && std::prev(it)->first + std::prev(it)->second.num > addr)
+			--it;
+		while (it != a.entries.end() && it->first < addr + num)
+		{
+			it = a.entries.erase(it);
+			++counters.invalidations;
+		}
+	}
+	catch (const std::exception &e)
+	{
+		MODBUS_LOG(error, "ModBusReadCache::invalidate", "caught exception", e.what());
+	}
+}
+
+int ModBusReadCache::read_bits(const int &addr, const int &num_of_bits, std::vector<std::uint8_t> &values) noexcept
+{
+	return read(ModBusArea::coils, addr, num_of_bits, default_max_age, values);
+}
+
+int ModBusReadCache::read_bits(const int &addr, const int &num_of_bits, std::vector<std::uint8_t> &values, const std::chrono::milliseconds &max_age) noexcept
+{
+	return read(ModBusArea::coils, addr, num_of_bits, max_age, values);
+}
+
+int ModBusReadCache::read_input_bits(const int &addr, const int &num_of_bits, std::vector<std::uint8_t> &values) noexcept
+{
+	return read(ModBusArea::input_bits, addr, num_of_bits, default_max_age, values);
+}
+
+int ModBusReadCache::read_input_bits(const int &addr, const int &num_of_bits, std::vector<std::uint8_t> &values, const std::chrono::milliseconds &max_age) noexcept
+{
+	return read(ModBusArea::input_bits, addr, num_of_bits, max_age, values);
+}
+
+int ModBusReadCache::read_registers(const int &addr, const int &num_of_registers, std::vector<std::uint16_t> &values) noexcept
+{
+	return read(ModBusArea::holding_registers, addr, num_of_registers, default_max_age, values);
+}
+
+int ModBusReadCache::read_registers(const int &addr, const int &num_of_registers, std::vector<std::uint16_t> &values, const std::chrono::milliseconds &max_age) noexcept
+{
+	return read(ModBusArea::holding_registers, addr, num_of_registers, max_age, values);
+}
+
+int ModBusReadCache::read_input_registers(const int &addr, const int &num_of_registers, std::vector<std::uint16_t> &values) noexcept
+{
+	return read(ModBusArea::input_registers, addr, num_of_registers, default_max_age, values);
+}
+
+int ModBusReadCache::read_input_registers(const int &addr, const int &num_of_registers, std::vector<std::uint16_t> &values, const std::chrono::milliseconds &max_age) noexcept
+{
+	return read(ModBusArea::input_registers, addr, num_of_registers, max_age, values);
+}
+
+/** the writes invalidate before and after the request: a read racing with the write is then
+ *  either dropped by the generation check or served after the write completed */
+int ModBusReadCache::write_bit(const int &addr, const std::uint8_t &value) noexcept
+{
+	invalidate(ModBusArea::coils, addr, 1);
+	int rc = conn.write_bit(addr, value);
+	invalidate(ModBusArea::coils, addr, 1);
+	return rc;
+}
+
+int ModBusReadCache::write_bits(const int &addr, const int &num_of_bits, const std::vector<std::uint8_t> &values) noexcept
+{
+	invalidate(ModBusArea::coils, addr, num_of_bits);
+	int rc = conn.write_bits(addr, num_of_bits, values);
+	invalidate(ModBusArea::coils, addr, num_of_bits);
+	return rc;
+}
+
+int ModBusReadCache::write_register(const int &addr, const std::uint16_t &value) noexcept
+{
+	invalidate(ModBusArea::holding_registers, addr, 1);
+	int rc = conn.write_register(addr, value);
+	invalidate(ModBusArea::holding_registers, addr, 1);
+	return rc;
+}
+
+int ModBusReadCache::write_registers(const int &addr, const int &num_of_registers, const std::vector<std::uint16_t> &values) noexcept
+{
+	invalidate(ModBusArea::holding_registers, addr, num_of_registers);
+	int rc = conn.write_registers(addr, num_of_registers, values);
+	invalidate(ModBusArea::holding_registers, addr, num_of_registers);
+	return rc;
+}
+
+int ModBusReadCache::mask_write_register(const int &addr, const std::uint16_t &and_mask, const std::uint16_t &or_mask) noexcept
+{
+	invalidate(ModBusArea::holding_registers, addr, 1);
+	int rc = conn.mask_write_register(addr, and_mask, or_mask);
+	invalidate(ModBusArea::holding_registers, addr, 1);
+	return rc;
+}
+
+int ModBusReadCache::write_register_bits(const int &addr, const std::uint16_t &mask, const std::uint16_t &bits) noexcept
+{
+	invalidate(ModBusArea::holding_registers, addr, 1);
+	int rc = conn.write_register_bits(addr, mask, bits);
+	invalidate(ModBusArea::holding_registers, addr, 1);
+	return rc;
+}
+
+/* drop everything cached */
+void ModBusReadCache::clear() noexcept
+{
+	for (int area = 0; area < 4; ++area)
+		invalidate((ModBusArea)area, 0, 0x10000);
+}
+
+/** counters since construction
+ * \throw: std::system_error if the lock cannot be acquired
+ */
+ModBusCacheStats ModBusReadCache::stats()
+{
+	std::lock_guard<std::mutex> lk(cache_lock);
+	return counters;
+}
@@ -1,35 +1,51 @@
 #include "includes/parser.h"
 #include "includes/modbus.h"
+#include "includes/decoder.h"
 #include <iomanip>
 #include <vector>
 
 void displayhelp();
 //display help info
 
-void displayvar(const std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map);
+void displayvar(const std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map,
+				const std::unordered_map<std::string, ModbusTagFormat> &format_map);
 //display varables modbus mapping
 
 void oper_write(ModBusConnector &conn, std::stringstream &ss, const bool is_float,
-				std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map);
+				std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map,
+				const std::unordered_map<std::string, ModbusTagFormat> &format_map);
 //write via modbus
 
 void oper_read(ModBusConnector &conn, std::stringstream &ss, const bool is_float,
-			   std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map);
+			   std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map,
+			   const std::unordered_map<std::string, ModbusTagFormat> &format_map);
 //read via modbus
 
 void oper_read_write(ModBusConnector &conn, std::stringstream &ss, const bool is_float,
-					 std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map);
+					 std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map,
+					 const std::unordered_map<std::string, ModbusTagFormat> &format_map);
 //write and read via modbus
 
+void oper_write_bit(ModBusConnector &conn, std::stringstream &ss,
+					const std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map);
+//set a single bit of a bitfield via modbus
+
+ModbusTagFormat real_format(const std::unordered_map<std::string, ModbusTagFormat> &format_map, const std::string &name);
+int real_width(const ModbusTagFormat &format);
+//format used by real number operations
+
 int main()
 {
 	std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> data_map;
 	//variable modbus mapping
 
+	std::unordered_map<std::string, ModbusTagFormat> format_map;
+	//variable annotations
+
 	std::string ip;
 	int port;
 
-	ModbusConfigParser::parse("./PLC.conf", ip, port, data_map); //parse config file
+	ModbusConfigParser::parse("./PLC.conf", ip, port, data_map, format_map); //parse config file
 
 	std::cout << "Connection to be established" << std::endl;
 
@@ -49,7 +65,7 @@ int main()
 
 	std::cout << "Available Variables List: " << std::endl;
 
-	displayvar(data_map); //display available varable mapping
+	displayvar(data_map, format_map); //display available varable mapping
 
 	displayhelp(); //display avaiable command
 
@@ -89,7 +105,7 @@ int main()
 
 		if (oper == "v") //display variable
 		{
-			displayvar(data_map);
+			displayvar(data_map, format_map);
 			continue;
 		}
 
@@ -105,36 +121,41 @@ int main()
 
 		if (oper == "w") //write
 		{
-			oper_write(conn, ss, false, data_map);
+			oper_write(conn, ss, false, data_map, format_map);
 			continue;
 		}
 
 		else if (oper == "wr") //write real numbers
 		{
-			oper_write(conn, ss, true, data_map);
+			oper_write(conn, ss, true, data_map, format_map);
 			continue;
 		}
 
 		else if (oper == "r") //read
 		{
-			oper_read(conn, ss, false, data_map);
+			oper_read(conn, ss, false, data_map, format_map);
 			continue;
 		}
 
 		else if (oper == "rr") //read real numbers
 		{
-			oper_read(conn, ss, true, data_map);
+			oper_read(conn, ss, true, data_map, format_map);
 			continue;
 		}
 
 		else if (oper == "rw") //write and then read
 		{
-			oper_read_write(conn, ss, false, data_map);
+			oper_read_write(conn, ss, false, data_map, format_map);
 		}
 
 		else if (oper == "rwr") //write and then read real nunbers
 		{
-			oper_read_write(conn, ss, true, data_map);
+			oper_read_write(conn, ss, true, data_map, format_map);
+		}
+
+		else if (oper == "wb") //set a bit
+		{
+			oper_write_bit(conn, ss, data_map);
 		}
 		else
 		{
@@ -168,22 +189,91 @@ void displayhelp()
 			  << "write the real number REAL_VALUE into VAR_NAME" << std::endl;
 	std::cout << std::left << std::setw(30) << "rwr VAR_NAME REAL_VALUE" << std::right
 			  << "write real number REAL_VALUE into VAR_NAME and then read the values from it" << std::endl;
+	std::cout << std::left << std::setw(30) << "wb VAR_NAME BIT 0|1" << std::right
+			  << "set bit BIT of VAR_NAME (16 bits per register) with a mask write, leaving the other bits" << std::endl;
 }
 
 //display available variable mapping
-void displayvar(const std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map)
+void displayvar(const std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map,
+				const std::unordered_map<std::string, ModbusTagFormat> &format_map)
 {
 	for (auto &x : data_map)
-
+	{
+		auto format = format_map.find(x.first);
 		std::cout << "Type: " << std::left << std::setw(17) << x.second.first
 				  << " Name: " << std::left << std::setw(15) << x.first << "\tStart Addr: "
-				  << x.second.second[0] + 1 << "\tNum of Value: " << x.second.second[1] << std::endl
+				  << x.second.second[0] + 1 << "\tNum of Value: " << x.second.second[1];
+		if (format != format_map.end() && format->second.type != ModbusDataType::raw)
+			std::cout << "\tData Type: " << ModbusTagFormat::type_name(format->second.type);
+		std::cout << std::endl
 				  << std::endl;
+	}
+}
+
+//format used by real number operations, unannotated registers are taken as floats
+ModbusTagFormat real_format(const std::unordered_map<std::string, ModbusTagFormat> &format_map, const std::string &name)
+{
+	ModbusTagFormat format;
+	auto got = format_map.find(name);
+	if (got != format_map.end())
+		format = got->second;
+	if (format.type == ModbusDataType::raw)
+		format.type = ModbusDataType::float32;
+	return format;
+}
+
+//registers taken by one real number of format
+int real_width(const ModbusTagFormat &format)
+{
+	return (format.type == ModbusDataType::int32 || format.type == ModbusDataType::float32) ? 2 : 1;
+}
+
+//set a single bit of a holding register varable, e.g. a bitfield, with one mask write request
+void oper_write_bit(ModBusConnector &conn, std::stringstream &ss,
+					const std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map)
+{
+	std::string name; //variable name
+	int bit, value;
+	ss >> name >> bit >> value;
+	if (!ss)
+	{
+		std::cerr << "Invalid operation argument: wb VAR_NAME BIT 0|1" << std::endl;
+		return;
+	}
+
+	auto got = data_map.find(name); //look for the mapping based on variable name
+	if (got == data_map.end())
+	{
+		std::cerr << "No such data name" << std::endl;
+		return;
+	}
+	if ((got->second).first != "holding_register")
+	{
+		std::cerr << "Bits can only be set in holding registers" << std::endl;
+		return;
+	}
+	if (bit < 0 || bit >= 16 * (got->second).second[1])
+	{
+		std::cerr << "BIT out of the range of " << name << std::endl;
+		return;
+	}
+
+	const std::uint16_t mask = 1 << (bit % 16);
+	int rc = conn.write_register_bits((got->second).second[0] + bit / 16, mask, value ? mask : 0); //write via modbus
+	if (rc == 1)
+	{
+		std::cout << "Writing finished successfully" << std::endl;
+	}
+	else
+	{
+		std::cout << "Writing finished unsuccessfully" << std::endl;
+	}
 }
 
 //write via modbus
 void oper_write(ModBusConnector &conn, std::stringstream &ss, const bool is_float,
-				std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map)
+				std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map,
+				const std::unordered_map<std::string, ModbusTagFormat> &format_map)
 {
 	std::string name; //variable name
 	ss >> name;
@@ -227,13 +317,20 @@ void oper_write(ModBusConnector &conn, std::stringstream &ss, const bool is_floa
 				// if no custom value, send random number to modbus server instead
 				// otherwise, send the custom value
 				// and the number of input value should not overflow the modbus variable
-				int counter = (2 * custom_value_counter > num) ? num : 2 * custom_value_counter;
-				for (int i = 0; i < counter - 1; i += 2) // one real number will take 2 registers
+				ModbusTagFormat format = real_format(format_map, name);
+				int width = real_width(format); // registers per real number
+				if (num % width)
 				{
-					float value = value_set[2 * i]; // custom real numbers
+					std::cerr << name << " does not hold a whole number of " << ModbusTagFormat::type_name(format.type) << " values" << std::endl;
+					return;
+				}
+				int counter = (width * custom_value_counter > num) ? num : width * custom_value_counter;
+				for (int i = 0; i + width <= counter; i += width)
+				{
+					float value = value_set[i / width]; // custom real numbers
 
-					ModBusConnector::set_float(value, tab_rq_registers[i], tab_rq_registers[i + 1]);
-					// convert real value to two registers
+					ModbusDecoder::encode(format, value, &tab_rq_registers[i]);
+					// convert real value to registers according to the variable annotations
 					std::cout << std::setprecision(7) << value << "\t";
 				}
 			}
@@ -299,7 +396,8 @@ void oper_write(ModBusConnector &conn, std::stringstream &ss, const bool is_floa
 }
 
 void oper_read(ModBusConnector &conn, std::stringstream &ss, const bool is_float,
-			   std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map)
+			   std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map,
+			   const std::unordered_map<std::string, ModbusTagFormat> &format_map)
 {
 	std::string name; //variable name
 	ss >> name;
@@ -338,11 +436,13 @@ void oper_read(ModBusConnector &conn, std::stringstream &ss, const bool is_float
 			{
 				if (is_float)
 				{
-					float value = 0.0;
-					for (int i = 0; i < num - 1; i += 2)
+					ModbusDecoder decoder;
+					decoder.add(real_format(format_map, name), 0, num);
+					std::vector<double> values(decoder.size(), 0.0);
+					decoder.decode(tab_rp_registers.data(), values.data());
+					//convert registers to real numbers according to the variable annotations
+					for (auto &value : values)
 					{
-						value = ModBusConnector::get_float(tab_rp_registers[i], tab_rp_registers[i + 1]);
-						//convert registers to real number
 						std::cout << std::setprecision(7) << value << "\t";
 					}
 				}
@@ -412,7 +512,8 @@ void oper_read(ModBusConnector &conn, std::stringstream &ss, const bool is_float
 }
 
 void oper_read_write(ModBusConnector &conn, std::stringstream &ss, const bool is_float,
-					 std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map)
+					 std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map,
+					 const std::unordered_map<std::string, ModbusTagFormat> &format_map)
 {
 	std::string name; //variable name
 	ss >> name;
@@ -456,11 +557,18 @@ void oper_read_write(ModBusConnector &conn, std::stringstream &ss, const bool is
 			// if no custom value, send random number to modbus server instead
 			// otherwise, send the custom value
 			// and the number of input value should not overflow the modbus variable
-			int counter = (2 * custom_value_counter > num) ? num : 2 * custom_value_counter;
-			for (int i = 0; i < counter - 1; i += 2)
+			ModbusTagFormat format = real_format(format_map, name);
+			int width = real_width(format); // registers per real number
+			if (num % width)
+			{
+				std::cerr << name << " does not hold a whole number of " << ModbusTagFormat::type_name(format.type) << " values" << std::endl;
+				return;
+			}
+			int counter = (width * custom_value_counter > num) ? num : width * custom_value_counter;
+			for (int i = 0; i + width <= counter; i += width)
 			{
-				float value = value_set[2 * i]; // custom real number
-				ModBusConnector::set_float(value, tab_rw_rq_registers[i], tab_rw_rq_registers[i + 1]);
+				float value = value_set[i / width]; // custom real number
+				ModbusDecoder::encode(format, value, &tab_rw_rq_registers[i]);
 				std::cout << std::setprecision(7) << value << "\t";
 			}
 		}
@@ -483,11 +591,13 @@ void oper_read_write(ModBusConnector &conn, std::stringstream &ss, const bool is
 			std::cout << "Read:" << std::endl;
 			if (is_float)
 			{
-				float value_read = 0.0;
-				for (int i = 0; i < num - 1; i += 2)
+				ModbusDecoder decoder;
+				decoder.add(real_format(format_map, name), 0, num);
+				std::vector<double> values_read(decoder.size(), 0.0);
+				decoder.decode(tab_rp_registers.data(), values_read.data());
+				//convert registers to real numbers according to the variable annotations
+				for (auto &value_read : values_read)
 				{
-					value_read = ModBusConnector::get_float(tab_rp_registers[i], tab_rp_registers[i + 1]);
-					//convert registers to real number
 					std::cout << std::setprecision(7) << value_read << "\t";
 				}
 			}
@@ -0,0 +1,216 @@
+/*
+ * combiner.cpp
+ *
+ * Description:
+ * Write-combining queue merging single register and coil writes into multiple-write requests.
+ *
+ */
+
+#include "includes/combiner.h"
+#include "includes/logger.h"
+
+/** start the thread sending the queue
+ * \conn: the connection writes are sent over, must outlive the combiner
+ * \window: how long the first queued write waits for others, 0 to wait for flush()
+ * \throw: runtime_error if the window is negative
+ *         std::system_error if the thread cannot be started
+ */
+ModBusWriteCombiner::ModBusWriteCombiner(ModBusConnector &conn, const std::chrono::milliseconds &window)
+	: conn(conn), window(window)
+{
+	if (window.count() < 0)
+	{
+		throw std::runtime_error("[ModBusWriteCombiner::ModBusWriteCombiner] Invalid window " + std::to_string(window.count()) + " ms");
+	}
+	if (window.count() > 0)
+		thread = std::thread(&ModBusWriteCombiner::run, this);
+}
+
+ModBusWriteCombiner::~ModBusWriteCombiner()
+{
+	{
+		std::lock_guard<std::mutex> lk(queue_lock);
+		stopping = true;
+	}
+	queue_cv.notify_all();
+	if (thread.joinable())
+		thread.join();
+	try
+	{
+		send();
+	}
+	catch (const std::exception &e)
+	{
+		MODBUS_LOG(error, "ModBusWriteCombiner::~ModBusWriteCombiner", "caught exception", e.what());
+	}
+}
+
+/** queue a value, replacing a value queued for the same address
+ * \throw: std::bad_alloc
+ *         std::system_error if the lock cannot be acquired
+ */
+std::future<int> ModBusWriteCombiner::queue(std::map<int, Pending> &area, const int &addr, const std::uint16_t &value)
+{
+	if (addr < 0 || addr > 0xFFFF)
+	{
+		throw std::runtime_error("[ModBusWriteCombiner::queue] Invalid address " + std::to_string(addr));
+	}
+
+	std::promise<int> promise;
+	std::future<int> future = promise.get_future();
+	bool first;
+	{
+		std::lock_guard<std::mutex> lk(queue_lock);
+		first = registers.empty() && coils.empty();
+		if (first)
+			deadline = std::chrono::steady_clock::now() + window;
+
+		Pending &pending = area[addr];
+		counters.overwrites += !pending.waiters.empty();
+		++counters.writes;
+		pending.value = value;
+		pending.waiters.push_back(std::move(promise));
+	}
+	if (first)
+		queue_cv.notify_all();
+	return future;
+}
+
+/** queue a write to a holding register
+ * \return: completed with 1 once the value is written, or -1 if the request failed
+ * \throw: runtime_error if the address is invalid
+ *         std::bad_alloc
+ */
+std::future<int> ModBusWriteCombiner::write_register(const int &addr, const std::uint16_t &value)
+{
+	return queue(registers, addr, value);
+}
+
+/** queue a write to a coil
+ * \return: completed with 1 once the value is written, or -1 if the request failed
+ * \throw: runtime_error if the address is invalid
+ *         std::bad_alloc
+ */
+std::future<int> ModBusWriteCombiner::write_bit(const int &addr, const std::uint8_t &value)
+{
+	return queue(coils, addr, value ? 1 : 0);
+}
+
+/** send everything queued now
+ * \throw: std::system_error if a lock cannot be acquired
+ */
+void ModBusWriteCombiner::flush()
+{
+	send();
+}
+
+/** counters since construction
+ * \throw: std::system_error if the lock cannot be acquired
+ */
+ModBusCombinerStats ModBusWriteCombiner::stats()
+{
+	std::lock_guard<std::mutex> lk(queue_lock);
+	return counters;
+}
+
+/** take the queue and send it
+ * \throw: std::system_error if a lock cannot be acquired
+ */
+void ModBusWriteCombiner::send()
+{
+	std::lock_guard<std::mutex> send_lk(send_lock);
+	std::map<int, Pending> batch_registers, batch_coils;
+	{
+		std::lock_guard<std::mutex> lk(queue_lock);
+		batch_registers.swap(registers);
+		batch_coils.swap(coils);
+	}
+	send_area(batch_registers, true);
+	send_area(batch_coils, false);
+}
+
+/** send the values of an area, each run of consecutive addresses in one request
+ * Runs longer than a request allows are split.
+ */
+void ModBusWriteCombiner::send_area(std::map<int, Pending> &area, const bool &is_register) noexcept
+{
+	const int max_run = is_register ? MODBUS_MAX_WRITE_REGISTERS : MODBUS_MAX_WRITE_BITS;
+	std::vector<std::uint16_t> values;
+	std::vector<std::uint8_t> bits;
+
+	auto it = area.begin();
+	while (it != area.end())
+	{
+		/* the run starting at it */
+		auto end = it;
+		int addr = it->first;
+		int num = 0;
+		while (end != area.end() && end->first == addr + num && num < max_run)
+		{
+			++end;
+			++num;
+		}
+
+		int rc;
+		try
+		{
+			if (is_register)
+			{
+				values.clear();
+				for (auto x = it; x != end; ++x)
+					values.push_back(x->second.value);
+				rc = num == 1 ? conn.write_register(addr, values[0]) : conn.write_registers(addr, num, values);
+			}
+			else
+			{
+				bits.clear();
+				for (auto x = it; x != end; ++x)
+					bits.push_back((std::uint8_t)x->second.value);
+				rc = num == 1 ? conn.write_bit(addr, bits[0]) : conn.write_bits(addr, num, bits);
+			}
+		}
+		catch (const std::exception &e) /* allocation failure of the request buffer */
+		{
+			MODBUS_LOG(error, "ModBusWriteCombiner::send_area", "caught exception", e.what());
+			rc = -1;
+		}
+
+		{
+			std::lock_guard<std::mutex> lk(queue_lock);
+			++counters.requests;
+		}
+		for (; it != end; ++it)
+		{
+			for (auto &waiter : it->second.waiters)
+				waiter.set_value(rc == num ? 1 : -1);
+		}
+	}
+}
+
+/** send the queue each time its window expires, until destruction */
+void ModBusWriteCombiner::run() noexcept
+{
+	try
+	{
+		std::unique_lock<std::mutex> ulk(queue_lock);
+		while (!stopping)
+		{
+			if (registers.empty() && coils.empty())
+			{
+				queue_cv.wait(ulk);
+				continue;
+			}
+			if (queue_cv.wait_until(ulk, deadline, [this] { return stopping; }))
+				break;
+			if (std::chrono::steady_clock::now() < deadline) /* flushed meanwhile, and queued again since */
+				continue;
+			ulk.unlock();
+			send();
+			ulk.lock();
+		}
+	}
+	catch (const std::exception &e)
+	{
+		MODBUS_LOG(error, "ModBusWriteCombiner::run", "caught exception", e.what());
+	}
+}
@@ -0,0 +1,201 @@
+/*
+ * decoder.cpp
+ *
+ * Description:
+ * Conversion between raw modbus register blocks and typed engineering values.
+ *
+ */
+
+#include "includes/decoder.h"
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+/* assemble a 32-bit value from two registers
+ * high_first: true for abcd word order, false for cdab word order
+ */
+template <bool high_first>
+inline std::uint32_t _word32(const std::uint16_t *__restrict src) noexcept
+{
+	return high_first ? (static_cast<std::uint32_t>(src[0]) << 16) | src[1]
+					  : (static_cast<std::uint32_t>(src[1]) << 16) | src[0];
+}
+
+/* decode a run of 16-bit values, T selects the signedness */
+template <typename T>
+inline void _decode16(const std::uint16_t *__restrict src, const int count, const double scale, const double offset,
+					  double *__restrict dst) noexcept
+{
+	for (int i = 0; i < count; ++i)
+		dst[i] = static_cast<double>(static_cast<T>(src[i])) * scale + offset;
+}
+
+/* decode a run of 32-bit signed integers */
+template <bool high_first>
+inline void _decode_int32(const std::uint16_t *__restrict src, const int count, const double scale, const double offset,
+						  double *__restrict dst) noexcept
+{
+	for (int i = 0; i < count; ++i)
+		dst[i] = static_cast<double>(static_cast<std::int32_t>(_word32<high_first>(src + 2 * i))) * scale + offset;
+}
+
+/* decode a run of IEEE-754 floats */
+template <bool high_first>
+inline void _decode_float32(const std::uint16_t *__restrict src, const int count, const double scale, const double offset,
+							double *__restrict dst) noexcept
+{
+	for (int i = 0; i < count; ++i)
+	{
+		std::uint32_t word = _word32<high_first>(src + 2 * i);
+		float f;
+		std::memcpy(&f, &word, sizeof(f));
+		dst[i] = static_cast<double>(f) * scale + offset;
+	}
+}
+
+/* clamp an engineering value converted back to raw into the range of T */
+template <typename T>
+inline T _clamp_round(const double &raw) noexcept
+{
+	if (!(raw > static_cast<double>(std::numeric_limits<T>::min()))) /* also catches NaN */
+		return std::numeric_limits<T>::min();
+	if (raw >= static_cast<double>(std::numeric_limits<T>::max()))
+		return std::numeric_limits<T>::max();
+	return static_cast<T>(std::lround(raw));
+}
+
+/** number of values a variable decodes to
+ * \format: the annotations of the variable
+ * \num_of_registers: the number of registers the variable takes
+ * \return: half the registers for 32-bit types, otherwise one value per register
+ */
+int ModbusDecoder::value_count(const ModbusTagFormat &format, const int &num_of_registers) noexcept
+{
+	if (format.type == ModbusDataType::int32 || format.type == ModbusDataType::float32)
+		return num_of_registers / 2;
+	return num_of_registers;
+}
+
+/** append a variable to the block layout
+ * Consecutive variables with identical formats are merged into one run so that
+ * decode() handles them in the same loop.
+ * \format: the annotations of the variable
+ * \src_offset: index of the first register of the variable in the raw block
+ * \num_of_registers: the number of registers the variable takes
+ * \return: the index of the first value of the variable in the output of decode()
+ */
+int ModbusDecoder::add(const ModbusTagFormat &format, const int &src_offset, const int &num_of_registers)
+{
+	int count = value_count(format, num_of_registers);
+	int dst_offset = this->num_of_values;
+	this->num_of_values += count;
+
+	ModbusTagFormat effective = format;
+	if (effective.type == ModbusDataType::bitfield) /* bits are never scaled */
+	{
+		effective.scale = 1.0;
+		effective.offset = 0.0;
+	}
+
+	if (!steps.empty())
+	{
+		Step &last = steps.back();
+		int width = (num_of_registers && count) ? num_of_registers / count : 1;
+		if (last.format.type == effective.type && last.format.order == effective.order &&
+			last.format.scale == effective.scale && last.format.offset == effective.offset &&
+			last.src_offset + last.count * width == src_offset && last.dst_offset + last.count == dst_offset)
+		{
+			last.count += count;
+			return dst_offset;
+		}
+	}
+
+	steps.push_back(Step{effective, src_offset, count, dst_offset});
+	return dst_offset;
+}
+
+/* the number of values decode() produces */
+int ModbusDecoder::size() const noexcept
+{
+	return this->num_of_values;
+}
+
+/** decode a raw register block into engineering values in one pass
+ * \block: the raw registers, as filled by a read request
+ * \values: output array of at least size() elements
+ */
+void ModbusDecoder::decode(const std::uint16_t *block, double *values) const noexcept
+{
+	for (const Step &step : steps)
+	{
+		const std::uint16_t *src = block + step.src_offset;
+		double *dst = values + step.dst_offset;
+		const bool high_first = step.format.order == ModbusWordOrder::abcd;
+
+		switch (step.format.type)
+		{
+		case ModbusDataType::int16:
+			_decode16<std::int16_t>(src, step.count, step.format.scale, step.format.offset, dst);
+			break;
+		case ModbusDataType::int32:
+			if (high_first)
+				_decode_int32<true>(src, step.count, step.format.scale, step.format.offset, dst);
+			else
+				_decode_int32<false>(src, step.count, step.format.scale, step.format.offset, dst);
+			break;
+		case ModbusDataType::float32:
+			if (high_first)
+				_decode_float32<true>(src, step.count, step.format.scale, step.format.offset, dst);
+			else
+				_decode_float32<false>(src, step.count, step.format.scale, step.format.offset, dst);
+			break;
+		default: /* raw, uint16 and bitfield */
+			_decode16<std::uint16_t>(src, step.count, step.format.scale, step.format.offset, dst);
+			break;
+		}
+	}
+}
+
+/** convert an engineering value back into registers
+ * Integer types are rounded and saturated to their range.
+ * \format: the annotations of the variable
+ * \value: the engineering value
+ * \registers: output, two registers for 32-bit types, otherwise one
+ */
+void ModbusDecoder::encode(const ModbusTagFormat &format, const double &value, std::uint16_t *registers) noexcept
+{
+	double raw = value;
+	if (format.type != ModbusDataType::bitfield && format.scale != 0.0)
+		raw = (value - format.offset) / format.scale;
+
+	std::uint32_t word = 0;
+	switch (format.type)
+	{
+	case ModbusDataType::int16:
+		registers[0] = static_cast<std::uint16_t>(_clamp_round<std::int16_t>(raw));
+		return;
+	case ModbusDataType::int32:
+		word = static_cast<std::uint32_t>(_clamp_round<std::int32_t>(raw));
+		break;
+	case ModbusDataType::float32:
+	{
+		float f = static_cast<float>(raw);
+		std::memcpy(&word, &f, sizeof(word));
+		break;
+	}
+	default: /* raw, uint16 and bitfield */
+		registers[0] = _clamp_round<std::uint16_t>(raw);
+		return;
+	}
+
+	if (format.order == ModbusWordOrder::abcd)
+	{
+		registers[0] = static_cast<std::uint16_t>(word >> 16);
+		registers[1] = static_cast<std::uint16_t>(word);
+	}
+	else
+	{
+		registers[0] = static_cast<std::uint16_t>(word);
+		registers[1] = static_cast<std::uint16_t>(word >> 16);
+	}
+}
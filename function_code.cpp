@@ -0,0 +1,67 @@
+/*
+ * function_code.cpp
+ *
+ * Description:
+ * Names and block size limits of the function codes sent by the benchmark and load tools.
+ *
+ */
+
+#include "includes/function_code.h"
+#include <modbus/modbus.h>
+
+/** the name of a function code
+ * \return: the ModBusConnector call issuing it, nullptr if the tools do not send it
+ */
+const char *ModBusFunctionCode::name(const int &function) noexcept
+{
+	switch (function)
+	{
+	case MODBUS_FC_READ_COILS:
+		return "read_bits";
+	case MODBUS_FC_READ_DISCRETE_INPUTS:
+		return "read_input_bits";
+	case MODBUS_FC_READ_HOLDING_REGISTERS:
+		return "read_registers";
+	case MODBUS_FC_READ_INPUT_REGISTERS:
+		return "read_input_registers";
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+		return "write_bit";
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+		return "write_register";
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+		return "write_bits";
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		return "write_registers";
+	case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+		return "write_and_read_registers";
+	default:
+		return nullptr;
+	}
+}
+
+/** the largest block a function code accepts, from the modbus specification
+ * \return: bits or registers per request, 1 for single writes, 0 for an unsupported function code
+ */
+int ModBusFunctionCode::max_block(const int &function) noexcept
+{
+	switch (function)
+	{
+	case MODBUS_FC_READ_COILS:
+	case MODBUS_FC_READ_DISCRETE_INPUTS:
+		return MODBUS_MAX_READ_BITS;
+	case MODBUS_FC_READ_HOLDING_REGISTERS:
+	case MODBUS_FC_READ_INPUT_REGISTERS:
+		return MODBUS_MAX_READ_REGISTERS;
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+		return 1;
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+		return MODBUS_MAX_WRITE_BITS;
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		return MODBUS_MAX_WRITE_REGISTERS;
+	case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+		return MODBUS_MAX_WR_WRITE_REGISTERS;
+	default:
+		return 0;
+	}
+}
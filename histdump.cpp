@@ -0,0 +1,102 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <ctime>
+#include "includes/historian.h"
+#include "includes/query.h"
+
+/* print the columns of a historian file written by poller.run, or the values of one of them
+   usage: histdump.run HIST_FILE [COLUMN [FROM TO [WINDOW]]]
+   FROM and TO are times in seconds since the epoch, the whole file by default
+   With WINDOW, the min, max, average and count of every WINDOW seconds are printed instead
+   of the values, for every column if COLUMN is "*" */
+int main(int argc, char **argv)
+{
+    if (argc != 2 && argc != 3 && argc != 5 && argc != 6)
+    {
+        std::cerr << "usage: " << argv[0] << " HIST_FILE [COLUMN [FROM TO [WINDOW]]]" << std::endl;
+        return 1;
+    }
+
+    ModBusHistorian historian(argv[1]); /* read-only */
+
+    if (argc == 2) /* summary only */
+    {
+        std::cout << "blocks: " << historian.num_blocks() << " rows: " << historian.num_rows() << std::endl;
+        for (auto &column : historian.columns())
+            std::cout << column << "\t"
+                      << (historian.kind(historian.find(column)) == ModBusColumnKind::digital ? "digital" : "analog") << std::endl;
+        return 0;
+    }
+
+    auto seconds = [](const char *text) {
+        return std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::duration<double>(std::stod(text))));
+    };
+    auto print_time = [](const std::int64_t &ms) {
+        std::time_t t = ms / 1000;
+        char when[32];
+        std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", std::localtime(&t));
+        std::cout << when << "." << std::to_string(1000 + ms % 1000).substr(1) << "\t";
+    };
+    auto from = argc >= 5 ? seconds(argv[3]) : std::chrono::system_clock::time_point::min();
+    auto to = argc >= 5 ? seconds(argv[4]) : std::chrono::system_clock::time_point::max();
+
+    if (argc == 6) /* windowed aggregates */
+    {
+        std::vector<std::size_t> columns;
+        for (std::size_t c = 0; c < historian.columns().size(); ++c)
+        {
+            if (std::string(argv[2]) == "*" || historian.columns()[c] == argv[2])
+                columns.push_back(c);
+        }
+        if (columns.empty())
+        {
+            std::cerr << "No such column" << std::endl;
+            return 1;
+        }
+        auto window = std::chrono::milliseconds((std::int64_t)(std::stod(argv[5]) * 1000));
+        ModBusQuery query(historian);
+        auto aggregates = query.aggregate(columns, from, to, window);
+        const std::int64_t start = std::chrono::duration_cast<std::chrono::milliseconds>(from.time_since_epoch()).count();
+        std::cout << "time\tcolumn\tmin\tmax\tavg\tcount" << std::endl;
+        for (std::size_t w = 0; !aggregates.empty() && w < aggregates[0].size(); ++w)
+        {
+            for (std::size_t c = 0; c < columns.size(); ++c)
+            {
+                const ModBusAggregate &a = aggregates[c][w];
+                if (!a.count)
+                    continue;
+                print_time(start + (std::int64_t)w * window.count());
+                std::cout << historian.columns()[columns[c]] << "\t" << a.min << "\t" << a.max << "\t"
+                          << a.mean() << "\t" << a.count << std::endl;
+            }
+        }
+        return 0;
+    }
+
+    int column = historian.find(argv[2]);
+    if (column == -1)
+    {
+        std::cerr << "No such column" << std::endl;
+        return 1;
+    }
+
+    ModBusColumnSummary summary = historian.summary(column, from, to);
+    std::cout << "rows: " << summary.rows << " valid: " << summary.valid
+              << " min: " << summary.min << " max: " << summary.max << std::endl;
+
+    std::vector<std::chrono::system_clock::time_point> timestamps;
+    std::vector<double> values;
+    historian.read(column, from, to, timestamps, values);
+    for (std::size_t i = 0; i < values.size(); ++i)
+    {
+        print_time(std::chrono::duration_cast<std::chrono::milliseconds>(timestamps[i].time_since_epoch()).count());
+        if (std::isnan(values[i]))
+            std::cout << "failed" << std::endl;
+        else
+            std::cout << values[i] << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * histogram.cpp
+ *
+ * Description:
+ * Log-linear latency histogram for the benchmark and load tools.
+ *
+ */
+
+#include "includes/histogram.h"
+#include <algorithm>
+#include <cmath>
+
+/* bucket index of 2^63, the last one */
+#define HISTOGRAM_BUCKETS ((64 - PRECISION_BITS + 2) << (PRECISION_BITS - 1))
+
+/** bucket of a value
+ * Values below 2^PRECISION_BITS have a bucket each, above that every power of two
+ * is split into 2^(PRECISION_BITS-1) buckets.
+ */
+std::size_t ModBusHistogram::index_of(const std::uint64_t &value) noexcept
+{
+	const std::uint64_t half = 1ULL << (PRECISION_BITS - 1);
+	if (value < (1ULL << PRECISION_BITS))
+		return value;
+
+	int magnitude = 63 - __builtin_clzll(value);
+	int shift = magnitude - PRECISION_BITS + 1;
+	return shift * half + (value >> shift);
+}
+
+/* smallest value of a bucket */
+std::uint64_t ModBusHistogram::lowest_of(const std::size_t &index) noexcept
+{
+	const std::uint64_t half = 1ULL << (PRECISION_BITS - 1);
+	if (index < (1ULL << PRECISION_BITS))
+		return index;
+
+	std::uint64_t shift = index / half - 1;
+	return (index - shift * half) << shift;
+}
+
+ModBusHistogram::ModBusHistogram() : counts(HISTOGRAM_BUCKETS, 0)
+{
+}
+
+/* count a value */
+void ModBusHistogram::record(const std::uint64_t &value) noexcept
+{
+	++counts[index_of(value)];
+	++total;
+	sum += value;
+	min_value = std::min(min_value, value);
+	max_value = std::max(max_value, value);
+}
+
+/* count a value n times */
+void ModBusHistogram::record(const std::uint64_t &value, const std::uint64_t &n) noexcept
+{
+	if (n == 0)
+		return;
+	counts[index_of(value)] += n;
+	total += n;
+	sum += (long double)value * n;
+	min_value = std::min(min_value, value);
+	max_value = std::max(max_value, value);
+}
+
+/* add the counts of another histogram */
+void ModBusHistogram::merge(const ModBusHistogram &other) noexcept
+{
+	for (std::size_t i = 0; i < counts.size(); ++i)
+		counts[i] += other.counts[i];
+	total += other.total;
+	sum += other.sum;
+	min_value = std::min(min_value, other.min_value);
+	max_value = std::max(max_value, other.max_value);
+}
+
+/* forget every value */
+void ModBusHistogram::reset() noexcept
+{
+	std::fill(counts.begin(), counts.end(), 0);
+	total = 0;
+	sum = 0;
+	min_value = UINT64_MAX;
+	max_value = 0;
+}
+
+/* the number of values recorded */
+std::uint64_t ModBusHistogram::count() const noexcept
+{
+	return total;
+}
+
+/* the smallest value recorded, 0 when empty */
+std::uint64_t ModBusHistogram::min() const noexcept
+{
+	return total ? min_value : 0;
+}
+
+/* the largest value recorded, 0 when empty */
+std::uint64_t ModBusHistogram::max() const noexcept
+{
+	return max_value;
+}
+
+/* the mean of the values recorded, 0 when empty */
+double ModBusHistogram::mean() const noexcept
+{
+	return total ? (double)(sum / total) : 0.0;
+}
+
+/** the value below which the given percentage of the values lie
+ * \percent: 0 to 100, e.g. 99.9
+ * \return: the upper end of the bucket holding that value, clamped to the largest value recorded
+ */
+std::uint64_t ModBusHistogram::percentile(const double &percent) const noexcept
+{
+	if (total == 0)
+		return 0;
+
+	std::uint64_t rank = (std::uint64_t)std::ceil(std::min(std::max(percent, 0.0), 100.0) / 100.0 * total);
+	rank = std::max<std::uint64_t>(rank, 1);
+
+	std::uint64_t seen = 0;
+	for (std::size_t i = 0; i < counts.size(); ++i)
+	{
+		seen += counts[i];
+		if (seen >= rank)
+		{
+			std::uint64_t upper = i + 1 < counts.size() ? lowest_of(i + 1) - 1 : max_value;
+			return std::min(std::max(upper, min_value), max_value);
+		}
+	}
+	return max_value;
+}
@@ -0,0 +1,815 @@
+/*
+ * historian.cpp
+ *
+ * Description:
+ * Compressed columnar archive of polled values: delta-of-delta timestamps, XOR-compressed analogs,
+ * run-length encoded digitals, with per-block min/max indexes.
+ *
+ */
+
+#include "includes/historian.h"
+#include "includes/poller.h"
+#include "includes/logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HISTORIAN_MAGIC "MBHIST1"
+#define HISTORIAN_BLOCK_MAGIC "MBHB"
+
+/* file header, followed by the columns: kind, name length (16 bits), name */
+struct HistorianHeader
+{
+	char magic[8];
+	std::uint32_t num_columns;
+	std::uint32_t directory_length; /* bytes of the column list */
+};
+
+/* block header, followed by a ColumnEntry per column, the timestamps, then the columns */
+struct ModBusHistorian::BlockHeader
+{
+	char magic[4];
+	std::uint32_t rows;
+	std::int64_t first_time;	   /* milliseconds since the epoch */
+	std::int64_t last_time;		   /* milliseconds since the epoch */
+	std::uint64_t length;		   /* bytes of the block after this header */
+	std::uint32_t timestamps_length; /* bytes of the encoded timestamps */
+	std::uint32_t reserved;
+};
+
+/* bits appended most significant first */
+class HistorianBitWriter
+{
+private:
+	std::vector<std::uint8_t> &bytes;
+	std::size_t used = 0; /* bits */
+
+public:
+	explicit HistorianBitWriter(std::vector<std::uint8_t> &out) : bytes(out) {}
+
+	/* append the low n bits of value, n from 1 to 64 */
+	void write(const std::uint64_t &value, int n)
+	{
+		while (n > 0)
+		{
+			if (used % 8 == 0)
+				bytes.push_back(0);
+			const int room = 8 - used % 8;
+			const int take = n < room ? n : room;
+			const std::uint8_t chunk = (value >> (n - take)) & ((1u << take) - 1);
+			bytes.back() |= chunk << (room - take);
+			used += take;
+			n -= take;
+		}
+	}
+};
+
+/* bits read most significant first, zeros past the end */
+class HistorianBitReader
+{
+private:
+	const std::uint8_t *bytes;
+	std::size_t size; /* bytes */
+	std::size_t used = 0; /* bits */
+
+public:
+	HistorianBitReader(const std::uint8_t *data, const std::size_t &length) : bytes(data), size(length) {}
+
+	/* the next n bits, n from 1 to 64 */
+	std::uint64_t read(int n) noexcept
+	{
+		if (n > 56) /* may span 9 bytes */
+		{
+			const std::uint64_t high = read(n - 32);
+			return high << 32 | read(32);
+		}
+		const std::uint64_t value = peek() >> (64 - n);
+		used += n;
+		return value;
+	}
+
+	/* the next bits left aligned, without consuming them; at least the first 57 are valid */
+	std::uint64_t peek() const noexcept
+	{
+		const std::size_t byte = used / 8;
+		std::uint64_t window = 0;
+		if (byte + 8 <= size)
+		{
+			memcpy(&window, bytes + byte, sizeof(window));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			window = __builtin_bswap64(window);
+#endif
+		}
+		else
+		{
+			for (std::size_t i = byte; i < byte + 8; ++i)
+				window = window << 8 | (i < size ? bytes[i] : 0);
+		}
+		return window << (used % 8);
+	}
+
+	/* consume n bits */
+	void skip(const int &n) noexcept
+	{
+		used += n;
+	}
+};
+
+/* a value of n bits read back as signed */
+static inline std::int64_t _sign_extend(const std::uint64_t &value, const int &n) noexcept
+{
+	const std::uint64_t sign = std::uint64_t(1) << (n - 1);
+	return static_cast<std::int64_t>((value ^ sign) - sign);
+}
+
+/** timestamps as delta-of-delta: a bit for a period unchanged, a few more for jitter */
+static void _encode_times(const std::vector<std::int64_t> &times, std::vector<std::uint8_t> &out)
+{
+	HistorianBitWriter bits(out);
+	std::int64_t delta = 0;
+	for (std::size_t i = 1; i < times.size(); ++i)
+	{
+		const std::int64_t d = times[i] - times[i - 1];
+		const std::int64_t dod = d - delta;
+		delta = d;
+		if (dod == 0)
+			bits.write(0, 1);
+		else if (dod >= -64 && dod <= 63)
+		{
+			bits.write(0x2, 2);
+			bits.write(dod, 7);
+		}
+		else if (dod >= -256 && dod <= 255)
+		{
+			bits.write(0x6, 3);
+			bits.write(dod, 9);
+		}
+		else if (dod >= -2048 && dod <= 2047)
+		{
+			bits.write(0xE, 4);
+			bits.write(dod, 12);
+		}
+		else
+		{
+			bits.write(0xF, 4);
+			bits.write(dod, 64);
+		}
+	}
+}
+
+static void _decode_times(const std::uint8_t *data, const std::size_t &length, const std::int64_t &first,
+						  const std::size_t &rows, std::vector<std::int64_t> &times)
+{
+	HistorianBitReader bits(data, length);
+	times.resize(rows);
+	if (!rows)
+		return;
+	times[0] = first;
+	std::int64_t delta = 0;
+	for (std::size_t i = 1; i < rows; ++i)
+	{
+		std::int64_t dod = 0;
+		if (bits.read(1))
+		{
+			if (!bits.read(1))
+				dod = _sign_extend(bits.read(7), 7);
+			else if (!bits.read(1))
+				dod = _sign_extend(bits.read(9), 9);
+			else if (!bits.read(1))
+				dod = _sign_extend(bits.read(12), 12);
+			else
+				dod = static_cast<std::int64_t>(bits.read(64));
+		}
+		delta += dod;
+		times[i] = times[i - 1] + delta;
+	}
+}
+
+/** doubles XORed with the previous one, storing only the bits that differ */
+static void _encode_analog(const std::vector<double> &values, std::vector<std::uint8_t> &out)
+{
+	HistorianBitWriter bits(out);
+	std::uint64_t previous = 0;
+	int leading = -1, trailing = 0; /* window of the last meaningful bits written */
+	for (std::size_t i = 0; i < values.size(); ++i)
+	{
+		std::uint64_t current;
+		memcpy(&current, &values[i], sizeof(current));
+		if (i == 0)
+		{
+			bits.write(current, 64);
+			previous = current;
+			continue;
+		}
+
+		const std::uint64_t x = current ^ previous;
+		previous = current;
+		if (x == 0)
+		{
+			bits.write(0, 1);
+			continue;
+		}
+		int lead = std::min(__builtin_clzll(x), 31);
+		int trail = __builtin_ctzll(x);
+		if (leading != -1 && lead >= leading && trail >= trailing) /* fits the previous window */
+		{
+			bits.write(0x2, 2);
+			bits.write(x >> trailing, 64 - leading - trailing);
+		}
+		else
+		{
+			const int significant = 64 - lead - trail;
+			bits.write(0x3, 2);
+			bits.write(lead, 5);
+			bits.write(significant & 63, 6); /* 64 is written as 0 */
+			bits.write(x >> trail, significant);
+			leading = lead;
+			trailing = trail;
+		}
+	}
+}
+
+static void _decode_analog(const std::uint8_t *data, const std::size_t &length, const std::size_t &rows,
+						   std::vector<double> &values)
+{
+	HistorianBitReader bits(data, length);
+	values.resize(rows);
+	std::uint64_t previous = 0;
+	int leading = 0, trailing = 0;
+	for (std::size_t i = 0; i < rows; ++i)
+	{
+		if (i == 0)
+		{
+			previous = bits.read(64);
+			memcpy(&values[i], &previous, sizeof(previous));
+			continue;
+		}
+		/* the control bits and most values fit the same window of bits */
+		const std::uint64_t window = bits.peek();
+		if (!(window >> 63)) /* unchanged, the most frequent case */
+			bits.skip(1);
+		else if (!(window >> 62 & 1)) /* within the previous window */
+		{
+			const int significant = 64 - leading - trailing;
+			if (significant <= 55)
+			{
+				previous ^= (window << 2 >> (64 - significant)) << trailing;
+				bits.skip(2 + significant);
+			}
+			else
+			{
+				bits.skip(2);
+				previous ^= bits.read(significant) << trailing;
+			}
+		}
+		else /* new window */
+		{
+			bits.skip(2);
+			leading = bits.read(5);
+			int significant = bits.read(6);
+			if (significant == 0)
+				significant = 64;
+			trailing = 64 - leading - significant;
+			previous ^= bits.read(significant) << trailing;
+		}
+		memcpy(&values[i], &previous, sizeof(previous));
+	}
+}
+
+/* unsigned LEB128 */
+static void _write_varint(std::uint64_t value, std::vector<std::uint8_t> &out)
+{
+	while (value >= 0x80)
+	{
+		out.push_back(static_cast<std::uint8_t>(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<std::uint8_t>(value));
+}
+
+static std::uint64_t _read_varint(const std::uint8_t *data, const std::size_t &length, std::size_t &pos) noexcept
+{
+	std::uint64_t value = 0;
+	for (int shift = 0; pos < length && shift < 64; shift += 7)
+	{
+		const std::uint8_t byte = data[pos++];
+		value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			break;
+	}
+	return value;
+}
+
+/** digital values as runs of a byte (0, 1, or 0xFF for a failed read) and a length */
+static void _encode_digital(const std::vector<double> &values, std::vector<std::uint8_t> &out)
+{
+	for (std::size_t i = 0; i < values.size();)
+	{
+		const std::uint8_t value = std::isnan(values[i]) ? 0xFF : values[i] != 0;
+		std::size_t run = 1;
+		while (i + run < values.size() && (std::isnan(values[i + run]) ? 0xFF : values[i + run] != 0) == value)
+			++run;
+		out.push_back(value);
+		_write_varint(run, out);
+		i += run;
+	}
+}
+
+static void _decode_digital(const std::uint8_t *data, const std::size_t &length, const std::size_t &rows,
+							std::vector<double> &values)
+{
+	values.assign(rows, std::numeric_limits<double>::quiet_NaN());
+	std::size_t pos = 0, row = 0;
+	while (pos < length && row < rows)
+	{
+		const std::uint8_t value = data[pos++];
+		const std::uint64_t run = std::min<std::uint64_t>(_read_varint(data, length, pos), rows - row);
+		if (value != 0xFF)
+			std::fill(values.begin() + row, values.begin() + row + run, value);
+		row += run;
+	}
+}
+
+/* milliseconds since the epoch */
+static inline std::int64_t _millis(const std::chrono::system_clock::time_point &time) noexcept
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+}
+
+/** create the file or reopen it to append
+ * \path: the archive file
+ * \layout: a scan of the device, giving its varables, their type and number of values
+ * \block_rows: the number of scans per block
+ * \throw: runtime_error when block_rows is 0, the file cannot be created or read,
+ *         or an existing file holds other columns
+ */
+ModBusHistorian::ModBusHistorian(const std::string &path, const ModBusScan &layout, const std::size_t &block_rows)
+	: writable(true), block_rows(block_rows)
+{
+	if (block_rows == 0 || block_rows > std::numeric_limits<std::uint32_t>::max())
+	{
+		throw std::runtime_error("[ModBusHistorian::ModBusHistorian]Invalid number of rows per block");
+	}
+
+	std::vector<std::uint8_t> directory;
+	for (auto &tag : layout.tags)
+	{
+		ModBusColumnKind kind = tag.type == "coil" || tag.type == "input_bit" ? ModBusColumnKind::digital : ModBusColumnKind::analog;
+		for (std::size_t i = 0; i < tag.values.size(); ++i)
+		{
+			std::string name = tag.values.size() == 1 ? tag.name : tag.name + "[" + std::to_string(i) + "]";
+			column_names.push_back(name);
+			column_kinds.push_back(kind);
+			directory.push_back(static_cast<std::uint8_t>(kind));
+			directory.push_back(name.size() & 0xFF);
+			directory.push_back(name.size() >> 8);
+			directory.insert(directory.end(), name.begin(), name.end());
+		}
+	}
+	rows.resize(column_names.size());
+
+	this->fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (this->fd == -1)
+	{
+		throw std::runtime_error("[ModBusHistorian::ModBusHistorian]Unable to open " + path + ": " + std::string(strerror(errno)));
+	}
+
+	struct stat st;
+	if (fstat(this->fd, &st) == -1)
+	{
+		auto tmp_error = errno;
+		close(this->fd);
+		throw std::runtime_error("[ModBusHistorian::ModBusHistorian]Unable to stat " + path + ": " + std::string(strerror(tmp_error)));
+	}
+
+	if (st.st_size == 0) /* new file */
+	{
+		HistorianHeader h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, HISTORIAN_MAGIC, sizeof(h.magic));
+		h.num_columns = column_names.size();
+		h.directory_length = directory.size();
+		if (pwrite(this->fd, directory.data(), directory.size(), sizeof(h)) != (ssize_t)directory.size() ||
+			pwrite(this->fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h))
+		{
+			auto tmp_error = errno;
+			close(this->fd);
+			unlink(path.c_str());
+			throw std::runtime_error("[ModBusHistorian::ModBusHistorian]Unable to create " + path + ": " + std::string(strerror(tmp_error)));
+		}
+	}
+
+	std::vector<std::string> names = column_names;
+	std::vector<ModBusColumnKind> kinds = column_kinds;
+	std::uint64_t end;
+	try
+	{
+		end = load(path);
+	}
+	catch (...)
+	{
+		close(this->fd);
+		throw;
+	}
+	if (!blocks.empty())
+		last_time = blocks.back().last_time;
+	blocks.clear(); /* the writer does not need the index */
+	if (names != column_names || kinds != column_kinds)
+	{
+		close(this->fd);
+		throw std::runtime_error("[ModBusHistorian::ModBusHistorian]" + path + " holds other columns");
+	}
+
+	/* drop a block cut short by a crash, append after the last complete one */
+	if ((std::uint64_t)st.st_size > end && ftruncate(this->fd, end) == -1)
+	{
+		auto tmp_error = errno;
+		close(this->fd);
+		throw std::runtime_error("[ModBusHistorian::ModBusHistorian]Unable to truncate " + path + ": " + std::string(strerror(tmp_error)));
+	}
+	lseek(this->fd, end, SEEK_SET);
+}
+
+/** open an existing file read-only and index its blocks
+ * Blocks the writer adds afterwards are not seen, open the file again to see them.
+ * \throw: runtime_error when the file cannot be read or is not a historian file
+ */
+ModBusHistorian::ModBusHistorian(const std::string &path)
+{
+	this->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (this->fd == -1)
+	{
+		throw std::runtime_error("[ModBusHistorian::ModBusHistorian]Unable to open " + path + ": " + std::string(strerror(errno)));
+	}
+	try
+	{
+		load(path);
+	}
+	catch (...)
+	{
+		close(this->fd);
+		throw;
+	}
+}
+
+ModBusHistorian::~ModBusHistorian()
+{
+	if (writable)
+	{
+		try
+		{
+			flush();
+		}
+		catch (const std::exception &e)
+		{
+			MODBUS_LOG(error, "ModBusHistorian::~ModBusHistorian", "rows lost", e.what());
+		}
+	}
+	close(this->fd);
+}
+
+/** read the columns and index the complete blocks
+ * \return: the offset following the last complete block
+ * \throw: runtime_error if the file is not a historian file
+ */
+std::uint64_t ModBusHistorian::load(const std::string &path)
+{
+	HistorianHeader h;
+	std::vector<std::uint8_t> directory;
+	bool valid = pread(this->fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && memcmp(h.magic, HISTORIAN_MAGIC, sizeof(h.magic)) == 0;
+	if (valid)
+	{
+		directory.resize(h.directory_length);
+		valid = pread(this->fd, directory.data(), directory.size(), sizeof(h)) == (ssize_t)directory.size();
+	}
+
+	column_names.clear();
+	column_kinds.clear();
+	std::size_t pos = 0;
+	for (std::uint32_t i = 0; valid && i < h.num_columns; ++i)
+	{
+		valid = pos + 3 <= directory.size();
+		if (!valid)
+			break;
+		const std::size_t length = directory[pos + 1] | directory[pos + 2] << 8;
+		valid = directory[pos] <= static_cast<std::uint8_t>(ModBusColumnKind::digital) && pos + 3 + length <= directory.size();
+		if (!valid)
+			break;
+		column_kinds.push_back(static_cast<ModBusColumnKind>(directory[pos]));
+		column_names.emplace_back(reinterpret_cast<const char *>(directory.data()) + pos + 3, length);
+		pos += 3 + length;
+	}
+	if (!valid)
+	{
+		throw std::runtime_error("[ModBusHistorian::load]" + path + " is not a historian file");
+	}
+
+	/* walk the block headers */
+	this->data_offset = sizeof(h) + h.directory_length;
+	std::uint64_t offset = this->data_offset;
+	BlockHeader b;
+	const std::size_t entries = column_names.size() * sizeof(ColumnEntry);
+	blocks.clear();
+	while (pread(this->fd, &b, sizeof(b), offset) == (ssize_t)sizeof(b))
+	{
+		BlockIndex block;
+		block.columns.resize(column_names.size());
+		if (memcmp(b.magic, HISTORIAN_BLOCK_MAGIC, sizeof(b.magic)) != 0 || b.length < entries + b.timestamps_length ||
+			pread(this->fd, block.columns.data(), entries, offset + sizeof(b)) != (ssize_t)entries)
+			break;
+
+		std::uint64_t total = entries + b.timestamps_length;
+		for (auto &column : block.columns)
+			total += column.length;
+		struct stat st;
+		if (total != b.length || fstat(this->fd, &st) == -1 || offset + sizeof(b) + b.length > (std::uint64_t)st.st_size)
+			break; /* cut short */
+
+		block.offset = offset;
+		block.rows = b.rows;
+		block.first_time = b.first_time;
+		block.last_time = b.last_time;
+		block.timestamps_length = b.timestamps_length;
+		blocks.push_back(std::move(block));
+		offset += sizeof(b) + b.length;
+	}
+	return offset;
+}
+
+/** add the values of a scan
+ * Failed reads are kept as NaN. Every block_rows scans the buffered rows are written as a block.
+ * Timestamps never go back in the file, for the readers to search them: a scan older than the
+ * previous one, after the system clock was stepped back, is stored at the time of the previous one.
+ * \scan: a scan of the device the file was created with
+ * \throw: runtime_error if the file is read-only or the block cannot be written
+ */
+void ModBusHistorian::append(const ModBusScan &scan)
+{
+	if (!writable)
+	{
+		throw std::runtime_error("[ModBusHistorian::append]The file is open read-only");
+	}
+
+	last_time = std::max(last_time, _millis(scan.timestamp));
+	times.push_back(last_time);
+	std::size_t column = 0;
+	for (auto &tag : scan.tags)
+	{
+		for (std::size_t i = 0; i < tag.values.size() && column < rows.size(); ++i, ++column)
+			rows[column].push_back(tag.rc == tag.num ? tag.values[i] : std::numeric_limits<double>::quiet_NaN());
+	}
+	for (; column < rows.size(); ++column) /* a scan of another layout */
+		rows[column].push_back(std::numeric_limits<double>::quiet_NaN());
+
+	if (times.size() >= block_rows)
+		flush();
+}
+
+/** encode the buffered rows and write them as one block with a single write
+ * \throw: runtime_error if the block cannot be written, the rows are kept for another attempt
+ */
+void ModBusHistorian::flush()
+{
+	if (!writable || times.empty())
+		return;
+
+	std::vector<std::uint8_t> body;
+	std::vector<ColumnEntry> entries(rows.size());
+	_encode_times(times, body);
+	const std::size_t timestamps_length = body.size();
+	for (std::size_t c = 0; c < rows.size(); ++c)
+	{
+		const std::size_t start = body.size();
+		if (column_kinds[c] == ModBusColumnKind::digital)
+			_encode_digital(rows[c], body);
+		else
+			_encode_analog(rows[c], body);
+
+		ColumnEntry &entry = entries[c];
+		entry.min = std::numeric_limits<double>::infinity();
+		entry.max = -std::numeric_limits<double>::infinity();
+		entry.valid = 0;
+		for (auto &value : rows[c])
+		{
+			if (std::isnan(value))
+				continue;
+			entry.min = std::min(entry.min, value);
+			entry.max = std::max(entry.max, value);
+			++entry.valid;
+		}
+		if (!entry.valid)
+			entry.min = entry.max = 0;
+		entry.length = body.size() - start;
+	}
+
+	BlockHeader b;
+	memset(&b, 0, sizeof(b));
+	memcpy(b.magic, HISTORIAN_BLOCK_MAGIC, sizeof(b.magic));
+	b.rows = times.size();
+	b.first_time = times.front();
+	b.last_time = times.back();
+	b.timestamps_length = timestamps_length;
+	b.length = entries.size() * sizeof(ColumnEntry) + body.size();
+
+	std::vector<std::uint8_t> block(sizeof(b) + b.length);
+	memcpy(block.data(), &b, sizeof(b));
+	memcpy(block.data() + sizeof(b), entries.data(), entries.size() * sizeof(ColumnEntry));
+	memcpy(block.data() + sizeof(b) + entries.size() * sizeof(ColumnEntry), body.data(), body.size());
+
+	const off_t offset = lseek(this->fd, 0, SEEK_CUR);
+	std::size_t written = 0;
+	while (written < block.size())
+	{
+		ssize_t n = write(this->fd, block.data() + written, block.size() - written);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			auto tmp_error = errno;
+			if (ftruncate(this->fd, offset) == 0) /* no partial block */
+				lseek(this->fd, offset, SEEK_SET);
+			throw std::runtime_error("[ModBusHistorian::flush]Unable to write a block: " + std::string(strerror(tmp_error)));
+		}
+		written += n;
+	}
+
+	times.clear();
+	for (auto &column : rows)
+		column.clear();
+}
+
+const std::vector<std::string> &ModBusHistorian::columns() const noexcept
+{
+	return column_names;
+}
+
+/* the index of a column, or -1 if not found */
+int ModBusHistorian::find(const std::string &column) const noexcept
+{
+	auto it = std::find(column_names.begin(), column_names.end(), column);
+	return it == column_names.end() ? -1 : it - column_names.begin();
+}
+
+/** the encoding of a column
+ * \throw: out_of_range
+ */
+ModBusColumnKind ModBusHistorian::kind(const std::size_t &column) const
+{
+	return column_kinds.at(column);
+}
+
+std::size_t ModBusHistorian::num_blocks() const noexcept
+{
+	return blocks.size();
+}
+
+std::uint64_t ModBusHistorian::num_rows() const noexcept
+{
+	std::uint64_t total = 0;
+	for (auto &block : blocks)
+		total += block.rows;
+	return total;
+}
+
+/** the time range of a block
+ * \throw: out_of_range for an invalid block
+ */
+void ModBusHistorian::block_range(const std::size_t &block, std::int64_t &first, std::int64_t &last) const
+{
+	const BlockIndex &b = blocks.at(block);
+	first = b.first_time;
+	last = b.last_time;
+}
+
+/** read and decode the timestamps of a block
+ * \throw: out_of_range for an invalid block, runtime_error if the block cannot be read
+ */
+void ModBusHistorian::read_timestamps(const std::size_t &block, std::vector<std::int64_t> &timestamps) const
+{
+	const BlockIndex &b = blocks.at(block);
+	std::vector<std::uint8_t> data(b.timestamps_length);
+	if (pread(this->fd, data.data(), data.size(), b.offset + sizeof(BlockHeader) + b.columns.size() * sizeof(ColumnEntry)) != (ssize_t)data.size())
+	{
+		throw std::runtime_error("[ModBusHistorian::read_timestamps]Unable to read a block: " + std::string(strerror(errno)));
+	}
+	_decode_times(data.data(), data.size(), b.first_time, b.rows, timestamps);
+}
+
+/** read and decode one column of a block, the other columns are not read
+ * \throw: out_of_range for an invalid block or column, runtime_error if the block cannot be read
+ */
+void ModBusHistorian::read_column(const std::size_t &block, const std::size_t &column, std::vector<double> &values) const
+{
+	const BlockIndex &b = blocks.at(block);
+	std::uint64_t offset = b.offset + sizeof(BlockHeader) + b.columns.size() * sizeof(ColumnEntry) + b.timestamps_length;
+	for (std::size_t c = 0; c < column; ++c)
+		offset += b.columns[c].length;
+	std::vector<std::uint8_t> data(b.columns.at(column).length);
+	if (pread(this->fd, data.data(), data.size(), offset) != (ssize_t)data.size())
+	{
+		throw std::runtime_error("[ModBusHistorian::read_column]Unable to read a block: " + std::string(strerror(errno)));
+	}
+	if (column_kinds[column] == ModBusColumnKind::digital)
+		_decode_digital(data.data(), data.size(), b.rows, values);
+	else
+		_decode_analog(data.data(), data.size(), b.rows, values);
+}
+
+/** the values of a column in a time range, only the blocks overlapping it are read
+ * \column: the index of the column
+ * \from, \to: the time range, inclusive, at millisecond resolution
+ * \timestamps, \values: the rows found are appended, NaN for a failed read
+ * \return: the number of rows appended
+ * \throw: out_of_range for an invalid column, runtime_error if a block cannot be read
+ */
+std::size_t ModBusHistorian::read(const std::size_t &column, const std::chrono::system_clock::time_point &from,
+								  const std::chrono::system_clock::time_point &to,
+								  std::vector<std::chrono::system_clock::time_point> &timestamps, std::vector<double> &values) const
+{
+	if (column >= column_names.size())
+		throw std::out_of_range("[ModBusHistorian::read]No such column");
+
+	const std::int64_t first = _millis(from), last = _millis(to);
+	std::vector<std::int64_t> block_times;
+	std::vector<double> block_values;
+	std::size_t count = 0;
+	for (std::size_t b = 0; b < blocks.size(); ++b)
+	{
+		if (blocks[b].last_time < first || blocks[b].first_time > last)
+			continue;
+		read_timestamps(b, block_times);
+		read_column(b, column, block_values);
+		for (std::size_t i = 0; i < block_times.size(); ++i)
+		{
+			if (block_times[i] < first || block_times[i] > last)
+				continue;
+			timestamps.push_back(std::chrono::system_clock::time_point(
+				std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::milliseconds(block_times[i]))));
+			values.push_back(block_values[i]);
+			++count;
+		}
+	}
+	return count;
+}
+
+/** min, max and number of values of a column in a time range
+ * Blocks entirely inside the range are summarized from their header, without reading them;
+ * only the blocks at the ends of the range are decoded.
+ * \throw: out_of_range for an invalid column, runtime_error if a block cannot be read
+ */
+ModBusColumnSummary ModBusHistorian::summary(const std::size_t &column, const std::chrono::system_clock::time_point &from,
+											 const std::chrono::system_clock::time_point &to) const
+{
+	if (column >= column_names.size())
+		throw std::out_of_range("[ModBusHistorian::summary]No such column");
+
+	const std::int64_t first = _millis(from), last = _millis(to);
+	ModBusColumnSummary result;
+	double min = std::numeric_limits<double>::infinity(), max = -min;
+	std::vector<std::int64_t> block_times;
+	std::vector<double> block_values;
+	for (std::size_t b = 0; b < blocks.size(); ++b)
+	{
+		const BlockIndex &block = blocks[b];
+		if (block.last_time < first || block.first_time > last)
+			continue;
+		if (block.first_time >= first && block.last_time <= last) /* whole block, from the index */
+		{
+			const ColumnEntry &entry = block.columns[column];
+			result.rows += block.rows;
+			result.valid += entry.valid;
+			if (entry.valid)
+			{
+				min = std::min(min, entry.min);
+				max = std::max(max, entry.max);
+			}
+			continue;
+		}
+
+		read_timestamps(b, block_times);
+		read_column(b, column, block_values);
+		for (std::size_t i = 0; i < block_times.size(); ++i)
+		{
+			if (block_times[i] < first || block_times[i] > last)
+				continue;
+			++result.rows;
+			if (std::isnan(block_values[i]))
+				continue;
+			++result.valid;
+			min = std::min(min, block_values[i]);
+			max = std::max(max, block_values[i]);
+		}
+	}
+	if (result.valid)
+	{
+		result.min = min;
+		result.max = max;
+	}
+	return result;
+}
@@ -0,0 +1,48 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include "includes/shm_image.h"
+
+/* print the latest values of every variable of a process image published by poller.run
+   usage: imagedump.run SHM_NAME [DEVICE VAR_NAME] */
+int main(int argc, char **argv)
+{
+    if (argc != 2 && argc != 4)
+    {
+        std::cerr << "usage: " << argv[0] << " SHM_NAME [DEVICE VAR_NAME]" << std::endl;
+        return 1;
+    }
+
+    ModBusShmImage image(argv[1]); /* read-only */
+
+    std::size_t first = 0, last = image.size();
+    if (argc == 4)
+    {
+        int index = image.find(argv[2], argv[3]);
+        if (index == -1)
+        {
+            std::cerr << "No such variable" << std::endl;
+            return 1;
+        }
+        first = index;
+        last = index + 1;
+    }
+
+    std::cout << "scans published: " << image.generation() << std::endl;
+    for (std::size_t i = first; i < last; ++i)
+    {
+        std::vector<double> values(image.num_values(i), 0.0);
+        ModBusShmSample sample;
+        if (!image.read(i, values.data(), sample))
+        {
+            std::cerr << image.device(i) << "/" << image.name(i) << ": busy" << std::endl;
+            continue;
+        }
+        std::cout << image.device(i) << "/" << image.name(i) << " scan " << sample.scan
+                  << (sample.rc == -1 ? " (stale)" : "") << ":";
+        for (auto &value : values)
+            std::cout << "\t" << value;
+        std::cout << std::endl;
+    }
+    return 0;
+}
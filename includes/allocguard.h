@@ -0,0 +1,35 @@
+#ifndef __MODBUS_ALLOCGUARD_
+#define __MODBUS_ALLOCGUARD_
+
+#include <cstdint>
+
+/*
+   Counts the heap allocations of the calling thread between its construction
+   and its destruction, to check that a real-time loop does not allocate once
+   it runs (see ModBusPoller::set_real_time()).
+
+   The global operator new and new[] are replaced by allocguard.cpp with ones
+   that count per thread while a guard is alive on it, then call malloc();
+   linking allocguard.o is enough. Memory taken with malloc() directly, by C
+   libraries, is not seen. Guards may nest.
+*/
+class ModBusAllocationGuard
+{
+private:
+	std::uint64_t start; /* allocations of the thread when the guard was made */
+
+public:
+	ModBusAllocationGuard() noexcept;
+	~ModBusAllocationGuard();
+
+	/* Not copyable or movable */
+	ModBusAllocationGuard(const ModBusAllocationGuard &) = delete;
+	ModBusAllocationGuard &operator=(const ModBusAllocationGuard &) = delete;
+	ModBusAllocationGuard(ModBusAllocationGuard &&) = delete;
+	ModBusAllocationGuard &operator=(ModBusAllocationGuard &&) = delete;
+
+	/* the allocations of this thread since the guard was made */
+	std::uint64_t count() const noexcept;
+};
+
+#endif
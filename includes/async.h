@@ -0,0 +1,89 @@
+#ifndef __MODBUS_ASYNC_
+#define __MODBUS_ASYNC_
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+#include "modbus.h"
+
+/* the outcome of a request of ModBusAsyncConnector */
+struct ModBusReply
+{
+	int rc = -1;						  /* -1 on failure, or the number of bits or registers read or written */
+	int error = 0;						  /* errno of a failed request */
+	std::vector<std::uint16_t> registers{}; /* values of a register read */
+	std::vector<std::uint8_t> bits{};	  /* values of a bit read */
+};
+
+/*
+   A connection shared by many threads without a lock held across requests.
+
+   Callers submit requests into a lock-free multi-producer single-consumer
+   queue and get a future; a single I/O thread owns the ModBusConnector,
+   sends the requests in submission order and completes the futures. Submitting
+   costs an allocation and an atomic exchange, plus a write to an eventfd when
+   the I/O thread is idle, instead of waiting for the connection mutex while
+   another thread's request is on the wire.
+
+   The connection is established on the first request, and again after a
+   request failed because the connection was lost.
+*/
+class ModBusAsyncConnector
+{
+private:
+	struct Request; /* a queued request, also the node of the queue */
+
+	ModBusConnector conn;
+	std::atomic<Request *> head; /* last pushed, producers exchange it */
+	Request *tail;				 /* next to pop, the I/O thread only */
+	Request *stub;				 /* node keeping the queue non-empty */
+	std::atomic<bool> sleeping{false};
+	std::atomic<bool> stopping{false};
+	int wakeup = -1; /* eventfd */
+	std::thread thread{};
+
+	/* queue a request and wake the I/O thread if it sleeps */
+	std::future<ModBusReply> submit(Request *request);
+
+	/* link a node at the head */
+	void push(Request *request) noexcept;
+
+	/* the oldest request, nullptr if none is complete in the queue */
+	Request *pop() noexcept;
+
+	/* send a request and complete its future */
+	void execute(Request *request) noexcept;
+
+	/* I/O thread */
+	void run() noexcept;
+
+public:
+	/* connection to the modbus server at ip:port, and its I/O thread */
+	ModBusAsyncConnector(const std::string &ip, const int &port);
+
+	/* Not copyable or movable*/
+	ModBusAsyncConnector(const ModBusAsyncConnector &) = delete;
+	ModBusAsyncConnector &operator=(const ModBusAsyncConnector &) = delete;
+	ModBusAsyncConnector(ModBusAsyncConnector &&) = delete;
+	ModBusAsyncConnector &operator=(ModBusAsyncConnector &&) = delete;
+
+	/* sends what is queued, then stops the I/O thread */
+	~ModBusAsyncConnector();
+
+	/* the underlying connection, to set its unit id, timeouts, ... */
+	ModBusConnector &connector() noexcept;
+
+	std::future<ModBusReply> read_bits(const int &addr, const int &num_of_bits);
+	std::future<ModBusReply> read_input_bits(const int &addr, const int &num_of_bits);
+	std::future<ModBusReply> read_registers(const int &addr, const int &num_of_registers);
+	std::future<ModBusReply> read_input_registers(const int &addr, const int &num_of_registers);
+	std::future<ModBusReply> write_bit(const int &addr, const std::uint8_t &value);
+	std::future<ModBusReply> write_bits(const int &addr, const std::vector<std::uint8_t> &values);
+	std::future<ModBusReply> write_register(const int &addr, const std::uint16_t &value);
+	std::future<ModBusReply> write_registers(const int &addr, const std::vector<std::uint16_t> &values);
+};
+
+#endif
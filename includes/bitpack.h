@@ -0,0 +1,37 @@
+#ifndef __MODBUS_BITPACK_
+#define __MODBUS_BITPACK_
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+   Conversion between a byte per bit, as taken and returned by
+   ModBusConnector::read_bits/read_input_bits/write_bits, and the packed
+   format of the modbus wire, used by their *_packed counterparts: bit i of a
+   range is bit i % 8 of byte i / 8, the unused high bits of the last byte being 0.
+
+   Both directions convert 16 bits per step with SSE2 where available.
+*/
+class ModBusBitPack
+{
+public:
+	/* the number of bytes holding num_of_bits packed bits */
+	static std::size_t bytes(const std::size_t &num_of_bits) noexcept
+	{
+		return (num_of_bits + 7) / 8;
+	}
+
+	/* the value of bit i of a packed array */
+	static bool test(const std::uint8_t *packed, const std::size_t &i) noexcept
+	{
+		return (packed[i / 8] >> (i % 8)) & 1;
+	}
+
+	/* pack num_of_bits bytes, any non-zero byte being a 1, into bytes(num_of_bits) bytes */
+	static void pack(const std::uint8_t *bits, const std::size_t &num_of_bits, std::uint8_t *packed) noexcept;
+
+	/* unpack num_of_bits packed bits into as many bytes of 0 or 1 */
+	static void unpack(const std::uint8_t *packed, const std::size_t &num_of_bits, std::uint8_t *bits) noexcept;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef __MODBUS_CACHE_
+#define __MODBUS_CACHE_
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+#include "modbus.h"
+
+/* counters of a ModBusReadCache */
+struct ModBusCacheStats
+{
+	std::uint64_t hits = 0;			 /* reads served from the cache */
+	std::uint64_t misses = 0;		 /* reads sent to the device */
+	std::uint64_t invalidations = 0; /* cached ranges dropped by a write */
+};
+
+/*
+   Read-through cache in front of a ModBusConnector, for applications whose
+   modules read the same tags within a few milliseconds of each other.
+
+   Every successful read is kept, per area, with the time it was read. A read
+   is served from the cache when a kept range covers it, a larger range
+   serving its sub-ranges, and is younger than the max_age the caller
+   tolerates; otherwise it goes to the device. Ranges of an area never
+   overlap, a new one replacing the older ones it overlaps. A write through
+   the cache drops the cached ranges it overlaps, and a read that was in
+   flight during such a write is not cached.
+*/
+class ModBusReadCache
+{
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	/* a cached range */
+	struct Entry
+	{
+		int num;						 /* number of bits or registers */
+		Clock::time_point time;			 /* when it was read */
+		std::vector<std::uint16_t> values; /* a word per register or bit */
+	};
+
+	/* cached ranges of an area, by start address */
+	struct Area
+	{
+		std::map<int, Entry> entries{};
+		std::uint64_t generation = 0; /* incremented by every write to the area */
+	};
+
+	ModBusConnector &conn;
+	const std::chrono::milliseconds default_max_age;
+	std::mutex cache_lock{};
+	Area areas[4];
+	ModBusCacheStats counters{};
+
+	/* copy a cached range covering [addr, addr + num) younger than max_age into values, false if none */
+	template <typename T>
+	bool lookup(const ModBusArea &area, const int &addr, const int &num, const std::chrono::milliseconds &max_age, std::vector<T> &values);
+
+	/* keep a range read at time, unless the area was written since generation */
+	template <typename T>
+	void store(const ModBusArea &area, const int &addr, const std::vector<T> &values, const Clock::time_point &time, const std::uint64_t &generation);
+
+	/* read from the device */
+	int fetch(const ModBusArea &area, const int &addr, const int &num, std::vector<std::uint8_t> &values) noexcept;
+	int fetch(const ModBusArea &area, const int &addr, const int &num, std::vector<std::uint16_t> &values) noexcept;
+
+	/* read through the cache */
+	template <typename T>
+	int read(const ModBusArea &area, const int &addr, const int &num, const std::chrono::milliseconds &max_age, std::vector<T> &values) noexcept;
+
+	/* drop the cached ranges of an area overlapping [addr, addr + num) */
+	void invalidate(const ModBusArea &area, const int &addr, const int &num) noexcept;
+
+public:
+	/* cache reads of conn, max_age applying to reads that do not give their own */
+	ModBusReadCache(ModBusConnector &conn, const std::chrono::milliseconds &default_max_age);
+
+	/* Not copyable or movable*/
+	ModBusReadCache(const ModBusReadCache &) = delete;
+	ModBusReadCache &operator=(const ModBusReadCache &) = delete;
+	ModBusReadCache(ModBusReadCache &&) = delete;
+	ModBusReadCache &operator=(ModBusReadCache &&) = delete;
+
+	/* read a number of coils, values being at most max_age old */
+	int read_bits(const int &addr, const int &num_of_bits, std::vector<std::uint8_t> &values) noexcept;
+	int read_bits(const int &addr, const int &num_of_bits, std::vector<std::uint8_t> &values, const std::chrono::milliseconds &max_age) noexcept;
+
+	/* read a number of discrete inputs, values being at most max_age old */
+	int read_input_bits(const int &addr, const int &num_of_bits, std::vector<std::uint8_t> &values) noexcept;
+	int read_input_bits(const int &addr, const int &num_of_bits, std::vector<std::uint8_t> &values, const std::chrono::milliseconds &max_age) noexcept;
+
+	/* read a number of holding registers, values being at most max_age old */
+	int read_registers(const int &addr, const int &num_of_registers, std::vector<std::uint16_t> &values) noexcept;
+	int read_registers(const int &addr, const int &num_of_registers, std::vector<std::uint16_t> &values, const std::chrono::milliseconds &max_age) noexcept;
+
+	/* read a number of input registers, values being at most max_age old */
+	int read_input_registers(const int &addr, const int &num_of_registers, std::vector<std::uint16_t> &values) noexcept;
+	int read_input_registers(const int &addr, const int &num_of_registers, std::vector<std::uint16_t> &values, const std::chrono::milliseconds &max_age) noexcept;
+
+	/* write through to the device, dropping the cached ranges written */
+	int write_bit(const int &addr, const std::uint8_t &value) noexcept;
+	int write_bits(const int &addr, const int &num_of_bits, const std::vector<std::uint8_t> &values) noexcept;
+	int write_register(const int &addr, const std::uint16_t &value) noexcept;
+	int write_registers(const int &addr, const int &num_of_registers, const std::vector<std::uint16_t> &values) noexcept;
+	int mask_write_register(const int &addr, const std::uint16_t &and_mask, const std::uint16_t &or_mask) noexcept;
+	int write_register_bits(const int &addr, const std::uint16_t &mask, const std::uint16_t &bits) noexcept;
+
+	/* drop everything cached, e.g. after writing through another connection or past the cache */
+	void clear() noexcept;
+
+	/* counters since construction */
+	ModBusCacheStats stats();
+};
+
+#endif
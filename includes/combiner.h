@@ -0,0 +1,98 @@
+#ifndef __MODBUS_COMBINER_
+#define __MODBUS_COMBINER_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "modbus.h"
+
+/* counters of a ModBusWriteCombiner */
+struct ModBusCombinerStats
+{
+	std::uint64_t writes = 0;	 /* writes queued */
+	std::uint64_t overwrites = 0; /* writes replaced by a later one to the same address before being sent */
+	std::uint64_t requests = 0;	 /* requests sent */
+};
+
+/*
+   Write-combining queue in front of a ModBusConnector, for applications that
+   write many single registers or coils in bursts.
+
+   Writes are queued, and sent once the window has passed since the first
+   queued one, or on flush(). Queued writes to consecutive addresses of the
+   same area go out as one FC16 (registers) or FC15 (coils) request, a lone
+   address as FC06 or FC05. A write to an address already queued replaces its
+   value (last writer wins); every write still gets its own completion, the
+   number of values written (1) or -1, through the returned future.
+
+   Only consecutive addresses are merged: a request covering a gap would
+   overwrite the registers in between with values nobody wrote.
+*/
+class ModBusWriteCombiner
+{
+private:
+	/* a queued value and the writers waiting for it */
+	struct Pending
+	{
+		std::uint16_t value;
+		std::vector<std::promise<int>> waiters;
+	};
+
+	ModBusConnector &conn;
+	const std::chrono::milliseconds window;
+
+	std::mutex queue_lock{};
+	std::condition_variable queue_cv{};
+	std::map<int, Pending> registers{}; /* by address */
+	std::map<int, Pending> coils{};		/* by address */
+	std::chrono::steady_clock::time_point deadline{}; /* when the queue is sent, set by the first queued write */
+	bool stopping = false;
+	ModBusCombinerStats counters{};
+
+	std::mutex send_lock{}; /* one batch at a time, so that batches reach the device in order */
+	std::thread thread{};
+
+	/* queue a value */
+	std::future<int> queue(std::map<int, Pending> &area, const int &addr, const std::uint16_t &value);
+
+	/* send everything queued */
+	void send();
+
+	/* send the queued values of an area, consecutive addresses together */
+	void send_area(std::map<int, Pending> &area, const bool &is_register) noexcept;
+
+	/* sends the queue when the window expires */
+	void run() noexcept;
+
+public:
+	/* combine the writes issued within window, or only on flush() if window is 0 */
+	ModBusWriteCombiner(ModBusConnector &conn, const std::chrono::milliseconds &window);
+
+	/* Not copyable or movable*/
+	ModBusWriteCombiner(const ModBusWriteCombiner &) = delete;
+	ModBusWriteCombiner &operator=(const ModBusWriteCombiner &) = delete;
+	ModBusWriteCombiner(ModBusWriteCombiner &&) = delete;
+	ModBusWriteCombiner &operator=(ModBusWriteCombiner &&) = delete;
+
+	/* sends what is still queued */
+	~ModBusWriteCombiner();
+
+	/* queue a write to a holding register */
+	std::future<int> write_register(const int &addr, const std::uint16_t &value);
+
+	/* queue a write to a coil */
+	std::future<int> write_bit(const int &addr, const std::uint8_t &value);
+
+	/* send everything queued now, return once it has been sent */
+	void flush();
+
+	/* counters since construction */
+	ModBusCombinerStats stats();
+};
+
+#endif
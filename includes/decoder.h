@@ -0,0 +1,47 @@
+#ifndef __MODBUS_DECODER_
+#define __MODBUS_DECODER_
+
+#include <cstdint>
+#include <vector>
+#include "parser.h"
+
+/*
+   Turns a raw register block, as returned by a single read request, into
+   engineering values according to the annotations of the variables it holds.
+   The layout of the block is compiled once by add(), decode() then walks the
+   block in a single pass with one tight loop per run of same-typed values.
+*/
+class ModbusDecoder
+{
+private:
+	/* a run of values sharing the same format inside the raw register block */
+	struct Step
+	{
+		ModbusTagFormat format;
+		int src_offset; /* index of the first register of the run in the block */
+		int count;		/* number of values in the run */
+		int dst_offset; /* index of the first value of the run in the output */
+	};
+
+	std::vector<Step> steps{};
+	int num_of_values = 0;
+
+public:
+	/* number of values a variable taking num_of_registers registers decodes to */
+	static int value_count(const ModbusTagFormat &format, const int &num_of_registers) noexcept;
+
+	/* append a variable taking num_of_registers registers from src_offset of the block
+	   return: the index of its first value in the output of decode() */
+	int add(const ModbusTagFormat &format, const int &src_offset, const int &num_of_registers);
+
+	/* the number of values decode() produces */
+	int size() const noexcept;
+
+	/* decode a raw register block into engineering values, values must hold size() elements */
+	void decode(const std::uint16_t *block, double *values) const noexcept;
+
+	/* convert an engineering value back into one or two registers (two for 32-bit types) */
+	static void encode(const ModbusTagFormat &format, const double &value, std::uint16_t *registers) noexcept;
+};
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __MODBUS_FUNCTION_CODE_
+#define __MODBUS_FUNCTION_CODE_
+
+/*
+   The modbus function codes the benchmark and load tools send, named after
+   the ModBusConnector call issuing them, with the block size limits of the
+   modbus specification.
+*/
+class ModBusFunctionCode
+{
+public:
+	/* the name of a function code, nullptr if it is not one of the tools */
+	static const char *name(const int &function) noexcept;
+
+	/* the largest number of bits or registers of a request, 1 for single writes, 0 if not supported */
+	static int max_block(const int &function) noexcept;
+};
+
+#endif
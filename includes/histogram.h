@@ -0,0 +1,61 @@
+#ifndef __MODBUS_HISTOGRAM_
+#define __MODBUS_HISTOGRAM_
+
+#include <cstdint>
+#include <vector>
+
+/*
+   Latency histogram with log-linear buckets, in the manner of HdrHistogram:
+   values below 2^PRECISION_BITS are counted exactly, larger values land in
+   buckets whose width is at most 1/2^(PRECISION_BITS-1) of their value
+   (0.8% for 8 bits), up to 2^63. Recording is a couple of shifts and an
+   increment, so it can sit on the hot path of a benchmark thread; one
+   histogram per thread, merged at the end.
+*/
+class ModBusHistogram
+{
+private:
+	static const int PRECISION_BITS = 8;
+
+	std::vector<std::uint64_t> counts;
+	std::uint64_t total = 0;
+	std::uint64_t min_value = UINT64_MAX;
+	std::uint64_t max_value = 0;
+	long double sum = 0;
+
+	/* bucket of a value */
+	static std::size_t index_of(const std::uint64_t &value) noexcept;
+
+	/* smallest value of a bucket */
+	static std::uint64_t lowest_of(const std::size_t &index) noexcept;
+
+public:
+	ModBusHistogram();
+
+	/* count a value */
+	void record(const std::uint64_t &value) noexcept;
+
+	/* count a value n times */
+	void record(const std::uint64_t &value, const std::uint64_t &n) noexcept;
+
+	/* add the counts of another histogram */
+	void merge(const ModBusHistogram &other) noexcept;
+
+	/* forget every value */
+	void reset() noexcept;
+
+	/* the number of values recorded */
+	std::uint64_t count() const noexcept;
+
+	/* the smallest and largest values recorded, 0 when empty */
+	std::uint64_t min() const noexcept;
+	std::uint64_t max() const noexcept;
+
+	/* the mean of the values recorded, 0 when empty */
+	double mean() const noexcept;
+
+	/* the value below which the given percentage (0-100) of the values lie */
+	std::uint64_t percentile(const double &percent) const noexcept;
+};
+
+#endif
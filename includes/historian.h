@@ -0,0 +1,145 @@
+#ifndef __MODBUS_HISTORIAN_
+#define __MODBUS_HISTORIAN_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct ModBusScan;
+
+/* the encoding of a historian column */
+enum class ModBusColumnKind : std::uint8_t
+{
+	analog, /* values of register varables, XOR-compressed doubles */
+	digital /* values of coils and discrete inputs, run-length encoded */
+};
+
+/* summary of a column over a time range */
+struct ModBusColumnSummary
+{
+	double min = 0;			/* smallest value, 0 if none */
+	double max = 0;			/* largest value, 0 if none */
+	std::uint64_t rows = 0; /* scans in the range */
+	std::uint64_t valid = 0; /* scans in the range with a value, the others failed */
+};
+
+/*
+   Long-term archive of the values of the varables of a device, in a
+   compressed columnar file.
+
+   The writer buffers the decoded values of every scan and writes them as a
+   block of block_rows scans at a time. Within a block each value of each
+   varable is a column encoded on its own: timestamps as delta-of-delta at
+   millisecond resolution, analog values with the XOR compression of Gorilla
+   (Pelkonen et al., VLDB 2015), digital values as runs. A failed read is kept
+   as a NaN, or a missing run, not as a value.
+
+   Every block starts with its time range and the min, max and number of valid
+   values of each column. A reader opens the file, indexes the block headers,
+   and only decodes the timestamps and the column asked for of the blocks a
+   time range touches; summaries over whole blocks come from the headers alone.
+
+   File layout: a header listing the columns, then the blocks one after the
+   other. A block cut short by a crash is dropped when the writer reopens the file.
+*/
+class ModBusHistorian
+{
+private:
+	struct BlockHeader; /* time range and length of a block */
+
+	/* summary and length of a column in a block, as written after the block header */
+	struct ColumnEntry
+	{
+		double min;
+		double max;
+		std::uint32_t valid;  /* rows with a value */
+		std::uint32_t length; /* bytes of the encoded column */
+	};
+
+	/* a block found in the file, reader side */
+	struct BlockIndex
+	{
+		std::uint64_t offset; /* of the block header */
+		std::uint32_t rows;
+		std::int64_t first_time;
+		std::int64_t last_time;
+		std::uint32_t timestamps_length;
+		std::vector<ColumnEntry> columns;
+	};
+
+	int fd = -1;
+	bool writable = false;
+	std::vector<std::string> column_names{};
+	std::vector<ModBusColumnKind> column_kinds{};
+	std::uint64_t data_offset = 0; /* of the first block */
+
+	/* writer side: the rows of the block being filled */
+	std::size_t block_rows = 0;
+	std::vector<std::int64_t> times{};
+	std::vector<std::vector<double>> rows{}; /* per column */
+	std::int64_t last_time = INT64_MIN;		 /* of the last scan appended, timestamps never go back */
+
+	/* reader side */
+	std::vector<BlockIndex> blocks{};
+
+	/* read the header and index the complete blocks, return the end of the last one */
+	std::uint64_t load(const std::string &path);
+
+public:
+	/* create the file for the varables of a device, or reopen it to append when it holds the same columns, writer side */
+	ModBusHistorian(const std::string &path, const ModBusScan &layout, const std::size_t &block_rows = 4096);
+
+	/* open an existing file read-only and index its blocks, reader side */
+	explicit ModBusHistorian(const std::string &path);
+
+	/* Not copyable or movable*/
+	ModBusHistorian(const ModBusHistorian &) = delete;
+	ModBusHistorian &operator=(const ModBusHistorian &) = delete;
+	ModBusHistorian(ModBusHistorian &&) = delete;
+	ModBusHistorian &operator=(ModBusHistorian &&) = delete;
+
+	/* the writer flushes the rows buffered, then the file is closed */
+	~ModBusHistorian();
+
+	/* add the values of a scan of the layout device, writer side */
+	void append(const ModBusScan &scan);
+
+	/* write the rows buffered as a block, writer side */
+	void flush();
+
+	/* the columns: a varable name, with [i] appended for the i-th value of a varable of several values */
+	const std::vector<std::string> &columns() const noexcept;
+
+	/* the index of a column, or -1 if not found */
+	int find(const std::string &column) const noexcept;
+
+	/* the encoding of a column */
+	ModBusColumnKind kind(const std::size_t &column) const;
+
+	/* the number of blocks and of rows indexed, reader side */
+	std::size_t num_blocks() const noexcept;
+	std::uint64_t num_rows() const noexcept;
+
+	/* the time range of a block, in milliseconds since the epoch */
+	void block_range(const std::size_t &block, std::int64_t &first, std::int64_t &last) const;
+
+	/* decode the timestamps of a block, in milliseconds since the epoch; safe to call from several threads */
+	void read_timestamps(const std::size_t &block, std::vector<std::int64_t> &timestamps) const;
+
+	/* decode a column of a block, NaN for a failed read; safe to call from several threads */
+	void read_column(const std::size_t &block, const std::size_t &column, std::vector<double> &values) const;
+
+	/* the values of a column between from and to (inclusive), appended with their timestamps
+	   return: the number of rows appended */
+	std::size_t read(const std::size_t &column, const std::chrono::system_clock::time_point &from,
+					 const std::chrono::system_clock::time_point &to,
+					 std::vector<std::chrono::system_clock::time_point> &timestamps, std::vector<double> &values) const;
+
+	/* min, max and number of values of a column between from and to (inclusive) */
+	ModBusColumnSummary summary(const std::size_t &column, const std::chrono::system_clock::time_point &from,
+								const std::chrono::system_clock::time_point &to) const;
+};
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef __MODBUS_LOGGER_
+#define __MODBUS_LOGGER_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+/* severity of a log message, messages below the logger level are discarded */
+enum class ModBusLogLevel
+{
+	debug,
+	info,
+	warning,
+	error,
+	off
+};
+
+/*
+   A place in the code that logs, declared by the MODBUS_LOG macros.
+   Holds the constant part of the message and the state of its rate limit.
+*/
+struct ModBusLogSite
+{
+	const ModBusLogLevel level;
+	const char *const where;   /* e.g. "ModBusConnector::read_bits" */
+	const char *const message; /* constant text, never formatted on the calling thread */
+	std::atomic<std::int64_t> window{0};	  /* start of the current rate-limit window, in ms */
+	std::atomic<std::uint32_t> emitted{0};	  /* messages queued in the current window */
+	std::atomic<std::uint32_t> suppressed{0}; /* messages dropped in the current window */
+
+	ModBusLogSite(const ModBusLogLevel &level, const char *where, const char *message) noexcept
+		: level(level), where(where), message(message) {}
+};
+
+/*
+   Asynchronous logger for the library's error paths.
+
+   The message goes into a ring buffer of the calling thread (single producer,
+   single consumer) and a background thread formats and writes it. The first
+   message of a thread allocates its ring, registers it under a lock and may
+   start the background thread; from then on log() never blocks and never
+   allocates. attach() does that set-up ahead of time, e.g. before a thread
+   enters a time-critical loop. A site logging the same message more than
+   rate_limit times per second has the extra messages counted instead of
+   queued, and the count is reported with its next message, so a PLC outage
+   hitting every request does not turn into a stream of writes stalling the
+   poll threads. Messages are dropped, and counted, if a thread's ring is full.
+*/
+class ModBusLogger
+{
+public:
+	/* queue a message, detail is copied (truncated to about 100 characters) */
+	static void log(ModBusLogSite &site, const char *detail) noexcept;
+	static void log(ModBusLogSite &site, const std::string &detail) noexcept;
+
+	/* queue a message with a number, e.g. a socket or a result code */
+	static void log(ModBusLogSite &site, const long long &value, const char *detail) noexcept;
+
+	/* discard messages below level, info by default */
+	static void set_level(const ModBusLogLevel &level) noexcept;
+	static ModBusLogLevel level() noexcept;
+
+	/* messages per second and per site before suppression, 10 by default, 0 for no limit */
+	static void set_rate_limit(const unsigned int &per_second) noexcept;
+
+	/* where messages are written, stderr by default */
+	static void set_output(std::FILE *output) noexcept;
+
+	/* set up the ring of the calling thread, and the background thread, before its first message */
+	static void attach() noexcept;
+
+	/* wait until every message queued so far is written */
+	static void flush() noexcept;
+
+	/* the number of messages lost because a ring was full */
+	static std::uint64_t dropped() noexcept;
+};
+
+/* log a message, detail is a const char* or std::string, may be nullptr */
+#define MODBUS_LOG(severity, where, message, detail)                                              \
+	do                                                                                            \
+	{                                                                                             \
+		if (ModBusLogLevel::severity >= ModBusLogger::level())                                    \
+		{                                                                                         \
+			static ModBusLogSite _modbus_log_site(ModBusLogLevel::severity, where, message);      \
+			ModBusLogger::log(_modbus_log_site, detail);                                          \
+		}                                                                                         \
+	} while (0)
+
+/* log a message with a number */
+#define MODBUS_LOG_VALUE(severity, where, message, value, detail)                                 \
+	do                                                                                            \
+	{                                                                                             \
+		if (ModBusLogLevel::severity >= ModBusLogger::level())                                    \
+		{                                                                                         \
+			static ModBusLogSite _modbus_log_site(ModBusLogLevel::severity, where, message);      \
+			ModBusLogger::log(_modbus_log_site, (long long)(value), detail);                      \
+		}                                                                                         \
+	} while (0)
+
+#endif
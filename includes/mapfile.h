@@ -0,0 +1,72 @@
+#ifndef __MODBUS_MAPFILE_
+#define __MODBUS_MAPFILE_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/* when a file-backed register map is flushed to disk */
+enum class ModBusSyncPolicy
+{
+	none,  /* leave it to the kernel, state survives a process crash but not a power loss */
+	async, /* schedule a flush (MS_ASYNC) after every write request */
+	sync   /* flush and wait (MS_SYNC) after every write request */
+};
+
+/*
+   The four modbus data areas kept in a memory-mapped file.
+   The owner (ModBusServer) creates or reopens the file read-write, the
+   areas then hold whatever state the previous run left, with no load phase.
+   Any other process can open the same file read-only to inspect the live
+   state without protocol traffic.
+
+   File layout: a 64-byte header followed by the coils, discrete inputs,
+   holding registers and input registers, each area 64-byte aligned.
+*/
+class ModBusMapFile
+{
+private:
+	struct Header; /* on-disk header */
+
+	int fd = -1;
+	void *base = nullptr;
+	std::size_t length = 0;
+	Header *header = nullptr;
+
+	/* map the whole file, writable or not */
+	void map(const std::string &path, const bool &writable);
+
+public:
+	/* create the file, or reopen it when it exists with the same area sizes, for read-write use */
+	ModBusMapFile(const std::string &path, const int &nb_coil_status, const int &nb_input_status,
+				  const int &nb_holding_registers, const int &nb_input_registers);
+
+	/* open an existing file read-only, to inspect the state of a running server */
+	explicit ModBusMapFile(const std::string &path);
+
+	/* Not copyable or movable*/
+	ModBusMapFile(const ModBusMapFile &) = delete;
+	ModBusMapFile &operator=(const ModBusMapFile &) = delete;
+	ModBusMapFile(ModBusMapFile &&) = delete;
+	ModBusMapFile &operator=(ModBusMapFile &&) = delete;
+
+	/* unmap and close the file */
+	~ModBusMapFile();
+
+	/* the number of objects in each area */
+	int nb_bits() const noexcept;
+	int nb_input_bits() const noexcept;
+	int nb_registers() const noexcept;
+	int nb_input_registers() const noexcept;
+
+	/* the areas, one byte per bit and one word per register as in modbus_mapping_t */
+	std::uint8_t *tab_bits() const noexcept;
+	std::uint8_t *tab_input_bits() const noexcept;
+	std::uint16_t *tab_registers() const noexcept;
+	std::uint16_t *tab_input_registers() const noexcept;
+
+	/* flush the areas to disk according to the policy */
+	void sync(const ModBusSyncPolicy &policy) noexcept;
+};
+
+#endif
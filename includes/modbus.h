@@ -8,9 +8,27 @@
 #include <exception>
 #include <stdexcept>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <unordered_map>
 #include <sys/epoll.h>
 #include <modbus/modbus.h>
 #include <unordered_set>
+#include "mapfile.h"
+#include "recorder.h"
+#include "snapshot.h"
+
+/* round-trip time statistics of a ModBusConnector, in milliseconds */
+struct ModBusRttStats
+{
+	double last = 0;			/* last round-trip time measured */
+	double srtt = 0;			/* smoothed round-trip time */
+	double rttvar = 0;			/* round-trip time variation */
+	double timeout = 0;			/* response timeout in use */
+	std::uint64_t samples = 0;	/* round-trip times measured */
+	std::uint64_t timeouts = 0; /* requests without a response in time */
+};
 
 class ModBusConnector
 {
@@ -18,6 +36,65 @@ private:
 	modbus_t *ctx;			   // libmodbus context
 	bool is_connected = false; // connection state;
 	std::mutex modbus_lock{};  // mutex lock
+	ModBusFlightRecorder recorder; // last transactions, written under modbus_lock
+
+	/* response timeout adapting to the round-trip time as TCP does (RFC 6298), under modbus_lock */
+	bool adaptive_timeout = false;
+	double min_timeout = 100; // ms
+	double max_timeout = 500; // ms, the libmodbus default
+	ModBusRttStats rtt{};
+	bool stale = false; // a late or malformed response may be left on the socket, under modbus_lock
+
+	/* flush what a failed request may have left on the socket, return the start time of a request */
+	std::uint64_t begin_request() noexcept;
+
+	/* update the round-trip time estimate after a request started at start, and the timeouts with it */
+	void adapt_timeout(const std::uint64_t &start, const int &rc, const int &error) noexcept;
+
+	/* hand a response timeout to libmodbus */
+	void apply_timeout(const double &timeout) noexcept;
+
+	/* use FC 0x17 to write and read in one request, until the device rejects it */
+	bool write_read_fusion = true;
+
+	/* a read shared by the threads asking for it at the same time */
+	struct Flight
+	{
+		bool done = false;
+		int rc = -1;
+		int error = 0;
+		std::vector<std::uint8_t> data{}; /* the values read, copied for the followers */
+	};
+
+	/* identical concurrent reads share one request while on */
+	std::atomic<bool> single_flight{false};
+	std::mutex flight_lock{};
+	std::condition_variable flight_cv{};
+	std::unordered_map<std::uint64_t, std::shared_ptr<Flight>> flights{}; /* by area, address and count */
+	std::uint64_t shared_reads = 0;										  /* under flight_lock */
+
+	/* read through the single-flight table */
+	template <typename T>
+	int read_shared(const ModBusArea &area, const int &addr, const int &num, std::vector<T> &values);
+
+	/* read a block of a plan, under modbus_lock */
+	int read_block(const ModBusReadBlock &block, void *dest) noexcept;
+
+	/* write holding registers, and read a block with the same request if block is not nullptr, under modbus_lock */
+	int write_block(const ModBusRegisterWrite &write, const ModBusReadBlock *block, std::uint16_t *dest) noexcept;
+
+	/* read or write bits in their packed wire format with a raw request, under modbus_lock */
+	int transfer_bits(const int &function, const int &addr, const int &num, const std::uint8_t *src, std::uint8_t *dest) noexcept;
+
+	/* kernel timestamps of the reads (SO_TIMESTAMPING), under modbus_lock */
+	bool timestamping = false;
+	ModBusTimestamps stamps{}; /* of the last read */
+
+	/* send a raw request and receive its response, taking the kernel timestamps if on, under modbus_lock */
+	int transact(const std::uint8_t *request, const int &length, std::uint8_t *response) noexcept;
+
+	/* read registers, or bits a byte per bit, with a raw request, under modbus_lock */
+	int read_raw(const int &function, const int &addr, const int &num, void *dest) noexcept;
 
 public:
 	/* No default constructor */
@@ -52,18 +129,42 @@ public:
 	/* write values into a number of coils */
 	int write_bits(const int &addr, const int &num_of_bits, const std::vector<std::uint8_t> &values) noexcept;
 
+	/*
+	   read a number of coils, discrete inputs, or write coils, as packed bits (see includes/bitpack.h)
+	   The bits go between the wire and packed, of ModBusBitPack::bytes(num_of_bits) bytes,
+	   without a byte per bit in between.
+	*/
+	int read_bits_packed(const int &addr, const int &num_of_bits, std::uint8_t *packed) noexcept;
+	int read_input_bits_packed(const int &addr, const int &num_of_bits, std::uint8_t *packed) noexcept;
+	int write_bits_packed(const int &addr, const int &num_of_bits, const std::uint8_t *packed) noexcept;
+
 	/* write value into a single holding register */
 	int write_register(const int &addr, const std::uint16_t &value) noexcept;
 
 	/* write values into a number of holding registers */
 	int write_registers(const int &addr, const int &num_of_registers, const std::vector<std::uint16_t> &values) noexcept;
 
+	/* set a holding register to (current & and_mask) | (or_mask & ~and_mask) in one request (FC 0x16) */
+	int mask_write_register(const int &addr, const std::uint16_t &and_mask, const std::uint16_t &or_mask) noexcept;
+
+	/* set the bits of mask in a holding register to their value in bits, the other bits are left as they are */
+	int write_register_bits(const int &addr, const std::uint16_t &mask, const std::uint16_t &bits) noexcept;
+
 	/* write values into a number of holding registers and then read values back from those registers */
 	int write_and_read_registers(const int &write_addr, const int &num_of_registers_to_write,
 								 const std::vector<std::uint16_t> &values_to_write,
 								 const int &read_addr, const int &num_registers_to_read,
 								 std::vector<std::uint16_t> &values_to_read) noexcept;
 
+	/* run every read of a compiled plan in one call, return the number of blocks read or -1 */
+	int read_snapshot(const ModBusReadPlan &plan, ModBusSnapshot &snapshot) noexcept;
+
+	/* write holding registers then run a plan, fusing writes with reads into FC 0x17 requests where possible */
+	int write_read_snapshot(std::vector<ModBusRegisterWrite> &writes, const ModBusReadPlan &plan, ModBusSnapshot &snapshot) noexcept;
+
+	/* use FC 0x17 in write_read_snapshot(), on by default */
+	void set_write_read_fusion(const bool &enabled);
+
 	/* convert a float type value to two holding registers */
 	static void set_float(const float &f, std::uint16_t &register0, std::uint16_t &register1) noexcept;
 
@@ -91,8 +192,41 @@ public:
 
 	/* enable modbus verbose message mode */
 	void set_debug(bool flag);
+
+	/* set the unit identifier sent with every request */
+	void set_unit_id(const int &unit_id);
+
+	/* the last transactions of this connection, see ModBusFlightRecorder */
+	const ModBusFlightRecorder &flight_recorder() const noexcept;
+
+	/* adapt the response timeout to the round-trip time, within [min_ms, max_ms], off by default */
+	void set_adaptive_timeout(const int &min_ms, const int &max_ms);
+
+	/* use a fixed response timeout instead */
+	void set_response_timeout(const int &ms);
+
+	/* round-trip time statistics */
+	ModBusRttStats rtt_stats();
+
+	/* merge identical reads issued concurrently by several threads into one request, off by default */
+	void set_single_flight(const bool &enabled) noexcept;
+
+	/* the number of reads answered by an identical read in flight */
+	std::uint64_t single_flight_hits();
+
+	/*
+	   take the kernel send and receive timestamps of every read, off by default
+	   Reads then go through raw requests; writes are not timestamped.
+	*/
+	void set_timestamping(const bool &enabled);
+
+	/* the kernel timestamps of the last read, zero if not taken */
+	ModBusTimestamps last_timestamps();
 };
 
+/* add socket to the interest list of an epoll instance for read events, shared by the server and the proxy */
+bool epoll_add(const int &epollfd, const int &socket);
+
 /* 
    The max number of available connection returned by ModBusServer::wait()
    per calling the functin, though ModBusServer::wait() can be called multiple 
@@ -126,12 +260,23 @@ private:
 	   true: the epoll event is ready for processing 
 	   false: the epoll event has already been processed */
 	bool *event_valid = nullptr;
+	/* file backing the data areas, nullptr when they live in memory only */
+	ModBusMapFile *map_file = nullptr;
+	/* when the file backing the data areas is flushed to disk */
+	ModBusSyncPolicy sync_policy = ModBusSyncPolicy::none;
+	/* last transactions of every client, written by process() */
+	ModBusFlightRecorder recorder;
 
 public:
 	/* default constructor for Modbus server */
 	ModBusServer(const std::string &ip, const int &port, const int &nb_coil_status, const int &nb_input_status,
 				 const int &nb_holding_registers, const int &nb_input_registers);
 
+	/* constructor for Modbus server whose data areas persist in a memory-mapped file */
+	ModBusServer(const std::string &ip, const int &port, const int &nb_coil_status, const int &nb_input_status,
+				 const int &nb_holding_registers, const int &nb_input_registers,
+				 const std::string &map_file_path, const ModBusSyncPolicy &policy = ModBusSyncPolicy::none);
+
 	/* Not copyable or movable*/
 	ModBusServer(const ModBusServer &) = delete;
 	ModBusServer &operator=(const ModBusServer &) = delete;
@@ -149,6 +294,9 @@ public:
 	*/
 	void listen(const int &max_number_pending_connection);
 
+	/* serve requests on an already connected socket, the server closes it */
+	void attach(const int &socket);
+
 	/* 
 	   wait for client to connect
 	   return: number of connections ready to receive data
@@ -157,6 +305,9 @@ public:
 
 	/* receive data from [index]th connection */
 	bool process(const int &index);
+
+	/* the last transactions of every client, see ModBusFlightRecorder */
+	const ModBusFlightRecorder &flight_recorder() const noexcept;
 };
 
 #endif
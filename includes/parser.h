@@ -1,6 +1,10 @@
+#ifndef __MODBUS_PARSER_
+#define __MODBUS_PARSER_
+
 #include <unordered_map>
 #include <utility>
 #include <vector>
+#include <string>
 #include <iostream>
 #include <sstream>
 #include <fstream>
@@ -8,10 +12,63 @@
 #include <locale>
 #include <exception>
 
+/* data type of the values held by a register-type variable */
+enum class ModbusDataType
+{
+	raw,	 /* no annotation, one unconverted register per value */
+	int16,	 /* one signed register per value */
+	uint16,	 /* one unsigned register per value */
+	int32,	 /* two registers per signed value */
+	float32, /* two registers per IEEE-754 value */
+	bitfield /* one register per value, bits are accessed individually */
+};
+
+/* order of the two registers of a 32-bit value */
+enum class ModbusWordOrder
+{
+	cdab, /* low word first, the order of ModBusConnector::get_float */
+	abcd  /* high word first, the order of ModBusConnector::get_float_swap */
+};
+
+/* optional per-variable annotations in the config file:
+   type=float32|int32|uint16|int16|bitfield order=cdab|abcd scale=REAL offset=REAL
+   engineering value = raw value * scale + offset */
+struct ModbusTagFormat
+{
+	ModbusDataType type = ModbusDataType::raw;
+	ModbusWordOrder order = ModbusWordOrder::cdab;
+	double scale = 1.0;
+	double offset = 0.0;
+
+	/* name of the data type as written in the config file */
+	static const char *type_name(const ModbusDataType &type) noexcept;
+};
+
+/* connection parameters and varables of one modbus server */
+struct ModbusDeviceConfig
+{
+	std::string name = "default";
+	std::string ip;
+	int port = 0;
+	int period = 1000;	/* communication period in milliseconds */
+	int unit_id = 0xFF; /* modbus unit identifier, 0xFF is the modbus TCP default */
+	std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> data_map;
+	std::unordered_map<std::string, ModbusTagFormat> format_map;
+};
+
 class ModbusConfigParser
 {
 	public:
-		static void parse(const std::string& config_file, std::string& ip, int& port, 
+		static void parse(const std::string& config_file, std::string& ip, int& port,
 			std::unordered_map<std::string, std::pair<std::string, std::vector<int>>>& data_map);
+
+		/* same as above, and also collects the annotations of each variable */
+		static void parse(const std::string& config_file, std::string& ip, int& port,
+			std::unordered_map<std::string, std::pair<std::string, std::vector<int>>>& data_map,
+			std::unordered_map<std::string, ModbusTagFormat>& format_map);
+
+		/* parse a config file made of device blocks, each with its own connection and varables */
+		static void parse(const std::string& config_file, std::vector<ModbusDeviceConfig>& devices);
 };
 
+#endif
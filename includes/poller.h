@@ -0,0 +1,130 @@
+#ifndef __MODBUS_POLLER_
+#define __MODBUS_POLLER_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "modbus.h"
+#include "parser.h"
+#include "decoder.h"
+#include "shm_image.h"
+#include "scanlog.h"
+#include "historian.h"
+#include "histogram.h"
+
+/* the values of one varable read in one scan */
+struct ModBusTagValues
+{
+	std::string name;			/* varable name */
+	std::string type;			/* modbus object type, as stored in the data map */
+	int addr = 0;				/* start address */
+	int num = 0;				/* number of modbus objects */
+	int rc = -1;				/* -1 on failure, or the number of modbus objects read */
+	std::vector<double> values; /* engineering values, decoded according to the varable annotations */
+};
+
+/* the result of one scan of a device */
+struct ModBusScan
+{
+	std::size_t device = 0;							 /* index of the device in the poller */
+	const ModbusDeviceConfig *config = nullptr;		 /* configuration of the device */
+	std::uint64_t sequence = 0;						 /* scan number, starting from 1 */
+	std::chrono::system_clock::time_point timestamp; /* when the scan started */
+	std::vector<ModBusTagValues> tags;				 /* varables, ordered by object type and address */
+};
+
+/* real-time options of the scan threads, see ModBusPoller::set_real_time() */
+struct ModBusRealTime
+{
+	bool lock_memory = true; /* lock every page of the process in memory (mlockall) */
+	std::vector<int> cpus{}; /* CPU of each scan thread, device i on cpus[i % cpus.size()]; any CPU if empty */
+	int priority = 0;		 /* SCHED_FIFO priority of the scan threads (1-99), 0 for the default policy */
+};
+
+/* cycle statistics of the scan thread of a device */
+struct ModBusCycleStats
+{
+	std::uint64_t cycles = 0;	   /* scans done */
+	std::uint64_t overruns = 0;	   /* scans that ran past the start of the next period */
+	std::uint64_t allocations = 0; /* heap allocations of the scan thread after its first scan, real-time mode only */
+	ModBusHistogram jitter{};	   /* how late each scan started on its schedule, in microseconds */
+};
+
+/*
+   Polls every device of a multi-device configuration from a single process.
+   Each device gets its own connection and scan thread, so a slow or dead
+   device never delays the others. Scan results are reused from one scan to
+   the next, no allocation takes place once every buffer has reached its size.
+*/
+class ModBusPoller
+{
+private:
+	struct Device; /* runtime state of one device */
+
+	std::vector<std::unique_ptr<Device>> devices;
+	std::function<void(const ModBusScan &)> on_scan{};
+	std::mutex run_lock{};
+	std::condition_variable run_cv{};
+	bool running = false;
+	std::unique_ptr<ModBusShmImage> image{}; /* process image every scan is published to, if any */
+	bool real_time_mode = false;
+	ModBusRealTime real_time{};
+
+	/* scan thread of a device, started is made ready once the real-time mode is applied */
+	void run(Device &device, std::promise<void> started) noexcept;
+
+	/* one scan of a device, then its publication */
+	void cycle(Device &device) noexcept;
+
+	/* read every varable of a device once */
+	void scan(Device &device) noexcept;
+
+public:
+	/* create a connection for each device, nothing is sent until start() */
+	explicit ModBusPoller(const std::vector<ModbusDeviceConfig> &configs);
+
+	/* Not copyable or movable*/
+	ModBusPoller(const ModBusPoller &) = delete;
+	ModBusPoller &operator=(const ModBusPoller &) = delete;
+	ModBusPoller(ModBusPoller &&) = delete;
+	ModBusPoller &operator=(ModBusPoller &&) = delete;
+
+	/* stops polling */
+	~ModBusPoller();
+
+	/* called from the scan thread of a device after each of its scans */
+	void set_scan_callback(const std::function<void(const ModBusScan &)> &callback);
+
+	/* publish every scan into a shared-memory process image with the given name */
+	void set_process_image(const std::string &shm_name);
+
+	/* record the raw values of every scan of each device into directory/DEVICE.scans, keeping the last capacity scans */
+	void set_scan_log(const std::string &directory, const std::size_t &capacity = 65536);
+
+	/* archive the values of every scan of each device into directory/DEVICE.hist, see ModBusHistorian, not in real-time mode */
+	void set_historian(const std::string &directory);
+
+	/* lock memory, pin the scan threads and raise their priority on start(), and count their allocations, not with a historian */
+	void set_real_time(const ModBusRealTime &options);
+
+	/* start one scan thread per device */
+	void start();
+
+	/* stop and join all scan threads */
+	void stop();
+
+	/* the number of devices */
+	std::size_t size() const noexcept;
+
+	/* the cycle statistics of a device so far */
+	ModBusCycleStats cycle_stats(const std::size_t &device);
+};
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef __MODBUS_PROXY_
+#define __MODBUS_PROXY_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+#include "modbus.h"
+
+/* counters of a ModBusProxy */
+struct ModBusProxyStats
+{
+	std::uint64_t requests = 0;			 /* requests received from downstream clients */
+	std::uint64_t upstream_requests = 0; /* requests sent to the upstream server */
+	std::uint64_t coalesced = 0;		 /* reads answered by an identical read already in flight */
+	std::uint64_t timeouts = 0;			 /* upstream requests without a response in time */
+	std::uint64_t rejected = 0;			 /* requests answered with an exception by the proxy itself */
+};
+
+/*
+   Modbus TCP proxy sharing a small pool of upstream connections among many
+   downstream clients, for servers that accept only a few connections.
+
+   Downstream requests are forwarded with a transaction id of the proxy's own,
+   and the responses mapped back to the client's transaction id. Each upstream
+   connection carries up to max_in_flight requests at once, further requests
+   wait in a FIFO queue. A read identical to one already in flight (same unit
+   id, function code, address and count) is not sent again: every client
+   waiting for it gets the same response.
+
+   Upstream connections are opened on demand with a non-blocking connect
+   watched by epoll, so an unreachable server never stalls the clients of the
+   proxy: requests wait in the queue while a connection is being opened, and
+   get a gateway path exception once no connection can be opened.
+
+   The proxy is driven like ModBusServer: listen() once, then wait() and
+   process() every ready index in a loop.
+*/
+class ModBusProxy
+{
+private:
+	/* a downstream client waiting for a response */
+	struct Waiter
+	{
+		int fd;				  /* client socket */
+		std::uint64_t client; /* client id, guards against a reused socket number */
+		std::uint16_t tid;	  /* the client's transaction id */
+	};
+
+	/* a request sent upstream */
+	struct InFlight
+	{
+		std::vector<Waiter> waiters;
+		std::string key;	  /* coalescing key, empty for requests that are never coalesced */
+		std::uint8_t unit;	  /* unit id of the request */
+		std::uint8_t function; /* function code of the request */
+		std::size_t upstream; /* index of the upstream connection */
+		std::chrono::steady_clock::time_point deadline;
+	};
+
+	/* a request waiting for a free upstream slot */
+	struct Queued
+	{
+		Waiter waiter;
+		std::vector<std::uint8_t> frame;
+	};
+
+	/* an upstream connection */
+	struct Upstream
+	{
+		int fd = -1;			 /* -1 when closed */
+		bool connecting = false; /* connect() in progress on fd */
+		int in_flight = 0;
+		std::vector<std::uint8_t> rx{};
+		std::chrono::steady_clock::time_point retry_at{}; /* no reconnect attempt before */
+		std::chrono::steady_clock::time_point deadline{}; /* connect() given up after */
+	};
+
+	/* a downstream client connection */
+	struct Client
+	{
+		std::uint64_t id;
+		std::vector<std::uint8_t> rx;
+	};
+
+	/* listening context and socket */
+	modbus_t *ctx = nullptr;
+	int server_socket = -1;
+	/* epoll file descriptor and the events returned by wait() */
+	int epollfd = -1;
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	int eventcount = -1;
+
+	struct sockaddr_in upstream_address;
+	std::vector<Upstream> upstreams;
+	std::unordered_map<int, Client> clients{};
+	std::uint64_t next_client_id = 1;
+	std::unordered_map<std::uint16_t, InFlight> in_flight{}; /* by upstream transaction id */
+	std::unordered_map<std::string, std::uint16_t> reads{};	  /* coalescing key -> upstream transaction id */
+	std::deque<Queued> queue{};
+	std::uint16_t next_tid = 0;
+
+	int max_in_flight;
+	std::chrono::milliseconds timeout;
+	std::size_t max_queue;
+	ModBusProxyStats counters{};
+
+	/* read what a socket has and append it to buf, false when the peer is gone */
+	static bool receive(const int &fd, std::vector<std::uint8_t> &buf) noexcept;
+
+	/* handle one complete request of a client */
+	void forward(const Waiter &waiter, std::vector<std::uint8_t> &frame);
+
+	/* handle one complete response of an upstream connection */
+	void respond(const std::size_t &upstream, std::vector<std::uint8_t> &frame);
+
+	/* send a frame to a client under its own transaction id, the client is dropped if it cannot take it */
+	void reply(const Waiter &waiter, std::vector<std::uint8_t> &frame);
+
+	/* answer a request with a modbus exception */
+	void reply_exception(const Waiter &waiter, const std::uint8_t &unit, const std::uint8_t &function, const std::uint8_t &code);
+
+	/* a connected upstream connection with a free slot, or -1 after opening one if possible */
+	int pick_upstream();
+
+	/* start connecting a closed upstream connection if none is connecting, false if none can be opened now */
+	bool open_upstream();
+
+	/* finish the connect() of an upstream connection whose socket became writable */
+	void complete_upstream(const std::size_t &upstream);
+
+	/* true if an upstream connection is connected or connecting */
+	bool reachable() const noexcept;
+
+	/* close an upstream connection and answer its requests in flight with an exception */
+	void fail_upstream(const std::size_t &upstream, const std::uint8_t &code);
+
+	/* close a client connection */
+	void drop_client(const int &fd);
+
+	/* answer expired requests with an exception and give up overdue connects */
+	void expire();
+
+	/* true if a request could be sent upstream right away */
+	bool has_free_slot() const noexcept;
+
+	/* forward queued requests while upstream slots are free */
+	void drain();
+
+public:
+	/* proxy listening on ip:port for the modbus server at upstream_ip:upstream_port */
+	ModBusProxy(const std::string &ip, const int &port, const std::string &upstream_ip, const int &upstream_port,
+				const int &num_upstreams = 1, const int &max_in_flight = 1, const int &timeout_ms = 1000,
+				const std::size_t &max_queue = 1024);
+
+	/* Not copyable or movable*/
+	ModBusProxy(const ModBusProxy &) = delete;
+	ModBusProxy &operator=(const ModBusProxy &) = delete;
+	ModBusProxy(ModBusProxy &&) = delete;
+	ModBusProxy &operator=(ModBusProxy &&) = delete;
+
+	/* closes every connection */
+	~ModBusProxy();
+
+	/* start listening to incoming downstream connections */
+	void listen(const int &max_number_pending_connection);
+
+	/* wait for sockets to be ready, expiring overdue requests meanwhile
+	   return: number of sockets ready for process() */
+	int wait();
+
+	/* handle the [index]th ready socket, return true if a new client connected */
+	bool process(const int &index);
+
+	/* counters since construction */
+	const ModBusProxyStats &stats() const noexcept;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef __MODBUS_QUERY_
+#define __MODBUS_QUERY_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class ModBusHistorian;
+
+/* min, max, sum and count of the values of a column in a window, failed reads left out */
+struct ModBusAggregate
+{
+	double min = 0;			 /* smallest value, 0 if none */
+	double max = 0;			 /* largest value, 0 if none */
+	double sum = 0;			 /* sum of the values */
+	std::uint64_t count = 0; /* values in the window */
+
+	/* the average of the values, NaN if none */
+	double mean() const noexcept;
+
+	/* fold another aggregate of the same column into this one */
+	void merge(const ModBusAggregate &other) noexcept;
+};
+
+/*
+   Reporting queries over the columns of a historian file.
+
+   aggregate() splits a time range into windows of a fixed width, e.g. one
+   per minute, and computes the aggregate of every column asked for in every
+   window; downsample() keeps the mean of each window as a series. The work is
+   cut into tasks of one block of the file and a group of columns, run by a
+   pool of threads: a task decodes the timestamps of its block once, then each
+   of its columns, and reduces the rows of each window with an SSE2 kernel.
+   The partial aggregates of the tasks are merged once they are all done.
+
+   The pool is started with the query and reused by every call; the calls
+   themselves are not meant to run concurrently on one ModBusQuery.
+*/
+class ModBusQuery
+{
+private:
+	class Pool; /* the worker threads */
+
+	const ModBusHistorian &historian;
+	std::unique_ptr<Pool> pool;
+
+public:
+	/* run the queries over historian with threads workers, one per core if 0 */
+	explicit ModBusQuery(const ModBusHistorian &historian, const std::size_t &threads = 0);
+
+	/* Not copyable or movable */
+	ModBusQuery(const ModBusQuery &) = delete;
+	ModBusQuery &operator=(const ModBusQuery &) = delete;
+	ModBusQuery(ModBusQuery &&) = delete;
+	ModBusQuery &operator=(ModBusQuery &&) = delete;
+
+	~ModBusQuery();
+
+	/* the number of worker threads */
+	std::size_t threads() const noexcept;
+
+	/*
+	   aggregate the columns over [from, to) in windows of width window starting at from
+	   result[i][w] is the aggregate of columns[i] in window w
+	*/
+	std::vector<std::vector<ModBusAggregate>> aggregate(const std::vector<std::size_t> &columns,
+														 const std::chrono::system_clock::time_point &from,
+														 const std::chrono::system_clock::time_point &to,
+														 const std::chrono::milliseconds &window) const;
+
+	/* the mean of every window of aggregate(), NaN for a window without values */
+	std::vector<std::vector<double>> downsample(const std::vector<std::size_t> &columns,
+												const std::chrono::system_clock::time_point &from,
+												const std::chrono::system_clock::time_point &to,
+												const std::chrono::milliseconds &window) const;
+
+	/* fold count values into aggregate, NaN values skipped; the kernel of the queries */
+	static void accumulate(const double *values, const std::size_t &count, ModBusAggregate &aggregate) noexcept;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef __MODBUS_RECORDER_
+#define __MODBUS_RECORDER_
+
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* number of transactions kept by the recorder of a connector or a server */
+#define MODBUS_RECORDER_SIZE 256
+
+/* one request and its outcome, as kept by ModBusFlightRecorder */
+struct ModBusTransaction
+{
+	std::uint64_t start;	/* steady clock, in nanoseconds */
+	std::uint32_t latency;	/* in microseconds, saturated at 2^32-1 */
+	std::int32_t result;	/* libmodbus return value, -1 on failure */
+	std::int32_t error;		/* errno on failure, e.g. EMBXILADD for an illegal data address exception */
+	std::int32_t socket;	/* server side: client socket, -1 for the connector */
+	std::uint16_t tid;		/* server side: transaction id of the request */
+	std::uint16_t addr;		/* start address */
+	std::uint16_t count;	/* number of bits or registers, 1 for single writes */
+	std::uint8_t unit;		/* unit identifier */
+	std::uint8_t function;	/* function code, 0 for a connection closed by the peer */
+};
+
+/*
+   Always-on record of the last transactions of a connector or a server, to
+   find out what happened before a PLC started answering with exceptions.
+
+   A fixed ring of MODBUS_RECORDER_SIZE entries, written by a single thread
+   (the one holding the connector's lock, or the one running the server loop)
+   without waiting: each entry has its own sequence lock, so a dump from any
+   thread copies consistent entries and skips the one being overwritten.
+
+   Every recorder is listed in a process-wide registry; dump_all() writes all
+   of them, and dump_on_signal() does it whenever the process gets SIGUSR1.
+*/
+class ModBusFlightRecorder
+{
+private:
+	struct Slot; /* sequence lock and transaction */
+
+	std::string recorder_name;
+	std::unique_ptr<Slot[]> slots;
+	std::atomic<std::uint64_t> next{0}; /* number of transactions recorded */
+
+public:
+	/* recorder named after what it records, e.g. "connector 10.0.0.5:502" */
+	explicit ModBusFlightRecorder(const std::string &name);
+
+	/* Not copyable or movable*/
+	ModBusFlightRecorder(const ModBusFlightRecorder &) = delete;
+	ModBusFlightRecorder &operator=(const ModBusFlightRecorder &) = delete;
+	ModBusFlightRecorder(ModBusFlightRecorder &&) = delete;
+	ModBusFlightRecorder &operator=(ModBusFlightRecorder &&) = delete;
+
+	~ModBusFlightRecorder();
+
+	/* steady clock in nanoseconds, the start of a transaction */
+	static std::uint64_t now() noexcept;
+
+	/* record a transaction started at start (from now()), single writer only */
+	void record(const std::uint64_t &start, const std::uint8_t &unit, const std::uint8_t &function,
+				const int &addr, const int &count, const int &result, const int &error,
+				const int &socket = -1, const std::uint16_t &tid = 0) noexcept;
+
+	/* the recorded transactions, oldest first, at most MODBUS_RECORDER_SIZE */
+	std::vector<ModBusTransaction> transactions() const;
+
+	/* write the recorded transactions as text */
+	void dump(std::FILE *out) const;
+
+	const std::string &name() const noexcept;
+
+	/* append the transactions of every recorder of the process to a file
+	   \throw: runtime_error if the file cannot be opened */
+	static void dump_all(const std::string &path);
+
+	/* call dump_all(path) from a background thread each time signo is received
+	   \throw: runtime_error if the handler cannot be installed */
+	static void dump_on_signal(const std::string &path, const int &signo = SIGUSR1);
+};
+
+#endif
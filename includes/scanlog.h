@@ -0,0 +1,88 @@
+#ifndef __MODBUS_SCANLOG_
+#define __MODBUS_SCANLOG_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "snapshot.h"
+
+/*
+   Record of the raw values of every scan of a device, for post-incident
+   analysis, in a preallocated memory-mapped ring file.
+
+   The writer (the poller) appends each ModBusSnapshot as a fixed-size record
+   at the slot of its scan number modulo the capacity: a copy into the mapping,
+   without allocation or system call. The oldest scans are overwritten once the
+   ring is full. Any other process opens the file read-only and reads scans by
+   number, or seeks them by time, while the writer goes on; each record has its
+   own sequence lock, so a reader never sees a half-written or reused record.
+
+   File layout: a 64-byte header, the blocks of the read plan, then the
+   records, each 64-byte aligned: scan number, timestamp, the status and errno
+   of every block and the words of the snapshot.
+*/
+class ModBusScanLog
+{
+private:
+	struct Header; /* file header */
+	struct Block;  /* a block of the read plan */
+	struct Record; /* sequence lock and timestamp preceding the values of a scan */
+
+	int fd = -1;
+	void *base = nullptr;
+	std::size_t length = 0;
+	Header *header = nullptr;
+	bool writable = false;
+
+	/* the record of a scan number */
+	Record *record(const std::uint64_t &scan) const noexcept;
+
+	/* map the whole file, writable or not */
+	void map(const std::string &path);
+
+public:
+	/* create the file for the scans of a compiled plan, or reopen it when it holds the same layout, writer side */
+	ModBusScanLog(const std::string &path, const ModBusReadPlan &plan, const std::size_t &capacity);
+
+	/* open an existing file read-only, reader side */
+	explicit ModBusScanLog(const std::string &path);
+
+	/* Not copyable or movable*/
+	ModBusScanLog(const ModBusScanLog &) = delete;
+	ModBusScanLog &operator=(const ModBusScanLog &) = delete;
+	ModBusScanLog(ModBusScanLog &&) = delete;
+	ModBusScanLog &operator=(ModBusScanLog &&) = delete;
+
+	/* unmap and close the file */
+	~ModBusScanLog();
+
+	/* record a snapshot of the plan as the next scan, writer side
+	   return: its scan number, or -1 if the snapshot does not fit the layout */
+	std::int64_t append(const ModBusSnapshot &snapshot) noexcept;
+
+	/* the number of records of the ring */
+	std::size_t capacity() const noexcept;
+
+	/* the requests of the plan, telling where the values of every block are in ModBusSnapshot::words */
+	std::vector<ModBusReadBlock> blocks() const;
+
+	/* the number of words of a snapshot */
+	std::size_t words() const noexcept;
+
+	/* the oldest scan number still in the ring, it moves on as the writer overwrites */
+	std::uint64_t begin() const noexcept;
+
+	/* the scan number the next append() gets, also the number of scans recorded */
+	std::uint64_t end() const noexcept;
+
+	/* copy a scan into snapshot
+	   return false if the scan is not in the ring (overwritten or not recorded yet) */
+	bool read(const std::uint64_t &scan, ModBusSnapshot &snapshot, const int &max_retries = 1000) const;
+
+	/* the first scan started at or after time, end() if none */
+	std::uint64_t seek(const std::chrono::system_clock::time_point &time) const noexcept;
+};
+
+#endif
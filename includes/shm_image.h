@@ -0,0 +1,87 @@
+#ifndef __MODBUS_SHM_IMAGE_
+#define __MODBUS_SHM_IMAGE_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct ModBusScan;
+
+/* metadata of a block read from the process image */
+struct ModBusShmSample
+{
+	int rc = -1;				/* result of the read of the varable, -1 on failure */
+	std::uint64_t scan = 0;		/* scan number of the device when the values were read */
+	std::int64_t timestamp = 0; /* start of that scan, nanoseconds since the epoch */
+};
+
+/*
+   Process image in a POSIX shared-memory segment.
+   The poller publishes every scan into it and any number of local processes
+   read the values without their own modbus connection. Each varable is a
+   block guarded by its own sequence lock: the writer never waits, a reader
+   copies the block and retries if the writer touched it meanwhile, so reads
+   need neither a system call nor a lock.
+
+   Segment layout: a header, a directory with the device, name and size of
+   every block, then the blocks themselves, each starting on a cache line.
+*/
+class ModBusShmImage
+{
+private:
+	struct Header;	  /* segment header */
+	struct Directory; /* directory entry of a block */
+	struct Block;	  /* sequence lock and metadata preceding the values of a block */
+
+	std::string shm_name;
+	bool owner = false;
+	void *base = nullptr;
+	std::size_t length = 0;
+	Header *header = nullptr;
+	Directory *directory = nullptr;
+	std::vector<std::size_t> first_block{}; /* index of the first block of each device, writer only */
+
+	/* the block at index */
+	Block *block(const std::size_t &index) const noexcept;
+
+public:
+	/* create the segment for the devices and varables of the given scan layouts, writer side */
+	ModBusShmImage(const std::string &name, const std::vector<const ModBusScan *> &layouts);
+
+	/* open an existing segment read-only, reader side */
+	explicit ModBusShmImage(const std::string &name);
+
+	/* Not copyable or movable*/
+	ModBusShmImage(const ModBusShmImage &) = delete;
+	ModBusShmImage &operator=(const ModBusShmImage &) = delete;
+	ModBusShmImage(ModBusShmImage &&) = delete;
+	ModBusShmImage &operator=(ModBusShmImage &&) = delete;
+
+	/* unmap, the writer also removes the segment name */
+	~ModBusShmImage();
+
+	/* write the values of every varable of a scan, writer side */
+	void publish(const ModBusScan &scan) noexcept;
+
+	/* the number of blocks, one per varable */
+	std::size_t size() const noexcept;
+
+	/* the index of the block of a varable, or -1 if not found */
+	int find(const std::string &device, const std::string &name) const noexcept;
+
+	/* the device name, varable name and number of values of a block */
+	std::string device(const std::size_t &index) const;
+	std::string name(const std::size_t &index) const;
+	int num_values(const std::size_t &index) const noexcept;
+
+	/* the number of scans published so far, over all devices */
+	std::uint64_t generation() const noexcept;
+
+	/* copy a consistent snapshot of a block, values must hold num_values(index) elements
+	   return false if the block kept changing during max_retries attempts */
+	bool read(const std::size_t &index, double *values, ModBusShmSample &sample,
+			  const int &max_retries = 1000) const noexcept;
+};
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef __MODBUS_SNAPSHOT_
+#define __MODBUS_SNAPSHOT_
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+/* the four modbus data areas */
+enum class ModBusArea : std::uint8_t
+{
+	coils,
+	input_bits,
+	holding_registers,
+	input_registers
+};
+
+/* one request of a ModBusReadPlan */
+struct ModBusReadBlock
+{
+	ModBusArea area;
+	int addr;			/* start address */
+	int num;			/* number of bits or registers */
+	std::size_t offset; /* first word of the block in ModBusSnapshot::words */
+};
+
+/*
+   The reads of a scan across all four areas, prepared once and executed with
+   ModBusConnector::read_snapshot() on every scan.
+
+   Ranges are added with add(), then compile() merges the ranges of each area
+   that overlap, touch, or are at most max_gap apart into as few requests as
+   the modbus limits (2000 bits, 125 registers) allow, and lays out where every
+   block lands in the snapshot buffer: registers take a word each, bits a byte
+   each, every block starting on a word boundary.
+*/
+class ModBusReadPlan
+{
+private:
+	struct Range
+	{
+		ModBusArea area;
+		int addr;
+		int num;
+		std::size_t block; /* index of the block reading it */
+		std::size_t offset; /* first register, or first bit, of the range within the block */
+	};
+
+	std::vector<Range> ranges{};
+	std::vector<ModBusReadBlock> plan_blocks{};
+	std::size_t plan_words = 0;
+	bool compiled = false;
+
+public:
+	/* add a range to read, return its index for the accessors below
+	   \throw: runtime_error if the range is invalid or the plan is already compiled */
+	std::size_t add(const ModBusArea &area, const int &addr, const int &num);
+
+	/* merge the ranges into requests, reading at most max_gap unrequested bits or registers between two ranges */
+	void compile(const int &max_gap = 0);
+
+	/* true once compile() was called */
+	bool ready() const noexcept;
+
+	/* the requests, in execution order */
+	const std::vector<ModBusReadBlock> &blocks() const noexcept;
+
+	/* words of the snapshot buffer */
+	std::size_t words() const noexcept;
+
+	/* the number of ranges added */
+	std::size_t size() const noexcept;
+
+	/* index of the block reading a range */
+	std::size_t block_of(const std::size_t &range) const;
+
+	/* the values of a register range within a snapshot */
+	const std::uint16_t *registers(const std::size_t &range, const std::vector<std::uint16_t> &words) const;
+
+	/* the values of a bit range within a snapshot, one byte per bit */
+	const std::uint8_t *bits(const std::size_t &range, const std::vector<std::uint16_t> &words) const;
+};
+
+/* a holding register write of ModBusConnector::write_read_snapshot */
+struct ModBusRegisterWrite
+{
+	int addr;					  /* start address */
+	int num;					  /* number of registers */
+	const std::uint16_t *values;  /* num values, kept by the caller */
+	int rc = -1;				  /* set by the call: -1 on failure, or the number of registers written */
+	int error = 0;				  /* set by the call: errno of a failed write, 0 otherwise */
+
+	ModBusRegisterWrite(const int &addr, const int &num, const std::uint16_t *values) noexcept
+		: addr(addr), num(num), values(values) {}
+};
+
+/* kernel timestamps of a request and of its response, see ModBusConnector::set_timestamping() */
+struct ModBusTimestamps
+{
+	std::chrono::system_clock::time_point sent{};	  /* the request was handed to the network device, zero if unknown */
+	std::chrono::system_clock::time_point received{}; /* the response came from the network device, zero if unknown */
+
+	/* the round-trip time between the two, zero if either is unknown */
+	std::chrono::nanoseconds rtt() const noexcept
+	{
+		if (sent == std::chrono::system_clock::time_point() || received == std::chrono::system_clock::time_point())
+			return std::chrono::nanoseconds(0);
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(received - sent);
+	}
+};
+
+/* the result of ModBusConnector::read_snapshot */
+struct ModBusSnapshot
+{
+	std::chrono::system_clock::time_point timestamp; /* when the first request was sent */
+	std::vector<std::uint16_t> words{};				 /* values of every block, laid out by the plan */
+	std::vector<int> status{};						 /* per block: the number of values read, or -1 */
+	std::vector<int> error{};						 /* per block: errno of a failed read, 0 otherwise */
+	std::vector<ModBusTimestamps> times{};			 /* per block: kernel timestamps, zero unless timestamping is on */
+
+	/* true if the block reading a range succeeded */
+	bool ok(const ModBusReadPlan &plan, const std::size_t &range) const
+	{
+		return status[plan.block_of(range)] != -1;
+	}
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef __MODBUS_TRACE_
+#define __MODBUS_TRACE_
+
+/*
+   Static tracepoints on the request/response hot path, for perf and bpftrace.
+
+   Built with MODBUSCPP_TRACE defined (make TRACE=1, needs <sys/sdt.h> from
+   systemtap-sdt-dev), these are USDT probes of provider "modbuscpp":
+
+     server_receive  (socket, tid, function, length)
+     server_dispatch (socket, tid, function, address, count)
+     server_reply    (socket, tid, function, rc, elapsed_ns)
+     client_send     (unit_id, function, address, count)
+     client_receive  (unit_id, function, address, count, rc, elapsed_ns)
+
+   elapsed_ns runs from the start of modbus_receive() to the end of the reply
+   on the server, and over the whole libmodbus call on the client. Every probe
+   has a semaphore, so the arguments are computed and the clock is read only
+   while a tracer is attached, e.g.
+
+     bpftrace -e 'usdt:./server_m.run:modbuscpp:server_reply { @us[arg2] = hist(arg4 / 1000); }'
+
+   Without MODBUSCPP_TRACE every macro expands to nothing.
+*/
+
+#ifdef MODBUSCPP_TRACE
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#include <cstdint>
+#include <time.h>
+
+/* set by the tracer while a probe is attached */
+#define MODBUSCPP_TRACE_SEMAPHORE(name) \
+	volatile unsigned short modbuscpp_##name##_semaphore __attribute__((section(".probes")))
+
+extern "C"
+{
+	extern MODBUSCPP_TRACE_SEMAPHORE(server_receive);
+	extern MODBUSCPP_TRACE_SEMAPHORE(server_dispatch);
+	extern MODBUSCPP_TRACE_SEMAPHORE(server_reply);
+	extern MODBUSCPP_TRACE_SEMAPHORE(client_send);
+	extern MODBUSCPP_TRACE_SEMAPHORE(client_receive);
+}
+
+/* monotonic clock in nanoseconds */
+inline std::uint64_t _modbuscpp_trace_now() noexcept
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (std::uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define MODBUSCPP_TRACE_ENABLED(name) __builtin_expect(modbuscpp_##name##_semaphore != 0, 0)
+
+/* declare var holding the start time, 0 unless the probe reporting the elapsed time is attached */
+#define MODBUSCPP_TRACE_START(var, name) \
+	const std::uint64_t var = MODBUSCPP_TRACE_ENABLED(name) ? _modbuscpp_trace_now() : 0
+
+#define MODBUSCPP_TRACE_ELAPSED(var) ((var) ? _modbuscpp_trace_now() - (var) : 0)
+
+#define MODBUSCPP_PROBE4(name, a1, a2, a3, a4)                     \
+	do                                                             \
+	{                                                              \
+		if (MODBUSCPP_TRACE_ENABLED(name))                         \
+			DTRACE_PROBE4(modbuscpp, name, a1, a2, a3, a4);        \
+	} while (0)
+
+#define MODBUSCPP_PROBE5(name, a1, a2, a3, a4, a5)                 \
+	do                                                             \
+	{                                                              \
+		if (MODBUSCPP_TRACE_ENABLED(name))                         \
+			DTRACE_PROBE5(modbuscpp, name, a1, a2, a3, a4, a5);    \
+	} while (0)
+
+#define MODBUSCPP_PROBE6(name, a1, a2, a3, a4, a5, a6)             \
+	do                                                             \
+	{                                                              \
+		if (MODBUSCPP_TRACE_ENABLED(name))                         \
+			DTRACE_PROBE6(modbuscpp, name, a1, a2, a3, a4, a5, a6); \
+	} while (0)
+
+#else
+
+/* the arguments are not evaluated, naming them only keeps variables computed for the probes used */
+#define MODBUSCPP_TRACE_START(var, name)
+#define MODBUSCPP_TRACE_ELAPSED(var) 0
+#define MODBUSCPP_PROBE4(name, a1, a2, a3, a4) \
+	do                                         \
+	{                                          \
+		(void)sizeof(a1);                      \
+		(void)sizeof(a2);                      \
+		(void)sizeof(a3);                      \
+		(void)sizeof(a4);                      \
+	} while (0)
+#define MODBUSCPP_PROBE5(name, a1, a2, a3, a4, a5) \
+	do                                             \
+	{                                              \
+		MODBUSCPP_PROBE4(name, a1, a2, a3, a4);    \
+		(void)sizeof(a5);                          \
+	} while (0)
+#define MODBUSCPP_PROBE6(name, a1, a2, a3, a4, a5, a6) \
+	do                                                 \
+	{                                                  \
+		MODBUSCPP_PROBE5(name, a1, a2, a3, a4, a5);    \
+		(void)sizeof(a6);                              \
+	} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,562 @@
+#include <iostream>
+#include <modbus/modbus.h>
+#include "includes/histogram.h"
+#include "includes/function_code.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+   Open-loop Modbus TCP load generator.
+
+   Every connection sends requests on a fixed-rate schedule, whether or not the
+   previous responses arrived, so a slow server builds up a backlog instead of
+   slowing the clients down. Latency is measured from the time a request was
+   scheduled to be sent, not from when it was actually written, so queueing in
+   the generator, the network and the server all count (no coordinated omission).
+
+   Connections are spread over a few threads, each driving its share with epoll
+   and non-blocking sockets; requests are pipelined on a connection and matched
+   to their responses by transaction id.
+*/
+
+typedef std::chrono::steady_clock Clock;
+
+/* one kind of request of the workload mix */
+struct LoadRequest
+{
+	int function; /* modbus function code */
+	int weight;   /* relative share of the requests */
+};
+
+struct LoadOptions
+{
+	std::string server = "127.0.0.1";
+	int port = 1502;
+	int unit_id = 1;
+	int connections = 100;
+	double rate = 10.0; /* requests per second per connection */
+	double duration = 10.0;
+	int threads = 0; /* 0: one per core, at most one per connection */
+	int address = 0;
+	int block = 10; /* bits or registers per request */
+	double timeout = 1.0; /* seconds to wait for the last responses */
+	std::vector<LoadRequest> mix{{MODBUS_FC_READ_HOLDING_REGISTERS, 1}};
+};
+
+/* results of one thread, or of the whole run once merged */
+struct LoadStats
+{
+	std::vector<ModBusHistogram> latency; /* in nanoseconds, by index of the request in the mix */
+	std::vector<std::uint64_t> sent, received, exceptions;
+	std::uint64_t timeouts = 0; /* requests without a response at the end */
+	std::uint64_t failed = 0;   /* requests lost with a connection */
+	ModBusHistogram send_lag{}; /* actual minus scheduled send time, in nanoseconds */
+
+	explicit LoadStats(const std::size_t &n) : latency(n), sent(n, 0), received(n, 0), exceptions(n, 0) {}
+
+	void merge(const LoadStats &other)
+	{
+		for (std::size_t i = 0; i < latency.size(); ++i)
+		{
+			latency[i].merge(other.latency[i]);
+			sent[i] += other.sent[i];
+			received[i] += other.received[i];
+			exceptions[i] += other.exceptions[i];
+		}
+		timeouts += other.timeouts;
+		failed += other.failed;
+		send_lag.merge(other.send_lag);
+	}
+};
+
+/* a request waiting for its response */
+struct Pending
+{
+	std::uint16_t tid;
+	std::size_t kind; /* index in the mix */
+	Clock::time_point scheduled;
+};
+
+struct LoadConnection
+{
+	int fd = -1;
+	std::uint16_t next_tid = 0;
+	std::deque<Pending> pending{}; /* in the order sent */
+	std::vector<std::uint8_t> tx{}, rx{};
+	bool want_write = false;
+};
+
+/* append one request to a transmit buffer */
+static void build_request(std::vector<std::uint8_t> &tx, const std::uint16_t &tid, const LoadOptions &options, const int &function)
+{
+	std::uint8_t pdu[MODBUS_MAX_PDU_LENGTH];
+	int length = 0;
+	pdu[length++] = function;
+	pdu[length++] = options.address >> 8;
+	pdu[length++] = options.address & 0xFF;
+	switch (function)
+	{
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+		pdu[length++] = 0xFF;
+		pdu[length++] = 0x00;
+		break;
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+		pdu[length++] = 0x12;
+		pdu[length++] = 0x34;
+		break;
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+		pdu[length++] = options.block >> 8;
+		pdu[length++] = options.block & 0xFF;
+		pdu[length++] = (options.block + 7) / 8;
+		for (int i = 0; i < (options.block + 7) / 8; ++i)
+			pdu[length++] = 0x55;
+		break;
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		pdu[length++] = options.block >> 8;
+		pdu[length++] = options.block & 0xFF;
+		pdu[length++] = options.block * 2;
+		for (int i = 0; i < options.block; ++i)
+		{
+			pdu[length++] = i >> 8;
+			pdu[length++] = i & 0xFF;
+		}
+		break;
+	default: /* reads */
+		pdu[length++] = options.block >> 8;
+		pdu[length++] = options.block & 0xFF;
+		break;
+	}
+
+	const std::uint8_t header[7] = {(std::uint8_t)(tid >> 8), (std::uint8_t)(tid & 0xFF), 0, 0,
+									(std::uint8_t)((length + 1) >> 8), (std::uint8_t)((length + 1) & 0xFF),
+									(std::uint8_t)options.unit_id};
+	tx.insert(tx.end(), header, header + 7);
+	tx.insert(tx.end(), pdu, pdu + length);
+}
+
+/* open a connection and switch it to non-blocking, -1 on failure */
+static int open_connection(const sockaddr_in &addr)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, (const sockaddr *)&addr, sizeof(addr)) == -1 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+	{
+		auto tmp_error = errno;
+		close(fd);
+		errno = tmp_error;
+		return -1;
+	}
+	return fd;
+}
+
+/* write what the socket takes, watching for writability while something is left */
+static bool flush(const int &epollfd, const std::size_t &index, LoadConnection &conn)
+{
+	while (!conn.tx.empty())
+	{
+		ssize_t n = send(conn.fd, conn.tx.data(), conn.tx.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n > 0)
+		{
+			conn.tx.erase(conn.tx.begin(), conn.tx.begin() + n);
+			continue;
+		}
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+			return false;
+		break;
+	}
+
+	bool want_write = !conn.tx.empty();
+	if (want_write != conn.want_write)
+	{
+		struct epoll_event ev;
+		ev.events = want_write ? (std::uint32_t)(EPOLLIN | EPOLLOUT) : (std::uint32_t)EPOLLIN;
+		ev.data.u64 = index;
+		epoll_ctl(epollfd, EPOLL_CTL_MOD, conn.fd, &ev);
+		conn.want_write = want_write;
+	}
+	return true;
+}
+
+/* drop a connection, its requests in flight are lost */
+static void fail(const int &epollfd, LoadConnection &conn, LoadStats &stats)
+{
+	stats.failed += conn.pending.size();
+	conn.pending.clear();
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.fd, nullptr);
+	close(conn.fd);
+	conn.fd = -1;
+}
+
+/* read the responses available on a connection, false when it is gone */
+static bool receive(LoadConnection &conn, LoadStats &stats)
+{
+	std::uint8_t chunk[16384];
+	while (true)
+	{
+		ssize_t n = recv(conn.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+		if (n > 0)
+		{
+			conn.rx.insert(conn.rx.end(), chunk, chunk + n);
+			if ((std::size_t)n < sizeof(chunk))
+				break;
+			continue;
+		}
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return false;
+		break;
+	}
+
+	const Clock::time_point now = Clock::now();
+	std::size_t consumed = 0;
+	while (conn.rx.size() - consumed >= 7)
+	{
+		const std::uint8_t *frame = conn.rx.data() + consumed;
+		std::size_t length = 6 + ((frame[4] << 8) | frame[5]);
+		if (length < 8 || length > MODBUS_TCP_MAX_ADU_LENGTH) /* not modbus TCP */
+			return false;
+		if (conn.rx.size() - consumed < length)
+			break;
+
+		std::uint16_t tid = (frame[0] << 8) | frame[1];
+		/* responses come in order from a sequential server, the first pending request is the usual match */
+		auto it = std::find_if(conn.pending.begin(), conn.pending.end(), [&tid](const Pending &p) { return p.tid == tid; });
+		if (it != conn.pending.end())
+		{
+			++stats.received[it->kind];
+			if (frame[7] & 0x80)
+				++stats.exceptions[it->kind];
+			else
+				stats.latency[it->kind].record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - it->scheduled).count());
+			conn.pending.erase(it);
+		}
+		consumed += length;
+	}
+	conn.rx.erase(conn.rx.begin(), conn.rx.begin() + consumed);
+	return true;
+}
+
+/** drive a share of the connections until the end of the run
+ * \first: global index of the first connection, to stagger the schedules over all connections
+ */
+static void drive(const LoadOptions &options, std::vector<LoadConnection> &conns, const std::size_t &first,
+				  const Clock::time_point &start, LoadStats &stats)
+{
+	const auto interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / options.rate));
+	const Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+	const Clock::time_point deadline = end + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.timeout));
+
+	int epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd == -1)
+	{
+		std::cerr << "Failed to create epoll: " << strerror(errno) << std::endl;
+		return;
+	}
+
+	/* schedule of the next request of every connection, earliest first */
+	typedef std::pair<Clock::time_point, std::size_t> Slot;
+	std::priority_queue<Slot, std::vector<Slot>, std::greater<Slot>> schedule;
+	for (std::size_t i = 0; i < conns.size(); ++i)
+	{
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u64 = i;
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+		schedule.push(Slot(start + interval * (first + i) / options.connections, i));
+	}
+
+	std::vector<int> cumulative;
+	int total_weight = 0;
+	for (auto &request : options.mix)
+		cumulative.push_back(total_weight += request.weight);
+	std::mt19937 random(first + 1);
+	std::uniform_int_distribution<int> pick(0, total_weight - 1);
+
+	struct epoll_event events[256];
+	std::size_t live = conns.size();
+	while (live > 0)
+	{
+		Clock::time_point now = Clock::now();
+
+		/* send every request due, late ones included: the schedule never waits for responses */
+		while (!schedule.empty() && schedule.top().first <= now)
+		{
+			std::size_t i = schedule.top().second;
+			Clock::time_point scheduled = schedule.top().first;
+			schedule.pop();
+			LoadConnection &conn = conns[i];
+			if (conn.fd == -1 || scheduled >= end)
+				continue;
+
+			std::size_t kind = std::upper_bound(cumulative.begin(), cumulative.end(), pick(random)) - cumulative.begin();
+			std::uint16_t tid = conn.next_tid++;
+			build_request(conn.tx, tid, options, options.mix[kind].function);
+			conn.pending.push_back(Pending{tid, kind, scheduled});
+			++stats.sent[kind];
+			stats.send_lag.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - scheduled).count());
+			if (!flush(epollfd, i, conn))
+			{
+				fail(epollfd, conn, stats);
+				--live;
+				continue;
+			}
+			schedule.push(Slot(scheduled + interval, i));
+		}
+
+		if (now >= deadline)
+			break;
+		if (schedule.empty()) /* done sending, stop once every response arrived */
+		{
+			bool waiting = false;
+			for (auto &conn : conns)
+				waiting = waiting || !conn.pending.empty();
+			if (!waiting)
+				break;
+		}
+
+		/* sleep until the next request is due, spinning over the last millisecond */
+		Clock::time_point wake = schedule.empty() ? deadline : std::min(schedule.top().first, deadline);
+		int timeout_ms = std::max<long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count() - 1);
+		int n = epoll_wait(epollfd, events, 256, timeout_ms);
+		for (int e = 0; e < n; ++e)
+		{
+			LoadConnection &conn = conns[events[e].data.u64];
+			if (conn.fd == -1)
+				continue;
+			bool ok = !(events[e].events & (EPOLLERR | EPOLLHUP)) || (events[e].events & EPOLLIN);
+			if (ok && (events[e].events & EPOLLIN))
+				ok = receive(conn, stats);
+			if (ok && (events[e].events & EPOLLOUT))
+				ok = flush(epollfd, events[e].data.u64, conn);
+			if (!ok)
+			{
+				fail(epollfd, conn, stats);
+				--live;
+			}
+		}
+	}
+
+	for (auto &conn : conns)
+	{
+		if (conn.fd == -1)
+			continue;
+		stats.timeouts += conn.pending.size();
+		close(conn.fd);
+		conn.fd = -1;
+	}
+	close(epollfd);
+}
+
+/* a comma separated list of FUNCTION_CODE[:WEIGHT] */
+static std::vector<LoadRequest> parse_mix(const std::string &arg)
+{
+	std::vector<LoadRequest> mix;
+	std::stringstream ss(arg);
+	std::string item;
+	while (std::getline(ss, item, ','))
+	{
+		std::size_t colon = item.find(':');
+		LoadRequest request{std::stoi(item.substr(0, colon)), colon == std::string::npos ? 1 : std::stoi(item.substr(colon + 1))};
+		/* build_request() has no FC 0x17, a request of two blocks */
+		if (!ModBusFunctionCode::name(request.function) || request.function == MODBUS_FC_WRITE_AND_READ_REGISTERS)
+			throw std::runtime_error("unsupported function code " + std::to_string(request.function));
+		if (request.weight < 1)
+			throw std::runtime_error("weights should be greater than 0: " + item);
+		mix.push_back(request);
+	}
+	if (mix.empty())
+		throw std::runtime_error("empty workload mix");
+	return mix;
+}
+
+static void print_latency(std::ostream &os, const ModBusHistogram &h)
+{
+	os << "{\"min\": " << h.min() / 1e3 << ", \"mean\": " << h.mean() / 1e3 << ", \"p50\": " << h.percentile(50) / 1e3
+	   << ", \"p90\": " << h.percentile(90) / 1e3 << ", \"p99\": " << h.percentile(99) / 1e3
+	   << ", \"p999\": " << h.percentile(99.9) / 1e3 << ", \"max\": " << h.max() / 1e3 << "}";
+}
+
+static void usage(const char *prog)
+{
+	std::cerr << "usage: " << prog << " [-s SERVER_IP] [-p PORT] [-u UNIT_ID] [-n CONNECTIONS] [-r RATE] [-d SECONDS]"
+			  << " [-m MIX] [-a ADDRESS] [-b BLOCK] [-t THREADS] [-T TIMEOUT]\n"
+			  << "  RATE is requests per second per connection, sent on schedule whatever the responses\n"
+			  << "  MIX is FUNCTION_CODE[:WEIGHT],..., e.g. -m 3:90,16:10 for 90% reads and 10% writes" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	LoadOptions options;
+	try
+	{
+		int opt;
+		while ((opt = getopt(argc, argv, "s:p:u:n:r:d:m:a:b:t:T:h")) != -1)
+		{
+			switch (opt)
+			{
+			case 's':
+				options.server = optarg;
+				break;
+			case 'p':
+				options.port = std::stoi(optarg);
+				break;
+			case 'u':
+				options.unit_id = std::stoi(optarg);
+				break;
+			case 'n':
+				options.connections = std::stoi(optarg);
+				break;
+			case 'r':
+				options.rate = std::stod(optarg);
+				break;
+			case 'd':
+				options.duration = std::stod(optarg);
+				break;
+			case 'm':
+				options.mix = parse_mix(optarg);
+				break;
+			case 'a':
+				options.address = std::stoi(optarg);
+				break;
+			case 'b':
+				options.block = std::stoi(optarg);
+				break;
+			case 't':
+				options.threads = std::stoi(optarg);
+				break;
+			case 'T':
+				options.timeout = std::stod(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		if (options.connections < 1 || options.rate <= 0 || options.duration <= 0 || options.threads < 0 ||
+			options.unit_id < 0 || options.unit_id > 255 || options.address < 0 || options.address > 65535)
+			throw std::runtime_error("argument out of range");
+		for (auto &request : options.mix)
+		{
+			/* single writes ignore the block size */
+			const int max_block = ModBusFunctionCode::max_block(request.function);
+			if (options.block < 1 || (max_block > 1 && options.block > max_block))
+				throw std::runtime_error("block size out of range for " + std::string(ModBusFunctionCode::name(request.function)));
+		}
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << e.what() << std::endl;
+		usage(argv[0]);
+		return 1;
+	}
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(options.port);
+	if (inet_pton(AF_INET, options.server.c_str(), &addr.sin_addr) != 1)
+	{
+		std::cerr << "Invalid server address: " << options.server << std::endl;
+		return 1;
+	}
+
+	/* thousands of connections need more descriptors than the usual soft limit */
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)options.connections + 64)
+	{
+		limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, options.connections + 64);
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	int num_threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+	num_threads = std::min(num_threads, options.connections);
+
+	/* connect everything before the clock starts */
+	std::vector<std::vector<LoadConnection>> shares(num_threads);
+	std::vector<std::size_t> firsts(num_threads);
+	for (int t = 0, index = 0; t < num_threads; ++t)
+	{
+		firsts[t] = index;
+		int count = options.connections / num_threads + (t < options.connections % num_threads);
+		for (int i = 0; i < count; ++i, ++index)
+		{
+			LoadConnection conn;
+			conn.fd = open_connection(addr);
+			if (conn.fd == -1)
+			{
+				std::cerr << "Connection " << index << " failed: " << strerror(errno) << std::endl;
+				for (auto &share : shares)
+					for (auto &c : share)
+						close(c.fd);
+				return 1;
+			}
+			shares[t].push_back(std::move(conn));
+		}
+	}
+
+	std::vector<LoadStats> stats(num_threads, LoadStats(options.mix.size()));
+	const Clock::time_point start = Clock::now() + std::chrono::milliseconds(100);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < num_threads; ++t)
+		threads.emplace_back(drive, std::cref(options), std::ref(shares[t]), firsts[t], std::cref(start), std::ref(stats[t]));
+	for (auto &thread : threads)
+		thread.join();
+
+	LoadStats total(options.mix.size());
+	for (auto &s : stats)
+		total.merge(s);
+
+	ModBusHistogram latency;
+	std::uint64_t sent = 0, received = 0, exceptions = 0;
+	for (std::size_t k = 0; k < options.mix.size(); ++k)
+	{
+		latency.merge(total.latency[k]);
+		sent += total.sent[k];
+		received += total.received[k];
+		exceptions += total.exceptions[k];
+	}
+
+	std::cout << "{\"connections\": " << options.connections << ", \"threads\": " << num_threads
+			  << ", \"target_req_per_s\": " << options.rate * options.connections << ", \"duration_s\": " << options.duration
+			  << ", \"sent\": " << sent << ", \"received\": " << received << ", \"exceptions\": " << exceptions
+			  << ", \"timeouts\": " << total.timeouts << ", \"failed\": " << total.failed
+			  << ", \"achieved_req_per_s\": " << (std::uint64_t)(received / options.duration)
+			  << ",\n \"send_lag_us\": {\"p99\": " << total.send_lag.percentile(99) / 1e3 << ", \"max\": " << total.send_lag.max() / 1e3 << "}"
+			  << ",\n \"latency_us\": ";
+	print_latency(std::cout, latency);
+	std::cout << ",\n \"requests\": [";
+	for (std::size_t k = 0; k < options.mix.size(); ++k)
+	{
+		std::cout << (k ? "," : "") << "\n  {\"function\": " << options.mix[k].function << ", \"name\": \""
+				  << ModBusFunctionCode::name(options.mix[k].function) << "\", \"sent\": " << total.sent[k]
+				  << ", \"received\": " << total.received[k] << ", \"exceptions\": " << total.exceptions[k]
+				  << ", \"latency_us\": ";
+		print_latency(std::cout, total.latency[k]);
+		std::cout << "}";
+	}
+	std::cout << "\n]}" << std::endl;
+	return total.failed ? 1 : 0;
+}
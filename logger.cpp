@@ -0,0 +1,366 @@
+/*
+ * logger.cpp
+ *
+ * Description:
+ * Asynchronous logger, per-thread ring buffers drained by a background thread.
+ *
+ */
+
+#include "includes/logger.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* records per thread ring, a power of two */
+#define LOG_RING_SIZE 256
+/* characters of detail kept per record */
+#define LOG_DETAIL_SIZE 104
+/* how often the background thread drains the rings */
+#define LOG_DRAIN_INTERVAL std::chrono::milliseconds(20)
+
+namespace
+{
+	/* a queued message, formatted by the background thread */
+	struct Record
+	{
+		std::int64_t timestamp; /* system clock, in microseconds */
+		const ModBusLogSite *site;
+		long long value;
+		bool has_value;
+		std::uint32_t suppressed; /* messages of the site suppressed before this one */
+		char detail[LOG_DETAIL_SIZE];
+	};
+
+	/* single producer (the owning thread), single consumer (the background thread) */
+	struct Ring
+	{
+		Record records[LOG_RING_SIZE];
+		std::atomic<std::size_t> head{0}; /* next record written, by the producer */
+		std::atomic<std::size_t> tail{0}; /* next record read, by the consumer */
+		std::atomic<bool> alive{true};	  /* false once the owning thread has exited */
+	};
+
+	struct Backend
+	{
+		std::mutex mutex;
+		std::condition_variable wakeup;
+		std::condition_variable drained;
+		std::vector<std::shared_ptr<Ring>> rings;
+		std::thread thread;
+		std::uint64_t flush_requested = 0; /* flush() calls, under mutex */
+		std::uint64_t flush_done = 0;	   /* flush() calls served, under mutex */
+		bool stopping = false;
+		std::atomic<bool> started{false};
+		std::atomic<bool> stopped{false};
+		std::atomic<int> level{(int)ModBusLogLevel::info};
+		std::atomic<unsigned int> rate_limit{10};
+		std::atomic<std::FILE *> output{nullptr}; /* nullptr for stderr */
+		std::atomic<std::uint64_t> dropped{0};
+		std::once_flag once;
+
+		~Backend()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wakeup.notify_all();
+			if (thread.joinable())
+				thread.join();
+			stopped = true;
+		}
+	};
+
+	Backend backend;
+
+	/* marks the ring of a thread as dead when the thread exits, the background thread releases it */
+	struct RingOwner
+	{
+		std::shared_ptr<Ring> ring;
+		~RingOwner()
+		{
+			if (ring)
+				ring->alive = false;
+		}
+	};
+
+	thread_local RingOwner owner;
+
+	const char *level_name(const ModBusLogLevel &level) noexcept
+	{
+		switch (level)
+		{
+		case ModBusLogLevel::debug:
+			return "DEBUG";
+		case ModBusLogLevel::info:
+			return "INFO";
+		case ModBusLogLevel::warning:
+			return "WARNING";
+		default:
+			return "ERROR";
+		}
+	}
+
+	/* write one record, called by the background thread only */
+	void write(std::FILE *out, const Record &record)
+	{
+		std::time_t seconds = record.timestamp / 1000000;
+		struct tm tm;
+		localtime_r(&seconds, &tm);
+		char time[32];
+		std::strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S", &tm);
+
+		const ModBusLogSite &site = *record.site;
+		std::fprintf(out, "%s.%06lld %s [%s] %s", time, (long long)(record.timestamp % 1000000),
+					 level_name(site.level), site.where, site.message);
+		if (record.has_value)
+			std::fprintf(out, " %lld", record.value);
+		if (record.detail[0])
+			std::fprintf(out, ": %s", record.detail);
+		if (record.suppressed)
+			std::fprintf(out, " (%u similar messages suppressed)", record.suppressed);
+		std::fputc('\n', out);
+	}
+
+	/* write everything queued, release the rings of exited threads */
+	void drain()
+	{
+		std::vector<std::shared_ptr<Ring>> rings;
+		{
+			std::lock_guard<std::mutex> lock(backend.mutex);
+			rings = backend.rings;
+		}
+
+		std::FILE *out = backend.output.load();
+		if (!out)
+			out = stderr;
+		bool wrote = false;
+		std::vector<Ring *> dead;
+		for (auto &ring : rings)
+		{
+			/* read alive first, so nothing written before the thread exited is missed */
+			bool alive = ring->alive.load(std::memory_order_acquire);
+			std::size_t tail = ring->tail.load(std::memory_order_relaxed);
+			std::size_t head = ring->head.load(std::memory_order_acquire);
+			for (; tail != head; ++tail)
+			{
+				write(out, ring->records[tail % LOG_RING_SIZE]);
+				wrote = true;
+			}
+			ring->tail.store(tail, std::memory_order_release);
+			if (!alive)
+				dead.push_back(ring.get());
+		}
+		if (wrote)
+			std::fflush(out);
+
+		if (!dead.empty())
+		{
+			std::lock_guard<std::mutex> lock(backend.mutex);
+			for (auto &ring : dead)
+			{
+				for (auto it = backend.rings.begin(); it != backend.rings.end(); ++it)
+				{
+					if (it->get() == ring)
+					{
+						backend.rings.erase(it);
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(backend.mutex);
+		while (true)
+		{
+			backend.wakeup.wait_for(lock, LOG_DRAIN_INTERVAL, [] { return backend.stopping || backend.flush_requested != backend.flush_done; });
+			bool stopping = backend.stopping;
+			std::uint64_t requested = backend.flush_requested;
+			lock.unlock();
+			drain();
+			lock.lock();
+			if (requested != backend.flush_done)
+			{
+				backend.flush_done = requested;
+				backend.drained.notify_all();
+			}
+			if (stopping)
+				return;
+		}
+	}
+
+	void start() noexcept
+	{
+		try
+		{
+			std::call_once(backend.once, [] {
+				backend.thread = std::thread(run);
+				backend.started = true;
+			});
+		}
+		catch (...)
+		{
+			/* no thread, records stay queued until the rings fill up */
+		}
+	}
+
+	/* the calling thread's ring, nullptr if it cannot be set up */
+	Ring *ring() noexcept
+	{
+		if (owner.ring)
+			return owner.ring.get();
+		try
+		{
+			std::shared_ptr<Ring> ring = std::make_shared<Ring>();
+			{
+				std::lock_guard<std::mutex> lock(backend.mutex);
+				backend.rings.push_back(ring);
+			}
+			owner.ring = ring;
+			start();
+			return owner.ring.get();
+		}
+		catch (...)
+		{
+			return nullptr;
+		}
+	}
+
+	std::int64_t now_ms() noexcept
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	/** count a message against the rate limit of its site
+	 * \param: suppressed, set to the messages suppressed in the previous window if a new one starts
+	 * return: false if the message is to be suppressed
+	 */
+	bool admit(ModBusLogSite &site, std::uint32_t &suppressed) noexcept
+	{
+		suppressed = 0;
+		const unsigned int limit = backend.rate_limit.load(std::memory_order_relaxed);
+		if (limit == 0)
+			return true;
+
+		std::int64_t now = now_ms();
+		std::int64_t window = site.window.load(std::memory_order_relaxed);
+		if (now - window >= 1000 && site.window.compare_exchange_strong(window, now, std::memory_order_relaxed))
+		{
+			site.emitted.store(0, std::memory_order_relaxed);
+			suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+		}
+		if (site.emitted.fetch_add(1, std::memory_order_relaxed) < limit)
+			return true;
+		site.suppressed.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	void push(ModBusLogSite &site, const bool &has_value, const long long &value, const char *detail, const std::size_t &length) noexcept
+	{
+		if ((int)site.level < backend.level.load(std::memory_order_relaxed))
+			return;
+		std::uint32_t suppressed;
+		if (!admit(site, suppressed))
+			return;
+
+		Record record;
+		record.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		record.site = &site;
+		record.value = value;
+		record.has_value = has_value;
+		record.suppressed = suppressed;
+		std::size_t n = length < LOG_DETAIL_SIZE - 1 ? length : LOG_DETAIL_SIZE - 1;
+		if (n)
+			std::memcpy(record.detail, detail, n);
+		record.detail[n] = '\0';
+
+		/* during static destruction the background thread is gone, write directly */
+		Ring *r = backend.stopped.load(std::memory_order_acquire) ? nullptr : ring();
+		if (!r)
+		{
+			std::FILE *out = backend.output.load();
+			write(out ? out : stderr, record);
+			return;
+		}
+
+		std::size_t head = r->head.load(std::memory_order_relaxed);
+		if (head - r->tail.load(std::memory_order_acquire) >= LOG_RING_SIZE)
+		{
+			backend.dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		r->records[head % LOG_RING_SIZE] = record;
+		r->head.store(head + 1, std::memory_order_release);
+	}
+}
+
+void ModBusLogger::log(ModBusLogSite &site, const char *detail) noexcept
+{
+	push(site, false, 0, detail, detail ? std::strlen(detail) : 0);
+}
+
+void ModBusLogger::log(ModBusLogSite &site, const std::string &detail) noexcept
+{
+	push(site, false, 0, detail.data(), detail.size());
+}
+
+void ModBusLogger::log(ModBusLogSite &site, const long long &value, const char *detail) noexcept
+{
+	push(site, true, value, detail, detail ? std::strlen(detail) : 0);
+}
+
+void ModBusLogger::attach() noexcept
+{
+	if (!backend.stopped.load(std::memory_order_acquire))
+		ring();
+}
+
+void ModBusLogger::set_level(const ModBusLogLevel &level) noexcept
+{
+	backend.level = (int)level;
+}
+
+ModBusLogLevel ModBusLogger::level() noexcept
+{
+	return (ModBusLogLevel)backend.level.load(std::memory_order_relaxed);
+}
+
+void ModBusLogger::set_rate_limit(const unsigned int &per_second) noexcept
+{
+	backend.rate_limit = per_second;
+}
+
+void ModBusLogger::set_output(std::FILE *output) noexcept
+{
+	flush();
+	backend.output = output;
+}
+
+void ModBusLogger::flush() noexcept
+{
+	if (!backend.started.load() || backend.stopped.load())
+		return;
+	try
+	{
+		std::unique_lock<std::mutex> lock(backend.mutex);
+		std::uint64_t ticket = ++backend.flush_requested;
+		backend.wakeup.notify_all();
+		backend.drained.wait(lock, [ticket] { return backend.flush_done >= ticket || backend.stopping; });
+	}
+	catch (...)
+	{
+	}
+}
+
+std::uint64_t ModBusLogger::dropped() noexcept
+{
+	return backend.dropped.load(std::memory_order_relaxed);
+}
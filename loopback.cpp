@@ -0,0 +1,314 @@
+#include <iostream>
+#include "includes/modbus.h"
+#include "includes/combiner.h"
+#include "includes/cache.h"
+#include "includes/async.h"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+   Loopback checks of the layers built over ModBusConnector.
+
+   A ModBusServer is started as a child process on 127.0.0.1:PORT; each check
+   drives it through one layer from several threads, then reads the values back
+   over a plain connection and compares them. Every check prints a JSON line
+   with its counters and duration, the exit status is 1 if one of them failed.
+*/
+
+typedef std::chrono::steady_clock Clock;
+
+/* a check, returns its counters as JSON members, throws runtime_error on failure */
+struct LoopbackCheck
+{
+	const char *name;
+	std::function<std::string(const int &port)> run;
+};
+
+static void expect(const bool &condition, const std::string &what)
+{
+	if (!condition)
+		throw std::runtime_error(what);
+}
+
+/* read holding registers [addr, addr + num) over a connection of its own */
+static std::vector<std::uint16_t> read_back(const int &port, const int &addr, const int &num)
+{
+	ModBusConnector conn("127.0.0.1", port);
+	conn.connect();
+	std::vector<std::uint16_t> values, block;
+	for (int i = 0; i < num; i += MODBUS_MAX_READ_REGISTERS)
+	{
+		const int n = std::min(num - i, MODBUS_MAX_READ_REGISTERS);
+		expect(conn.read_registers(addr + i, n, block) == n, "reading back registers failed");
+		values.insert(values.end(), block.begin(), block.end());
+	}
+	return values;
+}
+
+/** write-combiner: threads write disjoint ranges of single registers and coils, each register twice,
+ *  every future completes with 1 and the registers hold the last values written
+ */
+static std::string check_combiner(const int &port)
+{
+	const int threads = 4, per_thread = 250;
+	ModBusConnector conn("127.0.0.1", port);
+	conn.connect();
+
+	const auto start = Clock::now();
+	ModBusCombinerStats stats;
+	{
+		ModBusWriteCombiner combiner(conn, std::chrono::milliseconds(2));
+		std::vector<std::future<int>> results[threads];
+		std::vector<std::thread> writers;
+		for (int t = 0; t < threads; ++t)
+		{
+			writers.emplace_back([&combiner, &results, t] {
+				for (int i = 0; i < per_thread; ++i)
+				{
+					const int addr = t * per_thread + i;
+					results[t].push_back(combiner.write_register(addr, 0xFFFF));
+					results[t].push_back(combiner.write_bit(addr, addr % 3 == 0));
+					results[t].push_back(combiner.write_register(addr, (std::uint16_t)(addr * 7)));
+				}
+			});
+		}
+		for (auto &writer : writers)
+			writer.join();
+		combiner.flush();
+		for (auto &futures : results)
+		{
+			for (auto &future : futures)
+				expect(future.get() == 1, "a combined write failed");
+		}
+		stats = combiner.stats();
+	}
+	const double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+	std::vector<std::uint16_t> values = read_back(port, 0, threads * per_thread);
+	for (int addr = 0; addr < threads * per_thread; ++addr)
+		expect(values[addr] == (std::uint16_t)(addr * 7), "register " + std::to_string(addr) + " does not hold its last value");
+	std::vector<std::uint8_t> bits;
+	expect(conn.read_bits(0, threads * per_thread, bits) == threads * per_thread, "reading back coils failed");
+	for (int addr = 0; addr < threads * per_thread; ++addr)
+		expect(bits[addr] == (addr % 3 == 0), "coil " + std::to_string(addr) + " does not hold its value");
+	expect(stats.writes == 3u * threads * per_thread, "writes not counted");
+	expect(stats.requests < stats.writes, "no write was combined");
+
+	return "\"writes\": " + std::to_string(stats.writes) + ", \"overwrites\": " + std::to_string(stats.overwrites) +
+		   ", \"requests\": " + std::to_string(stats.requests) + ", \"ms\": " + std::to_string(ms);
+}
+
+/** read cache: hits on sub-ranges, stale values until their max age, invalidation by writes and
+ *  mask writes through the cache, then hits from several threads
+ */
+static std::string check_cache(const int &port)
+{
+	const int threads = 4, per_thread = 100000;
+	ModBusConnector conn("127.0.0.1", port), other("127.0.0.1", port);
+	conn.connect();
+	other.connect();
+	ModBusReadCache cache(conn, std::chrono::milliseconds(60000));
+
+	std::vector<std::uint16_t> values{1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+	expect(cache.write_registers(2000, 10, values) == 10, "write through the cache failed");
+	expect(cache.read_registers(2000, 10, values) == 10 && values[3] == 4, "read through the cache failed");
+	expect(cache.read_registers(2002, 4, values) == 4 && values[1] == 4, "sub-range read failed");
+	ModBusCacheStats stats = cache.stats();
+	expect(stats.misses == 1 && stats.hits == 1, "a sub-range of a cached range was not served from the cache");
+
+	/* written past the cache: the cached value until a read asks for a fresher one */
+	expect(other.write_register(2003, 40) == 1, "write past the cache failed");
+	expect(cache.read_registers(2003, 1, values) == 1 && values[0] == 4, "a value written past the cache was not cached");
+	expect(cache.read_registers(2000, 10, values, std::chrono::milliseconds(0)) == 10 && values[3] == 40, "max age ignored");
+
+	/* writes through the cache are seen by the next read */
+	expect(cache.write_register(2004, 50) == 1, "single write through the cache failed");
+	expect(cache.read_registers(2000, 10, values) == 10 && values[4] == 50, "a write left a stale value");
+	expect(cache.mask_write_register(2005, 0x00F0, 0x0F01) == 1, "mask write through the cache failed");
+	expect(cache.read_registers(2000, 10, values) == 10 && values[5] == ((6 & 0x00F0) | (0x0F01 & ~0x00F0)), "a mask write left a stale value");
+	expect(cache.write_register_bits(2006, 0x0003, 0x0001) == 1, "bit write through the cache failed");
+	expect(cache.read_registers(2000, 10, values) == 10 && values[6] == ((7 & ~0x0003) | 0x0001), "a bit write left a stale value");
+
+	const std::uint64_t misses = cache.stats().misses;
+	const auto start = Clock::now();
+	std::vector<std::thread> readers;
+	for (int t = 0; t < threads; ++t)
+	{
+		readers.emplace_back([&cache] {
+			std::vector<std::uint16_t> range;
+			for (int i = 0; i < per_thread; ++i)
+				cache.read_registers(2000 + i % 8, 2, range);
+		});
+	}
+	for (auto &reader : readers)
+		reader.join();
+	const double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+	stats = cache.stats();
+	expect(stats.misses == misses, "a cached range was read again");
+
+	return "\"hits\": " + std::to_string(stats.hits) + ", \"misses\": " + std::to_string(stats.misses) +
+		   ", \"invalidations\": " + std::to_string(stats.invalidations) +
+		   ", \"ns_per_hit\": " + std::to_string(ns / per_thread);
+}
+
+/** async connector: threads submit writes, each followed by a read of the register written, and
+ *  wait for the futures at the end; requests are completed in submission order, so every read
+ *  returns the value its own thread wrote before it
+ */
+static std::string check_async(const int &port)
+{
+	const int threads = 8, per_thread = 500;
+	const auto start = Clock::now();
+	{
+		ModBusAsyncConnector async("127.0.0.1", port);
+		std::vector<std::thread> submitters;
+		std::vector<std::string> failures(threads);
+		for (int t = 0; t < threads; ++t)
+		{
+			submitters.emplace_back([&async, &failures, t] {
+				std::vector<std::future<ModBusReply>> writes, reads;
+				for (int i = 0; i < per_thread; ++i)
+				{
+					const int addr = 4000 + t * per_thread + i;
+					writes.push_back(async.write_register(addr, (std::uint16_t)(addr ^ 0x5A5A)));
+					reads.push_back(async.read_registers(addr, 1));
+				}
+				for (int i = 0; i < per_thread && failures[t].empty(); ++i)
+				{
+					const int addr = 4000 + t * per_thread + i;
+					ModBusReply write = writes[i].get(), read = reads[i].get();
+					if (write.rc != 1 || read.rc != 1)
+						failures[t] = "request to register " + std::to_string(addr) + " failed";
+					else if (read.registers[0] != (std::uint16_t)(addr ^ 0x5A5A))
+						failures[t] = "register " + std::to_string(addr) + " read before its write completed";
+				}
+			});
+		}
+		for (auto &submitter : submitters)
+			submitter.join();
+		for (auto &failure : failures)
+			expect(failure.empty(), failure);
+	}
+	const double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+	std::vector<std::uint16_t> values = read_back(port, 4000, threads * per_thread);
+	for (int i = 0; i < threads * per_thread; ++i)
+		expect(values[i] == (std::uint16_t)((4000 + i) ^ 0x5A5A), "register " + std::to_string(4000 + i) + " does not hold its value");
+
+	return "\"requests\": " + std::to_string(2 * threads * per_thread) + ", \"ms\": " + std::to_string(ms);
+}
+
+static void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " [-p PORT] [CHECK]" << std::endl
+			  << "  -p PORT  port of the server started on 127.0.0.1, 15030 by default" << std::endl
+			  << "  CHECK    only run the checks whose name contains it" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	int port = 15030;
+	std::string filter;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:h")) != -1)
+	{
+		if (opt != 'p')
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		port = atoi(optarg);
+	}
+	if (optind < argc)
+		filter = argv[optind];
+
+	std::vector<LoopbackCheck> checks{
+		{"combiner", check_combiner},
+		{"cache", check_cache},
+		{"async", check_async},
+	};
+
+	/* server in a child process, killed once done */
+	pid_t server = fork();
+	if (server == -1)
+	{
+		std::cerr << "Unable to start the server: " << strerror(errno) << std::endl;
+		return 1;
+	}
+	if (server == 0)
+	{
+		try
+		{
+			ModBusServer child("127.0.0.1", port, 0x10000, 0x10000, 0x10000, 0x10000);
+			child.listen(64);
+			while (1)
+			{
+				int connection_count = child.wait();
+				for (int n = 0; n < connection_count; ++n)
+					child.process(n);
+			}
+		}
+		catch (const std::exception &e)
+		{
+			std::cerr << "[loopback server] " << e.what() << std::endl;
+		}
+		_exit(1);
+	}
+
+	/* wait for the server to listen */
+	ModBusConnector probe("127.0.0.1", port);
+	for (int attempt = 0; !probe.is_connect(); ++attempt)
+	{
+		try
+		{
+			probe.connect();
+		}
+		catch (const std::exception &e)
+		{
+			if (attempt == 100 || waitpid(server, nullptr, WNOHANG) == server)
+			{
+				std::cerr << "The server did not start: " << e.what() << std::endl;
+				kill(server, SIGKILL);
+				waitpid(server, nullptr, 0);
+				return 1;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+	probe.disconnect();
+
+	int status = 0;
+	bool first = true;
+	std::cout << "[" << std::endl;
+	for (auto &check : checks)
+	{
+		if (std::string(check.name).find(filter) == std::string::npos)
+			continue;
+		std::string result;
+		try
+		{
+			result = "\"ok\": true, " + check.run(port);
+		}
+		catch (const std::exception &e)
+		{
+			std::cerr << check.name << ": " << e.what() << std::endl;
+			result = "\"ok\": false";
+			status = 1;
+		}
+		std::cout << (first ? "" : ",\n") << "  {\"name\": \"" << check.name << "\", " << result << "}" << std::flush;
+		first = false;
+	}
+	std::cout << "\n]" << std::endl;
+
+	kill(server, SIGTERM);
+	waitpid(server, nullptr, 0);
+	return status;
+}
@@ -0,0 +1,50 @@
+#include <iostream>
+#include <string>
+#include "includes/mapfile.h"
+
+/* print a range of a running server's register map file without any protocol traffic
+   usage: mapdump.run MAP_FILE [coil|inputbit|register|inputreg START_ADDRESS NUMBER_OF_OBJECTS]
+   addresses are protocol addresses, starting from 0 */
+int main(int argc, char **argv)
+{
+    if (argc != 2 && argc != 5)
+    {
+        std::cerr << "usage: " << argv[0] << " MAP_FILE [coil|inputbit|register|inputreg START_ADDRESS NUMBER_OF_OBJECTS]" << std::endl;
+        return 1;
+    }
+
+    ModBusMapFile map(argv[1]); /* read-only */
+
+    if (argc == 2) /* summary only */
+    {
+        std::cout << "coils: " << map.nb_bits() << " discrete inputs: " << map.nb_input_bits()
+                  << " holding registers: " << map.nb_registers() << " input registers: " << map.nb_input_registers() << std::endl;
+        return 0;
+    }
+
+    std::string type(argv[2]);
+    int start = std::stoi(argv[3]);
+    int num = std::stoi(argv[4]);
+
+    int size = type == "coil" ? map.nb_bits() : type == "inputbit" ? map.nb_input_bits()
+                            : type == "register" ? map.nb_registers() : type == "inputreg" ? map.nb_input_registers() : -1;
+    if (size == -1 || start < 0 || num < 1 || start + num > size)
+    {
+        std::cerr << "Invalid object type or address range" << std::endl;
+        return 1;
+    }
+
+    for (int i = start; i < start + num; ++i)
+    {
+        if (type == "coil")
+            std::cout << (int)map.tab_bits()[i] << "\t";
+        else if (type == "inputbit")
+            std::cout << (int)map.tab_input_bits()[i] << "\t";
+        else if (type == "register")
+            std::cout << map.tab_registers()[i] << "\t";
+        else
+            std::cout << map.tab_input_registers()[i] << "\t";
+    }
+    std::cout << std::endl;
+    return 0;
+}
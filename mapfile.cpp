@@ -0,0 +1,214 @@
+/*
+ * mapfile.cpp
+ *
+ * Description:
+ * Memory-mapped file holding the data areas of a modbus server.
+ *
+ */
+
+#include "includes/mapfile.h"
+#include "includes/logger.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAPFILE_MAGIC "MBMAP01"
+#define MAPFILE_ALIGN 64
+
+/* on-disk header, 64 bytes */
+struct ModBusMapFile::Header
+{
+	char magic[8];
+	std::uint32_t nb_bits;
+	std::uint32_t nb_input_bits;
+	std::uint32_t nb_registers;
+	std::uint32_t nb_input_registers;
+	std::uint64_t bits_offset;
+	std::uint64_t input_bits_offset;
+	std::uint64_t registers_offset;
+	std::uint64_t input_registers_offset;
+};
+
+/* round up to the area alignment */
+inline std::uint64_t _align(const std::uint64_t &size) noexcept
+{
+	return (size + MAPFILE_ALIGN - 1) / MAPFILE_ALIGN * MAPFILE_ALIGN;
+}
+
+/** create the file or reopen it for read-write use
+ * The file is locked so that only one server at a time uses it.
+ * \path: the file backing the data areas
+ * \nb_coil_status, \nb_input_status, \nb_holding_registers, \nb_input_registers: the number of objects in each area
+ * \throw: runtime_error when the file cannot be created, locked or mapped,
+ *         or when an existing file holds areas of different sizes
+ */
+ModBusMapFile::ModBusMapFile(const std::string &path, const int &nb_coil_status, const int &nb_input_status,
+							 const int &nb_holding_registers, const int &nb_input_registers)
+{
+	static_assert(sizeof(Header) <= MAPFILE_ALIGN, "the header must fit in the first aligned block");
+
+	if (nb_coil_status < 0 || nb_input_status < 0 || nb_holding_registers < 0 || nb_input_registers < 0)
+	{
+		throw std::runtime_error("[ModBusMapFile::ModBusMapFile]The number of objects cannot be negative");
+	}
+
+	this->fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (this->fd == -1)
+	{
+		throw std::runtime_error("[ModBusMapFile::ModBusMapFile]Unable to open " + path + ": " + std::string(strerror(errno)));
+	}
+	if (flock(this->fd, LOCK_EX | LOCK_NB) == -1)
+	{
+		auto tmp_error = errno;
+		close(this->fd);
+		throw std::runtime_error("[ModBusMapFile::ModBusMapFile]" + path + " is used by another server: " + std::string(strerror(tmp_error)));
+	}
+
+	struct stat st;
+	if (fstat(this->fd, &st) == -1)
+	{
+		auto tmp_error = errno;
+		close(this->fd);
+		throw std::runtime_error("[ModBusMapFile::ModBusMapFile]Unable to stat " + path + ": " + std::string(strerror(tmp_error)));
+	}
+
+	if (st.st_size == 0) /* new file, lay out the areas */
+	{
+		Header h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, MAPFILE_MAGIC, sizeof(h.magic));
+		h.nb_bits = nb_coil_status;
+		h.nb_input_bits = nb_input_status;
+		h.nb_registers = nb_holding_registers;
+		h.nb_input_registers = nb_input_registers;
+		h.bits_offset = _align(sizeof(Header));
+		h.input_bits_offset = h.bits_offset + _align(h.nb_bits);
+		h.registers_offset = h.input_bits_offset + _align(h.nb_input_bits);
+		h.input_registers_offset = h.registers_offset + _align(h.nb_registers * sizeof(std::uint16_t));
+		std::uint64_t size = h.input_registers_offset + _align(h.nb_input_registers * sizeof(std::uint16_t));
+
+		/* the areas are zero-filled by ftruncate, the header is written last */
+		if (ftruncate(this->fd, size) == -1 || pwrite(this->fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h))
+		{
+			auto tmp_error = errno;
+			close(this->fd);
+			unlink(path.c_str());
+			throw std::runtime_error("[ModBusMapFile::ModBusMapFile]Unable to create " + path + ": " + std::string(strerror(tmp_error)));
+		}
+	}
+
+	map(path, true);
+
+	if ((int)header->nb_bits != nb_coil_status || (int)header->nb_input_bits != nb_input_status ||
+		(int)header->nb_registers != nb_holding_registers || (int)header->nb_input_registers != nb_input_registers)
+	{
+		munmap(this->base, this->length);
+		close(this->fd);
+		throw std::runtime_error("[ModBusMapFile::ModBusMapFile]" + path + " holds areas of different sizes");
+	}
+}
+
+/** open an existing file read-only
+ * \path: the file backing the data areas of a server
+ * \throw: runtime_error when the file cannot be opened or mapped, or is not a register map file
+ */
+ModBusMapFile::ModBusMapFile(const std::string &path)
+{
+	this->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (this->fd == -1)
+	{
+		throw std::runtime_error("[ModBusMapFile::ModBusMapFile]Unable to open " + path + ": " + std::string(strerror(errno)));
+	}
+	map(path, false);
+}
+
+ModBusMapFile::~ModBusMapFile()
+{
+	if (this->base)
+		munmap(this->base, this->length);
+	if (this->fd != -1)
+		close(this->fd); /* also releases the lock */
+}
+
+/** map the whole file and validate its header, the file is closed on failure
+ * \throw: runtime_error when the file cannot be mapped or is not a register map file
+ */
+void ModBusMapFile::map(const std::string &path, const bool &writable)
+{
+	struct stat st;
+	if (fstat(this->fd, &st) == -1 || st.st_size < (off_t)sizeof(Header))
+	{
+		close(this->fd);
+		throw std::runtime_error("[ModBusMapFile::map]" + path + " is not a register map file");
+	}
+
+	this->length = st.st_size;
+	this->base = mmap(nullptr, this->length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, this->fd, 0);
+	if (this->base == MAP_FAILED)
+	{
+		auto tmp_error = errno;
+		this->base = nullptr;
+		close(this->fd);
+		throw std::runtime_error("[ModBusMapFile::map]Unable to map " + path + ": " + std::string(strerror(tmp_error)));
+	}
+	this->header = static_cast<Header *>(this->base);
+
+	const Header &h = *this->header;
+	if (memcmp(h.magic, MAPFILE_MAGIC, sizeof(h.magic)) != 0 ||
+		h.input_registers_offset + h.nb_input_registers * sizeof(std::uint16_t) > this->length ||
+		h.registers_offset + h.nb_registers * sizeof(std::uint16_t) > h.input_registers_offset ||
+		h.input_bits_offset + h.nb_input_bits > h.registers_offset ||
+		h.bits_offset + h.nb_bits > h.input_bits_offset || h.bits_offset < sizeof(Header))
+	{
+		munmap(this->base, this->length);
+		this->base = nullptr;
+		close(this->fd);
+		throw std::runtime_error("[ModBusMapFile::map]" + path + " is not a valid register map file");
+	}
+}
+
+/* the number of objects in each area */
+int ModBusMapFile::nb_bits() const noexcept { return header->nb_bits; }
+int ModBusMapFile::nb_input_bits() const noexcept { return header->nb_input_bits; }
+int ModBusMapFile::nb_registers() const noexcept { return header->nb_registers; }
+int ModBusMapFile::nb_input_registers() const noexcept { return header->nb_input_registers; }
+
+/* the areas, nullptr for an empty area */
+std::uint8_t *ModBusMapFile::tab_bits() const noexcept
+{
+	return header->nb_bits ? static_cast<std::uint8_t *>(base) + header->bits_offset : nullptr;
+}
+
+std::uint8_t *ModBusMapFile::tab_input_bits() const noexcept
+{
+	return header->nb_input_bits ? static_cast<std::uint8_t *>(base) + header->input_bits_offset : nullptr;
+}
+
+std::uint16_t *ModBusMapFile::tab_registers() const noexcept
+{
+	return header->nb_registers ? reinterpret_cast<std::uint16_t *>(static_cast<std::uint8_t *>(base) + header->registers_offset) : nullptr;
+}
+
+std::uint16_t *ModBusMapFile::tab_input_registers() const noexcept
+{
+	return header->nb_input_registers ? reinterpret_cast<std::uint16_t *>(static_cast<std::uint8_t *>(base) + header->input_registers_offset) : nullptr;
+}
+
+/** flush the areas to disk
+ * \policy: none does nothing, async schedules the write back, sync waits for it
+ */
+void ModBusMapFile::sync(const ModBusSyncPolicy &policy) noexcept
+{
+	if (policy == ModBusSyncPolicy::none)
+		return;
+
+	if (__glibc_unlikely(msync(this->base, this->length, policy == ModBusSyncPolicy::sync ? MS_SYNC : MS_ASYNC) == -1))
+	{
+		MODBUS_LOG(error, "ModBusMapFile::sync", "msync fails", strerror(errno));
+	}
+}
@@ -0,0 +1,277 @@
+#include <iostream>
+#include "includes/modbus.h"
+#include "includes/parser.h"
+#include "includes/decoder.h"
+#include "includes/bitpack.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+   Microbenchmarks of the float codecs, the bit packing, the config parser and the server
+   request->reply path, each measured in isolation.
+
+   Every case runs a fixed amount of work on fixed-seed inputs several times
+   and reports the median and the minimum time per operation, so that runs on
+   different commits are comparable. The results are printed to stdout as a
+   JSON array; an optional argument only runs the cases whose name contains it.
+*/
+
+typedef std::chrono::steady_clock Clock;
+
+/* keep the compiler from optimizing a value away */
+template <typename T>
+inline void keep(const T &value)
+{
+	asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct MicroCase
+{
+	std::string name;
+	std::uint64_t ops;           /* operations per run */
+	std::function<void()> setup; /* before every run, not measured */
+	std::function<void()> run;   /* the measured work */
+};
+
+/* registers and floats shared by the codec cases */
+static const std::size_t CODEC_VALUES = 4096;
+static std::vector<std::uint16_t> codec_registers(2 * CODEC_VALUES);
+static std::vector<float> codec_floats(CODEC_VALUES);
+static std::vector<double> codec_decoded(CODEC_VALUES);
+
+/* a block of coils, a byte per bit and packed, shared by the bit cases */
+static const std::size_t BIT_VALUES = MODBUS_MAX_READ_BITS;
+static std::vector<std::uint8_t> bit_bytes(BIT_VALUES);
+static std::vector<std::uint8_t> bit_packed(ModBusBitPack::bytes(BIT_VALUES));
+
+/** write a synthetic config file
+ * One connection_params line followed by varables of every object type,
+ * a third of the registers with annotations.
+ */
+static void write_config(const std::string &path, const std::size_t &num_lines)
+{
+	std::ofstream out(path);
+	out << "connection_params 127.0.0.1 1502 200\n";
+	static const char *types[] = {"coil", "inputbit", "register", "inputreg"};
+	for (std::size_t i = 1; i < num_lines; ++i)
+	{
+		const char *type = types[i % 4];
+		out << type << " var_" << i << " " << 1 + (i * 8) % 60000 << " " << 1 + i % 4;
+		if ((i % 4 == 2 || i % 4 == 3) && i % 3 == 0)
+			out << " type=uint16 scale=0.1 offset=-20";
+		out << "\n";
+	}
+}
+
+/** serve requests over one end of a socketpair, driven from the same thread
+ * Each operation writes a request, lets the server wait/process it and reads the reply,
+ * so the cost measured is the request->reply path without any TCP stack.
+ */
+class SocketPairServer
+{
+private:
+	ModBusServer server;
+	int client = -1;
+	std::uint8_t response[MODBUS_TCP_MAX_ADU_LENGTH];
+
+public:
+	SocketPairServer() : server("127.0.0.1", 0, MODBUS_MAX_READ_BITS, MODBUS_MAX_READ_BITS,
+								MODBUS_MAX_READ_REGISTERS, MODBUS_MAX_READ_REGISTERS)
+	{
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+		{
+			throw std::runtime_error("socketpair: " + std::string(strerror(errno)));
+		}
+		server.attach(sv[0]);
+		client = sv[1];
+	}
+
+	~SocketPairServer()
+	{
+		close(client);
+	}
+
+	/* one request and its reply, false on failure */
+	bool transact(const std::vector<std::uint8_t> &request)
+	{
+		if (send(client, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size())
+			return false;
+		int n = server.wait();
+		for (int i = 0; i < n; ++i)
+			server.process(i);
+
+		/* the reply is complete once process() returns */
+		return recv(client, response, sizeof(response), 0) > 0;
+	}
+};
+
+/* the server of the server cases, created on first use */
+static SocketPairServer &pair_server()
+{
+	static std::unique_ptr<SocketPairServer> server(new SocketPairServer());
+	return *server;
+}
+
+/* a modbus TCP request frame */
+static std::vector<std::uint8_t> frame(const std::vector<std::uint8_t> &pdu)
+{
+	std::vector<std::uint8_t> adu{0, 1, 0, 0, (std::uint8_t)((pdu.size() + 1) >> 8), (std::uint8_t)((pdu.size() + 1) & 0xFF), 1};
+	adu.insert(adu.end(), pdu.begin(), pdu.end());
+	return adu;
+}
+
+static std::vector<MicroCase> build_cases()
+{
+	std::vector<MicroCase> cases;
+
+	std::mt19937 random(42);
+	std::uniform_real_distribution<float> real(-1e4f, 1e4f);
+	for (std::size_t i = 0; i < CODEC_VALUES; ++i)
+	{
+		codec_floats[i] = real(random);
+		ModBusConnector::set_float(codec_floats[i], codec_registers[2 * i], codec_registers[2 * i + 1]);
+	}
+
+	cases.push_back(MicroCase{"codec/get_float", CODEC_VALUES, nullptr, [] {
+		for (std::size_t i = 0; i < CODEC_VALUES; ++i)
+			keep(ModBusConnector::get_float(codec_registers[2 * i], codec_registers[2 * i + 1]));
+	}});
+	cases.push_back(MicroCase{"codec/get_float_swap", CODEC_VALUES, nullptr, [] {
+		for (std::size_t i = 0; i < CODEC_VALUES; ++i)
+			keep(ModBusConnector::get_float_swap(codec_registers[2 * i], codec_registers[2 * i + 1]));
+	}});
+	cases.push_back(MicroCase{"codec/set_float", CODEC_VALUES, nullptr, [] {
+		for (std::size_t i = 0; i < CODEC_VALUES; ++i)
+			ModBusConnector::set_float(codec_floats[i], codec_registers[2 * i], codec_registers[2 * i + 1]);
+		keep(codec_registers[0]);
+	}});
+	cases.push_back(MicroCase{"codec/set_float_swap", CODEC_VALUES, nullptr, [] {
+		for (std::size_t i = 0; i < CODEC_VALUES; ++i)
+			ModBusConnector::set_float_swap(codec_floats[i], codec_registers[2 * i], codec_registers[2 * i + 1]);
+		keep(codec_registers[0]);
+	}});
+
+	std::shared_ptr<ModbusDecoder> decoder(new ModbusDecoder());
+	ModbusTagFormat format;
+	format.type = ModbusDataType::float32;
+	decoder->add(format, 0, 2 * CODEC_VALUES);
+	cases.push_back(MicroCase{"codec/decode_float32", CODEC_VALUES, nullptr, [decoder] {
+		decoder->decode(codec_registers.data(), codec_decoded.data());
+		keep(codec_decoded[0]);
+	}});
+
+	for (std::size_t i = 0; i < BIT_VALUES; ++i)
+		bit_bytes[i] = random() % 2;
+	cases.push_back(MicroCase{"bits/pack_2000", BIT_VALUES, nullptr, [] {
+		ModBusBitPack::pack(bit_bytes.data(), BIT_VALUES, bit_packed.data());
+		keep(bit_packed[0]);
+	}});
+	cases.push_back(MicroCase{"bits/unpack_2000", BIT_VALUES, nullptr, [] {
+		ModBusBitPack::unpack(bit_packed.data(), BIT_VALUES, bit_bytes.data());
+		keep(bit_bytes[0]);
+	}});
+
+	for (std::size_t lines : {1000, 10000, 100000, 1000000})
+	{
+		std::string path = "/tmp/microbench_" + std::to_string(getpid()) + "_" + std::to_string(lines) + ".conf";
+		cases.push_back(MicroCase{"parser/parse_" + std::to_string(lines) + "_lines", lines,
+								  [path, lines] {
+									  std::ifstream exists(path);
+									  if (!exists.good())
+										  write_config(path, lines);
+								  },
+								  [path] {
+									  std::vector<ModbusDeviceConfig> devices;
+									  ModbusConfigParser::parse(path, devices);
+									  keep(devices.size());
+								  }});
+	}
+
+	struct ServerCase
+	{
+		const char *name;
+		std::vector<std::uint8_t> request;
+	};
+	std::vector<std::uint8_t> write_pdu{MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 0, 0, 0, 100, 200};
+	write_pdu.resize(write_pdu.size() + 200, 0x5A);
+	std::vector<ServerCase> server_cases{
+		{"server/read_registers_1", frame({MODBUS_FC_READ_HOLDING_REGISTERS, 0, 0, 0, 1})},
+		{"server/read_registers_100", frame({MODBUS_FC_READ_HOLDING_REGISTERS, 0, 0, 0, 100})},
+		{"server/read_bits_1000", frame({MODBUS_FC_READ_COILS, 0, 0, 1000 >> 8, 1000 & 0xFF})},
+		{"server/write_register", frame({MODBUS_FC_WRITE_SINGLE_REGISTER, 0, 0, 0x12, 0x34})},
+		{"server/write_registers_100", frame(write_pdu)},
+	};
+	const std::uint64_t server_ops = 10000;
+	for (auto &c : server_cases)
+	{
+		std::vector<std::uint8_t> request = c.request;
+		cases.push_back(MicroCase{c.name, server_ops, nullptr, [request, server_ops] {
+			SocketPairServer &s = pair_server();
+			for (std::uint64_t i = 0; i < server_ops; ++i)
+			{
+				if (!s.transact(request))
+					throw std::runtime_error("request failed");
+			}
+		}});
+	}
+	return cases;
+}
+
+int main(int argc, char **argv)
+{
+	const std::string filter = argc > 1 ? argv[1] : "";
+	const int repeats = 7;
+
+	std::vector<MicroCase> cases = build_cases();
+	int status = 0;
+	bool first = true;
+	std::cout << "[" << std::endl;
+	for (auto &c : cases)
+	{
+		if (c.name.find(filter) == std::string::npos)
+			continue;
+
+		std::vector<double> ns_per_op;
+		try
+		{
+			/* the first run warms caches and is not counted */
+			for (int r = 0; r <= repeats; ++r)
+			{
+				if (c.setup)
+					c.setup();
+				auto start = Clock::now();
+				c.run();
+				auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+				if (r > 0)
+					ns_per_op.push_back((double)elapsed / c.ops);
+			}
+		}
+		catch (const std::exception &e)
+		{
+			std::cerr << c.name << ": " << e.what() << std::endl;
+			status = 1;
+			continue;
+		}
+
+		std::sort(ns_per_op.begin(), ns_per_op.end());
+		std::cout << (first ? "" : ",\n") << "  {\"name\": \"" << c.name << "\", \"ops\": " << c.ops
+				  << ", \"repeats\": " << repeats << ", \"ns_per_op_median\": " << ns_per_op[ns_per_op.size() / 2]
+				  << ", \"ns_per_op_min\": " << ns_per_op.front() << "}" << std::flush;
+		first = false;
+	}
+	std::cout << "\n]" << std::endl;
+
+	for (std::size_t lines : {1000, 10000, 100000, 1000000})
+		std::remove(("/tmp/microbench_" + std::to_string(getpid()) + "_" + std::to_string(lines) + ".conf").c_str());
+	return status;
+}
@@ -13,10 +13,30 @@
  */
 
 #include "includes/modbus.h"
+#include "includes/trace.h"
+#include "includes/logger.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
 #include <unistd.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/net_tstamp.h>
+
+#ifdef MODBUSCPP_TRACE
+/* probe semaphores, see includes/trace.h */
+extern "C"
+{
+	MODBUSCPP_TRACE_SEMAPHORE(server_receive) = 0;
+	MODBUSCPP_TRACE_SEMAPHORE(server_dispatch) = 0;
+	MODBUSCPP_TRACE_SEMAPHORE(server_reply) = 0;
+	MODBUSCPP_TRACE_SEMAPHORE(client_send) = 0;
+	MODBUSCPP_TRACE_SEMAPHORE(client_receive) = 0;
+}
+#endif
 
 /* Function codes */
 /* 
@@ -36,9 +56,87 @@
 #define _FC_WRITE_MULTIPLE_COILS 0x0F
 #define _FC_WRITE_MULTIPLE_REGISTERS 0x10
 #define _FC_REPORT_SLAVE_ID 0x11
+#define _FC_MASK_WRITE_REGISTER 0x16
 #define _FC_WRITE_AND_READ_REGISTERS 0x17
 
+/* SO_TIMESTAMPING flags: software receive timestamps, and send timestamps while requested */
+#define _TIMESTAMPING_RX (SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE)
+#define _TIMESTAMPING_TX (SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY)
+
+/** address range of a request, as kept by the flight recorder
+ * \pdu: the request from its function code on
+ * \addr: start address, 0 for function codes without one
+ * \count: number of bits or registers read or written, 1 for single writes
+ */
+static inline void _request_range(const std::uint8_t *pdu, int &addr, int &count) noexcept
+{
+	addr = (pdu[1] << 8) | pdu[2];
+	switch (pdu[0])
+	{
+	case _FC_READ_COILS:
+	case _FC_READ_DISCRETE_INPUTS:
+	case _FC_READ_HOLDING_REGISTERS:
+	case _FC_READ_INPUT_REGISTERS:
+	case _FC_WRITE_MULTIPLE_COILS:
+	case _FC_WRITE_MULTIPLE_REGISTERS:
+		count = (pdu[3] << 8) | pdu[4];
+		break;
+	case _FC_WRITE_SINGLE_COIL:
+	case _FC_WRITE_SINGLE_REGISTER:
+	case _FC_MASK_WRITE_REGISTER:
+		count = 1;
+		break;
+	case _FC_WRITE_AND_READ_REGISTERS:
+		/* the read range, the write range follows it */
+		count = (pdu[3] << 8) | pdu[4];
+		break;
+	default:
+		addr = count = 0;
+		break;
+	}
+}
+
+/** set the SO_TIMESTAMPING flags of a socket
+ * \return: -1 on failure, errno holding the error
+ */
+static inline int _set_timestamping(const int &socket, const int &flags) noexcept
+{
+	return setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+/** receive a message from a socket without waiting, and take the software timestamp it carries
+ * \flags: MSG_PEEK to leave a response in place for libmodbus, MSG_ERRQUEUE for a send timestamp
+ * \return: false if there is no message, or no timestamp with it
+ */
+static bool _receive_timestamp(const int &socket, const int &flags, std::chrono::system_clock::time_point &time) noexcept
+{
+	std::uint8_t byte;
+	struct iovec iov = {&byte, 1};
+	alignas(struct cmsghdr) char control[256];
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	if (recvmsg(socket, &message, flags | MSG_DONTWAIT) == -1)
+		return false;
+
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&message); c; c = CMSG_NXTHDR(&message, c))
+	{
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPING)
+			continue;
+		struct timespec ts[3]; /* software, deprecated, hardware */
+		memcpy(ts, CMSG_DATA(c), sizeof(ts));
+		time = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+			std::chrono::seconds(ts[0].tv_sec) + std::chrono::nanoseconds(ts[0].tv_nsec)));
+		return true;
+	}
+	return false;
+}
+
 ModBusConnector::ModBusConnector(const std::string &ip, const int &port)
+	: recorder("connector " + ip + ":" + std::to_string(port))
 {
 	/* create modbux context */
 	this->ctx = modbus_new_tcp(ip.c_str(), port);
@@ -47,6 +145,9 @@ ModBusConnector::ModBusConnector(const std::string &ip, const int &port)
 	{
 		throw std::runtime_error("Unable to allocate libmodbus context" + std::string(modbus_strerror(errno)));
 	}
+	std::uint32_t sec, usec; /* the libmodbus default until one is set */
+	modbus_get_response_timeout(this->ctx, &sec, &usec);
+	this->rtt.timeout = sec * 1e3 + usec / 1e3;
 }
 
 ModBusConnector::~ModBusConnector() noexcept
@@ -77,6 +178,10 @@ void ModBusConnector::connect()
 		throw std::runtime_error("Connection failed: " + std::string(modbus_strerror(errno)));
 	}
 	this->is_connected = true;
+	if (this->timestamping && _set_timestamping(modbus_get_socket(this->ctx), _TIMESTAMPING_RX) == -1)
+	{
+		MODBUS_LOG(warning, "ModBusConnector::connect", "kernel timestamps not available", strerror(errno));
+	}
 }
 
 /** disconnect a modbus connection
@@ -118,6 +223,178 @@ void ModBusConnector::set_debug(bool flag)
 	modbus_set_debug(this->ctx, flag);			 /* enable modbus verbose message mode */
 }
 
+/** set the unit identifier (slave id) sent with every request
+ * \unit_id: 0-247 addresses a device behind a gateway, 0xFF is the modbus TCP default
+ * \throw: runtime_error if the unit identifier is invalid
+ *         std::system_error if when errors occur, including errors from the
+ *         underlying operating system that would prevent lock from meeting its
+ *         specifications */
+void ModBusConnector::set_unit_id(const int &unit_id)
+{
+	std::lock_guard<std::mutex> lk(modbus_lock); /* acquire lock, lock_guard will auto unlock when out of scope */
+	if (modbus_set_slave(this->ctx, unit_id) == -1) /* call libmodbus to set the slave id */
+	{
+		throw std::runtime_error("Invalid unit id " + std::to_string(unit_id) + ": " + std::string(modbus_strerror(errno)));
+	}
+}
+
+/** the last transactions of this connection
+ * Safe to read from any thread, see ModBusFlightRecorder::transactions()
+ */
+const ModBusFlightRecorder &ModBusConnector::flight_recorder() const noexcept
+{
+	return this->recorder;
+}
+
+/** adapt the response timeout to the round-trip time, as TCP computes its retransmission timeout
+ * Off by default, the libmodbus timeout being kept. The timeout is SRTT + 4 * RTTVAR within
+ * [min_ms, max_ms], doubled after each timeout until a response is measured again. Until the first
+ * measurement it is max_ms. min_ms should leave room for the slowest answers of the device, a
+ * response arriving after the timeout being discarded.
+ * \throw: runtime_error if the bounds are invalid
+ *         std::system_error if when errors occur, including errors from the
+ *         underlying operating system that would prevent lock from meeting its
+ *         specifications */
+void ModBusConnector::set_adaptive_timeout(const int &min_ms, const int &max_ms)
+{
+	if (min_ms <= 0 || max_ms < min_ms)
+	{
+		throw std::runtime_error("[ModBusConnector::set_adaptive_timeout] Invalid bounds " + std::to_string(min_ms) + "-" + std::to_string(max_ms) + " ms");
+	}
+	std::lock_guard<std::mutex> lk(modbus_lock); /* acquire lock, lock_guard will auto unlock when out of scope */
+	this->adaptive_timeout = true;
+	this->min_timeout = min_ms;
+	this->max_timeout = max_ms;
+	double timeout = this->rtt.samples ? this->rtt.srtt + 4 * this->rtt.rttvar : max_ms;
+	this->apply_timeout(std::min(std::max(timeout, this->min_timeout), this->max_timeout));
+}
+
+/** use a fixed response timeout, the round-trip time is still measured
+ * \throw: runtime_error if the timeout is not positive
+ *         std::system_error if when errors occur, including errors from the
+ *         underlying operating system that would prevent lock from meeting its
+ *         specifications */
+void ModBusConnector::set_response_timeout(const int &ms)
+{
+	if (ms <= 0)
+	{
+		throw std::runtime_error("[ModBusConnector::set_response_timeout] Invalid timeout " + std::to_string(ms) + " ms");
+	}
+	std::lock_guard<std::mutex> lk(modbus_lock); /* acquire lock, lock_guard will auto unlock when out of scope */
+	this->adaptive_timeout = false;
+	this->apply_timeout(ms);
+}
+
+/** round-trip time statistics
+ * \throw: std::system_error if when errors occur, including errors from the
+ *         underlying operating system that would prevent lock from meeting its
+ *         specifications */
+ModBusRttStats ModBusConnector::rtt_stats()
+{
+	std::lock_guard<std::mutex> lk(modbus_lock);
+	return this->rtt;
+}
+
+/** the start of a request, called with modbus_lock held before sending it
+ * After a timeout or a malformed response, the response that was late or the rest of the
+ * malformed one may have arrived since; it is discarded so that it is not taken for the
+ * response of this request.
+ * \return: ModBusFlightRecorder::now()
+ */
+std::uint64_t ModBusConnector::begin_request() noexcept
+{
+	if (__glibc_unlikely(this->stale))
+	{
+		const int error = errno;
+		modbus_flush(this->ctx);
+		errno = error;
+		this->stale = false;
+	}
+	return ModBusFlightRecorder::now();
+}
+
+/** update the round-trip time estimate, called with modbus_lock held after each request
+ * A response, exception responses included, is a sample; a timeout doubles the timeout instead
+ * (Karn's algorithm: a request without response gives no sample). A malformed response, e.g. the
+ * late response of an earlier request, is no sample either; what arrives after it is discarded
+ * until the socket is quiet, or the connection dropped when it does not get quiet within a response
+ * timeout. After both the socket is flushed again before the next request. Other failures change nothing.
+ * \start: ModBusFlightRecorder::now() when the request was sent
+ * \rc: the libmodbus return value
+ * \error: errno after the request when rc is -1, errno itself is left unchanged
+ */
+void ModBusConnector::adapt_timeout(const std::uint64_t &start, const int &rc, const int &error) noexcept
+{
+	if (rc == -1 && (error == ETIMEDOUT || error == EAGAIN)) /* no response in time */
+	{
+		++this->rtt.timeouts;
+		if (this->adaptive_timeout)
+			this->apply_timeout(std::min(2 * this->rtt.timeout, this->max_timeout));
+		this->stale = true;
+		modbus_flush(this->ctx);
+		return;
+	}
+	if (rc == -1 && error < MODBUS_ENOBASE) /* connection error, no response */
+		return;
+	if (rc == -1 && error > EMBXGTAR) /* not a response to this request, or not a valid one */
+	{
+		/* the response of this request may still be on its way: discard what arrives until the
+		   socket is quiet, for one response timeout at most. A peer that closed the connection,
+		   an error or bytes still arriving at the deadline drop the connection instead */
+		const std::uint64_t deadline = ModBusFlightRecorder::now() + (std::uint64_t)(this->rtt.timeout * 1e6);
+		struct pollfd fd = {modbus_get_socket(this->ctx), POLLIN, 0};
+		bool lost = modbus_flush(this->ctx) == -1;
+		while (!lost)
+		{
+			const std::uint64_t now = ModBusFlightRecorder::now();
+			const int ready = poll(&fd, 1, now < deadline ? (int)std::ceil((deadline - now) / 1e6) : 0);
+			if (ready == 0) /* quiet */
+				break;
+			if (ready == -1 && errno == EINTR)
+				continue;
+			lost = ready == -1 || (fd.revents & (POLLERR | POLLHUP | POLLNVAL)) || modbus_flush(this->ctx) <= 0 ||
+				   ModBusFlightRecorder::now() >= deadline;
+		}
+		if (lost)
+		{
+			MODBUS_LOG(warning, "ModBusConnector::adapt_timeout", "connection dropped after an invalid response",
+					   modbus_strerror(error));
+			modbus_close(this->ctx);
+			this->is_connected = false;
+			this->stale = false;
+			return;
+		}
+		this->stale = true;
+		return;
+	}
+
+	double sample = (ModBusFlightRecorder::now() - start) / 1e6;
+	if (!this->rtt.samples++)
+	{
+		this->rtt.srtt = sample;
+		this->rtt.rttvar = sample / 2;
+	}
+	else
+	{
+		this->rtt.rttvar = 0.75 * this->rtt.rttvar + 0.25 * std::abs(this->rtt.srtt - sample);
+		this->rtt.srtt = 0.875 * this->rtt.srtt + 0.125 * sample;
+	}
+	this->rtt.last = sample;
+	if (this->adaptive_timeout)
+		this->apply_timeout(std::min(std::max(this->rtt.srtt + 4 * this->rtt.rttvar, this->min_timeout), this->max_timeout));
+}
+
+/** set the libmodbus response timeout
+ * The byte timeout, between bytes of a response that started to arrive, keeps its libmodbus default.
+ * \timeout: response timeout in ms
+ */
+void ModBusConnector::apply_timeout(const double &timeout) noexcept
+{
+	this->rtt.timeout = timeout;
+	std::uint32_t us = (std::uint32_t)(timeout * 1000);
+	modbus_set_response_timeout(this->ctx, us / 1000000, us % 1000000);
+}
+
 /** receive a serial of coil-type modbus objects from modbus server
  * \addr: the start address of a serial of coil-type modbus objects
  * \num_of_bits: the number of coil-type modbus objects
@@ -130,10 +407,13 @@ int ModBusConnector::read_bits(const int &addr, const int &num_of_bits, std::vec
 	{
 		if (__glibc_unlikely(num_of_bits <= 0))
 		{
-			std::cerr << "ModBusConnector::read_bits: num_of_bits should be greater than 0 " << std::endl;
+			MODBUS_LOG(error, "ModBusConnector::read_bits", "num_of_bits should be greater than 0", nullptr);
 			return -1;
 		}
 
+		if (this->single_flight.load(std::memory_order_relaxed)) /* join an identical read in flight, or lead one */
+			return this->read_shared(ModBusArea::coils, addr, num_of_bits, values);
+
 		std::unique_lock<std::mutex> ulk(modbus_lock); /* acquire lock, unique_lock will auto unlock when out of scope */
 		if (!this->is_connected)					   /* return failure if connection not yet established */
 			return -1;
@@ -143,7 +423,16 @@ int ModBusConnector::read_bits(const int &addr, const int &num_of_bits, std::vec
 		values.resize(num_of_bits, 0); /* resize to have num_of_bits of elements and filled with 0 */
 
 		ulk.lock();																/* acquire lock */
-		int rc = modbus_read_bits(this->ctx, addr, num_of_bits, values.data()); /* call libmodbus to do the reading */
+		MODBUSCPP_TRACE_START(trace_start, client_receive);
+		const std::uint64_t record_start = this->begin_request();
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), _FC_READ_COILS, addr, num_of_bits);
+		int rc = this->timestamping ? this->read_raw(_FC_READ_COILS, addr, num_of_bits, values.data())
+								   : modbus_read_bits(this->ctx, addr, num_of_bits, values.data()); /* call libmodbus to do the reading */
+		const int error = rc == -1 ? errno : 0;
+		MODBUSCPP_PROBE6(client_receive, modbus_get_slave(this->ctx), _FC_READ_COILS, addr, num_of_bits, rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+		recorder.record(record_start, modbus_get_slave(this->ctx), _FC_READ_COILS, addr, num_of_bits, rc, error);
+		this->adapt_timeout(record_start, rc, error);
+		errno = error;
 		ulk.unlock();															/* release the lock */
 
 		if (rc != num_of_bits) /* reading fails */
@@ -155,7 +444,7 @@ int ModBusConnector::read_bits(const int &addr, const int &num_of_bits, std::vec
 	}
 	catch (const std::exception &e) /* catch the exception from acquiring the lock to give the chance to clean memory */
 	{
-		std::cerr << "ModBusConnector::read_bits: " << e.what() << std::endl;
+		MODBUS_LOG(error, "ModBusConnector::read_bits", "caught exception", e.what());
 		return -1;
 	}
 }
@@ -173,10 +462,13 @@ int ModBusConnector::read_input_bits(const int &addr, const int &num_of_bits,
 	{
 		if (__glibc_unlikely(num_of_bits <= 0))
 		{
-			std::cerr << "ModBusConnector::read_input_bits: num_of_bits should be greater than 0 " << std::endl;
+			MODBUS_LOG(error, "ModBusConnector::read_input_bits", "num_of_bits should be greater than 0", nullptr);
 			return -1;
 		}
 
+		if (this->single_flight.load(std::memory_order_relaxed)) /* join an identical read in flight, or lead one */
+			return this->read_shared(ModBusArea::input_bits, addr, num_of_bits, values);
+
 		std::unique_lock<std::mutex> ulk(modbus_lock); /* acquire lock, unique_lock will auto unlock when out of scope */
 		if (!this->is_connected)					   /* return failure if connection not yet established */
 			return -1;
@@ -186,7 +478,16 @@ int ModBusConnector::read_input_bits(const int &addr, const int &num_of_bits,
 		values.resize(num_of_bits, 0); /* resize to have num_of_bits of elements and filled with 0 */
 
 		ulk.lock();																	  /* acquire lock */
-		int rc = modbus_read_input_bits(this->ctx, addr, num_of_bits, values.data()); /* call libmodbus to do the reading */
+		MODBUSCPP_TRACE_START(trace_start, client_receive);
+		const std::uint64_t record_start = this->begin_request();
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), _FC_READ_DISCRETE_INPUTS, addr, num_of_bits);
+		int rc = this->timestamping ? this->read_raw(_FC_READ_DISCRETE_INPUTS, addr, num_of_bits, values.data())
+								   : modbus_read_input_bits(this->ctx, addr, num_of_bits, values.data()); /* call libmodbus to do the reading */
+		const int error = rc == -1 ? errno : 0;
+		MODBUSCPP_PROBE6(client_receive, modbus_get_slave(this->ctx), _FC_READ_DISCRETE_INPUTS, addr, num_of_bits, rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+		recorder.record(record_start, modbus_get_slave(this->ctx), _FC_READ_DISCRETE_INPUTS, addr, num_of_bits, rc, error);
+		this->adapt_timeout(record_start, rc, error);
+		errno = error;
 		ulk.unlock();																  /* release the lock */
 
 		if (rc != num_of_bits) /* reading fails */
@@ -198,7 +499,7 @@ int ModBusConnector::read_input_bits(const int &addr, const int &num_of_bits,
 	}
 	catch (const std::exception &e)
 	{
-		std::cerr << "ModBusConnector::read_input_bits: " << e.what() << std::endl;
+		MODBUS_LOG(error, "ModBusConnector::read_input_bits", "caught exception", e.what());
 		return -1;
 	}
 }
@@ -215,10 +516,13 @@ int ModBusConnector::read_registers(const int &addr, const int &num_of_registers
 	{
 		if (__glibc_unlikely(num_of_registers <= 0))
 		{
-			std::cerr << "ModBusConnector::read_registers: num_of_registers should be greater than 0 " << std::endl;
+			MODBUS_LOG(error, "ModBusConnector::read_registers", "num_of_registers should be greater than 0", nullptr);
 			return -1;
 		}
 
+		if (this->single_flight.load(std::memory_order_relaxed)) /* join an identical read in flight, or lead one */
+			return this->read_shared(ModBusArea::holding_registers, addr, num_of_registers, values);
+
 		std::unique_lock<std::mutex> ulk(modbus_lock); /* acquire lock, unique_lock will auto unlock when out of scope */
 		if (!this->is_connected)					   /* return failure if connection not yet established */
 			return -1;
@@ -228,7 +532,16 @@ int ModBusConnector::read_registers(const int &addr, const int &num_of_registers
 		values.resize(num_of_registers, 0); /* resize to have num_of_registers of elements and filled with 0 */
 
 		ulk.lock();																		  /* acquire lock */
-		int rc = modbus_read_registers(this->ctx, addr, num_of_registers, values.data()); /* call libmodbus to do the reading */
+		MODBUSCPP_TRACE_START(trace_start, client_receive);
+		const std::uint64_t record_start = this->begin_request();
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), _FC_READ_HOLDING_REGISTERS, addr, num_of_registers);
+		int rc = this->timestamping ? this->read_raw(_FC_READ_HOLDING_REGISTERS, addr, num_of_registers, values.data())
+								   : modbus_read_registers(this->ctx, addr, num_of_registers, values.data()); /* call libmodbus to do the reading */
+		const int error = rc == -1 ? errno : 0;
+		MODBUSCPP_PROBE6(client_receive, modbus_get_slave(this->ctx), _FC_READ_HOLDING_REGISTERS, addr, num_of_registers, rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+		recorder.record(record_start, modbus_get_slave(this->ctx), _FC_READ_HOLDING_REGISTERS, addr, num_of_registers, rc, error);
+		this->adapt_timeout(record_start, rc, error);
+		errno = error;
 		ulk.unlock();																	  /* release the lock */
 
 		if (rc != num_of_registers) /* reading fails */
@@ -240,7 +553,7 @@ int ModBusConnector::read_registers(const int &addr, const int &num_of_registers
 	}
 	catch (const std::exception &e)
 	{
-		std::cerr << "ModBusConnector::read_registers: " << e.what() << std::endl;
+		MODBUS_LOG(error, "ModBusConnector::read_registers", "caught exception", e.what());
 		return -1;
 	}
 }
@@ -257,10 +570,13 @@ int ModBusConnector::read_input_registers(const int &addr, const int &num_of_reg
 	{
 		if (__glibc_unlikely(num_of_registers <= 0))
 		{
-			std::cerr << "ModBusConnector::read_input_registers: num_of_bits should be greater than 0 " << std::endl;
+			MODBUS_LOG(error, "ModBusConnector::read_input_registers", "num_of_bits should be greater than 0", nullptr);
 			return -1;
 		}
 
+		if (this->single_flight.load(std::memory_order_relaxed)) /* join an identical read in flight, or lead one */
+			return this->read_shared(ModBusArea::input_registers, addr, num_of_registers, values);
+
 		std::unique_lock<std::mutex> ulk(modbus_lock); /* acquire lock, unique_lock will auto unlock when out of scope */
 		if (!this->is_connected)					   /* return failure if connection not yet established */
 			return -1;
@@ -270,7 +586,16 @@ int ModBusConnector::read_input_registers(const int &addr, const int &num_of_reg
 		values.resize(num_of_registers, 0); /* resize to have num_of_registers of elements and filled with 0 */
 
 		ulk.lock();																				/* return value */
-		int rc = modbus_read_input_registers(this->ctx, addr, num_of_registers, values.data()); /* call libmodbus to do the reading */
+		MODBUSCPP_TRACE_START(trace_start, client_receive);
+		const std::uint64_t record_start = this->begin_request();
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), _FC_READ_INPUT_REGISTERS, addr, num_of_registers);
+		int rc = this->timestamping ? this->read_raw(_FC_READ_INPUT_REGISTERS, addr, num_of_registers, values.data())
+								   : modbus_read_input_registers(this->ctx, addr, num_of_registers, values.data()); /* call libmodbus to do the reading */
+		const int error = rc == -1 ? errno : 0;
+		MODBUSCPP_PROBE6(client_receive, modbus_get_slave(this->ctx), _FC_READ_INPUT_REGISTERS, addr, num_of_registers, rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+		recorder.record(record_start, modbus_get_slave(this->ctx), _FC_READ_INPUT_REGISTERS, addr, num_of_registers, rc, error);
+		this->adapt_timeout(record_start, rc, error);
+		errno = error;
 		ulk.unlock();																			/* release the lock */
 
 		if (rc != num_of_registers) /* reading fails */
@@ -282,7 +607,7 @@ int ModBusConnector::read_input_registers(const int &addr, const int &num_of_reg
 	}
 	catch (const std::exception &e)
 	{
-		std::cerr << "ModBusConnector::read_input_registers: " << e.what() << std::endl;
+		MODBUS_LOG(error, "ModBusConnector::read_input_registers", "caught exception", e.what());
 		return -1;
 	}
 }
@@ -300,12 +625,20 @@ int ModBusConnector::write_bit(const int &addr, const std::uint8_t &value) noexc
 		if (!this->is_connected)					 /* return failure if connection not yet established */
 			return -1;
 
+		MODBUSCPP_TRACE_START(trace_start, client_receive);
+		const std::uint64_t record_start = this->begin_request();
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), _FC_WRITE_SINGLE_COIL, addr, 1);
 		int rc = modbus_write_bit(this->ctx, addr, value); /* call libmodbus to do the writing */
+		const int error = rc == -1 ? errno : 0;
+		MODBUSCPP_PROBE6(client_receive, modbus_get_slave(this->ctx), _FC_WRITE_SINGLE_COIL, addr, 1, rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+		recorder.record(record_start, modbus_get_slave(this->ctx), _FC_WRITE_SINGLE_COIL, addr, 1, rc, error);
+		this->adapt_timeout(record_start, rc, error);
+		errno = error;
 		return rc;
 	}
 	catch (const std::exception &e)
 	{
-		std::cerr << "ModBusConnector::write_bit: " << e.what() << std::endl;
+		MODBUS_LOG(error, "ModBusConnector::write_bit", "caught exception", e.what());
 		return -1;
 	}
 }
@@ -323,7 +656,7 @@ int ModBusConnector::write_bits(const int &addr, const int &num_of_bits,
 	{
 		if (__glibc_unlikely(num_of_bits <= 0))
 		{
-			std::cerr << "ModBusConnector::write_bits: num_of_bits should be greater than 0 " << std::endl;
+			MODBUS_LOG(error, "ModBusConnector::write_bits", "num_of_bits should be greater than 0", nullptr);
 			return -1;
 		}
 
@@ -342,7 +675,15 @@ int ModBusConnector::write_bits(const int &addr, const int &num_of_bits,
 		}
 
 		ulk.lock();																  /* acquire lock */
+		MODBUSCPP_TRACE_START(trace_start, client_receive);
+		const std::uint64_t record_start = this->begin_request();
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), _FC_WRITE_MULTIPLE_COILS, addr, num_to_write);
 		int rc = modbus_write_bits(this->ctx, addr, num_to_write, values.data()); /* call libmodbus to do the writing */
+		const int error = rc == -1 ? errno : 0;
+		MODBUSCPP_PROBE6(client_receive, modbus_get_slave(this->ctx), _FC_WRITE_MULTIPLE_COILS, addr, num_to_write, rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+		recorder.record(record_start, modbus_get_slave(this->ctx), _FC_WRITE_MULTIPLE_COILS, addr, num_to_write, rc, error);
+		this->adapt_timeout(record_start, rc, error);
+		errno = error;
 		ulk.unlock();															  /* release lock when it's not required */
 
 		if (rc != num_of_bits) /* writing fails */
@@ -352,7 +693,88 @@ int ModBusConnector::write_bits(const int &addr, const int &num_of_bits,
 	}
 	catch (const std::exception &e)
 	{
-		std::cerr << "ModBusConnector::write_bits: " << e.what() << std::endl;
+		MODBUS_LOG(error, "ModBusConnector::write_bits", "caught exception", e.what());
+		return -1;
+	}
+}
+
+/** receive a serial of coils as packed bits
+ * \addr: the start address of a serial of coil-type modbus objects
+ * \num_of_bits: the number of coil-type modbus objects, up to MODBUS_MAX_READ_BITS
+ * \packed: ModBusBitPack::bytes(num_of_bits) bytes receiving the values, bit i at bit i % 8 of byte i / 8
+ * \return: -1 on failure, or the number of coil-type objects received on success
+*/
+int ModBusConnector::read_bits_packed(const int &addr, const int &num_of_bits, std::uint8_t *packed) noexcept
+{
+	if (__glibc_unlikely(num_of_bits <= 0 || num_of_bits > MODBUS_MAX_READ_BITS))
+	{
+		MODBUS_LOG(error, "ModBusConnector::read_bits_packed", "num_of_bits out of range", nullptr);
+		return -1;
+	}
+	try
+	{
+		std::lock_guard<std::mutex> lk(modbus_lock);
+		if (!this->is_connected) /* return failure if connection not yet established */
+			return -1;
+		return this->transfer_bits(_FC_READ_COILS, addr, num_of_bits, nullptr, packed);
+	}
+	catch (const std::exception &e)
+	{
+		MODBUS_LOG(error, "ModBusConnector::read_bits_packed", "caught exception", e.what());
+		return -1;
+	}
+}
+
+/** receive a serial of discrete inputs as packed bits
+ * \addr: the start address of a serial of discrete-input-type modbus objects
+ * \num_of_bits: the number of discrete-input-type modbus objects, up to MODBUS_MAX_READ_BITS
+ * \packed: ModBusBitPack::bytes(num_of_bits) bytes receiving the values, bit i at bit i % 8 of byte i / 8
+ * \return: -1 on failure, or the number of discrete-input-type objects received on success
+*/
+int ModBusConnector::read_input_bits_packed(const int &addr, const int &num_of_bits, std::uint8_t *packed) noexcept
+{
+	if (__glibc_unlikely(num_of_bits <= 0 || num_of_bits > MODBUS_MAX_READ_BITS))
+	{
+		MODBUS_LOG(error, "ModBusConnector::read_input_bits_packed", "num_of_bits out of range", nullptr);
+		return -1;
+	}
+	try
+	{
+		std::lock_guard<std::mutex> lk(modbus_lock);
+		if (!this->is_connected) /* return failure if connection not yet established */
+			return -1;
+		return this->transfer_bits(_FC_READ_DISCRETE_INPUTS, addr, num_of_bits, nullptr, packed);
+	}
+	catch (const std::exception &e)
+	{
+		MODBUS_LOG(error, "ModBusConnector::read_input_bits_packed", "caught exception", e.what());
+		return -1;
+	}
+}
+
+/** send packed bits into a serial of coils
+ * \addr: the start address of the serial of coil modbus objects
+ * \num_of_bits: the number of coil-type modbus objects to be sent, up to MODBUS_MAX_WRITE_BITS
+ * \packed: ModBusBitPack::bytes(num_of_bits) bytes holding the values, bit i at bit i % 8 of byte i / 8
+ * \return: -1 on failure, or the number of coil-type objects sent on success
+*/
+int ModBusConnector::write_bits_packed(const int &addr, const int &num_of_bits, const std::uint8_t *packed) noexcept
+{
+	if (__glibc_unlikely(num_of_bits <= 0 || num_of_bits > MODBUS_MAX_WRITE_BITS))
+	{
+		MODBUS_LOG(error, "ModBusConnector::write_bits_packed", "num_of_bits out of range", nullptr);
+		return -1;
+	}
+	try
+	{
+		std::lock_guard<std::mutex> lk(modbus_lock);
+		if (!this->is_connected) /* return failure if connection not yet established */
+			return -1;
+		return this->transfer_bits(_FC_WRITE_MULTIPLE_COILS, addr, num_of_bits, packed, nullptr);
+	}
+	catch (const std::exception &e)
+	{
+		MODBUS_LOG(error, "ModBusConnector::write_bits_packed", "caught exception", e.what());
 		return -1;
 	}
 }
@@ -370,12 +792,20 @@ int ModBusConnector::write_register(const int &addr, const std::uint16_t &value)
 		if (!this->is_connected)					 /* return failure if connection not yet established */
 			return -1;
 
+		MODBUSCPP_TRACE_START(trace_start, client_receive);
+		const std::uint64_t record_start = this->begin_request();
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), _FC_WRITE_SINGLE_REGISTER, addr, 1);
 		int rc = modbus_write_register(this->ctx, addr, value); /* call libmodbus to do the writing */
+		const int error = rc == -1 ? errno : 0;
+		MODBUSCPP_PROBE6(client_receive, modbus_get_slave(this->ctx), _FC_WRITE_SINGLE_REGISTER, addr, 1, rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+		recorder.record(record_start, modbus_get_slave(this->ctx), _FC_WRITE_SINGLE_REGISTER, addr, 1, rc, error);
+		this->adapt_timeout(record_start, rc, error);
+		errno = error;
 		return rc;
 	}
 	catch (const std::exception &e)
 	{
-		std::cerr << "ModBusConnector::write_register: " << e.what() << std::endl;
+		MODBUS_LOG(error, "ModBusConnector::write_register", "caught exception", e.what());
 		return -1;
 	}
 }
@@ -393,7 +823,7 @@ int ModBusConnector::write_registers(const int &addr, const int &num_of_register
 	{
 		if (__glibc_unlikely(num_of_registers <= 0))
 		{
-			std::cerr << "ModBusConnector::write_registers: num_of_registers should be greater than 0 " << std::endl;
+			MODBUS_LOG(error, "ModBusConnector::write_registers", "num_of_registers should be greater than 0", nullptr);
 			return -1;
 		}
 
@@ -412,7 +842,15 @@ int ModBusConnector::write_registers(const int &addr, const int &num_of_register
 		}
 
 		ulk.lock();																	   /* acquire lock */
+		MODBUSCPP_TRACE_START(trace_start, client_receive);
+		const std::uint64_t record_start = this->begin_request();
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), _FC_WRITE_MULTIPLE_REGISTERS, addr, num_to_write);
 		int rc = modbus_write_registers(this->ctx, addr, num_to_write, values.data()); /* call libmodbus to do the writing */
+		const int error = rc == -1 ? errno : 0;
+		MODBUSCPP_PROBE6(client_receive, modbus_get_slave(this->ctx), _FC_WRITE_MULTIPLE_REGISTERS, addr, num_to_write, rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+		recorder.record(record_start, modbus_get_slave(this->ctx), _FC_WRITE_MULTIPLE_REGISTERS, addr, num_to_write, rc, error);
+		this->adapt_timeout(record_start, rc, error);
+		errno = error;
 		ulk.unlock();
 
 		if (rc != num_of_registers)
@@ -422,11 +860,60 @@ int ModBusConnector::write_registers(const int &addr, const int &num_of_register
 	}
 	catch (const std::exception &e)
 	{
-		std::cerr << "ModBusConnector::write_registers: " << e.what() << std::endl;
+		MODBUS_LOG(error, "ModBusConnector::write_registers", "caught exception", e.what());
+		return -1;
+	}
+}
+
+/** modify bits of a holding register with one request (Mask Write Register, FC 0x16)
+ * The device sets the register to (current & and_mask) | (or_mask & ~and_mask), so the
+ * bits cleared in and_mask take their value from or_mask and the others are kept, without
+ * a read-modify-write racing with other writers.
+ * \addr: the address of holding register
+ * \and_mask: the bits to keep
+ * \or_mask: the value of the bits not kept
+ * \return: -1 on failure, or 1 on success
+*/
+int ModBusConnector::mask_write_register(const int &addr, const std::uint16_t &and_mask, const std::uint16_t &or_mask) noexcept
+{
+	try
+	{
+		std::lock_guard<std::mutex> lk(modbus_lock);
+		if (!this->is_connected) /* return failure if connection not yet established */
+			return -1;
+
+		MODBUSCPP_TRACE_START(trace_start, client_receive);
+		const std::uint64_t record_start = this->begin_request();
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), _FC_MASK_WRITE_REGISTER, addr, 1);
+		int rc = modbus_mask_write_register(this->ctx, addr, and_mask, or_mask); /* call libmodbus to do the writing */
+		const int error = rc == -1 ? errno : 0;
+		MODBUSCPP_PROBE6(client_receive, modbus_get_slave(this->ctx), _FC_MASK_WRITE_REGISTER, addr, 1, rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+		recorder.record(record_start, modbus_get_slave(this->ctx), _FC_MASK_WRITE_REGISTER, addr, 1, rc, error);
+		this->adapt_timeout(record_start, rc, error);
+		errno = error;
+
+		if (rc != 1) /* writing fails */
+			return -1;
+		return rc;
+	}
+	catch (const std::exception &e)
+	{
+		MODBUS_LOG(error, "ModBusConnector::mask_write_register", "caught exception", e.what());
 		return -1;
 	}
 }
 
+/** set bits of a holding register, e.g. of a bitfield varable, with one request
+ * \addr: the address of holding register
+ * \mask: the bits to set
+ * \bits: their new value, bits outside mask are ignored
+ * \return: -1 on failure, or 1 on success
+*/
+int ModBusConnector::write_register_bits(const int &addr, const std::uint16_t &mask, const std::uint16_t &bits) noexcept
+{
+	return this->mask_write_register(addr, ~mask, bits & mask);
+}
+
 /** send values into a serial of holding registers and then read values back from those registers
  * \write_addr: the start address of the serial of holding registers
  * \num_of_registers_to_write: the number of holding registers to send values into
@@ -444,7 +931,7 @@ int ModBusConnector::write_and_read_registers(const int &write_addr, const int &
 	{
 		if (__glibc_unlikely(num_of_registers_to_write <= 0 || num_registers_to_read <= 0))
 		{
-			std::cerr << "ModBusConnector::write_and_read_registers: num_of_registers_to_write and num_registers_to_read should be greater than 0 " << std::endl;
+			MODBUS_LOG(error, "ModBusConnector::write_and_read_registers", "num_of_registers_to_write and num_registers_to_read should be greater than 0", nullptr);
 			return -1;
 		}
 
@@ -468,9 +955,17 @@ int ModBusConnector::write_and_read_registers(const int &write_addr, const int &
 		int rc = -1; /* return value */
 
 		ulk.lock(); /* acquire lock */
+		MODBUSCPP_TRACE_START(trace_start, client_receive);
+		const std::uint64_t record_start = this->begin_request();
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), _FC_WRITE_AND_READ_REGISTERS, read_addr, num_registers_to_read);
 		/* call libmodbus to do the jobs */
 		rc = modbus_write_and_read_registers(this->ctx, write_addr, num_to_write, values_to_write.data(),
 											 read_addr, num_registers_to_read, values_to_read.data());
+		const int error = rc == -1 ? errno : 0;
+		MODBUSCPP_PROBE6(client_receive, modbus_get_slave(this->ctx), _FC_WRITE_AND_READ_REGISTERS, read_addr, num_registers_to_read, rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+		recorder.record(record_start, modbus_get_slave(this->ctx), _FC_WRITE_AND_READ_REGISTERS, read_addr, num_registers_to_read, rc, error);
+		this->adapt_timeout(record_start, rc, error);
+		errno = error;
 		ulk.unlock(); /* release the lock */
 
 		if (rc != num_registers_to_read) /* writing or reading fails */
@@ -482,11 +977,607 @@ int ModBusConnector::write_and_read_registers(const int &write_addr, const int &
 	}
 	catch (const std::exception &e)
 	{
-		std::cerr << "ModBusConnector::write_and_read_registers: " << e.what() << std::endl;
+		MODBUS_LOG(error, "ModBusConnector::write_and_read_registers", "caught exception", e.what());
+		return -1;
+	}
+}
+
+/** read through the single-flight table
+ * The first caller for a given area, address and count sends the request; callers asking for the
+ * same while it is in flight (sent, or waiting for the connection lock) wait for it and get a copy
+ * of its result instead of sending their own.
+ * \values: resized to num, the values read; cleared on failure
+ * \return: -1 on failure, or num
+ * \throw: std::system_error if a lock cannot be acquired
+ *         std::bad_alloc
+ */
+template <typename T>
+int ModBusConnector::read_shared(const ModBusArea &area, const int &addr, const int &num, std::vector<T> &values)
+{
+	const std::uint64_t key = ((std::uint64_t)area << 32) | ((std::uint64_t)(addr & 0xFFFF) << 16) | (std::uint64_t)(num & 0xFFFF);
+
+	std::unique_lock<std::mutex> flk(flight_lock);
+	auto it = flights.find(key);
+	if (it != flights.end()) /* follow the read in flight */
+	{
+		std::shared_ptr<Flight> flight = it->second;
+		++this->shared_reads;
+		flight_cv.wait(flk, [&flight] { return flight->done; });
+		if (flight->rc != num)
+		{
+			values.clear();
+			errno = flight->error;
+			return -1;
+		}
+		values.resize(num);
+		memcpy(values.data(), flight->data.data(), num * sizeof(T));
+		return num;
+	}
+
+	std::shared_ptr<Flight> flight = std::make_shared<Flight>(); /* lead */
+	flights.emplace(key, flight);
+	flk.unlock();
+
+	int rc = -1;
+	int error = ENOTCONN;
+	try
+	{
+		values.clear();		   /* clear pre-existing content */
+		values.resize(num, 0); /* resize to have num elements and filled with 0 */
+		std::lock_guard<std::mutex> lk(modbus_lock);
+		if (this->is_connected) /* fail if connection not yet established */
+		{
+			rc = this->read_block(ModBusReadBlock{area, addr, num, 0}, values.data());
+			error = errno;
+		}
+	}
+	catch (...)
+	{
+		error = ENOMEM;
+	}
+
+	/* complete the flight whatever happened, followers are waiting for it */
+	flk.lock();
+	flight->rc = rc;
+	flight->error = error;
+	if (rc == num && flight.use_count() > 2) /* followers hold the rest of the references */
+	{
+		try
+		{
+			flight->data.assign(reinterpret_cast<const std::uint8_t *>(values.data()),
+								reinterpret_cast<const std::uint8_t *>(values.data() + num));
+		}
+		catch (...)
+		{
+			flight->rc = -1;
+			flight->error = ENOMEM;
+		}
+	}
+	flight->done = true;
+	flights.erase(key);
+	flk.unlock();
+	flight_cv.notify_all();
+
+	if (rc != num) /* reading fails */
+	{
+		values.clear(); /* clear values vector on failure */
+		errno = error;
+		return -1;
+	}
+	return rc;
+}
+
+/** merge identical concurrent reads, off by default
+ * While on, a read_bits/read_input_bits/read_registers/read_input_registers call identical to one
+ * in flight on another thread waits for that one's result instead of sending a request.
+ */
+void ModBusConnector::set_single_flight(const bool &enabled) noexcept
+{
+	this->single_flight = enabled;
+}
+
+/** the number of reads answered by an identical read in flight
+ * \throw: std::system_error if when errors occur, including errors from the
+ *         underlying operating system that would prevent lock from meeting its
+ *         specifications */
+std::uint64_t ModBusConnector::single_flight_hits()
+{
+	std::lock_guard<std::mutex> lk(flight_lock);
+	return this->shared_reads;
+}
+
+/** take the kernel timestamps (SO_TIMESTAMPING) of every read, off by default
+ * While on, reads are sent as raw requests: the time the kernel handed each request to the network
+ * device and received the first segment of its response are kept with the values, see
+ * last_timestamps() and ModBusSnapshot::times. Writes, and reads fused with a write, go through
+ * libmodbus and are not timestamped.
+ * \throw: runtime_error if the socket does not take the option
+ *         std::system_error if when errors occur, including errors from the
+ *         underlying operating system that would prevent lock from meeting its
+ *         specifications */
+void ModBusConnector::set_timestamping(const bool &enabled)
+{
+	std::lock_guard<std::mutex> lk(modbus_lock); /* acquire lock, lock_guard will auto unlock when out of scope */
+	if (this->is_connected && _set_timestamping(modbus_get_socket(this->ctx), enabled ? _TIMESTAMPING_RX : 0) == -1)
+	{
+		throw std::runtime_error("[ModBusConnector::set_timestamping] Unable to set SO_TIMESTAMPING: " + std::string(strerror(errno)));
+	}
+	this->timestamping = enabled;
+	this->stamps = ModBusTimestamps{};
+}
+
+/** the kernel timestamps of the last read of this connection, zero when not taken
+ * With several threads sharing the connection, the last read may be another thread's.
+ * \throw: std::system_error if when errors occur, including errors from the
+ *         underlying operating system that would prevent lock from meeting its
+ *         specifications */
+ModBusTimestamps ModBusConnector::last_timestamps()
+{
+	std::lock_guard<std::mutex> lk(modbus_lock);
+	return this->stamps;
+}
+
+/** read one block of a plan, called with modbus_lock held
+ * \dest: where the values go, a word per register or a byte per bit
+ * \return: the libmodbus return value, errno holding the error when -1
+ */
+int ModBusConnector::read_block(const ModBusReadBlock &block, void *dest) noexcept
+{
+	int function;
+	int rc;
+
+	MODBUSCPP_TRACE_START(trace_start, client_receive);
+	const std::uint64_t record_start = this->begin_request();
+	this->stamps = ModBusTimestamps{};
+	switch (block.area) /* call libmodbus to do the reading */
+	{
+	case ModBusArea::coils:
+		function = _FC_READ_COILS;
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), function, block.addr, block.num);
+		rc = this->timestamping ? this->read_raw(function, block.addr, block.num, dest)
+							   : modbus_read_bits(this->ctx, block.addr, block.num, static_cast<std::uint8_t *>(dest));
+		break;
+	case ModBusArea::input_bits:
+		function = _FC_READ_DISCRETE_INPUTS;
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), function, block.addr, block.num);
+		rc = this->timestamping ? this->read_raw(function, block.addr, block.num, dest)
+							   : modbus_read_input_bits(this->ctx, block.addr, block.num, static_cast<std::uint8_t *>(dest));
+		break;
+	case ModBusArea::holding_registers:
+		function = _FC_READ_HOLDING_REGISTERS;
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), function, block.addr, block.num);
+		rc = this->timestamping ? this->read_raw(function, block.addr, block.num, dest)
+							   : modbus_read_registers(this->ctx, block.addr, block.num, static_cast<std::uint16_t *>(dest));
+		break;
+	default:
+		function = _FC_READ_INPUT_REGISTERS;
+		MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), function, block.addr, block.num);
+		rc = this->timestamping ? this->read_raw(function, block.addr, block.num, dest)
+							   : modbus_read_input_registers(this->ctx, block.addr, block.num, static_cast<std::uint16_t *>(dest));
+		break;
+	}
+	const int error = rc == -1 ? errno : 0;
+	MODBUSCPP_PROBE6(client_receive, modbus_get_slave(this->ctx), function, block.addr, block.num, rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+	recorder.record(record_start, modbus_get_slave(this->ctx), function, block.addr, block.num, rc, error);
+	this->adapt_timeout(record_start, rc, error);
+	errno = error;
+	return rc;
+}
+
+/** read or write bits in the packed format of the wire, called with modbus_lock held
+ * libmodbus only takes and returns a byte per bit, so the request is built and the response
+ * checked here, and sent and received with modbus_send_raw_request()/modbus_receive_confirmation().
+ * \function: _FC_READ_COILS, _FC_READ_DISCRETE_INPUTS or _FC_WRITE_MULTIPLE_COILS
+ * \src: the packed values to write, nullptr for a read
+ * \dest: where the packed values read go, nullptr for a write
+ * \return: -1 on failure, errno holding the error, or num on success
+ */
+int ModBusConnector::transfer_bits(const int &function, const int &addr, const int &num, const std::uint8_t *src, std::uint8_t *dest) noexcept
+{
+	const int num_bytes = (num + 7) / 8;
+	const std::uint8_t tail_mask = num % 8 ? (1 << num % 8) - 1 : 0xFF; /* bits of the last byte in the range */
+	std::uint8_t request[MODBUS_TCP_MAX_ADU_LENGTH];
+	std::uint8_t response[MODBUS_TCP_MAX_ADU_LENGTH];
+	int length = 6;
+
+	request[0] = modbus_get_slave(this->ctx);
+	request[1] = function;
+	request[2] = addr >> 8;
+	request[3] = addr & 0xFF;
+	request[4] = num >> 8;
+	request[5] = num & 0xFF;
+	if (src)
+	{
+		request[6] = num_bytes;
+		memcpy(request + 7, src, num_bytes);
+		request[6 + num_bytes] &= tail_mask;
+		length = 7 + num_bytes;
+	}
+
+	MODBUSCPP_TRACE_START(trace_start, client_receive);
+	const std::uint64_t record_start = this->begin_request();
+	MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), function, addr, num);
+	int rc = this->transact(request, length, response);
+	if (rc != -1)
+	{
+		const int offset = modbus_get_header_length(this->ctx); /* of the function code */
+		const std::uint8_t *pdu = response + offset;
+		if (rc >= offset + 2 && pdu[0] == (function | 0x80)) /* exception response */
+		{
+			errno = MODBUS_ENOBASE + pdu[1];
+			rc = -1;
+		}
+		else if (dest ? rc < offset + 2 + num_bytes || pdu[0] != function || pdu[1] != num_bytes
+					  : rc < offset + 5 || pdu[0] != function || (pdu[1] << 8 | pdu[2]) != addr || (pdu[3] << 8 | pdu[4]) != num)
+		{
+			modbus_flush(this->ctx);
+			errno = EMBBADDATA;
+			rc = -1;
+		}
+		else
+		{
+			if (dest)
+			{
+				memcpy(dest, pdu + 2, num_bytes);
+				dest[num_bytes - 1] &= tail_mask;
+			}
+			rc = num;
+		}
+	}
+	const int error = rc == -1 ? errno : 0;
+	MODBUSCPP_PROBE6(client_receive, modbus_get_slave(this->ctx), function, addr, num, rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+	recorder.record(record_start, modbus_get_slave(this->ctx), function, addr, num, rc, error);
+	this->adapt_timeout(record_start, rc, error);
+	errno = error;
+	return rc;
+}
+
+/** send a raw request and receive its response, called with modbus_lock held
+ * With timestamping on, send timestamps are asked for the request alone, the response is waited
+ * for with poll() and its receive timestamp taken with recvmsg(MSG_PEEK) before libmodbus reads
+ * it. The send timestamp comes through the error queue of the socket, emptied here so that the
+ * select() of libmodbus is not woken by it. stamps holds the timestamps taken.
+ * \request: the request from the unit identifier on, as modbus_send_raw_request() takes it
+ * \return: as modbus_receive_confirmation(), errno holding the error when -1
+ */
+int ModBusConnector::transact(const std::uint8_t *request, const int &length, std::uint8_t *response) noexcept
+{
+	this->stamps = ModBusTimestamps{};
+	if (!this->timestamping)
+	{
+		int rc = modbus_send_raw_request(this->ctx, request, length);
+		return rc == -1 ? rc : modbus_receive_confirmation(this->ctx, response);
+	}
+
+	const int socket = modbus_get_socket(this->ctx);
+	_set_timestamping(socket, _TIMESTAMPING_RX | _TIMESTAMPING_TX);
+	int rc = modbus_send_raw_request(this->ctx, request, length);
+	_set_timestamping(socket, _TIMESTAMPING_RX); /* the flags are taken when the data is sent */
+	if (rc == -1)
+		return -1;
+
+	const std::uint64_t deadline = ModBusFlightRecorder::now() + (std::uint64_t)(this->rtt.timeout * 1e6);
+	for (;;)
+	{
+		const std::uint64_t now = ModBusFlightRecorder::now();
+		struct pollfd fd = {socket, POLLIN, 0};
+		int n = poll(&fd, 1, now < deadline ? (int)((deadline - now + 999999) / 1000000) : 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == 0) /* no response in time, as libmodbus would report it */
+		{
+			_receive_timestamp(socket, MSG_ERRQUEUE, this->stamps.sent);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (n == -1)
+			break;
+		if (fd.revents & POLLIN)
+		{
+			_receive_timestamp(socket, MSG_PEEK, this->stamps.received);
+			break;
+		}
+		/* POLLERR: the send timestamp, or an error of the connection left to libmodbus */
+		if (!_receive_timestamp(socket, MSG_ERRQUEUE, this->stamps.sent))
+			break;
+	}
+	while (_receive_timestamp(socket, MSG_ERRQUEUE, this->stamps.sent)) /* a stamp not seen yet, or a stale one */
+		;
+	return modbus_receive_confirmation(this->ctx, response);
+}
+
+/** read registers or bits with a raw request, called with modbus_lock held
+ * The same as modbus_read_registers() and the others, for the requests to go through transact().
+ * \function: _FC_READ_COILS, _FC_READ_DISCRETE_INPUTS, _FC_READ_HOLDING_REGISTERS or _FC_READ_INPUT_REGISTERS
+ * \dest: a byte per bit, or a word per register
+ * \return: -1 on failure, errno holding the error, or num on success
+ */
+int ModBusConnector::read_raw(const int &function, const int &addr, const int &num, void *dest) noexcept
+{
+	const bool bits = function == _FC_READ_COILS || function == _FC_READ_DISCRETE_INPUTS;
+	if (num < 1 || num > (bits ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS))
+	{
+		errno = EMBMDATA;
+		return -1;
+	}
+	const int num_bytes = bits ? (num + 7) / 8 : 2 * num;
+	const std::uint8_t request[6] = {(std::uint8_t)modbus_get_slave(this->ctx), (std::uint8_t)function,
+									 (std::uint8_t)(addr >> 8), (std::uint8_t)(addr & 0xFF),
+									 (std::uint8_t)(num >> 8), (std::uint8_t)(num & 0xFF)};
+	std::uint8_t response[MODBUS_TCP_MAX_ADU_LENGTH];
+
+	int rc = this->transact(request, sizeof(request), response);
+	if (rc == -1)
+		return -1;
+	const int offset = modbus_get_header_length(this->ctx); /* of the function code */
+	const std::uint8_t *pdu = response + offset;
+	if (rc >= offset + 2 && pdu[0] == (function | 0x80)) /* exception response */
+	{
+		errno = MODBUS_ENOBASE + pdu[1];
+		return -1;
+	}
+	if (rc < offset + 2 + num_bytes || pdu[0] != function || pdu[1] != num_bytes)
+	{
+		modbus_flush(this->ctx);
+		errno = EMBBADDATA;
+		return -1;
+	}
+	if (bits)
+	{
+		std::uint8_t *values = static_cast<std::uint8_t *>(dest);
+		for (int i = 0; i < num; ++i)
+			values[i] = (pdu[2 + i / 8] >> (i % 8)) & 1;
+	}
+	else
+	{
+		std::uint16_t *values = static_cast<std::uint16_t *>(dest);
+		for (int i = 0; i < num; ++i)
+			values[i] = pdu[2 + 2 * i] << 8 | pdu[3 + 2 * i];
+	}
+	return num;
+}
+
+/** write holding registers, and read a block of holding registers with the same request when
+ *  block is not nullptr (FC 0x17), called with modbus_lock held
+ * \return: the libmodbus return value (the number of registers written, or read when fused),
+ *          errno holding the error when -1
+ */
+int ModBusConnector::write_block(const ModBusRegisterWrite &write, const ModBusReadBlock *block, std::uint16_t *dest) noexcept
+{
+	const int function = block ? _FC_WRITE_AND_READ_REGISTERS : _FC_WRITE_MULTIPLE_REGISTERS;
+	const int addr = block ? block->addr : write.addr;
+	const int num = block ? block->num : write.num;
+	int rc;
+
+	MODBUSCPP_TRACE_START(trace_start, client_receive);
+	const std::uint64_t record_start = this->begin_request();
+	MODBUSCPP_PROBE4(client_send, modbus_get_slave(this->ctx), function, addr, num);
+	if (block) /* call libmodbus to do the jobs */
+		rc = modbus_write_and_read_registers(this->ctx, write.addr, write.num, write.values, block->addr, block->num, dest);
+	else
+		rc = modbus_write_registers(this->ctx, write.addr, write.num, write.values);
+	const int error = rc == -1 ? errno : 0;
+	MODBUSCPP_PROBE6(client_receive, modbus_get_slave(this->ctx), function, addr, num, rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+	recorder.record(record_start, modbus_get_slave(this->ctx), function, addr, num, rc, error);
+	this->adapt_timeout(record_start, rc, error);
+	errno = error;
+	return rc;
+}
+
+/** prepare a snapshot for a plan, every block failed until read
+ * \throw: std::bad_alloc if the buffers need to grow
+ */
+static void _reset_snapshot(const ModBusReadPlan &plan, ModBusSnapshot &snapshot)
+{
+	snapshot.words.resize(plan.words());
+	snapshot.status.assign(plan.blocks().size(), -1);
+	snapshot.error.assign(plan.blocks().size(), ENOTCONN);
+	snapshot.times.assign(plan.blocks().size(), ModBusTimestamps{});
+}
+
+/** store the outcome of reading block i of a snapshot
+ * \return: false if the device did not respond, so the next requests need not be sent
+ */
+static bool _block_done(ModBusSnapshot &snapshot, const std::size_t &i, const int &num, const int &rc, const int &error) noexcept
+{
+	if (rc == num)
+	{
+		snapshot.status[i] = rc;
+		snapshot.error[i] = 0;
+		return true;
+	}
+	snapshot.error[i] = error ? error : EMBBADDATA;
+	return !error || error >= MODBUS_ENOBASE;
+}
+
+/** read every block of a plan, for a whole scan in one call
+ * The connection is locked once for all the blocks and the values land in the snapshot buffer,
+ * which is only allocated while its size differs from the plan's. The blocks are sent one after
+ * the other, libmodbus waiting for each response; after a block without any response (timeout,
+ * connection lost) the remaining ones are not sent and fail with the same error.
+ * \plan: a compiled plan
+ * \snapshot: receives the timestamp, the values and the status and errno of every block
+ * \return: -1 if the plan is not compiled or the connection not established,
+ *          or the number of blocks read successfully
+*/
+int ModBusConnector::read_snapshot(const ModBusReadPlan &plan, ModBusSnapshot &snapshot) noexcept
+{
+	try
+	{
+		if (__glibc_unlikely(!plan.ready()))
+		{
+			MODBUS_LOG(error, "ModBusConnector::read_snapshot", "the plan should be compiled", nullptr);
+			return -1;
+		}
+		_reset_snapshot(plan, snapshot);
+
+		std::lock_guard<std::mutex> lk(modbus_lock); /* acquire lock, lock_guard will auto unlock when out of scope */
+		snapshot.timestamp = std::chrono::system_clock::now();
+		if (!this->is_connected) /* return failure if connection not yet established */
+			return -1;
+
+		const std::vector<ModBusReadBlock> &blocks = plan.blocks();
+		int succeeded = 0;
+		for (std::size_t i = 0; i < blocks.size(); ++i)
+		{
+			int rc = this->read_block(blocks[i], snapshot.words.data() + blocks[i].offset);
+			snapshot.times[i] = this->stamps;
+			succeeded += rc == blocks[i].num;
+			if (!_block_done(snapshot, i, blocks[i].num, rc, errno))
+			{
+				std::fill(snapshot.error.begin() + i + 1, snapshot.error.end(), snapshot.error[i]);
+				break;
+			}
+		}
+		return succeeded;
+	}
+	catch (const std::exception &e) /* catch the exception from acquiring the lock or allocating the buffers */
+	{
+		MODBUS_LOG(error, "ModBusConnector::read_snapshot", "caught exception", e.what());
+		return -1;
+	}
+}
+
+/** the holding register block of a plan a write can share a request (FC 0x17) with
+ * The block must fit in the request, and must not overlap a later write: the fused read
+ * happens right after this write, before the later ones.
+ * \fused: blocks already taken by an earlier write
+ * \return: index of the block, or -1
+ */
+static int _fusion_partner(const std::vector<ModBusRegisterWrite> &writes, const std::size_t &w,
+						   const ModBusReadPlan &plan, const std::vector<bool> &fused) noexcept
+{
+	if (writes[w].num > MODBUS_MAX_WR_WRITE_REGISTERS)
+		return -1;
+
+	const std::vector<ModBusReadBlock> &blocks = plan.blocks();
+	for (std::size_t i = 0; i < blocks.size(); ++i)
+	{
+		const ModBusReadBlock &block = blocks[i];
+		if (fused[i] || block.area != ModBusArea::holding_registers || block.num > MODBUS_MAX_WR_READ_REGISTERS)
+			continue;
+
+		bool overlaps = false;
+		for (std::size_t later = w + 1; later < writes.size() && !overlaps; ++later)
+			overlaps = writes[later].addr < block.addr + block.num && block.addr < writes[later].addr + writes[later].num;
+		if (!overlaps)
+			return i;
+	}
+	return -1;
+}
+
+/** write holding registers, then read every block of a plan: one control cycle in one call
+ * The result is the same as write_registers() for each write in order followed by
+ * read_snapshot(), but a write and a holding register read it does not affect are sent as a
+ * single Read/Write Multiple Registers request (FC 0x17), saving a round trip each. When the
+ * device answers FC 0x17 with an illegal function exception, the request is sent again as a
+ * separate write and read and FC 0x17 is no longer used on this connection.
+ * \writes: the writes, in order; rc and error of each are set, rc being -1 or the number written
+ * \plan: a compiled plan
+ * \snapshot: as for read_snapshot()
+ * \return: -1 if the plan is not compiled or the connection not established,
+ *          or the number of blocks read successfully
+*/
+int ModBusConnector::write_read_snapshot(std::vector<ModBusRegisterWrite> &writes, const ModBusReadPlan &plan, ModBusSnapshot &snapshot) noexcept
+{
+	try
+	{
+		if (__glibc_unlikely(!plan.ready()))
+		{
+			MODBUS_LOG(error, "ModBusConnector::write_read_snapshot", "the plan should be compiled", nullptr);
+			return -1;
+		}
+		for (auto &write : writes)
+		{
+			write.rc = -1;
+			write.error = ENOTCONN;
+			if (__glibc_unlikely(write.num <= 0 || write.num > MODBUS_MAX_WRITE_REGISTERS || !write.values))
+			{
+				MODBUS_LOG_VALUE(error, "ModBusConnector::write_read_snapshot", "invalid number of registers to write", write.num, nullptr);
+				return -1;
+			}
+		}
+		_reset_snapshot(plan, snapshot);
+		const std::vector<ModBusReadBlock> &blocks = plan.blocks();
+		thread_local std::vector<bool> fused;
+		fused.assign(blocks.size(), false);
+
+		std::lock_guard<std::mutex> lk(modbus_lock); /* acquire lock, lock_guard will auto unlock when out of scope */
+		snapshot.timestamp = std::chrono::system_clock::now();
+		if (!this->is_connected) /* return failure if connection not yet established */
+			return -1;
+
+		int succeeded = 0;
+		int lost = 0; /* errno of a request without response, nothing is sent after it */
+		for (std::size_t w = 0; w < writes.size() && !lost; ++w)
+		{
+			ModBusRegisterWrite &write = writes[w];
+			int partner = this->write_read_fusion ? _fusion_partner(writes, w, plan, fused) : -1;
+			if (partner != -1)
+			{
+				const ModBusReadBlock &block = blocks[partner];
+				int rc = this->write_block(write, &block, snapshot.words.data() + block.offset);
+				if (rc == -1 && errno == EMBXILFUN) /* FC 0x17 not supported, write and read separately */
+				{
+					MODBUS_LOG(info, "ModBusConnector::write_read_snapshot", "the device rejects FC 0x17, writes and reads are sent separately", nullptr);
+					this->write_read_fusion = false;
+				}
+				else
+				{
+					fused[partner] = true;
+					write.rc = rc == -1 ? -1 : write.num;
+					write.error = rc == -1 ? errno : 0;
+					succeeded += rc == block.num;
+					if (!_block_done(snapshot, partner, block.num, rc, errno))
+						lost = errno;
+					continue;
+				}
+			}
+
+			int rc = this->write_block(write, nullptr, nullptr);
+			write.rc = rc;
+			write.error = rc == -1 ? errno : 0;
+			if (rc == -1 && errno < MODBUS_ENOBASE)
+				lost = errno;
+		}
+
+		for (std::size_t i = 0; i < blocks.size() && !lost; ++i)
+		{
+			if (fused[i])
+				continue;
+			int rc = this->read_block(blocks[i], snapshot.words.data() + blocks[i].offset);
+			snapshot.times[i] = this->stamps;
+			succeeded += rc == blocks[i].num;
+			if (!_block_done(snapshot, i, blocks[i].num, rc, errno))
+				lost = errno;
+		}
+
+		if (lost) /* what was not sent fails with the error of the request without response */
+		{
+			for (auto &write : writes)
+				write.error = write.rc == -1 && write.error == ENOTCONN ? lost : write.error;
+			for (std::size_t i = 0; i < blocks.size(); ++i)
+				snapshot.error[i] = snapshot.status[i] == -1 && snapshot.error[i] == ENOTCONN ? lost : snapshot.error[i];
+		}
+		return succeeded;
+	}
+	catch (const std::exception &e) /* catch the exception from acquiring the lock or allocating the buffers */
+	{
+		MODBUS_LOG(error, "ModBusConnector::write_read_snapshot", "caught exception", e.what());
 		return -1;
 	}
 }
 
+/** use FC 0x17 in write_read_snapshot(), on by default and turned off when the device rejects it
+ * \throw: std::system_error if when errors occur, including errors from the
+ *         underlying operating system that would prevent lock from meeting its
+ *         specifications */
+void ModBusConnector::set_write_read_fusion(const bool &enabled)
+{
+	std::lock_guard<std::mutex> lk(modbus_lock); /* acquire lock, lock_guard will auto unlock when out of scope */
+	this->write_read_fusion = enabled;
+}
+
 /** convert a float type value to two holding registers
  * \f the float value to be converted
  * \register0: the first of the registers the float converted to
@@ -539,8 +1630,6 @@ float ModBusConnector::get_float_swap(const std::uint16_t &register0, const std:
 	return modbus_get_float(tmp_values); //libmodbus
 }
 
-inline bool epoll_add(const int &epollfd, const int &socket);
-
 /** constructor for Modbus server
  * \ip: the ip which the server to bind with
  * \port: the port which the server to bind with
@@ -552,6 +1641,7 @@ inline bool epoll_add(const int &epollfd, const int &socket);
 */
 ModBusServer::ModBusServer(const std::string &ip, const int &port, const int &nb_coil_status, const int &nb_input_status,
 						   const int &nb_holding_registers, const int &nb_input_registers)
+	: recorder("server " + ip + ":" + std::to_string(port))
 {
 	this->ctx = modbus_new_tcp(ip.c_str(), port); /* create modbux context */
 	if (!this->ctx)
@@ -618,6 +1708,32 @@ ModBusServer::ModBusServer(const std::string &ip, const int &port, const int &nb
 	memset(this->event_valid, 0, MAX_EPOLL_EVENTS * sizeof(bool)); /* init each bit of event_valid is 0 */
 }
 
+/** constructor for Modbus server whose data areas persist in a memory-mapped file
+ * The areas are created zero-filled, or keep the state of the previous run when the file exists.
+ * \map_file_path: the file backing the data areas, see ModBusMapFile
+ * \policy: when the file is flushed to disk after a write request
+ * \throw: runtime_error when unable to allocate enough memory resources,
+ *         or when the file cannot be used (see ModBusMapFile::ModBusMapFile)
+*/
+ModBusServer::ModBusServer(const std::string &ip, const int &port, const int &nb_coil_status, const int &nb_input_status,
+						   const int &nb_holding_registers, const int &nb_input_registers,
+						   const std::string &map_file_path, const ModBusSyncPolicy &policy)
+	: ModBusServer(ip, port, 0, 0, 0, 0) /* areas are not allocated, they are taken from the file */
+{
+	this->map_file = new ModBusMapFile(map_file_path, nb_coil_status, nb_input_status, nb_holding_registers, nb_input_registers);
+	this->sync_policy = policy;
+
+	/* point the libmodbus mapping at the file */
+	this->mb_mapping->nb_bits = map_file->nb_bits();
+	this->mb_mapping->nb_input_bits = map_file->nb_input_bits();
+	this->mb_mapping->nb_registers = map_file->nb_registers();
+	this->mb_mapping->nb_input_registers = map_file->nb_input_registers();
+	this->mb_mapping->tab_bits = map_file->tab_bits();
+	this->mb_mapping->tab_input_bits = map_file->tab_input_bits();
+	this->mb_mapping->tab_registers = map_file->tab_registers();
+	this->mb_mapping->tab_input_registers = map_file->tab_input_registers();
+}
+
 // default destructor for Modbus server
 ModBusServer::~ModBusServer()
 {
@@ -631,15 +1747,12 @@ ModBusServer::~ModBusServer()
 			if (__glibc_unlikely(epoll_ctl(this->epollfd, EPOLL_CTL_DEL, sock, NULL) == -1))
 			{
 				/* sanity check */
-				std::cerr << "[ModBusServer::process] removing socket " << sock
-						  << " from epoll interest list fails, "
-						  << strerror(errno) << std::endl;
+				MODBUS_LOG_VALUE(error, "ModBusServer::~ModBusServer", "removing from epoll interest list fails, socket", sock, strerror(errno));
 			}
 			if (__glibc_unlikely(close(sock) == -1)) /* close all active sockets */
 			{
 				/* sanity check, never happen if code is correct */
-				std::cerr << "[ModBusServer::process] closing socket fails when adding to epoll interest list fails, "
-						  << strerror(errno) << std::endl;
+				MODBUS_LOG_VALUE(error, "ModBusServer::~ModBusServer", "closing socket fails", sock, strerror(errno));
 			}
 		}
 		delete active_socket_set;
@@ -651,7 +1764,17 @@ ModBusServer::~ModBusServer()
 	if (epollfd != -1)
 		close(epollfd);
 	if (mb_mapping)
+	{
+		if (map_file) /* the areas belong to the file, don't let libmodbus free them */
+		{
+			mb_mapping->tab_bits = nullptr;
+			mb_mapping->tab_input_bits = nullptr;
+			mb_mapping->tab_registers = nullptr;
+			mb_mapping->tab_input_registers = nullptr;
+		}
 		modbus_mapping_free(mb_mapping);
+	}
+	delete map_file;
 	if (ctx)
 		modbus_free(ctx);
 }
@@ -691,6 +1814,25 @@ void ModBusServer::listen(const int &max_number_pending_connection)
 	}
 }
 
+/** serve requests on an already connected stream socket
+ * The socket is handled like an accepted connection and closed by the server, e.g. one end of a
+ * socketpair() to drive the server in memory, or a connection accepted by the application itself.
+ * \socket: a connected stream socket
+ * \throw: runtime_error when unable to add the socket to the epoll interest list or it is already served
+ */
+void ModBusServer::attach(const int &socket)
+{
+	if (!active_socket_set->insert(socket).second)
+	{
+		throw std::runtime_error("[ModBusServer::attach]Socket " + std::to_string(socket) + " is already served");
+	}
+	if (__glibc_unlikely(!epoll_add(this->epollfd, socket)))
+	{
+		active_socket_set->erase(socket);
+		throw std::runtime_error("[ModBusServer::attach]Unable to add the socket (epoll_ctl): " + std::string(strerror(errno)));
+	}
+}
+
 /** wait for client to connect, blocking until a connection is ready for ModBusServer::receive()
  * // TODO: add a timeout for it
  * \return the number of connections ready for ModBusServer::receive()
@@ -771,8 +1913,7 @@ bool ModBusServer::process(const int &index)
 			auto tmp_error = errno;
 			if (__glibc_unlikely(close(new_sock) == -1)) /* sanity check, never happen if code is correct */
 			{
-				std::cerr << "[ModBusServer::process] closing socket fails when adding to epoll interest list fails, "
-						  << strerror(errno) << std::endl;
+				MODBUS_LOG_VALUE(error, "ModBusServer::process", "closing socket fails when adding to epoll interest list fails, socket", new_sock, strerror(errno));
 				errno = tmp_error;
 			}
 			throw std::runtime_error("[ModBusServer::process]Unable to accept new incoming connection (epoll_ctl): " + std::string(strerror(errno)));
@@ -783,8 +1924,7 @@ bool ModBusServer::process(const int &index)
 			/* insert fails due to duplicate key */
 			if (__glibc_unlikely(close(new_sock) == -1)) /* sanity check, never happen if code is correct */
 			{
-				std::cerr << "[ModBusServer::process] closing socket fails when duplicate socket number found, "
-						  << strerror(errno) << std::endl;
+				MODBUS_LOG_VALUE(error, "ModBusServer::process", "closing socket fails when duplicate socket number found, socket", new_sock, strerror(errno));
 			}
 			throw std::runtime_error("[ModBusServer::process]uplicate socket number found: " + std::to_string(new_sock));
 		}
@@ -796,14 +1936,47 @@ bool ModBusServer::process(const int &index)
 		modbus_set_socket(ctx, events[index].data.fd);
 
 		/* call libmodbus to receive modbus query */
+		MODBUSCPP_TRACE_START(trace_start, server_reply);
+		const std::uint64_t record_start = ModBusFlightRecorder::now();
 		int rc = modbus_receive(ctx, query);
 		if (rc > 0)
 		{
-			/* call libmodbus to reply the query */
-			modbus_reply(ctx, query, rc, mb_mapping);
+			const int offset = modbus_get_header_length(ctx);
+			MODBUSCPP_PROBE4(server_receive, events[index].data.fd, (query[0] << 8) | query[1], query[offset], rc);
+			MODBUSCPP_PROBE5(server_dispatch, events[index].data.fd, (query[0] << 8) | query[1], query[offset],
+							 (query[offset + 1] << 8) | query[offset + 2], (query[offset + 3] << 8) | query[offset + 4]);
+
+			/* call libmodbus to reply the query; requests are served one at a time from this thread and
+			   the areas are written by this server alone, so a mask write cannot race with another writer */
+			int reply_rc = modbus_reply(ctx, query, rc, mb_mapping);
+			MODBUSCPP_PROBE5(server_reply, events[index].data.fd, (query[0] << 8) | query[1], query[offset],
+							 reply_rc, MODBUSCPP_TRACE_ELAPSED(trace_start));
+			int record_addr, record_count;
+			_request_range(query + offset, record_addr, record_count);
+			recorder.record(record_start, query[offset - 1], query[offset], record_addr, record_count, reply_rc,
+							reply_rc == -1 ? errno : 0, events[index].data.fd, (query[0] << 8) | query[1]);
+
+			if (map_file && sync_policy != ModBusSyncPolicy::none)
+			{
+				/* flush the file after requests that may have changed the areas */
+				switch (query[offset])
+				{
+				case _FC_WRITE_SINGLE_COIL:
+				case _FC_WRITE_SINGLE_REGISTER:
+				case _FC_WRITE_MULTIPLE_COILS:
+				case _FC_WRITE_MULTIPLE_REGISTERS:
+				case _FC_MASK_WRITE_REGISTER:
+				case _FC_WRITE_AND_READ_REGISTERS:
+					map_file->sync(sync_policy);
+					break;
+				default:
+					break;
+				}
+			}
 		}
 		else if (rc == -1) /* connection failure or reset by peer */
 		{
+			recorder.record(record_start, 0, 0, 0, 0, rc, errno, events[index].data.fd);
 			/* Remove from epoll interest list */
 			epoll_ctl(this->epollfd, EPOLL_CTL_DEL, events[index].data.fd, &events[index]);
 			/* close socket */
@@ -816,19 +1989,27 @@ bool ModBusServer::process(const int &index)
 
 		if (__glibc_unlikely(!rc)) /* sanity check, not possible as stated by the doc file of libmodbus*/
 		{
-			std::cerr << " ModBusServer::process: rc == 0!" << std::endl;
+			MODBUS_LOG(error, "ModBusServer::process", "rc == 0!", nullptr);
 		}
 		this->event_valid[index] = false;
 		return false;
 	}
 }
 
+/** the last transactions of every client of the server
+ * Safe to read from any thread, see ModBusFlightRecorder::transactions()
+ */
+const ModBusFlightRecorder &ModBusServer::flight_recorder() const noexcept
+{
+	return this->recorder;
+}
+
 /** add socket to the interest list of epoll instance
  * \epollfd: the epollfd file descriptor
  * \socket: the socket to be added
  * \return: true on success, false on failure
 */
-inline bool epoll_add(const int &epollfd, const int &socket)
+bool epoll_add(const int &epollfd, const int &socket)
 {
 	/** Note: epoll_event describes the object linked to the epoll file descriptor
 	 * defined as (epoll.h)
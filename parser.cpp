@@ -1,4 +1,5 @@
 #include "includes/parser.h"
+#include "includes/logger.h"
 
 /* Put varable into map
  * name: varable name
@@ -15,14 +16,252 @@ inline bool _store_params(const std::string &name, const std::string &type, cons
 {
 	// duplicate name found
 	bool ret = data_map.find(name) != data_map.end();
-	data_map.emplace(std::piecewise_construct,
-					 std::forward_as_tuple(name),
-					 std::forward_as_tuple(std::piecewise_construct,
-										   std::forward_as_tuple(type),
-										   std::forward_as_tuple(var_addr, var_addr + 2)));
+	data_map[name] = std::make_pair(type, std::vector<int>(var_addr, var_addr + 2));
 	return ret;
 }
 
+/* name of the data type as written in the config file */
+const char *ModbusTagFormat::type_name(const ModbusDataType &type) noexcept
+{
+	switch (type)
+	{
+	case ModbusDataType::int16:
+		return "int16";
+	case ModbusDataType::uint16:
+		return "uint16";
+	case ModbusDataType::int32:
+		return "int32";
+	case ModbusDataType::float32:
+		return "float32";
+	case ModbusDataType::bitfield:
+		return "bitfield";
+	default:
+		return "raw";
+	}
+}
+
+/* Parse the optional annotations following NUMBER_OF_OBJECTS of a register-type varable
+ * ss: the line stream positioned after NUMBER_OF_OBJECTS
+ * num: the number of registers this varable takes
+ * format: the annotations parsed, unannotated fields keep their default
+ * return false if an annotation is unknown or malformed, or 32-bit values don't fit num
+ */
+inline bool _parse_format(std::stringstream &ss, const int &num, ModbusTagFormat &format)
+{
+	std::string token;
+	while (ss >> token)
+	{
+		if (token[0] == '#') //rest of the line is comment
+			break;
+
+		std::size_t pos = token.find('=');
+		if (pos == std::string::npos)
+			return false;
+
+		std::string key = token.substr(0, pos);
+		std::string value = token.substr(pos + 1);
+
+		if (key == "type")
+		{
+			if (value == "int16")
+				format.type = ModbusDataType::int16;
+			else if (value == "uint16")
+				format.type = ModbusDataType::uint16;
+			else if (value == "int32")
+				format.type = ModbusDataType::int32;
+			else if (value == "float32")
+				format.type = ModbusDataType::float32;
+			else if (value == "bitfield")
+				format.type = ModbusDataType::bitfield;
+			else
+				return false;
+		}
+		else if (key == "order")
+		{
+			if (value == "cdab")
+				format.order = ModbusWordOrder::cdab;
+			else if (value == "abcd")
+				format.order = ModbusWordOrder::abcd;
+			else
+				return false;
+		}
+		else if (key == "scale" || key == "offset")
+		{
+			char *end = nullptr;
+			double real = std::strtod(value.c_str(), &end);
+			if (value.empty() || *end != '\0')
+				return false;
+			(key == "scale" ? format.scale : format.offset) = real;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	// 32-bit values take two registers each
+	if ((format.type == ModbusDataType::int32 || format.type == ModbusDataType::float32) && num % 2)
+		return false;
+	return true;
+}
+
+/* Parse a varable line and put the varable into the maps of its device
+ * item: the first word of the line, i.e. the object type
+ * ss: the line stream positioned after the object type
+ * config_file, line: used in error messages
+ * data_map, format_map: the varables of the device the line belongs to
+ * return false if item is not an object type
+ * Exception: Configuration file parsing failed.
+ */
+inline bool _parse_variable(const std::string &item, std::stringstream &ss, const std::string &config_file, const std::string &line,
+							std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map,
+							std::unordered_map<std::string, ModbusTagFormat> &format_map)
+{
+	std::string name;
+
+	if (item == "coil") //coil type
+	{
+		int coils_addr[2];
+		//coils_addr[0]: start address
+		//coils_addr[1]: number of values
+		ss >> name >> coils_addr[0] >> coils_addr[1];
+
+		if (!ss || coils_addr[0] < 1 || coils_addr[1] < 1)
+		{
+			std::cerr << "CnfPrsr: The data parameters are not correct! "
+											   << "CnfPrsr: FORMAT: coil NAME START_ADDR NUMBER_OF_VALUES" << std::endl;
+			throw std::runtime_error("CnfPrsr: Configuration file parsing failed. " + config_file + ":" + line);
+		}
+
+		coils_addr[0]--; //convert PLC address space mapping to true address space
+						 //e.g In PLC, address 1-999 -----> true address 0-998
+
+		format_map[name] = ModbusTagFormat(); //store the annotations of the varable
+
+		//put varable into map, return true if duplicate found
+		if (_store_params(name, "coil", coils_addr, data_map))
+			MODBUS_LOG(warning, "ModbusConfigParser::parse", "Duplicate variable found, stored value will be replaced by this",
+					   config_file + ":" + line);
+	}
+	else if (item == "inputbit") //discrete input
+	{
+		int inputbits_addr[2];
+		//inputbits_addr[0]: start address
+		//inputbits_addr[1]: number of values
+		ss >> name >> inputbits_addr[0] >> inputbits_addr[1];
+
+		if (!ss || inputbits_addr[0] < 1 || inputbits_addr[1] < 1)
+		{
+			std::cerr << "CnfPrsr: The data parameters are not correct! "
+											   << "FORMAT: inputbit NAME START_ADDR NUMBER_OF_VALUES" << std::endl;
+			throw std::runtime_error("CnfPrsr: Configuration file parsing failed. " + config_file + ":" + line);
+		}
+
+		inputbits_addr[0]--; //convert PLC address space mapping to true address space
+							 //e.g In PLC, address 1-999 -----> true address 0-998
+
+		format_map[name] = ModbusTagFormat(); //store the annotations of the varable
+
+		//put varable into map, return true if duplicate found
+		if (_store_params(name, "input_bit", inputbits_addr, data_map))
+			MODBUS_LOG(warning, "ModbusConfigParser::parse", "Duplicate variable found, stored value will be replaced by this",
+					   config_file + ":" + line);
+	}
+	else if (item == "register") //holding register
+	{
+		int registers_addr[2];
+		//registers_addr[0]: start address
+		//registers_addr[1]: number of values
+		ss >> name >> registers_addr[0] >> registers_addr[1];
+
+		if (!ss || registers_addr[0] < 1 || registers_addr[1] < 1)
+		{
+			std::cerr << "CnfPrsr: The data parameters are not correct! "
+											   << "FORMAT: register NAME START_ADDR NUMBER_OF_VALUES" << std::endl;
+			throw std::runtime_error("CnfPrsr: Configuration file parsing failed. " + config_file + ":" + line);
+		}
+
+		ModbusTagFormat format;
+		if (!_parse_format(ss, registers_addr[1], format))
+		{
+			std::cerr << "CnfPrsr: The data annotations are not correct! "
+											   << "FORMAT: register NAME START_ADDR NUMBER_OF_VALUES "
+											   << "[type=TYPE] [order=ORDER] [scale=REAL] [offset=REAL]" << std::endl;
+			throw std::runtime_error("CnfPrsr: Configuration file parsing failed. " + config_file + ":" + line);
+		}
+
+		registers_addr[0]--; //convert PLC address space mapping to true address space
+							 //e.g In PLC, address 1-999 -----> true address 0-998
+
+		format_map[name] = format; //store the annotations of the varable
+
+		//put varable into map, return true if duplicate found
+		if (_store_params(name, "holding_register", registers_addr, data_map))
+			MODBUS_LOG(warning, "ModbusConfigParser::parse", "Duplicate variable found, stored value will be replaced by this",
+					   config_file + ":" + line);
+	}
+	else if (item == "inputreg") //input registers
+	{
+		int inputregs_addr[2];
+		//inputregs_addr[0]: start address
+		//inputregs_addr[1]: number of values
+		ss >> name >> inputregs_addr[0] >> inputregs_addr[1];
+
+		if (!ss || inputregs_addr[0] < 1 || inputregs_addr[1] < 1)
+		{
+			std::cerr << "CnfPrsr: The data parameters are not correct! "
+											   << "FORMAT: coil NAME START_ADDR NUMBER_OF_VALUES" << std::endl;
+			throw std::runtime_error("CnfPrsr: Configuration file parsing failed. " + config_file + ":" + line);
+		}
+
+		ModbusTagFormat format;
+		if (!_parse_format(ss, inputregs_addr[1], format))
+		{
+			std::cerr << "CnfPrsr: The data annotations are not correct! "
+											   << "FORMAT: inputreg NAME START_ADDR NUMBER_OF_VALUES "
+											   << "[type=TYPE] [order=ORDER] [scale=REAL] [offset=REAL]" << std::endl;
+			throw std::runtime_error("CnfPrsr: Configuration file parsing failed. " + config_file + ":" + line);
+		}
+
+		inputregs_addr[0]--; //convert PLC address space mapping to true address space
+							 //e.g In PLC, address 1-999 -----> true address 0-998
+
+		format_map[name] = format; //store the annotations of the varable
+
+		//put varable into map, return true if duplicate found
+		if (_store_params(name, "input_register", inputregs_addr, data_map))
+			MODBUS_LOG(warning, "ModbusConfigParser::parse", "Duplicate variable found, stored value will be replaced by this",
+					   config_file + ":" + line);
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+/* Parse the connection parameters of a device
+ * ss: the line stream positioned after connection_params or the device name
+ * device: the device to configure
+ * return false if the parameters are missing or out of range
+ */
+inline bool _parse_connection(std::stringstream &ss, ModbusDeviceConfig &device)
+{
+	if (!(ss >> device.ip >> device.port))
+		return false;
+
+	int value;
+	if (ss >> value) //optional communication period
+	{
+		device.period = value;
+		if (ss >> value) //optional unit id
+			device.unit_id = value;
+	}
+
+	return device.port > 0 && device.port < 65536 && device.period > 0 &&
+		   device.unit_id >= 0 && device.unit_id <= 255;
+}
+
 /**Parse modbus connection parameters
  * config_file: configuration file name
  * ip: modbus server ip address
@@ -32,12 +271,56 @@ inline bool _store_params(const std::string &name, const std::string &type, cons
  */
 void ModbusConfigParser::parse(const std::string &config_file, std::string &ip, int &port,
 							   std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map)
+{
+	std::unordered_map<std::string, ModbusTagFormat> format_map; //annotations are discarded
+	parse(config_file, ip, port, data_map, format_map);
+}
+
+/**Parse modbus connection parameters and the annotations of each varable
+ * format_map: the annotations of each varable, varables without annotations get the default format
+ * Exception: Configuration file parsing failed/Configuration file cannot be opened/
+ *            the configuration file defines more than one device.
+ */
+void ModbusConfigParser::parse(const std::string &config_file, std::string &ip, int &port,
+							   std::unordered_map<std::string, std::pair<std::string, std::vector<int>>> &data_map,
+							   std::unordered_map<std::string, ModbusTagFormat> &format_map)
+{
+	std::vector<ModbusDeviceConfig> devices;
+	parse(config_file, devices);
+
+	if (devices.size() > 1)
+	{
+		std::cerr << "CnfPrsr: The config file " << config_file << " defines " << devices.size()
+				  << " devices, but only one device is supported by this client" << std::endl;
+		throw std::runtime_error("CnfPrsr: Configuration file defines more than one device. " + config_file);
+	}
+
+	if (devices.empty())
+		return;
+
+	if (!devices[0].ip.empty()) //connection parameters given
+	{
+		ip = devices[0].ip;
+		port = devices[0].port;
+	}
+	data_map.insert(devices[0].data_map.begin(), devices[0].data_map.end());
+	format_map.insert(devices[0].format_map.begin(), devices[0].format_map.end());
+}
+
+/**Parse the connection parameters and varables of every device
+ * A single connection_params line and the varables following it define the default device,
+ * every "device" line starts a new device owning the varables that follow it.
+ * devices: the parsed devices, in order of appearance
+ * Exception: Configuration file parsing failed/Configuration file cannot be opened.
+ */
+void ModbusConfigParser::parse(const std::string &config_file, std::vector<ModbusDeviceConfig> &devices)
 {
 	std::ifstream ifs(config_file); //open config file
 
 	if (ifs.is_open())
 	{
 		std::string line;
+		bool has_default = false; //connection_params line found
 		while (std::getline(ifs, line)) //read line
 		{
 			if (line.empty()) // skip empty line
@@ -46,122 +329,62 @@ void ModbusConfigParser::parse(const std::string &config_file, std::string &ip,
 			}
 
 			std::stringstream ss(line); //read line into stream
-			std::string item, name;
+			std::string item;
 
 			if (!(ss >> item) || !item.size() || item[0] == '#') //skip line begining with #
 			{
 				continue;
 			}
 
-			if (item == "connection_params") //connection parameters, server ip and port
+			if (item == "connection_params") //connection parameters of the default device
 			{
-				ss >> ip >> port;
-				if (!ss)
+				if (has_default || (!devices.empty() && devices[0].name != "default"))
 				{
-					std::cerr << "CnfPrsr: The connection parameters are not correct! "
-													   << "CnfPrsr: FORMAT: connection_params IP_ADDRESS PORT SENDING_RATE"
-													   << std::endl;
-					ip = "";
-					port = 0;
+					std::cerr << "CnfPrsr: Only one connection_params line is allowed, before any device line, "
+							  << "use device blocks to define several servers" << std::endl;
 					throw std::runtime_error("CnfPrsr: Configuration file parsing failed. " + config_file + ":" + line);
 				}
-			}
-			else if (item == "coil") //coil type
-			{
-				int coils_addr[2];
-				//coils_addr[0]: start address
-				//coils_addr[1]: number of values
-				ss >> name >> coils_addr[0] >> coils_addr[1];
+				has_default = true;
 
-				if (!ss || coils_addr[0] < 1 || coils_addr[1] < 1)
+				if (devices.empty())
+					devices.emplace_back();
+				if (!_parse_connection(ss, devices[0]))
 				{
-					std::cerr << "CnfPrsr: The data parameters are not correct! "
-													   << "CnfPrsr: FORMAT: coil NAME START_ADDR NUMBER_OF_VALUES" << std::endl;
+					std::cerr << "CnfPrsr: The connection parameters are not correct! "
+													   << "CnfPrsr: FORMAT: connection_params IP_ADDRESS PORT SENDING_RATE [UNIT_ID]"
+													   << std::endl;
 					throw std::runtime_error("CnfPrsr: Configuration file parsing failed. " + config_file + ":" + line);
 				}
-
-				coils_addr[0]--; //convert PLC address space mapping to true address space
-								 //e.g In PLC, address 1-999 -----> true address 0-998
-
-				//put varable into map, return true if duplicate found
-				if (_store_params(name, "coil", coils_addr, data_map))
-					std::cerr << "confparser: Warning! Duplicate variable found, "
-													   << "stored value will be replaced by this. "
-													   << config_file << ":" << line << std::endl;
 			}
-			else if (item == "inputbit") //discrete input
+			else if (item == "device") //start of a device block
 			{
-				int inputbits_addr[2];
-				//inputbits_addr[0]: start address
-				//inputbits_addr[1]: number of values
-				ss >> name >> inputbits_addr[0] >> inputbits_addr[1];
-
-				if (!ss || inputbits_addr[0] < 1 || inputbits_addr[1] < 1)
+				ModbusDeviceConfig device;
+				if (!(ss >> device.name) || !_parse_connection(ss, device))
 				{
-					std::cerr << "CnfPrsr: The data parameters are not correct! "
-													   << "FORMAT: inputbit NAME START_ADDR NUMBER_OF_VALUES" << std::endl;
+					std::cerr << "CnfPrsr: The device parameters are not correct! "
+							  << "CnfPrsr: FORMAT: device NAME IP_ADDRESS PORT SENDING_RATE [UNIT_ID]" << std::endl;
 					throw std::runtime_error("CnfPrsr: Configuration file parsing failed. " + config_file + ":" + line);
 				}
-
-				inputbits_addr[0]--; //convert PLC address space mapping to true address space
-									 //e.g In PLC, address 1-999 -----> true address 0-998
-
-				//put varable into map, return true if duplicate found
-				if (_store_params(name, "input_bit", inputbits_addr, data_map))
-					std::cerr << "confparser: Warning! Duplicate variable found, "
-													   << "stored value will be replaced by this. "
-													   << config_file << ":" << line << std::endl;
-			}
-			else if (item == "register") //holding register
-			{
-				int registers_addr[2];
-				//registers_addr[0]: start address
-				//registers_addr[1]: number of values
-				ss >> name >> registers_addr[0] >> registers_addr[1];
-
-				if (!ss || registers_addr[0] < 1 || registers_addr[1] < 1)
+				for (auto &x : devices)
 				{
-					std::cerr << "CnfPrsr: The data parameters are not correct! "
-													   << "FORMAT: register NAME START_ADDR NUMBER_OF_VALUES" << std::endl;
-					throw std::runtime_error("CnfPrsr: Configuration file parsing failed. " + config_file + ":" + line);
+					if (x.name == device.name)
+					{
+						std::cerr << "CnfPrsr: Duplicate device name " << device.name << std::endl;
+						throw std::runtime_error("CnfPrsr: Configuration file parsing failed. " + config_file + ":" + line);
+					}
 				}
-
-				registers_addr[0]--; //convert PLC address space mapping to true address space
-									 //e.g In PLC, address 1-999 -----> true address 0-998
-
-				//put varable into map, return true if duplicate found
-				if (_store_params(name, "holding_register", registers_addr, data_map))
-					std::cerr << "confparser: Warning! Duplicate variable found, "
-													   << "stored value will be replaced by this. "
-													   << config_file << ":" << line << std::endl;
+				devices.push_back(std::move(device));
 			}
-			else if (item == "inputreg") //input registers
+			else
 			{
-				int inputregs_addr[2];
-				//inputregs_addr[0]: start address
-				//inputregs_addr[1]: number of values
-				ss >> name >> inputregs_addr[0] >> inputregs_addr[1];
+				if (devices.empty()) //varables before any device belong to the default device
+					devices.emplace_back();
 
-				if (!ss || inputregs_addr[0] < 1 || inputregs_addr[1] < 1)
+				if (!_parse_variable(item, ss, config_file, line, devices.back().data_map, devices.back().format_map))
 				{
-					std::cerr << "CnfPrsr: The data parameters are not correct! "
-													   << "FORMAT: coil NAME START_ADDR NUMBER_OF_VALUES" << std::endl;
+					std::cerr << "CnfPrsr: failed to parse config file in line: " << line << std::endl;
 					throw std::runtime_error("CnfPrsr: Configuration file parsing failed. " + config_file + ":" + line);
 				}
-
-				inputregs_addr[0]--; //convert PLC address space mapping to true address space
-									 //e.g In PLC, address 1-999 -----> true address 0-998
-
-				//put varable into map, return true if duplicate found
-				if (_store_params(name, "input_register", inputregs_addr, data_map))
-					std::cerr << "confparser: Warning! Duplicate variable found, "
-													   << "stored value will be replaced by this. "
-													   << config_file << ":" << line << std::endl;
-			}
-			else
-			{
-				std::cerr << "CnfPrsr: failed to parse config file in line: " << line << std::endl;
-				throw std::runtime_error("CnfPrsr: Configuration file parsing failed. " + config_file + ":" + line);
 			}
 		} // while
 		ifs.close();
@@ -0,0 +1,485 @@
+/*
+ * poller.cpp
+ *
+ * Description:
+ * Concurrent cyclic polling of several modbus servers.
+ *
+ */
+
+#include "includes/poller.h"
+#include "includes/logger.h"
+#include "includes/allocguard.h"
+#include <algorithm>
+#include <cstring>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+/* runtime state of one device */
+struct ModBusPoller::Device
+{
+	ModbusDeviceConfig config;
+	ModBusConnector conn;
+	std::vector<ModbusDecoder> decoders{}; /* decoder of each register-type varable, same order as scan.tags */
+	ModBusReadPlan plan{};				   /* reads of a scan, range i being scan.tags[i] */
+	ModBusSnapshot snapshot{};			   /* raw values of the last scan */
+	std::unique_ptr<ModBusScanLog> log{};  /* ring file the snapshots are recorded to, if any */
+	std::unique_ptr<ModBusHistorian> historian{}; /* archive the values are appended to, if any */
+	ModBusScan scan{};
+	std::thread thread{};
+	std::mutex stats_lock{};
+	ModBusCycleStats stats{}; /* under stats_lock */
+
+	Device(const ModbusDeviceConfig &device_config, const std::size_t &index)
+		: config(device_config), conn(device_config.ip, device_config.port)
+	{
+		conn.set_unit_id(config.unit_id);
+
+		scan.device = index;
+		scan.config = &config;
+		for (auto &x : config.data_map)
+		{
+			ModBusTagValues tag;
+			tag.name = x.first;
+			tag.type = x.second.first;
+			tag.addr = x.second.second[0];
+			tag.num = x.second.second[1];
+			scan.tags.push_back(tag);
+		}
+		/* deterministic order: by object type, then by address */
+		std::sort(scan.tags.begin(), scan.tags.end(), [](const ModBusTagValues &a, const ModBusTagValues &b) {
+			return a.type != b.type ? a.type < b.type : a.addr < b.addr;
+		});
+
+		for (auto &tag : scan.tags)
+		{
+			ModbusDecoder decoder;
+			auto format = config.format_map.find(tag.name);
+			decoder.add(format != config.format_map.end() ? format->second : ModbusTagFormat(), 0, tag.num);
+			bool is_register = tag.type == "holding_register" || tag.type == "input_register";
+			tag.values.assign(is_register ? decoder.size() : tag.num, 0.0);
+			decoders.push_back(decoder);
+			plan.add(tag.type == "coil" ? ModBusArea::coils : tag.type == "input_bit" ? ModBusArea::input_bits
+														   : tag.type == "holding_register" ? ModBusArea::holding_registers
+																						   : ModBusArea::input_registers,
+					 tag.addr, tag.num);
+		}
+		plan.compile(); /* adjacent varables are read together */
+
+		/* sized once, so that read_snapshot() never allocates */
+		snapshot.words.resize(plan.words());
+		snapshot.status.resize(plan.blocks().size());
+		snapshot.error.resize(plan.blocks().size());
+		snapshot.times.resize(plan.blocks().size());
+	}
+};
+
+/** create the runtime state of every device
+ * \configs: the devices to poll, as returned by ModbusConfigParser::parse
+ * \throw: runtime_error when a connection context cannot be allocated, a unit id is invalid
+ *         or a varable is larger than a single request can read
+ */
+ModBusPoller::ModBusPoller(const std::vector<ModbusDeviceConfig> &configs)
+{
+	for (std::size_t i = 0; i < configs.size(); ++i)
+	{
+		devices.emplace_back(new Device(configs[i], i));
+	}
+}
+
+ModBusPoller::~ModBusPoller()
+{
+	try
+	{
+		stop();
+	}
+	catch (const std::exception &e)
+	{
+		MODBUS_LOG(error, "ModBusPoller::~ModBusPoller", "caught exception", e.what());
+	}
+}
+
+/** set the function called after each scan
+ * The callback runs on the scan thread of the device, so it is called concurrently for
+ * different devices and should return quickly to keep the scan period.
+ * \throw: runtime_error if polling already started
+ */
+void ModBusPoller::set_scan_callback(const std::function<void(const ModBusScan &)> &callback)
+{
+	std::lock_guard<std::mutex> lk(run_lock);
+	if (running)
+	{
+		throw std::runtime_error("[ModBusPoller::set_scan_callback]Cannot change the callback while polling");
+	}
+	on_scan = callback;
+}
+
+/** publish every scan into a shared-memory process image
+ * Local processes open the image with ModBusShmImage(shm_name) to read the values
+ * without their own connection to the devices.
+ * \shm_name: shared memory object name
+ * \throw: runtime_error if polling already started or the segment cannot be created
+ */
+void ModBusPoller::set_process_image(const std::string &shm_name)
+{
+	std::lock_guard<std::mutex> lk(run_lock);
+	if (running)
+	{
+		throw std::runtime_error("[ModBusPoller::set_process_image]Cannot change the process image while polling");
+	}
+
+	std::vector<const ModBusScan *> layouts;
+	for (auto &device : devices)
+		layouts.push_back(&device->scan);
+	image.reset(new ModBusShmImage(shm_name, layouts));
+}
+
+/** record the raw values of every scan into a ring file per device
+ * The files are created, or reopened when they hold the same read plan, and read with
+ * ModBusScanLog(path) while polling goes on, see scandump.run.
+ * \directory: where the files go, named after the devices
+ * \capacity: the number of scans each file keeps
+ * \throw: runtime_error if polling already started or a file cannot be created
+ */
+void ModBusPoller::set_scan_log(const std::string &directory, const std::size_t &capacity)
+{
+	std::lock_guard<std::mutex> lk(run_lock);
+	if (running)
+	{
+		throw std::runtime_error("[ModBusPoller::set_scan_log]Cannot change the scan log while polling");
+	}
+
+	for (auto &device : devices)
+		device->log.reset(new ModBusScanLog(directory + "/" + device->config.name + ".scans", device->plan, capacity));
+}
+
+/** archive the values of every scan into a compressed columnar file per device
+ * The files are created, or appended to when they hold the same varables; the rows are
+ * written a block at a time and on stop().
+ * \directory: where the files go, named after the devices
+ * \throw: runtime_error if polling already started, the real-time mode is set, or a file cannot be created
+ */
+void ModBusPoller::set_historian(const std::string &directory)
+{
+	std::lock_guard<std::mutex> lk(run_lock);
+	if (running)
+	{
+		throw std::runtime_error("[ModBusPoller::set_historian]Cannot change the historian while polling");
+	}
+	if (real_time_mode)
+	{
+		/* the rows grow and full blocks are written from the scan thread */
+		throw std::runtime_error("[ModBusPoller::set_historian]A historian cannot be used in real-time mode");
+	}
+
+	for (auto &device : devices)
+		device->historian.reset(new ModBusHistorian(directory + "/" + device->config.name + ".hist", device->scan));
+}
+
+/** run the scan threads in real time from the next start()
+ * On start(), the pages of the process are locked in memory, freed heap memory is no longer given
+ * back to the system, and each scan thread is pinned to its CPU and scheduled SCHED_FIFO as asked.
+ * Every buffer of a scan is allocated when the poller is made; from its second scan on, the heap
+ * allocations of each scan thread are counted in cycle_stats() and the first one logged.
+ * \throw: runtime_error if polling already started, a historian is set, or a CPU or the priority is out of range
+ */
+void ModBusPoller::set_real_time(const ModBusRealTime &options)
+{
+	std::lock_guard<std::mutex> lk(run_lock);
+	if (running)
+	{
+		throw std::runtime_error("[ModBusPoller::set_real_time]Cannot change the real-time mode while polling");
+	}
+	for (auto &device : devices)
+	{
+		if (device->historian)
+		{
+			throw std::runtime_error("[ModBusPoller::set_real_time]The real-time mode cannot be used with a historian");
+		}
+	}
+	for (auto &cpu : options.cpus)
+	{
+		if (cpu < 0 || cpu >= CPU_SETSIZE)
+		{
+			throw std::runtime_error("[ModBusPoller::set_real_time]Invalid CPU " + std::to_string(cpu));
+		}
+	}
+	if (options.priority < 0 || options.priority > sched_get_priority_max(SCHED_FIFO))
+	{
+		throw std::runtime_error("[ModBusPoller::set_real_time]Invalid priority " + std::to_string(options.priority));
+	}
+	real_time_mode = true;
+	real_time = options;
+}
+
+/** pin the calling scan thread to its CPU and set its scheduling policy, as the real-time options say
+ * \throw: runtime_error if the CPU or the policy cannot be set
+ */
+static void _apply_real_time(const ModBusRealTime &options, const std::size_t &index)
+{
+	if (!options.cpus.empty())
+	{
+		const int cpu = options.cpus[index % options.cpus.size()];
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (rc != 0)
+		{
+			throw std::runtime_error("[ModBusPoller::start]Unable to pin a scan thread to CPU " + std::to_string(cpu) + ": " + strerror(rc));
+		}
+	}
+	if (options.priority > 0)
+	{
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = options.priority;
+		int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (rc != 0)
+		{
+			throw std::runtime_error("[ModBusPoller::start]Unable to schedule a scan thread SCHED_FIFO: " + std::string(strerror(rc)));
+		}
+	}
+}
+
+/** start one scan thread per device
+ * Each thread applies the real-time mode to itself before its first scan, and the next one is
+ * started once it did.
+ * \throw: runtime_error if polling already started, or the real-time mode cannot be applied
+ *         std::system_error if a thread cannot be started
+ */
+void ModBusPoller::start()
+{
+	{
+		std::lock_guard<std::mutex> lk(run_lock);
+		if (running)
+		{
+			throw std::runtime_error("[ModBusPoller::start]Already polling");
+		}
+		if (real_time_mode && real_time.lock_memory)
+		{
+			/* freed memory stays in the heap, locked, instead of being faulted in again later */
+			mallopt(M_TRIM_THRESHOLD, -1);
+			mallopt(M_MMAP_MAX, 0);
+			/* the stacks of the threads started from now on are locked as well */
+			if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+			{
+				throw std::runtime_error("[ModBusPoller::start]Unable to lock memory: " + std::string(strerror(errno)));
+			}
+		}
+		running = true;
+	}
+
+	try
+	{
+		for (auto &device : devices)
+		{
+			std::promise<void> started;
+			std::future<void> ready = started.get_future();
+			device->thread = std::thread(&ModBusPoller::run, this, std::ref(*device), std::move(started));
+			ready.get(); /* rethrows the failure of the thread, which then returned */
+		}
+	}
+	catch (...)
+	{
+		stop(); /* join the threads already started, no scan thread is left running */
+		throw;
+	}
+}
+
+/** stop and join all scan threads, the connections are closed and the archived rows written
+ * \throw: std::system_error if a thread cannot be joined
+ *         runtime_error if a historian cannot write its rows
+ */
+void ModBusPoller::stop()
+{
+	{
+		std::lock_guard<std::mutex> lk(run_lock);
+		running = false;
+	}
+	run_cv.notify_all();
+
+	for (auto &device : devices)
+	{
+		if (device->thread.joinable())
+			device->thread.join();
+		device->conn.disconnect();
+		if (device->historian)
+			device->historian->flush();
+	}
+}
+
+/* the number of devices */
+std::size_t ModBusPoller::size() const noexcept
+{
+	return devices.size();
+}
+
+/** the cycle statistics of a device, copied while its scan thread waits
+ * \throw: out_of_range for an invalid device
+ *         std::system_error if when errors occur, including errors from the
+ *         underlying operating system that would prevent lock from meeting its
+ *         specifications
+ */
+ModBusCycleStats ModBusPoller::cycle_stats(const std::size_t &device)
+{
+	Device &d = *devices.at(device);
+	std::lock_guard<std::mutex> lk(d.stats_lock);
+	return d.stats;
+}
+
+/** scan thread of a device, scans once every period until stop()
+ * In real-time mode, the thread pins and schedules itself first; started is then made ready, or
+ * given the failure and the thread returns without scanning.
+ * A scan taking longer than the period delays the next one instead of queueing up missed scans.
+ * How late each scan starts is recorded in the jitter histogram of the device.
+ */
+void ModBusPoller::run(Device &device, std::promise<void> started) noexcept
+{
+	try
+	{
+		if (real_time_mode)
+			_apply_real_time(real_time, device.scan.device);
+		ModBusLogger::attach(); /* the log ring of the thread is not allocated by a scan */
+		started.set_value();
+	}
+	catch (...)
+	{
+		started.set_exception(std::current_exception());
+		return;
+	}
+
+	const std::chrono::milliseconds period(device.config.period);
+	auto next = std::chrono::steady_clock::now();
+	bool warned = false; /* of an allocation in real-time mode */
+
+	std::unique_lock<std::mutex> ulk(run_lock);
+	while (running)
+	{
+		ulk.unlock();
+
+		const auto start = std::chrono::steady_clock::now();
+		std::uint64_t allocations;
+		{
+			ModBusAllocationGuard guard;
+			cycle(device);
+			allocations = guard.count();
+		}
+		const auto end = std::chrono::steady_clock::now();
+
+		bool allocated = false;
+		{
+			std::lock_guard<std::mutex> lk(device.stats_lock);
+			ModBusCycleStats &stats = device.stats;
+			stats.jitter.record(std::max<std::int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(start - next).count()));
+			stats.overruns += end > next + period;
+			if (stats.cycles++ > 0 && real_time_mode) /* the first scan connects and sizes the buffers */
+			{
+				stats.allocations += allocations;
+				allocated = allocations != 0;
+			}
+		}
+		if (allocated && !warned)
+		{
+			warned = true;
+			MODBUS_LOG(warning, "ModBusPoller::run", "heap allocation in a real-time scan",
+					   device.config.name + ": " + std::to_string(allocations) + " in scan " + std::to_string(device.scan.sequence));
+		}
+
+		next += period;
+		auto now = std::chrono::steady_clock::now();
+		if (next < now) /* overrun, skip the missed periods */
+			next = now;
+
+		ulk.lock();
+		run_cv.wait_until(ulk, next, [this] { return !running; });
+	}
+}
+
+/** scan a device, then publish, archive and hand the scan to the callback
+ */
+void ModBusPoller::cycle(Device &device) noexcept
+{
+	scan(device);
+	if (image)
+		image->publish(device.scan);
+	if (device.historian)
+	{
+		try
+		{
+			device.historian->append(device.scan);
+		}
+		catch (const std::exception &e)
+		{
+			MODBUS_LOG(error, "ModBusPoller::run", "archiving failed", device.config.name + ": " + e.what());
+		}
+	}
+	if (on_scan)
+	{
+		try
+		{
+			on_scan(device.scan);
+		}
+		catch (const std::exception &e)
+		{
+			MODBUS_LOG(error, "ModBusPoller::run", "scan callback failed", device.config.name + ": " + e.what());
+		}
+	}
+}
+
+/** read and decode every varable of a device once
+ * All varables are read by a single ModBusConnector::read_snapshot() call, adjacent ones in the same request.
+ * The connection is (re)established on demand and dropped when every read of a scan fails,
+ * so that a restarted server is picked up again on the next scan.
+ */
+void ModBusPoller::scan(Device &device) noexcept
+{
+	ModBusScan &scan = device.scan;
+	++scan.sequence;
+	scan.timestamp = std::chrono::system_clock::now();
+
+	for (auto &tag : scan.tags)
+		tag.rc = -1;
+
+	try
+	{
+		device.conn.connect(); /* no-op when connected */
+	}
+	catch (const std::exception &e)
+	{
+		MODBUS_LOG(error, "ModBusPoller::scan", "connection failed", device.config.name + ": " + e.what());
+		return;
+	}
+
+	bool any_success = device.conn.read_snapshot(device.plan, device.snapshot) > 0;
+	if (device.log)
+		device.log->append(device.snapshot); /* failed blocks included, with their errno */
+	if (any_success)
+	{
+		scan.timestamp = device.snapshot.timestamp;
+		for (std::size_t i = 0; i < scan.tags.size(); ++i)
+		{
+			ModBusTagValues &tag = scan.tags[i];
+			if (!device.snapshot.ok(device.plan, i))
+				continue;
+			tag.rc = tag.num;
+			if (tag.type == "holding_register" || tag.type == "input_register")
+				device.decoders[i].decode(device.plan.registers(i, device.snapshot.words), tag.values.data());
+			else
+				std::copy(device.plan.bits(i, device.snapshot.words), device.plan.bits(i, device.snapshot.words) + tag.num, tag.values.begin());
+		}
+	}
+
+	if (!any_success && !scan.tags.empty())
+	{
+		try
+		{
+			device.conn.disconnect(); /* reconnect on the next scan */
+		}
+		catch (const std::exception &e)
+		{
+			MODBUS_LOG(error, "ModBusPoller::scan", "disconnection failed", device.config.name + ": " + e.what());
+		}
+	}
+}
@@ -0,0 +1,87 @@
+#include "includes/poller.h"
+#include <atomic>
+#include <csignal>
+#include <sstream>
+
+static std::atomic<bool> quit(false);
+
+void signal_handle(int)
+{
+    quit = true;
+}
+
+int main(int argc, char **argv)
+{
+    std::signal(SIGINT, signal_handle);
+    /* kill -USR1 <pid> appends the last transactions of every connection to flight_recorder.log */
+    ModBusFlightRecorder::dump_on_signal("flight_recorder.log");
+
+    /* every device block of the config file is polled by this process */
+    std::vector<ModbusDeviceConfig> devices;
+    ModbusConfigParser::parse(argc > 1 ? argv[1] : "./PLC.conf", devices);
+
+    for (auto &device : devices)
+    {
+        std::cout << "device: " << device.name << " ip: " << device.ip << " port: " << device.port
+                  << " unit id: " << device.unit_id << " period: " << device.period << "ms"
+                  << " variables: " << device.data_map.size() << std::endl;
+    }
+
+    ModBusPoller poller(devices);
+
+    /* publish the values for local readers, see imagedump.run */
+    if (argc > 2 && std::string(argv[2]) != "-")
+        poller.set_process_image(argv[2]);
+
+    /* record every scan into DIRECTORY/DEVICE.scans, see scandump.run */
+    if (argc > 3 && std::string(argv[3]) != "-")
+        poller.set_scan_log(argv[3]);
+
+    /* archive the values into DIRECTORY/DEVICE.hist, see histdump.run */
+    if (argc > 4 && std::string(argv[4]) != "-")
+        poller.set_historian(argv[4]);
+
+    /* real-time mode: memory locked, scan threads on the CPUs listed ("-" for any) and SCHED_FIFO if a priority is given */
+    if (argc > 5)
+    {
+        ModBusRealTime options;
+        std::stringstream cpus(std::string(argv[5]) != "-" ? argv[5] : "");
+        std::string cpu;
+        while (std::getline(cpus, cpu, ','))
+            options.cpus.push_back(std::stoi(cpu));
+        if (argc > 6)
+            options.priority = std::stoi(argv[6]);
+        poller.set_real_time(options);
+    }
+
+    /* print a summary line per scan, the callback runs on the scan thread of each device */
+    std::mutex print_lock;
+    poller.set_scan_callback([&print_lock](const ModBusScan &scan) {
+        std::size_t ok = 0;
+        for (auto &tag : scan.tags)
+            ok += tag.rc == tag.num;
+
+        std::lock_guard<std::mutex> lk(print_lock);
+        std::cout << scan.config->name << " scan " << scan.sequence << ": "
+                  << ok << "/" << scan.tags.size() << " variables read" << std::endl;
+    });
+
+    poller.start();
+
+    /* poll until "ctrl+C" */
+    while (!quit)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    poller.stop();
+
+    /* how late the scans started, in microseconds */
+    for (std::size_t i = 0; i < poller.size(); ++i)
+    {
+        ModBusCycleStats stats = poller.cycle_stats(i);
+        std::cout << devices[i].name << ": " << stats.cycles << " scans, " << stats.overruns << " overruns, "
+                  << stats.allocations << " allocations, jitter us p50 " << stats.jitter.percentile(50)
+                  << " p99 " << stats.jitter.percentile(99) << " p99.9 " << stats.jitter.percentile(99.9)
+                  << " max " << stats.jitter.max() << std::endl;
+    }
+    return 0;
+}
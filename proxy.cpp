@@ -0,0 +1,655 @@
+/*
+ * proxy.cpp
+ *
+ * Description:
+ * Modbus TCP proxy multiplexing many downstream clients over a few upstream connections.
+ *
+ */
+
+#include "includes/proxy.h"
+#include "includes/logger.h"
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/* MBAP header: transaction id (2), protocol id (2), length (2), unit id (1) */
+#define MBAP_HEADER_LENGTH 7
+
+/* delay before reconnecting an upstream connection that failed to connect */
+#define UPSTREAM_RETRY_DELAY std::chrono::seconds(1)
+
+/** length of the first complete frame in a receive buffer
+ * \buf: bytes received so far
+ * \return: the frame length, 0 if the frame is not complete yet, -1 if the stream is not modbus TCP
+ */
+inline int _frame_length(const std::vector<std::uint8_t> &buf) noexcept
+{
+	if (buf.size() < MBAP_HEADER_LENGTH)
+		return 0;
+
+	int length = (buf[4] << 8) | buf[5]; /* unit id and PDU */
+	if (buf[2] != 0 || buf[3] != 0 || length < 2 || length > MODBUS_TCP_MAX_ADU_LENGTH - 6)
+		return -1;
+
+	return (int)buf.size() >= 6 + length ? 6 + length : 0;
+}
+
+/** coalescing key of a request
+ * Only reads can be coalesced, they are identical when unit id, function code, address and count match.
+ * \frame: a complete request
+ * \return: the key, empty when the request must not be coalesced
+ */
+inline std::string _read_key(const std::vector<std::uint8_t> &frame)
+{
+	std::uint8_t function = frame[MBAP_HEADER_LENGTH];
+	if (frame.size() != MBAP_HEADER_LENGTH + 5 || function < MODBUS_FC_READ_COILS || function > MODBUS_FC_READ_INPUT_REGISTERS)
+		return std::string();
+	return std::string(frame.begin() + 6, frame.end());
+}
+
+/** constructor for Modbus proxy
+ * \ip, \port: the address downstream clients connect to
+ * \upstream_ip, \upstream_port: the address of the modbus server behind the proxy
+ * \num_upstreams: the maximum number of connections opened to the server, opened on demand
+ *                 and given up after timeout_ms if the server does not accept them
+ * \max_in_flight: the number of requests sent on one upstream connection before its response arrives,
+ *                 1 for servers handling one request at a time
+ * \timeout_ms: time the server has to answer a request before the clients get an exception
+ * \max_queue: the number of requests waiting for a free upstream slot, above which clients get a busy exception
+ * \throw: runtime_error when a parameter is out of range, upstream_ip is not an IPv4 address
+ *         or unable to allocate resources
+ */
+ModBusProxy::ModBusProxy(const std::string &ip, const int &port, const std::string &upstream_ip, const int &upstream_port,
+						 const int &num_upstreams, const int &max_in_flight, const int &timeout_ms, const std::size_t &max_queue)
+	: max_in_flight(max_in_flight), timeout(timeout_ms), max_queue(max_queue)
+{
+	if (num_upstreams < 1 || max_in_flight < 1 || timeout_ms < 1)
+	{
+		throw std::runtime_error("[ModBusProxy::ModBusProxy]num_upstreams, max_in_flight and timeout_ms should be greater than 0");
+	}
+
+	std::memset(&this->upstream_address, 0, sizeof(this->upstream_address));
+	this->upstream_address.sin_family = AF_INET;
+	this->upstream_address.sin_port = htons(upstream_port);
+	if (upstream_port < 0 || upstream_port > 65535 || inet_pton(AF_INET, upstream_ip.c_str(), &this->upstream_address.sin_addr) != 1)
+	{
+		throw std::runtime_error("[ModBusProxy::ModBusProxy]Invalid upstream address: " + upstream_ip + ":" + std::to_string(upstream_port));
+	}
+
+	this->ctx = modbus_new_tcp(ip.c_str(), port); /* create modbux context for listening */
+	if (!this->ctx)
+	{
+		throw std::runtime_error("[ModBusProxy::ModBusProxy]Unable to allocate libmodbus context: " + std::string(modbus_strerror(errno)));
+	}
+
+	this->epollfd = epoll_create1(0);
+	if (__glibc_unlikely(this->epollfd == -1))
+	{
+		modbus_free(this->ctx); /* cleanup on failure */
+		throw std::runtime_error("[ModBusProxy::ModBusProxy]Failed to create epoll: " + std::string(strerror(errno)));
+	}
+
+	this->upstreams.resize(num_upstreams);
+}
+
+ModBusProxy::~ModBusProxy()
+{
+	for (auto &client : clients)
+		close(client.first);
+
+	for (auto &upstream : upstreams)
+	{
+		if (upstream.fd != -1)
+			close(upstream.fd);
+	}
+
+	if (server_socket != -1)
+		close(server_socket);
+	if (epollfd != -1)
+		close(epollfd);
+	if (ctx)
+		modbus_free(ctx);
+}
+
+/** start listening to incoming downstream connections
+ * \max_number_pending_connection: see ModBusServer::listen
+ * \throw: runtime_error when already listening or unable to listen
+ */
+void ModBusProxy::listen(const int &max_number_pending_connection)
+{
+	if (this->server_socket != -1)
+	{
+		throw std::runtime_error("[ModBusProxy::listen]Already start listening to incomming connections!");
+	}
+
+	this->server_socket = modbus_tcp_listen(ctx, max_number_pending_connection);
+	if (this->server_socket == -1)
+	{
+		throw std::runtime_error("[ModBusProxy::listen]Unable to listen TCP connection: " + std::string(modbus_strerror(errno)));
+	}
+
+	if (__glibc_unlikely(!epoll_add(this->epollfd, this->server_socket)))
+	{
+		auto tmp_error = errno;
+		close(this->server_socket);
+		this->server_socket = -1;
+		throw std::runtime_error("[ModBusProxy::listen]Unable to listen TCP connection (epoll_ctl): " + std::string(strerror(tmp_error)));
+	}
+}
+
+/** wait for sockets to be ready
+ * Wakes up at least every 100ms to answer requests the server did not answer in time
+ * and to retry queued requests.
+ * \return: the number of sockets ready for process()
+ * \throw: runtime_error if unable to wait
+ */
+int ModBusProxy::wait()
+{
+	int tick = timeout.count() < 100 ? (int)timeout.count() : 100;
+	this->eventcount = epoll_wait(epollfd, events, MAX_EPOLL_EVENTS, tick);
+	if (this->eventcount == -1)
+	{
+		if (errno != EINTR) /* interrupted by a signal handler is not a fatal error */
+			throw std::runtime_error("[ModBusProxy::wait]Unable to wait for incoming connection: " + std::string(strerror(errno)));
+		this->eventcount = 0;
+	}
+
+	expire();
+	drain();
+	return this->eventcount;
+}
+
+/** handle the [index]th socket returned by wait()
+ * Accepts a new client, forwards the complete requests of a client, or dispatches the
+ * complete responses of an upstream connection.
+ * \index: the index of the selected socket, less than the value returned by wait()
+ * \return: true if a new client connected
+ * \throw: runtime_error when index exceeds the number of ready sockets or unable to accept a new connection
+ */
+bool ModBusProxy::process(const int &index)
+{
+	if (index < 0 || index >= this->eventcount)
+	{
+		throw std::runtime_error("[ModBusProxy::process] index:" + std::to_string(index) + ", this connection is not ready");
+	}
+
+	int fd = events[index].data.fd;
+	if (fd == this->server_socket) /* A client is asking for a new connection */
+	{
+		int new_sock = accept4(this->server_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (new_sock == -1)
+		{
+			throw std::runtime_error("[ModBusProxy::process]Unable to accept new incoming connection: " + std::string(strerror(errno)));
+		}
+		if (__glibc_unlikely(!epoll_add(this->epollfd, new_sock)))
+		{
+			auto tmp_error = errno;
+			close(new_sock);
+			throw std::runtime_error("[ModBusProxy::process]Unable to accept new incoming connection (epoll_ctl): " + std::string(strerror(tmp_error)));
+		}
+		clients[new_sock] = Client{next_client_id++, std::vector<std::uint8_t>()};
+		return true;
+	}
+
+	auto client = clients.find(fd);
+	if (client != clients.end()) /* requests from a client */
+	{
+		const std::uint64_t id = client->second.id;
+		if (!receive(fd, client->second.rx))
+		{
+			drop_client(fd);
+			return false;
+		}
+
+		/* forwarding may drop the client, look it up again for every frame */
+		while ((client = clients.find(fd)) != clients.end() && client->second.id == id)
+		{
+			std::vector<std::uint8_t> &rx = client->second.rx;
+			int length = _frame_length(rx);
+			if (length == 0)
+				break;
+			if (length < 0) /* not modbus TCP */
+			{
+				drop_client(fd);
+				break;
+			}
+
+			std::vector<std::uint8_t> frame(rx.begin(), rx.begin() + length);
+			rx.erase(rx.begin(), rx.begin() + length);
+			++counters.requests;
+			forward(Waiter{fd, id, (std::uint16_t)((frame[0] << 8) | frame[1])}, frame);
+		}
+		return false;
+	}
+
+	for (std::size_t i = 0; i < upstreams.size(); ++i)
+	{
+		if (upstreams[i].fd != fd)
+			continue;
+
+		if (upstreams[i].connecting) /* connect() finished, successfully or not */
+		{
+			complete_upstream(i);
+			break;
+		}
+
+		/* responses from the server */
+		if (!receive(fd, upstreams[i].rx))
+		{
+			fail_upstream(i, MODBUS_EXCEPTION_GATEWAY_TARGET);
+			break;
+		}
+		int length;
+		while (upstreams[i].fd == fd && (length = _frame_length(upstreams[i].rx)) != 0)
+		{
+			if (length < 0)
+			{
+				fail_upstream(i, MODBUS_EXCEPTION_GATEWAY_TARGET);
+				break;
+			}
+			std::vector<std::uint8_t> frame(upstreams[i].rx.begin(), upstreams[i].rx.begin() + length);
+			upstreams[i].rx.erase(upstreams[i].rx.begin(), upstreams[i].rx.begin() + length);
+			respond(i, frame);
+		}
+		drain();
+		break;
+	}
+	return false; /* otherwise a socket closed since wait() returned */
+}
+
+/* counters since construction */
+const ModBusProxyStats &ModBusProxy::stats() const noexcept
+{
+	return counters;
+}
+
+/** read what a non-blocking socket has
+ * \fd: the socket
+ * \buf: the bytes are appended to it
+ * \return: false when the peer closed the connection or the connection failed
+ */
+bool ModBusProxy::receive(const int &fd, std::vector<std::uint8_t> &buf) noexcept
+{
+	std::uint8_t chunk[MODBUS_TCP_MAX_ADU_LENGTH * 4];
+	while (true)
+	{
+		ssize_t n = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+		if (n > 0)
+		{
+			buf.insert(buf.end(), chunk, chunk + n);
+			if ((std::size_t)n < sizeof(chunk))
+				return true;
+			continue;
+		}
+		if (n == 0) /* closed by peer */
+			return false;
+		if (errno == EINTR)
+			continue;
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+}
+
+/** handle one complete request of a client
+ * The request joins an identical read in flight, goes upstream under a transaction id of the proxy,
+ * or waits in the queue when every upstream slot is busy.
+ * \waiter: the client and its transaction id
+ * \frame: the request, its transaction id is rewritten
+ */
+void ModBusProxy::forward(const Waiter &waiter, std::vector<std::uint8_t> &frame)
+{
+	const std::uint8_t unit = frame[6];
+	const std::uint8_t function = frame[MBAP_HEADER_LENGTH];
+	std::string key = _read_key(frame);
+
+	if (!key.empty()) /* identical read in flight */
+	{
+		auto read = reads.find(key);
+		if (read != reads.end())
+		{
+			in_flight[read->second].waiters.push_back(waiter);
+			++counters.coalesced;
+			return;
+		}
+	}
+
+	int upstream = pick_upstream();
+	if (upstream == -1)
+	{
+		if (!reachable()) /* server unreachable */
+			reply_exception(waiter, unit, function, MODBUS_EXCEPTION_GATEWAY_PATH);
+		else if (queue.size() >= max_queue)
+			reply_exception(waiter, unit, function, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+		else
+			queue.push_back(Queued{waiter, frame});
+		return;
+	}
+
+	std::uint16_t tid;
+	do
+	{
+		tid = next_tid++;
+	} while (in_flight.count(tid));
+	frame[0] = tid >> 8;
+	frame[1] = tid & 0xFF;
+
+	if (send(upstreams[upstream].fd, frame.data(), frame.size(), MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)frame.size())
+	{
+		fail_upstream(upstream, MODBUS_EXCEPTION_GATEWAY_TARGET);
+		reply_exception(waiter, unit, function, MODBUS_EXCEPTION_GATEWAY_TARGET);
+		return;
+	}
+
+	InFlight request;
+	request.waiters.push_back(waiter);
+	request.key = key;
+	request.unit = unit;
+	request.function = function;
+	request.upstream = upstream;
+	request.deadline = std::chrono::steady_clock::now() + timeout;
+	in_flight.emplace(tid, std::move(request));
+	if (!key.empty())
+		reads[key] = tid;
+	++upstreams[upstream].in_flight;
+	++counters.upstream_requests;
+}
+
+/** handle one complete response of an upstream connection
+ * \upstream: index of the connection
+ * \frame: the response, sent to every client waiting for it
+ */
+void ModBusProxy::respond(const std::size_t &upstream, std::vector<std::uint8_t> &frame)
+{
+	std::uint16_t tid = (frame[0] << 8) | frame[1];
+	auto it = in_flight.find(tid);
+	if (it == in_flight.end() || it->second.upstream != upstream) /* late response of an expired request */
+		return;
+
+	InFlight request = std::move(it->second);
+	in_flight.erase(it);
+	--upstreams[upstream].in_flight;
+	if (!request.key.empty())
+		reads.erase(request.key);
+
+	for (auto &waiter : request.waiters)
+		reply(waiter, frame);
+}
+
+/** send a frame to a client under its own transaction id
+ * Responses are small, a client whose socket cannot take one is not reading and gets dropped.
+ * \waiter: the client and its transaction id
+ * \frame: the response
+ */
+void ModBusProxy::reply(const Waiter &waiter, std::vector<std::uint8_t> &frame)
+{
+	auto client = clients.find(waiter.fd);
+	if (client == clients.end() || client->second.id != waiter.client) /* client gone meanwhile */
+		return;
+
+	frame[0] = waiter.tid >> 8;
+	frame[1] = waiter.tid & 0xFF;
+	if (send(waiter.fd, frame.data(), frame.size(), MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)frame.size())
+		drop_client(waiter.fd);
+}
+
+/** answer a request with a modbus exception
+ * \waiter: the client and its transaction id
+ * \unit, \function: unit id and function code of the request
+ * \code: the modbus exception code
+ */
+void ModBusProxy::reply_exception(const Waiter &waiter, const std::uint8_t &unit, const std::uint8_t &function, const std::uint8_t &code)
+{
+	std::vector<std::uint8_t> frame{0, 0, 0, 0, 0, 3, unit, (std::uint8_t)(function | 0x80), code};
+	++counters.rejected;
+	reply(waiter, frame);
+}
+
+/** a connected upstream connection with a free slot
+ * The least loaded one is preferred. When they are all busy, another connection is opened
+ * in the background; the request then waits in the queue, it is not sent on a connection
+ * before connect() completes.
+ * \return: the index of the connection, or -1 if none is available
+ */
+int ModBusProxy::pick_upstream()
+{
+	int best = -1;
+	for (std::size_t i = 0; i < upstreams.size(); ++i)
+	{
+		const Upstream &upstream = upstreams[i];
+		if (upstream.fd != -1 && !upstream.connecting && upstream.in_flight < max_in_flight &&
+			(best == -1 || upstream.in_flight < upstreams[best].in_flight))
+			best = i;
+	}
+	if (best == -1)
+		open_upstream();
+	return best;
+}
+
+/** start connecting a closed upstream connection
+ * The socket is non-blocking, process() completes the connection once epoll reports it writable,
+ * expire() gives up if it is not done within the request timeout. One connection is opened at a time.
+ * \return: true if a connection is connecting, false if none can be opened before a retry delay
+ */
+bool ModBusProxy::open_upstream()
+{
+	auto now = std::chrono::steady_clock::now();
+	for (auto &upstream : upstreams)
+	{
+		if (upstream.connecting)
+			return true;
+	}
+
+	for (auto &upstream : upstreams)
+	{
+		if (upstream.fd != -1 || now < upstream.retry_at)
+			continue;
+
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+		{
+			MODBUS_LOG(error, "ModBusProxy::open_upstream", "Unable to create upstream socket", strerror(errno));
+			upstream.retry_at = now + UPSTREAM_RETRY_DELAY;
+			continue;
+		}
+		int flag = 1; /* requests are small and latency bound, as libmodbus sets it */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+		if (connect(fd, (struct sockaddr *)&upstream_address, sizeof(upstream_address)) == -1 && errno != EINPROGRESS)
+		{
+			MODBUS_LOG(error, "ModBusProxy::open_upstream", "Connection failed", strerror(errno));
+			close(fd);
+			upstream.retry_at = now + UPSTREAM_RETRY_DELAY;
+			continue;
+		}
+
+		/* writable once connect() completes, even if it completed right away */
+		struct epoll_event ev = {0, {0}};
+		ev.events = EPOLLOUT;
+		ev.data.fd = fd;
+		if (epoll_ctl(this->epollfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		{
+			MODBUS_LOG(error, "ModBusProxy::open_upstream", "Unable to watch upstream socket", strerror(errno));
+			close(fd);
+			upstream.retry_at = now + UPSTREAM_RETRY_DELAY;
+			continue;
+		}
+		upstream.fd = fd;
+		upstream.connecting = true;
+		upstream.deadline = now + timeout;
+		upstream.in_flight = 0;
+		upstream.rx.clear();
+		return true;
+	}
+	return false;
+}
+
+/** finish the connect() of an upstream connection
+ * On success the connection starts taking the queued requests. On failure it is retried after a
+ * delay, and the queued requests get a gateway path exception if no other connection is left.
+ * \upstream: index of the connection, connecting and reported ready by epoll
+ */
+void ModBusProxy::complete_upstream(const std::size_t &upstream)
+{
+	Upstream &u = upstreams[upstream];
+	int error = 0;
+	socklen_t length = sizeof(error);
+	if (getsockopt(u.fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1)
+		error = errno;
+
+	struct epoll_event ev = {0, {0}};
+	ev.events = EPOLLIN;
+	ev.data.fd = u.fd;
+	if (error == 0 && epoll_ctl(this->epollfd, EPOLL_CTL_MOD, u.fd, &ev) == -1)
+		error = errno;
+
+	if (error != 0)
+	{
+		MODBUS_LOG(error, "ModBusProxy::complete_upstream", "Connection failed", strerror(error));
+		u.retry_at = std::chrono::steady_clock::now() + UPSTREAM_RETRY_DELAY;
+		fail_upstream(upstream, MODBUS_EXCEPTION_GATEWAY_PATH);
+		return;
+	}
+	u.connecting = false;
+	drain();
+}
+
+/* true if an upstream connection is connected or connecting */
+bool ModBusProxy::reachable() const noexcept
+{
+	for (auto &upstream : upstreams)
+	{
+		if (upstream.fd != -1)
+			return true;
+	}
+	return false;
+}
+
+/** close an upstream connection, it is reopened on demand
+ * When it was the last connection and no other can be opened now, the queued requests get a
+ * gateway path exception.
+ * \upstream: index of the connection
+ * \code: the exception code sent to the clients of its requests in flight
+ */
+void ModBusProxy::fail_upstream(const std::size_t &upstream, const std::uint8_t &code)
+{
+	Upstream &u = upstreams[upstream];
+	if (u.fd != -1)
+	{
+		epoll_ctl(this->epollfd, EPOLL_CTL_DEL, u.fd, nullptr);
+		close(u.fd);
+		u.fd = -1;
+	}
+	u.connecting = false;
+	u.in_flight = 0;
+	u.rx.clear();
+
+	std::vector<InFlight> failed;
+	for (auto it = in_flight.begin(); it != in_flight.end();)
+	{
+		if (it->second.upstream == upstream)
+		{
+			if (!it->second.key.empty())
+				reads.erase(it->second.key);
+			failed.push_back(std::move(it->second));
+			it = in_flight.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	for (auto &request : failed)
+	{
+		for (auto &waiter : request.waiters)
+			reply_exception(waiter, request.unit, request.function, code);
+	}
+
+	if (queue.empty() || reachable() || open_upstream())
+		return;
+	std::deque<Queued> stranded;
+	stranded.swap(queue);
+	for (auto &queued : stranded)
+		reply_exception(queued.waiter, queued.frame[6], queued.frame[MBAP_HEADER_LENGTH], MODBUS_EXCEPTION_GATEWAY_PATH);
+}
+
+/** close a client connection, responses still due to it are discarded
+ * \fd: the client socket
+ */
+void ModBusProxy::drop_client(const int &fd)
+{
+	epoll_ctl(this->epollfd, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	clients.erase(fd);
+}
+
+/* answer the requests the server did not answer in time with a gateway target exception,
+   and give up connections the server did not accept in time */
+void ModBusProxy::expire()
+{
+	auto now = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < upstreams.size(); ++i)
+	{
+		if (upstreams[i].connecting && now >= upstreams[i].deadline)
+		{
+			MODBUS_LOG(error, "ModBusProxy::expire", "Connection failed", "timed out");
+			upstreams[i].retry_at = now + UPSTREAM_RETRY_DELAY;
+			fail_upstream(i, MODBUS_EXCEPTION_GATEWAY_PATH);
+		}
+	}
+
+	std::vector<InFlight> expired;
+	for (auto it = in_flight.begin(); it != in_flight.end();)
+	{
+		if (now >= it->second.deadline)
+		{
+			--upstreams[it->second.upstream].in_flight;
+			if (!it->second.key.empty())
+				reads.erase(it->second.key);
+			expired.push_back(std::move(it->second));
+			it = in_flight.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	for (auto &request : expired)
+	{
+		++counters.timeouts;
+		for (auto &waiter : request.waiters)
+			reply_exception(waiter, request.unit, request.function, MODBUS_EXCEPTION_GATEWAY_TARGET);
+	}
+}
+
+/* true if a request could be sent upstream right away */
+bool ModBusProxy::has_free_slot() const noexcept
+{
+	for (auto &upstream : upstreams)
+	{
+		if (upstream.fd != -1 && !upstream.connecting && upstream.in_flight < max_in_flight)
+			return true;
+	}
+	return false;
+}
+
+/* forward queued requests, in order, while upstream slots are free, opening another connection when they are not */
+void ModBusProxy::drain()
+{
+	while (!queue.empty())
+	{
+		std::string key = _read_key(queue.front().frame);
+		if ((key.empty() || !reads.count(key)) && !has_free_slot())
+		{
+			open_upstream();
+			break;
+		}
+
+		Queued queued = std::move(queue.front());
+		queue.pop_front();
+		forward(queued.waiter, queued.frame);
+	}
+}
@@ -0,0 +1,43 @@
+#include <iostream>
+#include "includes/proxy.h"
+#include <csignal>
+#include <string>
+
+void signal_handle(int)
+{
+    std::exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv)
+{
+    std::signal(SIGINT, signal_handle);
+
+    if (argc < 3)
+    {
+        std::cerr << "usage: " << argv[0] << " UPSTREAM_IP UPSTREAM_PORT [LISTEN_PORT [NUM_UPSTREAMS [MAX_IN_FLIGHT]]]" << std::endl;
+        return 1;
+    }
+
+    /* modbus proxy instance, bind to 0.0.0.0:1503 by default
+       clients share at most NUM_UPSTREAMS connections to the server behind it,
+       each carrying MAX_IN_FLIGHT requests at once
+    */
+    static ModBusProxy proxy("0.0.0.0", argc > 3 ? std::stoi(argv[3]) : 1503, argv[1], std::stoi(argv[2]),
+                             argc > 4 ? std::stoi(argv[4]) : 1, argc > 5 ? std::stoi(argv[5]) : 1);
+
+    /* start to listen to incomming connections */
+    proxy.listen(32);
+
+    while (1)
+    {
+        /* wait for any connections to be ready for I/O */
+        int connection_count = proxy.wait();
+
+        /* iterate over the ready connections to forward requests and responses */
+        for (int n = 0; n < connection_count; ++n)
+        {
+            if (proxy.process(n)) /* true if a new client connected */
+                std::cout << "New Connection" << std::endl;
+        }
+    }
+}
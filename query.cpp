@@ -0,0 +1,395 @@
+/*
+ * query.cpp
+ *
+ * Description:
+ * Windowed aggregates and downsampled series over the columns of a historian file.
+ *
+ */
+
+#include "includes/query.h"
+#include "includes/historian.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* columns decoded by one task, after the timestamps of its block */
+#define _QUERY_COLUMNS_PER_TASK 16
+/* windows of one call, to catch a range without bounds */
+#define _QUERY_MAX_WINDOWS (1 << 24)
+
+/*
+   Fixed set of worker threads running the tasks of one call at a time.
+   The calling thread takes tasks too, so that a pool of one thread has no worker.
+*/
+class ModBusQuery::Pool
+{
+private:
+	std::vector<std::thread> workers{};
+	std::mutex lock{};
+	std::condition_variable wake{}; /* a job is posted, or the pool stops */
+	std::condition_variable idle{}; /* the last worker left the job */
+
+	/* the job, written under lock while no worker is busy */
+	const std::function<void(std::size_t)> *job = nullptr;
+	std::size_t job_tasks = 0;
+	std::uint64_t generation = 0;
+	std::atomic<std::size_t> next{0}; /* the next task to take */
+	std::size_t busy = 0;			  /* workers on the job */
+	bool stopping = false;
+	std::exception_ptr error{}; /* first exception of the job */
+
+	/* take and run tasks until there is none left */
+	void drain() noexcept
+	{
+		for (;;)
+		{
+			std::size_t task = next.fetch_add(1);
+			if (task >= job_tasks)
+				return;
+			try
+			{
+				(*job)(task);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (!error)
+					error = std::current_exception();
+			}
+		}
+	}
+
+	void loop() noexcept
+	{
+		std::uint64_t seen = 0;
+		std::unique_lock<std::mutex> guard(lock);
+		for (;;)
+		{
+			wake.wait(guard, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+			++busy;
+			guard.unlock();
+			drain();
+			guard.lock();
+			if (--busy == 0)
+				idle.notify_all();
+		}
+	}
+
+public:
+	explicit Pool(const std::size_t &threads)
+	{
+		try
+		{
+			for (std::size_t i = 1; i < threads; ++i)
+				workers.emplace_back(&Pool::loop, this);
+		}
+		catch (...)
+		{
+			stop();
+			throw;
+		}
+	}
+
+	~Pool()
+	{
+		stop();
+	}
+
+	void stop() noexcept
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+		workers.clear();
+	}
+
+	std::size_t size() const noexcept
+	{
+		return workers.size() + 1;
+	}
+
+	/* run task(0) to task(tasks - 1), return once they are all done and rethrow the first exception */
+	void run(const std::size_t &tasks, const std::function<void(std::size_t)> &task)
+	{
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			/* a worker late to the previous job may still be leaving it */
+			idle.wait(guard, [&] { return busy == 0; });
+			job = &task;
+			job_tasks = tasks;
+			next.store(0);
+			error = nullptr;
+			++generation;
+		}
+		wake.notify_all();
+		drain();
+
+		std::unique_lock<std::mutex> guard(lock);
+		idle.wait(guard, [&] { return busy == 0; });
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+/** the average of the values
+ * \return: NaN if there is no value
+ */
+double ModBusAggregate::mean() const noexcept
+{
+	return count ? sum / count : std::numeric_limits<double>::quiet_NaN();
+}
+
+/** fold the aggregate of other values of the same column into this one
+ */
+void ModBusAggregate::merge(const ModBusAggregate &other) noexcept
+{
+	if (other.count == 0)
+		return;
+	if (count == 0)
+	{
+		*this = other;
+		return;
+	}
+	min = std::min(min, other.min);
+	max = std::max(max, other.max);
+	sum += other.sum;
+	count += other.count;
+}
+
+/** fold count values into aggregate
+ * NaN values are failed reads and are skipped. Four values are reduced at a
+ * time in two pairs of lanes, a NaN being replaced by the neutral value of
+ * each reduction with masks; the lanes are folded at the end. The sum is thus
+ * added in a different order than one by one, and may differ from it in the
+ * last bits.
+ */
+void ModBusQuery::accumulate(const double *values, const std::size_t &count, ModBusAggregate &aggregate) noexcept
+{
+	const double inf = std::numeric_limits<double>::infinity();
+	double min = inf, max = -inf, sum = 0;
+	std::uint64_t valid = 0;
+	std::size_t i = 0;
+#ifdef __SSE2__
+	const __m128d pos_inf = _mm_set1_pd(inf);
+	const __m128d neg_inf = _mm_set1_pd(-inf);
+	__m128d min0 = pos_inf, min1 = pos_inf, max0 = neg_inf, max1 = neg_inf;
+	__m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd();
+	__m128i valid0 = _mm_setzero_si128(), valid1 = _mm_setzero_si128();
+	for (; i + 4 <= count; i += 4)
+	{
+		const __m128d a = _mm_loadu_pd(values + i);
+		const __m128d b = _mm_loadu_pd(values + i + 2);
+		/* all ones in the lanes holding a number */
+		const __m128d ma = _mm_cmpord_pd(a, a);
+		const __m128d mb = _mm_cmpord_pd(b, b);
+		const __m128d va = _mm_and_pd(ma, a);
+		const __m128d vb = _mm_and_pd(mb, b);
+		sum0 = _mm_add_pd(sum0, va);
+		sum1 = _mm_add_pd(sum1, vb);
+		min0 = _mm_min_pd(min0, _mm_or_pd(va, _mm_andnot_pd(ma, pos_inf)));
+		min1 = _mm_min_pd(min1, _mm_or_pd(vb, _mm_andnot_pd(mb, pos_inf)));
+		max0 = _mm_max_pd(max0, _mm_or_pd(va, _mm_andnot_pd(ma, neg_inf)));
+		max1 = _mm_max_pd(max1, _mm_or_pd(vb, _mm_andnot_pd(mb, neg_inf)));
+		/* a mask lane is -1 as an integer */
+		valid0 = _mm_sub_epi64(valid0, _mm_castpd_si128(ma));
+		valid1 = _mm_sub_epi64(valid1, _mm_castpd_si128(mb));
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, _mm_min_pd(min0, min1));
+	min = std::min(lanes[0], lanes[1]);
+	_mm_storeu_pd(lanes, _mm_max_pd(max0, max1));
+	max = std::max(lanes[0], lanes[1]);
+	_mm_storeu_pd(lanes, _mm_add_pd(sum0, sum1));
+	sum = lanes[0] + lanes[1];
+	std::uint64_t counts[2];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(counts), _mm_add_epi64(valid0, valid1));
+	valid = counts[0] + counts[1];
+#endif
+	for (; i < count; ++i)
+	{
+		if (std::isnan(values[i]))
+			continue;
+		min = std::min(min, values[i]);
+		max = std::max(max, values[i]);
+		sum += values[i];
+		++valid;
+	}
+
+	ModBusAggregate result;
+	result.min = min;
+	result.max = max;
+	result.sum = sum;
+	result.count = valid;
+	aggregate.merge(result);
+}
+
+/** queries over historian, which must outlive the query
+ * \threads: threads running a query, including the calling one, one per core if 0
+ * \throw: std::system_error if a thread cannot be started
+ */
+ModBusQuery::ModBusQuery(const ModBusHistorian &historian, const std::size_t &threads)
+	: historian(historian),
+	  pool(new Pool(threads ? threads : std::max(1u, std::thread::hardware_concurrency())))
+{
+}
+
+ModBusQuery::~ModBusQuery() = default;
+
+std::size_t ModBusQuery::threads() const noexcept
+{
+	return pool->size();
+}
+
+/** the aggregates of columns in the windows [from + w * window, from + (w + 1) * window) up to to
+ * The last window is cut at to. Rows are matched at the millisecond resolution of the historian.
+ * \return: a vector of windows per column, in the order of columns
+ * \throw: out_of_range for an invalid column, runtime_error for a window not positive,
+ *         too many windows, or a block that cannot be read
+ */
+std::vector<std::vector<ModBusAggregate>> ModBusQuery::aggregate(const std::vector<std::size_t> &columns,
+																  const std::chrono::system_clock::time_point &from,
+																  const std::chrono::system_clock::time_point &to,
+																  const std::chrono::milliseconds &window) const
+{
+	if (window.count() <= 0)
+	{
+		throw std::runtime_error("[ModBusQuery::aggregate]The window must be positive");
+	}
+	for (auto &column : columns)
+		historian.kind(column); /* throws out_of_range for an invalid column */
+
+	const std::int64_t first = std::chrono::duration_cast<std::chrono::milliseconds>(from.time_since_epoch()).count();
+	const std::int64_t last = std::chrono::duration_cast<std::chrono::milliseconds>(to.time_since_epoch()).count();
+	const std::int64_t width = window.count();
+	std::size_t num_windows = 0;
+	if (last > first)
+	{
+		if ((double)last - (double)first > (double)width * _QUERY_MAX_WINDOWS)
+		{
+			throw std::runtime_error("[ModBusQuery::aggregate]Too many windows in the time range");
+		}
+		num_windows = (last - first + width - 1) / width;
+	}
+	std::vector<std::vector<ModBusAggregate>> result(columns.size(), std::vector<ModBusAggregate>(num_windows));
+	if (num_windows == 0 || columns.empty())
+		return result;
+
+	/* the blocks touching the range */
+	std::vector<std::size_t> blocks;
+	for (std::size_t b = 0; b < historian.num_blocks(); ++b)
+	{
+		std::int64_t block_first, block_last;
+		historian.block_range(b, block_first, block_last);
+		if (block_last >= first && block_first < last)
+			blocks.push_back(b);
+	}
+
+	/* a task per block and group of columns, each with its own partial aggregates */
+	struct Partial
+	{
+		std::size_t first_window = 0;
+		std::size_t num_windows = 0;
+		std::vector<ModBusAggregate> aggregates{}; /* num_windows per column of the group */
+	};
+	const std::size_t groups = (columns.size() + _QUERY_COLUMNS_PER_TASK - 1) / _QUERY_COLUMNS_PER_TASK;
+	std::vector<Partial> partials(blocks.size() * groups);
+
+	std::function<void(std::size_t)> task = [&](std::size_t index) {
+		const std::size_t block = blocks[index / groups];
+		const std::size_t column_begin = (index % groups) * _QUERY_COLUMNS_PER_TASK;
+		const std::size_t column_end = std::min(columns.size(), column_begin + _QUERY_COLUMNS_PER_TASK);
+
+		std::vector<std::int64_t> timestamps;
+		historian.read_timestamps(block, timestamps);
+
+		/* the runs of rows of the same window in the block, shared by every column
+		   The historian writes timestamps in order, each row is still checked against
+		   the range so that a file out of order cannot send a row outside the windows. */
+		struct Segment
+		{
+			std::size_t window, begin, end;
+		};
+		std::vector<Segment> segments;
+		std::size_t min_window = SIZE_MAX, max_window = 0;
+		for (std::size_t row = 0; row < timestamps.size(); ++row)
+		{
+			if (timestamps[row] < first || timestamps[row] >= last)
+				continue;
+			const std::size_t w = (timestamps[row] - first) / width;
+			if (!segments.empty() && segments.back().window == w && segments.back().end == row)
+			{
+				++segments.back().end;
+				continue;
+			}
+			segments.push_back(Segment{w, row, row + 1});
+			min_window = std::min(min_window, w);
+			max_window = std::max(max_window, w);
+		}
+		if (segments.empty())
+			return;
+
+		Partial &partial = partials[index];
+		partial.first_window = min_window;
+		partial.num_windows = max_window - min_window + 1;
+		partial.aggregates.resize(partial.num_windows * (column_end - column_begin));
+
+		std::vector<double> values;
+		for (std::size_t c = column_begin; c < column_end; ++c)
+		{
+			historian.read_column(block, columns[c], values);
+			ModBusAggregate *aggregates = partial.aggregates.data() + (c - column_begin) * partial.num_windows;
+			for (auto &segment : segments)
+				accumulate(values.data() + segment.begin, segment.end - segment.begin,
+						   aggregates[segment.window - partial.first_window]);
+		}
+	};
+	pool->run(partials.size(), task);
+
+	for (std::size_t index = 0; index < partials.size(); ++index)
+	{
+		const Partial &partial = partials[index];
+		const std::size_t column_begin = (index % groups) * _QUERY_COLUMNS_PER_TASK;
+		for (std::size_t i = 0; i < partial.aggregates.size(); ++i)
+		{
+			result[column_begin + i / partial.num_windows][partial.first_window + i % partial.num_windows].merge(partial.aggregates[i]);
+		}
+	}
+	return result;
+}
+
+/** the mean of the columns in every window of aggregate()
+ * \return: a series per column, NaN for a window without values
+ * \throw: as aggregate()
+ */
+std::vector<std::vector<double>> ModBusQuery::downsample(const std::vector<std::size_t> &columns,
+														 const std::chrono::system_clock::time_point &from,
+														 const std::chrono::system_clock::time_point &to,
+														 const std::chrono::milliseconds &window) const
+{
+	std::vector<std::vector<ModBusAggregate>> aggregates = aggregate(columns, from, to, window);
+	std::vector<std::vector<double>> result(aggregates.size());
+	for (std::size_t c = 0; c < aggregates.size(); ++c)
+	{
+		result[c].reserve(aggregates[c].size());
+		for (auto &aggregate : aggregates[c])
+			result[c].push_back(aggregate.mean());
+	}
+	return result;
+}
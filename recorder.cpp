@@ -0,0 +1,263 @@
+/*
+ * recorder.cpp
+ *
+ * Description:
+ * Flight recorder of the last modbus transactions of a connector or a server.
+ *
+ */
+
+#include "includes/recorder.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <modbus/modbus.h>
+
+struct ModBusFlightRecorder::Slot
+{
+	std::atomic<std::uint32_t> sequence{0}; /* odd while the writer updates the slot */
+	ModBusTransaction transaction{};
+};
+
+namespace
+{
+	/* every live recorder, for dump_all(), never destroyed so that static connectors may outlive it */
+	std::mutex &registry_mutex()
+	{
+		static std::mutex *mutex = new std::mutex();
+		return *mutex;
+	}
+
+	std::vector<const ModBusFlightRecorder *> &registry()
+	{
+		static std::vector<const ModBusFlightRecorder *> *recorders = new std::vector<const ModBusFlightRecorder *>();
+		return *recorders;
+	}
+
+	/* dump_on_signal() state, the handler only writes the signal number to the pipe */
+	int signal_pipe[2] = {-1, -1};
+	std::string signal_path;
+
+	void signal_handler(int signo)
+	{
+		int saved = errno;
+		unsigned char byte = (unsigned char)signo;
+		if (write(signal_pipe[1], &byte, 1) == -1)
+		{
+			/* pipe full, a dump is pending anyway */
+		}
+		errno = saved;
+	}
+
+	void signal_watcher()
+	{
+		unsigned char byte;
+		while (true)
+		{
+			ssize_t n = read(signal_pipe[0], &byte, 1);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n != 1)
+				return;
+
+			std::string path;
+			{
+				std::lock_guard<std::mutex> lock(registry_mutex());
+				path = signal_path;
+			}
+			try
+			{
+				ModBusFlightRecorder::dump_all(path);
+			}
+			catch (const std::exception &e)
+			{
+				std::fprintf(stderr, "[ModBusFlightRecorder::dump_on_signal] %s\n", e.what());
+			}
+		}
+	}
+}
+
+ModBusFlightRecorder::ModBusFlightRecorder(const std::string &name)
+	: recorder_name(name), slots(new Slot[MODBUS_RECORDER_SIZE])
+{
+	std::lock_guard<std::mutex> lock(registry_mutex());
+	registry().push_back(this);
+}
+
+ModBusFlightRecorder::~ModBusFlightRecorder()
+{
+	std::lock_guard<std::mutex> lock(registry_mutex());
+	registry().erase(std::remove(registry().begin(), registry().end(), this), registry().end());
+}
+
+std::uint64_t ModBusFlightRecorder::now() noexcept
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (std::uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** record a transaction
+ * Overwrites the oldest entry once the ring is full. Must not be called by two threads at once.
+ * \start: now() when the request was sent or received
+ * \result: return value of the libmodbus call
+ * \error: errno when result is -1, 0 otherwise
+ */
+void ModBusFlightRecorder::record(const std::uint64_t &start, const std::uint8_t &unit, const std::uint8_t &function,
+								  const int &addr, const int &count, const int &result, const int &error,
+								  const int &socket, const std::uint16_t &tid) noexcept
+{
+	std::uint64_t latency = (now() - start) / 1000;
+	std::uint64_t n = next.load(std::memory_order_relaxed);
+	Slot &slot = slots[n % MODBUS_RECORDER_SIZE];
+
+	std::uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+	slot.sequence.store(sequence + 1, std::memory_order_relaxed); /* odd: update in progress */
+	std::atomic_thread_fence(std::memory_order_release);
+
+	ModBusTransaction &t = slot.transaction;
+	t.start = start;
+	t.latency = latency > UINT32_MAX ? UINT32_MAX : (std::uint32_t)latency;
+	t.result = result;
+	t.error = error;
+	t.socket = socket;
+	t.tid = tid;
+	t.addr = (std::uint16_t)addr;
+	t.count = (std::uint16_t)count;
+	t.unit = unit;
+	t.function = function;
+
+	slot.sequence.store(sequence + 2, std::memory_order_release); /* even: consistent again */
+	next.store(n + 1, std::memory_order_release);
+}
+
+/** copy the recorded transactions
+ * Safe while the writer records; an entry overwritten during the copy is left out.
+ * \throw: std::bad_alloc
+ */
+std::vector<ModBusTransaction> ModBusFlightRecorder::transactions() const
+{
+	std::vector<ModBusTransaction> result;
+	std::uint64_t end = next.load(std::memory_order_acquire);
+	std::uint64_t begin = end > MODBUS_RECORDER_SIZE ? end - MODBUS_RECORDER_SIZE : 0;
+	result.reserve(end - begin);
+	for (std::uint64_t i = begin; i < end; ++i)
+	{
+		const Slot &slot = slots[i % MODBUS_RECORDER_SIZE];
+		std::uint32_t before = slot.sequence.load(std::memory_order_acquire);
+		if (before & 1)
+			continue;
+		ModBusTransaction copy = slot.transaction;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.sequence.load(std::memory_order_relaxed) != before)
+			continue;
+		/* the writer went around the ring since end was read */
+		if (copy.start < (result.empty() ? 0 : result.back().start))
+			continue;
+		result.push_back(copy);
+	}
+	return result;
+}
+
+/** write the recorded transactions, one per line, with wall clock timestamps
+ * \throw: std::bad_alloc
+ */
+void ModBusFlightRecorder::dump(std::FILE *out) const
+{
+	std::vector<ModBusTransaction> list = transactions();
+
+	/* convert steady clock to wall clock with the current offset between the two */
+	struct timespec wall;
+	clock_gettime(CLOCK_REALTIME, &wall);
+	std::int64_t offset = ((std::int64_t)wall.tv_sec * 1000000000LL + wall.tv_nsec) - (std::int64_t)now();
+
+	std::fprintf(out, "# %s: %zu transactions\n", recorder_name.c_str(), list.size());
+	for (auto &t : list)
+	{
+		std::int64_t ns = (std::int64_t)t.start + offset;
+		std::time_t seconds = ns / 1000000000LL;
+		struct tm tm;
+		localtime_r(&seconds, &tm);
+		char time[32];
+		std::strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S", &tm);
+
+		std::fprintf(out, "%s.%06lld", time, (long long)(ns % 1000000000LL) / 1000);
+		if (t.socket != -1)
+			std::fprintf(out, " socket=%d tid=%u", t.socket, t.tid);
+		std::fprintf(out, " unit=%u fc=%u addr=%u count=%u result=%d latency_us=%u",
+					 t.unit, t.function, t.addr, t.count, t.result, t.latency);
+		if (t.result == -1)
+			std::fprintf(out, " error=\"%s\"", modbus_strerror(t.error));
+		std::fputc('\n', out);
+	}
+}
+
+const std::string &ModBusFlightRecorder::name() const noexcept
+{
+	return recorder_name;
+}
+
+/** append the transactions of every recorder to a file
+ * \path: the file, created if needed
+ * \throw: runtime_error if the file cannot be opened
+ *         std::bad_alloc
+ */
+void ModBusFlightRecorder::dump_all(const std::string &path)
+{
+	std::FILE *out = std::fopen(path.c_str(), "a");
+	if (!out)
+	{
+		throw std::runtime_error("[ModBusFlightRecorder::dump_all] Unable to open " + path + ": " + std::string(strerror(errno)));
+	}
+
+	char time[32];
+	std::time_t seconds = std::time(nullptr);
+	struct tm tm;
+	localtime_r(&seconds, &tm);
+	std::strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S", &tm);
+	std::fprintf(out, "## flight recorder dump of pid %d at %s\n", (int)getpid(), time);
+
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex());
+		for (auto &recorder : registry())
+			recorder->dump(out);
+	}
+	std::fclose(out);
+}
+
+/** dump every recorder to path whenever signo is received
+ * The signal handler only writes to a pipe, the dump runs on a background thread.
+ * Calling it again changes the path or adds another signal.
+ * \throw: runtime_error if the pipe, the thread or the handler cannot be set up
+ */
+void ModBusFlightRecorder::dump_on_signal(const std::string &path, const int &signo)
+{
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex());
+		signal_path = path;
+		if (signal_pipe[0] == -1)
+		{
+			if (pipe2(signal_pipe, O_CLOEXEC) == -1)
+			{
+				throw std::runtime_error("[ModBusFlightRecorder::dump_on_signal] Unable to create pipe: " + std::string(strerror(errno)));
+			}
+			fcntl(signal_pipe[1], F_SETFL, fcntl(signal_pipe[1], F_GETFL) | O_NONBLOCK);
+			std::thread(signal_watcher).detach();
+		}
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = signal_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(signo, &action, nullptr) == -1)
+	{
+		throw std::runtime_error("[ModBusFlightRecorder::dump_on_signal] Unable to install the signal handler: " + std::string(strerror(errno)));
+	}
+}
@@ -0,0 +1,66 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <ctime>
+#include "includes/scanlog.h"
+
+/* print the scans recorded by poller.run into a scan log, while it goes on recording
+   usage: scandump.run SCAN_FILE [FROM [COUNT]]
+   FROM is a time in seconds since the epoch (all the scans in the ring by default),
+   COUNT the number of scans to print from there (all by default) */
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 4)
+    {
+        std::cerr << "usage: " << argv[0] << " SCAN_FILE [FROM [COUNT]]" << std::endl;
+        return 1;
+    }
+
+    ModBusScanLog log(argv[1]); /* read-only */
+    std::vector<ModBusReadBlock> blocks = log.blocks();
+
+    std::uint64_t scan = log.begin();
+    if (argc > 2)
+    {
+        auto from = std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::duration<double>(std::stod(argv[2]))));
+        scan = log.seek(from);
+    }
+    std::uint64_t last = log.end();
+    if (argc > 3 && scan + std::stoull(argv[3]) < last)
+        last = scan + std::stoull(argv[3]);
+
+    std::cout << "scans recorded: " << log.end() << " kept: " << log.end() - log.begin() << "/" << log.capacity() << std::endl;
+
+    static const char *areas[] = {"coil", "inputbit", "register", "inputreg"};
+    ModBusSnapshot snapshot;
+    for (; scan < last; ++scan)
+    {
+        if (!log.read(scan, snapshot))
+            continue; /* overwritten meanwhile */
+
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(snapshot.timestamp.time_since_epoch()).count();
+        std::time_t seconds = ns / 1000000000;
+        char when[32];
+        std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", std::localtime(&seconds));
+        std::cout << "scan " << scan << " " << when << "." << std::to_string(1000000 + ns / 1000 % 1000000).substr(1) << std::endl;
+
+        for (std::size_t i = 0; i < blocks.size(); ++i)
+        {
+            const ModBusReadBlock &block = blocks[i];
+            std::cout << "  " << areas[static_cast<int>(block.area)] << " " << block.addr << " " << block.num << ":";
+            if (snapshot.status[i] == -1)
+            {
+                std::cout << "\tfailed, errno " << snapshot.error[i] << std::endl;
+                continue;
+            }
+            bool is_register = block.area == ModBusArea::holding_registers || block.area == ModBusArea::input_registers;
+            const std::uint16_t *words = snapshot.words.data() + block.offset;
+            const std::uint8_t *bits = reinterpret_cast<const std::uint8_t *>(words);
+            for (int k = 0; k < block.num; ++k)
+                std::cout << "\t" << (is_register ? (int)words[k] : (int)bits[k]);
+            std::cout << std::endl;
+        }
+    }
+    return 0;
+}
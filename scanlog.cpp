@@ -0,0 +1,363 @@
+/*
+ * scanlog.cpp
+ *
+ * Description:
+ * Ring file of the raw values of every scan, memory-mapped and guarded by per-record sequence locks.
+ *
+ */
+
+#include "includes/scanlog.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SCANLOG_MAGIC "MBSCAN1"
+#define SCANLOG_ALIGN 64
+
+#if ATOMIC_LLONG_LOCK_FREE != 2
+#error "the scan log needs lock-free atomics to be shared between processes"
+#endif
+
+/* file header, 64 bytes */
+struct ModBusScanLog::Header
+{
+	char magic[8];
+	std::uint32_t num_blocks;
+	std::uint32_t words;
+	std::uint64_t capacity;
+	std::uint64_t record_size;
+	std::uint64_t records_offset;
+	std::atomic<std::uint64_t> next; /* number of scans recorded */
+	std::uint64_t reserved[2];
+};
+
+/* a block of the read plan */
+struct ModBusScanLog::Block
+{
+	std::uint8_t area;
+	std::uint8_t reserved[3];
+	std::int32_t addr;
+	std::int32_t num;
+	std::uint32_t offset;
+};
+
+/* record header, followed by the status and errno of every block, then the words */
+struct ModBusScanLog::Record
+{
+	std::atomic<std::uint64_t> sequence; /* 2 * scan + 1 while the writer fills the record, 2 * scan + 2 once complete */
+	std::int64_t timestamp;				 /* when the scan started, nanoseconds since the epoch, never before the previous scan */
+};
+
+/* round up to a cache line */
+inline std::uint64_t _align_record(const std::uint64_t &size) noexcept
+{
+	return (size + SCANLOG_ALIGN - 1) / SCANLOG_ALIGN * SCANLOG_ALIGN;
+}
+
+/** create the file or reopen it for the writer
+ * The file is locked so that only one writer at a time uses it, and its blocks are allocated
+ * up front so that appending never waits for the file system to find space.
+ * A reopened file goes on from the last scan it recorded.
+ * \path: the ring file
+ * \plan: the compiled plan the snapshots are read with
+ * \capacity: the number of scans kept
+ * \throw: runtime_error when the plan is not compiled, the capacity is 0, the file cannot be
+ *         created, locked, allocated or mapped, or an existing file holds another layout
+ */
+ModBusScanLog::ModBusScanLog(const std::string &path, const ModBusReadPlan &plan, const std::size_t &capacity)
+	: writable(true)
+{
+	static_assert(sizeof(Header) == SCANLOG_ALIGN, "the header takes the first aligned block");
+
+	if (!plan.ready() || capacity == 0)
+	{
+		throw std::runtime_error("[ModBusScanLog::ModBusScanLog]A compiled plan and a capacity are required");
+	}
+
+	const std::vector<ModBusReadBlock> &plan_blocks = plan.blocks();
+	Header h;
+	memset(static_cast<void *>(&h), 0, sizeof(h)); /* next starts at 0 */
+	memcpy(h.magic, SCANLOG_MAGIC, sizeof(h.magic));
+	h.num_blocks = plan_blocks.size();
+	h.words = plan.words();
+	h.capacity = capacity;
+	h.record_size = _align_record(sizeof(Record) + 2 * h.num_blocks * sizeof(std::int32_t) + h.words * sizeof(std::uint16_t));
+	h.records_offset = _align_record(sizeof(Header) + h.num_blocks * sizeof(Block));
+	const std::uint64_t size = h.records_offset + h.capacity * h.record_size;
+
+	std::vector<Block> directory(h.num_blocks);
+	memset(directory.data(), 0, directory.size() * sizeof(Block));
+	for (std::size_t i = 0; i < plan_blocks.size(); ++i)
+	{
+		directory[i].area = static_cast<std::uint8_t>(plan_blocks[i].area);
+		directory[i].addr = plan_blocks[i].addr;
+		directory[i].num = plan_blocks[i].num;
+		directory[i].offset = plan_blocks[i].offset;
+	}
+
+	this->fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (this->fd == -1)
+	{
+		throw std::runtime_error("[ModBusScanLog::ModBusScanLog]Unable to open " + path + ": " + std::string(strerror(errno)));
+	}
+	if (flock(this->fd, LOCK_EX | LOCK_NB) == -1)
+	{
+		auto tmp_error = errno;
+		close(this->fd);
+		throw std::runtime_error("[ModBusScanLog::ModBusScanLog]" + path + " is used by another writer: " + std::string(strerror(tmp_error)));
+	}
+
+	struct stat st;
+	if (fstat(this->fd, &st) == -1)
+	{
+		auto tmp_error = errno;
+		close(this->fd);
+		throw std::runtime_error("[ModBusScanLog::ModBusScanLog]Unable to stat " + path + ": " + std::string(strerror(tmp_error)));
+	}
+
+	if (st.st_size == 0) /* new file, the records are zero-filled, the header is written last */
+	{
+		int rc = posix_fallocate(this->fd, 0, size);
+		if (rc != 0 || pwrite(this->fd, directory.data(), directory.size() * sizeof(Block), sizeof(Header)) != (ssize_t)(directory.size() * sizeof(Block)) ||
+			pwrite(this->fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h))
+		{
+			auto tmp_error = rc ? rc : errno;
+			close(this->fd);
+			unlink(path.c_str());
+			throw std::runtime_error("[ModBusScanLog::ModBusScanLog]Unable to create " + path + ": " + std::string(strerror(tmp_error)));
+		}
+	}
+
+	map(path);
+
+	if (header->num_blocks != h.num_blocks || header->words != h.words || header->capacity != h.capacity ||
+		memcmp(header + 1, directory.data(), directory.size() * sizeof(Block)) != 0)
+	{
+		munmap(this->base, this->length);
+		close(this->fd);
+		throw std::runtime_error("[ModBusScanLog::ModBusScanLog]" + path + " holds scans of another layout");
+	}
+}
+
+/** open an existing file read-only
+ * \path: the ring file of a writer
+ * \throw: runtime_error when the file cannot be opened or mapped, or is not a scan log
+ */
+ModBusScanLog::ModBusScanLog(const std::string &path)
+{
+	this->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (this->fd == -1)
+	{
+		throw std::runtime_error("[ModBusScanLog::ModBusScanLog]Unable to open " + path + ": " + std::string(strerror(errno)));
+	}
+	map(path);
+}
+
+ModBusScanLog::~ModBusScanLog()
+{
+	if (this->base)
+		munmap(this->base, this->length);
+	if (this->fd != -1)
+		close(this->fd); /* also releases the lock */
+}
+
+/** map the whole file and validate its header, the file is closed on failure
+ * \throw: runtime_error when the file cannot be mapped or is not a scan log
+ */
+void ModBusScanLog::map(const std::string &path)
+{
+	struct stat st;
+	if (fstat(this->fd, &st) == -1 || st.st_size < (off_t)sizeof(Header))
+	{
+		close(this->fd);
+		throw std::runtime_error("[ModBusScanLog::map]" + path + " is not a scan log");
+	}
+	this->length = st.st_size;
+	this->base = mmap(nullptr, this->length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, this->fd, 0);
+	if (this->base == MAP_FAILED)
+	{
+		auto tmp_error = errno;
+		this->base = nullptr;
+		close(this->fd);
+		throw std::runtime_error("[ModBusScanLog::map]Unable to map " + path + ": " + std::string(strerror(tmp_error)));
+	}
+
+	this->header = static_cast<Header *>(this->base);
+	if (memcmp(header->magic, SCANLOG_MAGIC, sizeof(header->magic)) != 0 || header->capacity == 0 ||
+		header->record_size < _align_record(sizeof(Record) + 2 * header->num_blocks * sizeof(std::int32_t) + header->words * sizeof(std::uint16_t)) ||
+		header->records_offset < sizeof(Header) + header->num_blocks * sizeof(Block) ||
+		header->records_offset + header->capacity * header->record_size != this->length)
+	{
+		munmap(this->base, this->length);
+		this->base = nullptr;
+		close(this->fd);
+		throw std::runtime_error("[ModBusScanLog::map]" + path + " is not a valid scan log");
+	}
+}
+
+/* the record of a scan number */
+ModBusScanLog::Record *ModBusScanLog::record(const std::uint64_t &scan) const noexcept
+{
+	return reinterpret_cast<Record *>(static_cast<char *>(this->base) + header->records_offset + scan % header->capacity * header->record_size);
+}
+
+/** record a snapshot as the next scan
+ * A timestamp before the one of the previous scan, after the system clock was set back, is
+ * recorded as that one, so that seek() can rely on the timestamps never decreasing.
+ * \snapshot: the result of ModBusConnector::read_snapshot() with the plan of the file
+ * \return: the scan number of the record, or -1 if the file is read-only or the snapshot
+ *          does not have the words and blocks of the plan
+ */
+std::int64_t ModBusScanLog::append(const ModBusSnapshot &snapshot) noexcept
+{
+	if (__glibc_unlikely(!writable || snapshot.words.size() != header->words ||
+						 snapshot.status.size() != header->num_blocks || snapshot.error.size() != header->num_blocks))
+		return -1;
+
+	const std::uint64_t scan = header->next.load(std::memory_order_relaxed);
+	std::int64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(snapshot.timestamp.time_since_epoch()).count();
+	if (scan > 0) /* read before its slot may be reused, with a capacity of 1 */
+		timestamp = std::max(timestamp, record(scan - 1)->timestamp);
+	Record *r = record(scan);
+	std::int32_t *status = reinterpret_cast<std::int32_t *>(r + 1);
+	std::int32_t *error = status + header->num_blocks;
+	std::uint16_t *words = reinterpret_cast<std::uint16_t *>(error + header->num_blocks);
+
+	r->sequence.store(2 * scan + 1, std::memory_order_relaxed); /* odd: update in progress */
+	std::atomic_thread_fence(std::memory_order_release);
+
+	r->timestamp = timestamp;
+	for (std::size_t i = 0; i < header->num_blocks; ++i)
+	{
+		status[i] = snapshot.status[i];
+		error[i] = snapshot.error[i];
+	}
+	memcpy(words, snapshot.words.data(), header->words * sizeof(std::uint16_t));
+
+	r->sequence.store(2 * scan + 2, std::memory_order_release); /* even: the record of scan */
+	header->next.store(scan + 1, std::memory_order_release);
+	return scan;
+}
+
+/* the number of records of the ring */
+std::size_t ModBusScanLog::capacity() const noexcept
+{
+	return header->capacity;
+}
+
+/** the requests of the plan the scans were read with
+ * \throw: std::bad_alloc
+ */
+std::vector<ModBusReadBlock> ModBusScanLog::blocks() const
+{
+	const Block *directory = reinterpret_cast<const Block *>(header + 1);
+	std::vector<ModBusReadBlock> result;
+	for (std::size_t i = 0; i < header->num_blocks; ++i)
+		result.push_back(ModBusReadBlock{static_cast<ModBusArea>(directory[i].area), directory[i].addr, directory[i].num, directory[i].offset});
+	return result;
+}
+
+/* the number of words of a snapshot */
+std::size_t ModBusScanLog::words() const noexcept
+{
+	return header->words;
+}
+
+/* the oldest scan number still in the ring */
+std::uint64_t ModBusScanLog::begin() const noexcept
+{
+	const std::uint64_t next = header->next.load(std::memory_order_acquire);
+	return next > header->capacity ? next - header->capacity : 0;
+}
+
+/* the scan number of the next append */
+std::uint64_t ModBusScanLog::end() const noexcept
+{
+	return header->next.load(std::memory_order_acquire);
+}
+
+/** copy a scan, retrying while the writer fills its record
+ * \scan: the scan number, from begin() to end() - 1
+ * \snapshot: receives the timestamp, status, errno and words of the scan, laid out as by the plan
+ * \max_retries: attempts before giving up on a record the writer keeps rewriting
+ * \return: false if the record holds another scan or kept changing
+ * \throw: std::bad_alloc when the snapshot buffers are first sized
+ */
+bool ModBusScanLog::read(const std::uint64_t &scan, ModBusSnapshot &snapshot, const int &max_retries) const
+{
+	const Record *r = record(scan);
+	const std::int32_t *status = reinterpret_cast<const std::int32_t *>(r + 1);
+	const std::int32_t *error = status + header->num_blocks;
+	const std::uint16_t *words = reinterpret_cast<const std::uint16_t *>(error + header->num_blocks);
+
+	snapshot.words.resize(header->words);
+	snapshot.status.resize(header->num_blocks);
+	snapshot.error.resize(header->num_blocks);
+	for (int attempt = 0; attempt < max_retries; ++attempt)
+	{
+		std::uint64_t before = r->sequence.load(std::memory_order_acquire);
+		if (before == 2 * scan + 1) /* update in progress */
+			continue;
+		if (before != 2 * scan + 2) /* overwritten, or not recorded yet */
+			return false;
+
+		std::int64_t timestamp = r->timestamp;
+		for (std::size_t i = 0; i < header->num_blocks; ++i)
+		{
+			snapshot.status[i] = status[i];
+			snapshot.error[i] = error[i];
+		}
+		memcpy(snapshot.words.data(), words, header->words * sizeof(std::uint16_t));
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (r->sequence.load(std::memory_order_relaxed) == before)
+		{
+			snapshot.timestamp = std::chrono::system_clock::time_point(
+				std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(timestamp)));
+			return true;
+		}
+	}
+	return false;
+}
+
+/** binary search of the first scan started at or after time
+ * The timestamps of the scans never decrease, see append(). A scan overwritten during the search
+ * counts as older than time.
+ * \return: its scan number, or end() if every scan in the ring is older
+ */
+std::uint64_t ModBusScanLog::seek(const std::chrono::system_clock::time_point &time) const noexcept
+{
+	const std::int64_t target = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+	std::uint64_t low = begin(), high = end();
+	while (low < high)
+	{
+		const std::uint64_t middle = low + (high - low) / 2;
+		const Record *r = record(middle);
+		std::int64_t timestamp = 0;
+		bool found = false;
+		for (int attempt = 0; attempt < 1000 && !found; ++attempt)
+		{
+			std::uint64_t before = r->sequence.load(std::memory_order_acquire);
+			if (before == 2 * middle + 1) /* update in progress */
+				continue;
+			if (before != 2 * middle + 2) /* overwritten */
+				break;
+			timestamp = r->timestamp;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			found = r->sequence.load(std::memory_order_relaxed) == before;
+		}
+		if (!found || timestamp < target)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
@@ -1,37 +1,47 @@
 #include <iostream>
 #include "includes/modbus.h"
+#include "includes/logger.h"
 #include <csignal>
+#include <memory>
 
 void signal_handle(int)
 {
     std::exit(EXIT_SUCCESS);
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
     std::signal(SIGINT, signal_handle);
+    /* kill -USR1 <pid> appends the last transactions of every connection to flight_recorder.log */
+    ModBusFlightRecorder::dump_on_signal("flight_recorder.log");
     /* modbus server instance, bind to 0.0.0.0:1502 
        the number of coil bits, input bits, holding registers and input registers are 9999
+       when a file is given, the registers are kept in it and survive restarts
     */
-    static ModBusServer server("0.0.0.0", 1502, 9999, 9999, 9999, 9999);
+    static std::unique_ptr<ModBusServer> server(argc > 1
+        ? new ModBusServer("0.0.0.0", 1502, 9999, 9999, 9999, 9999, argv[1], ModBusSyncPolicy::async)
+        : new ModBusServer("0.0.0.0", 1502, 9999, 9999, 9999, 9999));
 
     /* start to listen to incomming connections
        max number of pending connections waiting
        for the server to accept in queue is 5 */
-    server.listen(5);
+    server->listen(5);
+
+    /* the log ring of this thread is set up now, not by the first error while serving */
+    ModBusLogger::attach();
 
     while (1)
     {
         /* wait for any connections to be ready for I/O,
            connection_count is number of connections ready for I/O
         */
-        int connection_count = server.wait();
+        int connection_count = server->wait();
 
         /* iterate over the ready connections to handle the request */
         for (int n = 0; n < connection_count; ++n)
         {
-            if (server.process(n)) /* true if we build a new connection */
+            if (server->process(n)) /* true if we build a new connection */
                 std::cout << "New Connection" << std::endl;
         }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,328 @@
+/*
+ * shm_image.cpp
+ *
+ * Description:
+ * Process image of polled values in POSIX shared memory, guarded by per-block sequence locks.
+ *
+ */
+
+#include "includes/shm_image.h"
+#include "includes/poller.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_IMAGE_MAGIC "MBSHM01"
+#define SHM_IMAGE_ALIGN 64
+#define SHM_NAME_LENGTH 48
+
+#if ATOMIC_INT_LOCK_FREE != 2 || ATOMIC_LLONG_LOCK_FREE != 2
+#error "the process image needs lock-free atomics to be shared between processes"
+#endif
+
+/* segment header, the magic is written last so readers never see a half-built layout */
+struct ModBusShmImage::Header
+{
+	char magic[8];
+	std::uint32_t num_blocks;
+	std::uint32_t reserved;
+	std::uint64_t length;
+	std::atomic<std::uint64_t> generation; /* number of scans published */
+};
+
+/* directory entry of a block */
+struct ModBusShmImage::Directory
+{
+	char device[SHM_NAME_LENGTH];
+	char name[SHM_NAME_LENGTH];
+	std::uint32_t num_values;
+	std::uint32_t reserved;
+	std::uint64_t offset; /* offset of the block from the start of the segment */
+};
+
+/* block header, followed by the values of the varable */
+struct ModBusShmImage::Block
+{
+	std::atomic<std::uint32_t> sequence; /* odd while the writer updates the block */
+	std::int32_t rc;
+	std::uint64_t scan;
+	std::int64_t timestamp;
+};
+
+/* round up to a cache line */
+inline std::size_t _align_line(const std::size_t &size) noexcept
+{
+	return (size + SHM_IMAGE_ALIGN - 1) / SHM_IMAGE_ALIGN * SHM_IMAGE_ALIGN;
+}
+
+/* POSIX shared memory object names start with a slash */
+inline std::string _shm_path(const std::string &name)
+{
+	return (!name.empty() && name[0] == '/') ? name : "/" + name;
+}
+
+/** create the segment, replacing a stale one left by a previous run
+ * \name: shared memory object name
+ * \layouts: the scan of each device, giving its name and the varables with their number of values
+ * \throw: runtime_error when a name is too long or the segment cannot be created
+ */
+ModBusShmImage::ModBusShmImage(const std::string &name, const std::vector<const ModBusScan *> &layouts)
+	: shm_name(_shm_path(name)), owner(true)
+{
+	/* size the segment */
+	std::size_t num_blocks = 0;
+	for (auto &layout : layouts)
+	{
+		if (layout->config->name.size() >= SHM_NAME_LENGTH)
+			throw std::runtime_error("[ModBusShmImage::ModBusShmImage]Device name too long: " + layout->config->name);
+		for (auto &tag : layout->tags)
+		{
+			if (tag.name.size() >= SHM_NAME_LENGTH)
+				throw std::runtime_error("[ModBusShmImage::ModBusShmImage]Varable name too long: " + tag.name);
+		}
+		num_blocks += layout->tags.size();
+	}
+
+	std::size_t offset = _align_line(sizeof(Header)) + _align_line(num_blocks * sizeof(Directory));
+	std::vector<std::size_t> offsets;
+	for (auto &layout : layouts)
+	{
+		for (auto &tag : layout->tags)
+		{
+			offsets.push_back(offset);
+			offset += _align_line(sizeof(Block) + tag.values.size() * sizeof(double));
+		}
+	}
+	this->length = offset;
+
+	/* a fresh segment, readers of a stale one keep their own mapping */
+	shm_unlink(shm_name.c_str());
+	int fd = shm_open(shm_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd == -1)
+	{
+		throw std::runtime_error("[ModBusShmImage::ModBusShmImage]Unable to create " + shm_name + ": " + std::string(strerror(errno)));
+	}
+	if (ftruncate(fd, this->length) == -1)
+	{
+		auto tmp_error = errno;
+		close(fd);
+		shm_unlink(shm_name.c_str());
+		throw std::runtime_error("[ModBusShmImage::ModBusShmImage]Unable to size " + shm_name + ": " + std::string(strerror(tmp_error)));
+	}
+	this->base = mmap(nullptr, this->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	auto tmp_error = errno;
+	close(fd); /* the mapping keeps the segment */
+	if (this->base == MAP_FAILED)
+	{
+		this->base = nullptr;
+		shm_unlink(shm_name.c_str());
+		throw std::runtime_error("[ModBusShmImage::ModBusShmImage]Unable to map " + shm_name + ": " + std::string(strerror(tmp_error)));
+	}
+
+	/* lay out the segment, ftruncate zero-filled it */
+	this->header = new (this->base) Header;
+	this->header->num_blocks = num_blocks;
+	this->header->length = this->length;
+	this->header->generation.store(0, std::memory_order_relaxed);
+	this->directory = reinterpret_cast<Directory *>(static_cast<char *>(this->base) + _align_line(sizeof(Header)));
+
+	std::size_t index = 0;
+	for (auto &layout : layouts)
+	{
+		first_block.push_back(index);
+		for (auto &tag : layout->tags)
+		{
+			Directory &entry = directory[index];
+			strncpy(entry.device, layout->config->name.c_str(), SHM_NAME_LENGTH - 1);
+			strncpy(entry.name, tag.name.c_str(), SHM_NAME_LENGTH - 1);
+			entry.num_values = tag.values.size();
+			entry.offset = offsets[index];
+
+			Block *b = new (static_cast<char *>(this->base) + entry.offset) Block;
+			b->sequence.store(0, std::memory_order_relaxed);
+			b->rc = -1;
+			++index;
+		}
+	}
+
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(this->header->magic, SHM_IMAGE_MAGIC, sizeof(this->header->magic));
+}
+
+/** open an existing segment read-only
+ * \name: shared memory object name given to the writer
+ * \throw: runtime_error when the segment does not exist or is not a process image
+ */
+ModBusShmImage::ModBusShmImage(const std::string &name) : shm_name(_shm_path(name))
+{
+	int fd = shm_open(shm_name.c_str(), O_RDONLY, 0);
+	if (fd == -1)
+	{
+		throw std::runtime_error("[ModBusShmImage::ModBusShmImage]Unable to open " + shm_name + ": " + std::string(strerror(errno)));
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(Header))
+	{
+		close(fd);
+		throw std::runtime_error("[ModBusShmImage::ModBusShmImage]" + shm_name + " is not a process image");
+	}
+	this->length = st.st_size;
+	this->base = mmap(nullptr, this->length, PROT_READ, MAP_SHARED, fd, 0);
+	auto tmp_error = errno;
+	close(fd);
+	if (this->base == MAP_FAILED)
+	{
+		this->base = nullptr;
+		throw std::runtime_error("[ModBusShmImage::ModBusShmImage]Unable to map " + shm_name + ": " + std::string(strerror(tmp_error)));
+	}
+
+	this->header = static_cast<Header *>(this->base);
+	this->directory = reinterpret_cast<Directory *>(static_cast<char *>(this->base) + _align_line(sizeof(Header)));
+	bool valid = memcmp(header->magic, SHM_IMAGE_MAGIC, sizeof(header->magic)) == 0 && header->length == this->length &&
+				 _align_line(sizeof(Header)) + header->num_blocks * sizeof(Directory) <= this->length;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	for (std::size_t i = 0; valid && i < header->num_blocks; ++i)
+		valid = directory[i].offset + sizeof(Block) + directory[i].num_values * sizeof(double) <= this->length;
+	if (!valid)
+	{
+		munmap(this->base, this->length);
+		this->base = nullptr;
+		throw std::runtime_error("[ModBusShmImage::ModBusShmImage]" + shm_name + " is not a valid process image");
+	}
+}
+
+ModBusShmImage::~ModBusShmImage()
+{
+	if (this->base)
+		munmap(this->base, this->length);
+	if (this->owner)
+		shm_unlink(shm_name.c_str()); /* readers already attached keep their mapping */
+}
+
+/* the block at index */
+ModBusShmImage::Block *ModBusShmImage::block(const std::size_t &index) const noexcept
+{
+	return reinterpret_cast<Block *>(static_cast<char *>(this->base) + directory[index].offset);
+}
+
+/** write the values of every varable of a scan
+ * Failed reads only update the result code, the block keeps the last values read.
+ * \scan: a scan of one of the devices the segment was created for
+ */
+void ModBusShmImage::publish(const ModBusScan &scan) noexcept
+{
+	if (__glibc_unlikely(!owner || scan.device >= first_block.size()))
+		return;
+
+	const std::int64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(scan.timestamp.time_since_epoch()).count();
+	std::size_t index = first_block[scan.device];
+	for (auto &tag : scan.tags)
+	{
+		if (__glibc_unlikely(index >= header->num_blocks))
+			break;
+		Block *b = block(index);
+		double *values = reinterpret_cast<double *>(b + 1);
+		std::size_t num = std::min<std::size_t>(directory[index].num_values, tag.values.size());
+
+		std::uint32_t sequence = b->sequence.load(std::memory_order_relaxed);
+		b->sequence.store(sequence + 1, std::memory_order_relaxed); /* odd: update in progress */
+		std::atomic_thread_fence(std::memory_order_release);
+
+		b->rc = tag.rc;
+		b->scan = scan.sequence;
+		b->timestamp = timestamp;
+		if (tag.rc == tag.num)
+			memcpy(values, tag.values.data(), num * sizeof(double));
+
+		b->sequence.store(sequence + 2, std::memory_order_release); /* even: consistent again */
+		++index;
+	}
+	header->generation.fetch_add(1, std::memory_order_release);
+}
+
+/* the number of blocks, one per varable */
+std::size_t ModBusShmImage::size() const noexcept
+{
+	return header->num_blocks;
+}
+
+/** the index of the block of a varable
+ * \device: the device name, "default" for the device of a connection_params line
+ * \name: the varable name
+ * \return: the block index, or -1 if not found
+ */
+int ModBusShmImage::find(const std::string &device, const std::string &name) const noexcept
+{
+	for (std::size_t i = 0; i < header->num_blocks; ++i)
+	{
+		if (device == directory[i].device && name == directory[i].name)
+			return i;
+	}
+	return -1;
+}
+
+/* the device name of a block */
+std::string ModBusShmImage::device(const std::size_t &index) const
+{
+	return std::string(directory[index].device, strnlen(directory[index].device, SHM_NAME_LENGTH));
+}
+
+/* the varable name of a block */
+std::string ModBusShmImage::name(const std::size_t &index) const
+{
+	return std::string(directory[index].name, strnlen(directory[index].name, SHM_NAME_LENGTH));
+}
+
+/* the number of values of a block */
+int ModBusShmImage::num_values(const std::size_t &index) const noexcept
+{
+	return directory[index].num_values;
+}
+
+/* the number of scans published so far, over all devices */
+std::uint64_t ModBusShmImage::generation() const noexcept
+{
+	return header->generation.load(std::memory_order_acquire);
+}
+
+/** copy a consistent snapshot of a block
+ * \index: the block index, see find()
+ * \values: output, at least num_values(index) elements
+ * \sample: output, result code, scan number and timestamp of the values
+ * \max_retries: the number of attempts while the writer keeps updating the block
+ * \return: true on success, false if no consistent snapshot was obtained
+ */
+bool ModBusShmImage::read(const std::size_t &index, double *values, ModBusShmSample &sample,
+						  const int &max_retries) const noexcept
+{
+	if (__glibc_unlikely(index >= header->num_blocks))
+		return false;
+
+	const Block *b = block(index);
+	const double *src = reinterpret_cast<const double *>(b + 1);
+	const std::size_t num = directory[index].num_values;
+
+	for (int attempt = 0; attempt < max_retries; ++attempt)
+	{
+		std::uint32_t before = b->sequence.load(std::memory_order_acquire);
+		if (before & 1) /* update in progress */
+			continue;
+
+		sample.rc = b->rc;
+		sample.scan = b->scan;
+		sample.timestamp = b->timestamp;
+		memcpy(values, src, num * sizeof(double));
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (b->sequence.load(std::memory_order_relaxed) == before)
+			return true;
+	}
+	return false;
+}
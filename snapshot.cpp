@@ -0,0 +1,141 @@
+/*
+ * snapshot.cpp
+ *
+ * Description:
+ * Read plans merging the ranges of a scan into few requests across the four areas.
+ *
+ */
+
+#include "includes/snapshot.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <modbus/modbus.h>
+
+/* the most values a single read of an area returns */
+static inline int _max_read(const ModBusArea &area) noexcept
+{
+	return area == ModBusArea::coils || area == ModBusArea::input_bits ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+}
+
+/* words of the snapshot buffer taken by num values of an area */
+static inline std::size_t _words(const ModBusArea &area, const int &num) noexcept
+{
+	return area == ModBusArea::coils || area == ModBusArea::input_bits ? (num + 1) / 2 : num;
+}
+
+/** add a range to read
+ * \addr: start address, 0-based
+ * \num: number of bits or registers, at most what a single request can read
+ * \return: index of the range
+ * \throw: runtime_error if the range is invalid or the plan is already compiled
+ */
+std::size_t ModBusReadPlan::add(const ModBusArea &area, const int &addr, const int &num)
+{
+	if (compiled)
+	{
+		throw std::runtime_error("[ModBusReadPlan::add] The plan is already compiled");
+	}
+	if (addr < 0 || num < 1 || num > _max_read(area) || addr + num > 0x10000)
+	{
+		throw std::runtime_error("[ModBusReadPlan::add] Invalid range " + std::to_string(addr) + "+" + std::to_string(num));
+	}
+	ranges.push_back(Range{area, addr, num, 0, 0});
+	return ranges.size() - 1;
+}
+
+/** merge the ranges into requests
+ * The ranges of an area are sorted by address and merged while the next one starts at most
+ * max_gap values after the end of the current request and the request stays within the modbus
+ * limit. Blocks are ordered by area, then address.
+ * \max_gap: unrequested values read to save a request, 0 to merge only overlapping or adjacent ranges
+ * \throw: runtime_error if the plan is already compiled
+ *         std::bad_alloc
+ */
+void ModBusReadPlan::compile(const int &max_gap)
+{
+	if (compiled)
+	{
+		throw std::runtime_error("[ModBusReadPlan::compile] The plan is already compiled");
+	}
+
+	std::vector<std::size_t> order(ranges.size());
+	for (std::size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [this](const std::size_t &a, const std::size_t &b) {
+		return ranges[a].area != ranges[b].area ? ranges[a].area < ranges[b].area : ranges[a].addr < ranges[b].addr;
+	});
+
+	for (auto &i : order)
+	{
+		Range &range = ranges[i];
+		if (!plan_blocks.empty())
+		{
+			ModBusReadBlock &last = plan_blocks.back();
+			int end = std::max(last.addr + last.num, range.addr + range.num);
+			if (last.area == range.area && range.addr <= last.addr + last.num + max_gap && end - last.addr <= _max_read(range.area))
+			{
+				last.num = end - last.addr;
+				range.block = plan_blocks.size() - 1;
+				range.offset = range.addr - last.addr;
+				continue;
+			}
+		}
+		plan_blocks.push_back(ModBusReadBlock{range.area, range.addr, range.num, 0});
+		range.block = plan_blocks.size() - 1;
+		range.offset = 0;
+	}
+
+	for (auto &block : plan_blocks)
+	{
+		block.offset = plan_words;
+		plan_words += _words(block.area, block.num);
+	}
+	compiled = true;
+}
+
+bool ModBusReadPlan::ready() const noexcept
+{
+	return compiled;
+}
+
+const std::vector<ModBusReadBlock> &ModBusReadPlan::blocks() const noexcept
+{
+	return plan_blocks;
+}
+
+std::size_t ModBusReadPlan::words() const noexcept
+{
+	return plan_words;
+}
+
+std::size_t ModBusReadPlan::size() const noexcept
+{
+	return ranges.size();
+}
+
+/** index of the block reading a range
+ * \throw: std::out_of_range if the range does not exist
+ */
+std::size_t ModBusReadPlan::block_of(const std::size_t &range) const
+{
+	return ranges.at(range).block;
+}
+
+/** the values of a register range within a snapshot buffer
+ * \throw: std::out_of_range if the range does not exist
+ */
+const std::uint16_t *ModBusReadPlan::registers(const std::size_t &range, const std::vector<std::uint16_t> &words) const
+{
+	const Range &r = ranges.at(range);
+	return words.data() + plan_blocks[r.block].offset + r.offset;
+}
+
+/** the values of a bit range within a snapshot buffer, one byte per bit
+ * \throw: std::out_of_range if the range does not exist
+ */
+const std::uint8_t *ModBusReadPlan::bits(const std::size_t &range, const std::vector<std::uint16_t> &words) const
+{
+	const Range &r = ranges.at(range);
+	return reinterpret_cast<const std::uint8_t *>(words.data() + plan_blocks[r.block].offset) + r.offset;
+}